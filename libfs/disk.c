@@ -24,7 +24,8 @@ struct disk {
 /* Currently open virtual disk (invalid by default) */
 static struct disk disk = { .fd = INVALID_FD };
 
-int block_disk_open(const char *diskname)
+/* Open @diskname with @flags, O_RDWR or O_RDONLY */
+static int disk_open(const char *diskname, int flags)
 {
 	int fd;
 	struct stat st;
@@ -39,7 +40,7 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, flags, 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
@@ -62,6 +63,16 @@ int block_disk_open(const char *diskname)
 	return 0;
 }
 
+int block_disk_open(const char *diskname)
+{
+	return disk_open(diskname, O_RDWR);
+}
+
+int block_disk_open_ro(const char *diskname)
+{
+	return disk_open(diskname, O_RDONLY);
+}
+
 int block_disk_close(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -99,15 +110,10 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
-
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/* Perform the actual write into the disk image, at the specified block
+	 * number without moving the shared file offset (threads) */
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
@@ -127,15 +133,10 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
-
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	/* Perform the actual read from the disk image, at the specified block
+	 * number without moving the shared file offset (threads) */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
 		return -1;
 	}
 
@@ -19,6 +19,18 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_ro - Open virtual disk file read-only
+ * @diskname: Name of the virtual disk file
+ *
+ * Open virtual disk file @diskname like block_disk_open(), without the right
+ * to write it: block_write() fails until it is closed.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open. 0 otherwise.
+ */
+int block_disk_open_ro(const char *diskname);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -1,13 +1,30 @@
+#define _GNU_SOURCE // recursive mutex and writer preferring rwlock initializers
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // strcmp, strlen, strcpy
 
 #include <stdbool.h>
 #include <stdint.h> //Integers
+#include <stddef.h> // offsetof
+#include <limits.h> // INT_MAX
+#include <sys/uio.h> // struct iovec
+#include <sys/eventfd.h> // completion queue of the asynchronous calls
+#include <sys/mman.h> // mapped views
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <dirent.h> // bulk import
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h> // zero block check
+#endif
 
 #include "disk.h"
 #include "fs.h"
+#include "lz4.h"
 
 
 
@@ -41,6 +58,8 @@
 #define pickmax(x, y) (((x) > (y)) ? (x) : (y))
 
 #define FAT_EOC 0xFFFF
+#define FAT_PER_BLK (BLOCK_SIZE / sizeof(uint16_t)) // FAT entries held by one FAT block
+#define FILE_SZ_MAX INT_MAX // largest file, fs_stat() returns an int
 // const static char FS_NAME[8] = "ECS150FS"; //from TA: Kind of redundant, since the string literal will evaulate to a pointer to a similar const char array in the global space.
 static char FS_NAME[8] = "ECS150FS"; //from TA: Kind of redundant, since the string literal will evaulate to a pointer to a similar const char array in the global space.
 
@@ -82,8 +101,13 @@ struct SuperBlock
 
     uint16_t  fat_used;     // myself
     uint16_t  rdir_used;    // from TA: You won't be able to guarantee that other users of the filesystem will store this for you, so it doesn't really help speed up anything without further identification fields.
+    uint16_t  ref_blk;      // first block of the reference count table, 0 if no block is shared
+    uint16_t  snap_blk;     // block of the snapshot table, 0 if there is no snapshot
+    uint16_t  journal_blk;  // first block of the metadata journal, 0 if there is none
+    uint16_t  log_blk;      // first block of the write log, 0 if there is none
+    uint16_t  dedup_blk;    // first block of the fingerprint table, 0 if dedup is off
 
-    char     unused[4063];     // 4079 Unused/Padding, I use 32bits
+    char     unused[4053];     // 4079 Unused/Padding, I use 64bits
 }__attribute__((packed));
 
 
@@ -93,15 +117,114 @@ struct RootDirEntry {                // Inode structure
     uint16_t    first_data_blk; // Direct pointers
 
     uint16_t    last_data_blk; // Direct pointers
-    uint8_t     open;
-    char        unused[7];     // one char for indicating writing 'w'
+    uint8_t     open;          // 0, the descriptors are counted in file_open[]
+    uint16_t    hole_blk;      // first block of the hole list of a sparse file, 0 if none
+    uint8_t     zip;           // FS_COMPRESS_LZ4 if the data is compressed, see Compressed Files
+    uint32_t    zip_sz;        // size of a compressed file, @file_sz is then the size of its layout
 }__attribute__((packed));
 typedef struct RootDirEntry * direntry_t;
 
+/* Snapshot table, one block, %FS_SNAPSHOT_MAX_COUNT entries
+ * a snapshot is a frozen copy of the root directory, its files hold a
+ * reference on their first data block, so the chains they reach never change
+*/
+struct SnapEntry {
+    char        name[FS_FILENAME_LEN];
+    uint16_t    rdir_blk;      // data block of the frozen root directory
+    uint16_t    fat_used;      // superblock counters when the snapshot was taken
+    uint16_t    rdir_used;
+    char        unused[10];
+}__attribute__((packed));
+
+/* Metadata journal
+ * A chain of data blocks starting at sp->journal_blk: a header, then a ring of
+ * record blocks. A transaction is a stream of records split over consecutive
+ * ring blocks, the last one flagged @commit. A block only counts if its magic,
+ * sequence and checksum match, so a torn or stale block ends the replay.
+*/
+struct JournalHdr {
+    char        signature[8];  // "ECS150JR"
+    uint32_t    seq;           // first transaction to replay
+    uint32_t    tail;          // ring block where it starts
+    uint32_t    len;           // number of ring blocks
+    char        unused[4076];
+}__attribute__((packed));
+
+struct JournalBlk {
+    uint32_t    magic;
+    uint32_t    seq;           // transaction of the block
+    uint32_t    sum;           // checksum of the block, taken with @sum = 0
+    uint16_t    len;           // bytes of records in @data
+    uint8_t     commit;        // last block of its transaction
+    uint8_t     unused;
+    char        data[BLOCK_SIZE - 16];
+}__attribute__((packed));
+
+/* a data block of metadata (hole list, reference counts, snapshot table) waiting for its commit */
+struct MetaImage {
+    uint16_t    blk;
+    char        data[BLOCK_SIZE];
+};
+
+struct Journal {
+    uint16_t *  blk;           // blocks of the journal, blk[0] is the header
+    uint32_t    len;           // ring blocks
+    uint32_t    head;          // next ring block to write
+    uint32_t    used;          // ring blocks written since the last checkpoint
+    uint32_t    seq;           // sequence of the running transaction
+    uint32_t    ops;           // write_meta() calls in the running transaction
+    uint16_t *  fat_list;      // FAT entries changed by the running transaction
+    uint32_t    fat_cnt;
+    uint8_t *   fat_mark;
+    uint8_t *   freed;         // blocks it freed, not reused before it commits
+    uint32_t    freed_cnt;
+    uint16_t    freed_min;
+    struct SuperBlock * sp_log; // superblock and root directory as last logged
+    direntry_t  rdir_log;
+    struct MetaImage * img;
+    uint32_t    img_cnt;
+    uint32_t    img_cap;
+};
+
+/* Write log
+ * A chain of data blocks starting at sp->log_blk: a header (struct JournalHdr,
+ * @seq being the generation) then segments (struct JournalBlk). A segment
+ * belongs to the log while its @seq is the current generation, cleaning the
+ * log bumps it. Records: uint8_t file index, uint32_t offset, uint16_t length,
+ * then the bytes written.
+*/
+struct LogExt {
+    uint8_t     idx;           // file in root_dir
+    uint32_t    off;           // offset in the file
+    uint16_t    len;
+    uint32_t    data;          // offset of the bytes in WriteLog.data
+};
+
+struct WriteLog {
+    uint16_t *  blk;           // blk[0] is the header
+    uint32_t    len;           // segments
+    uint32_t    gen;
+    uint32_t    seg;           // segment being filled
+    uint32_t    fill;          // bytes used in it
+    uint8_t     dirty;         // not on disk yet
+    char *      data;          // copy of the segments, read through the extents
+    struct LogExt * ext;
+    uint32_t    ext_cnt;
+    uint32_t    ext_cap;
+    uint16_t    file_cnt[FS_FILE_MAX_COUNT]; // extents per file
+};
+
 struct FileDescriptor
 {
     struct RootDirEntry * file_entry; // to be more clear, not use void*
     size_t offset;
+    char *   wbuf;      // write buffer of one block, NULL until the first small write
+    size_t   wbuf_blk;  // offset in the file of the block it holds
+    uint16_t wbuf_lo;   // bytes [@wbuf_lo, @wbuf_hi) of the block are waiting
+    uint16_t wbuf_hi;
+    uint16_t wbuf_held; // free data block held for the buffer, 0 if it needs none
+    int      prev;      // descriptors of the same file, or next free one in @next
+    int      next;
 };
 
 
@@ -122,35 +245,480 @@ direntry_t  root_dir = NULL;         // root directory pointer
 // struct RootDirEntry * dir_entry = NULL; //from Joël: better not to use any global variable if not necessary
 
 uint16_t * fat = NULL;              //FAT block pointer
+uint8_t * fat_dirty = NULL;         // one flag per FAT block, write_meta() only writes back the dirty ones
+uint16_t fat_hint = 1;              // lowest FAT entry which may still be free, speed up get_free_blk_idx()
+struct Journal * jr = NULL;         // metadata journal, NULL if the disk has none
+struct WriteLog * lg = NULL;        // write log, only kept by fs_log_mount()
+bool log_mode = false;
 // uint16_t * fat16 = NULL;        //fat array entry pointer
 //from TA: Keeping track of two variables is going to be more complex than just doing some typecasting occasionally.
 
+bool read_only = false;             // a snapshot or fs_readonly_mount(), nothing is written back
+bool shared_ro = false;             // fs_readonly_mount(), see Read-only Mounts
 int fd_cnt = 0;     // fd used number; from TA: In C, memory used for global variables are initialized to 0 by default, so it is not necessary to make these assignments.
-struct FileDescriptor* filedes[FS_OPEN_MAX_COUNT];
+/* Descriptors come from slabs of FD_SLAB, added as needed up to
+ * FS_OPEN_MAX_COUNT and kept until fs_umount(): a descriptor never moves, so
+ * get_fd() takes no lock. Free ones are chained from fd_free, taken and given
+ * back in O(1) under fd_lock. Those of a file are chained from fd_first[] of
+ * its entry, and share what is kept per file: file_open[] counts them,
+ * file_view[] has its size and blocks, wbuf_cnt[] the ones with bytes in
+ * their write buffer.
+*/
+#define FD_SLAB 256
+struct FileDescriptor * fd_slab[FS_OPEN_MAX_COUNT / FD_SLAB];
+int fd_top = 0;                     // descriptors in the slabs
+int fd_free = -1;                   // first free one, -1 if none
+int fd_first[FS_FILE_MAX_COUNT] = { [0 ... FS_FILE_MAX_COUNT - 1] = -1 };
+pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+uint16_t wbuf_cnt[FS_FILE_MAX_COUNT];   // descriptors of root_dir[i] with bytes in their write buffer
+uint8_t * fat_held = NULL;          // free data blocks held by writes in progress, see Range Locks
+uint32_t held_cnt = 0;
+
+
+/******************* Locking *********************/
+/* Any number of threads may use the mounted file system (fs_mount() and
+ * fs_umount() excepted):
+ * - file_lock[i] guards root_dir[i], its blocks and its hole list. Reads take
+ *   it shared, anything which writes the file takes it exclusive.
+ * - dir_lock guards the names of the root directory, and descriptors leaving
+ *   the lists of descriptors of their files.
+ * - meta_lock guards the FAT, the superblock, the reference counts, the
+ *   journal and the write log, so write_meta() and every block allocation.
+ * - io_range[i] holds the blocks of root_dir[i] being read or written, taken
+ *   before file_lock[i], see Range Locks.
+ * They are taken in this order, and the two mutexes are recursive. fd_lock,
+ * which guards the free descriptors and the lists of those of each file, comes
+ * last: nothing is taken under it. A read of a file nobody writes takes no
+ * lock at all, see Lock-free Reads, or else its file_lock shared, never
+ * meta_lock: it walks a chain no other file can change. A write which only
+ * rewrites blocks the file owns alone skips meta_lock as well, see
+ * write_in_place(). fs_open() only takes fd_lock.
+ * Operations on several files or on the whole disk stop everything with
+ * lock_all(). The offset of a file descriptor belongs to the thread using it:
+ * threads sharing a descriptor use fs_pread() and fs_pwrite().
+*/
+pthread_rwlock_t file_lock[FS_FILE_MAX_COUNT] = { [0 ... FS_FILE_MAX_COUNT - 1] = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP };
+pthread_mutex_t dir_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_mutex_t meta_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+
+
+/******************* Lock-free Reads *********************/
+/* Lookups and reads never wait for a writer updating metadata (RCU):
+ * - dir_view is an immutable copy of the names in root_dir, fs_open() looks
+ *   them up there. Whoever changes a name publishes a new copy.
+ * - file_view[i] maps the logical blocks of root_dir[i] to its data blocks.
+ *   The first locked read builds it, and a writer which took meta_lock, so
+ *   may have moved blocks, drops it. file_seq[i] is odd while a writer holds
+ *   file_lock[i]: a read through the view checks it did not change meanwhile,
+ *   or reads again under the lock, since the blocks may have been reused.
+ * A dropped copy is freed once no reader can still hold it: readers announce
+ * the epoch they started in, and a copy retired at epoch e waits until every
+ * reader announcing e or less is done.
+*/
+#define RCU_SLOTS 512                 // threads inside lock-free reads at once, others take the locks
+#define FILE_DYING UINT32_MAX         // file_open[] of a file being removed
+
+struct DirView {
+    uint32_t    gen[FS_FILE_MAX_COUNT];  // dir_gen[] when published
+    char        name[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+};
+
+struct FileView {
+    uint32_t    size;          // file_sz
+    uint32_t    nblk;
+    uint16_t    blk[];         // data block of each logical block, FAT_EOC in a hole
+};
+
+struct RcuSlot {
+    uint64_t    epoch;         // epoch its reader started in, 0 outside
+    int         used;
+} __attribute__((aligned(64)));  // one cache line each, readers share nothing
+
+struct RcuRetired {
+    void *      ptr;
+    uint64_t    epoch;
+};
+
+struct DirView * dir_view = NULL;
+struct FileView * file_view[FS_FILE_MAX_COUNT];
+uint32_t file_seq[FS_FILE_MAX_COUNT];
+uint32_t dir_gen[FS_FILE_MAX_COUNT];   // bumped when root_dir[i] goes away
+uint32_t file_open[FS_FILE_MAX_COUNT]; // descriptors of root_dir[i], FILE_DYING while removed
+uint32_t view_mark[FS_FILE_MAX_COUNT]; // meta_taken of the writer holding file_lock[i]
+__thread uint32_t meta_taken = 0;      // how many times this thread took meta_lock
+
+struct RcuSlot rcu_slot[RCU_SLOTS];
+uint64_t rcu_epoch = 1;
+__thread int rcu_self = -1;            // slot of this thread
+pthread_key_t rcu_key;
+pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER; // the retired list, taken last
+struct RcuRetired * rcu_list = NULL;
+uint32_t rcu_cnt = 0;
+uint32_t rcu_cap = 0;
+
+/* give the slot of an exiting thread back */
+void rcu_release(void * slot){
+    __atomic_store_n(&((struct RcuSlot *)slot)->used, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_key_create(){
+    pthread_key_create(&rcu_key, rcu_release);
+}
+
+/* enter a lock-free read, false if every slot is taken */
+bool rcu_enter(){
+    if(rcu_self < 0){
+        pthread_once(&rcu_once, rcu_key_create);
+        for (int i = 0; i < RCU_SLOTS && rcu_self < 0; ++i)
+        {
+            int unused = 0;
+            if(__atomic_compare_exchange_n(&rcu_slot[i].used, &unused, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+                rcu_self = i;
+                pthread_setspecific(rcu_key, rcu_slot + i);
+            }
+        }
+        if(rcu_self < 0)
+            return false;
+    }
+    __atomic_store_n(&rcu_slot[rcu_self].epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    return true;
+}
+
+void rcu_exit(){
+    __atomic_store_n(&rcu_slot[rcu_self].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* free @ptr, unpublished already, once the readers which may hold it are done */
+void rcu_retire(void * ptr){
+    if(ptr == NULL)
+        return;
+    pthread_mutex_lock(&rcu_lock);
+    if(rcu_cnt == rcu_cap){
+        uint32_t cap = rcu_cap ? rcu_cap * 2 : 16;
+        struct RcuRetired * list = realloc(rcu_list, cap * sizeof(struct RcuRetired));
+        if(list == NULL){ // rather leak it than free it under a reader
+            pthread_mutex_unlock(&rcu_lock);
+            return;
+        }
+        rcu_list = list;
+        rcu_cap = cap;
+    }
+    rcu_list[rcu_cnt].ptr = ptr;
+    rcu_list[rcu_cnt++].epoch = __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < RCU_SLOTS; ++i)
+    {
+        uint64_t e = __atomic_load_n(&rcu_slot[i].epoch, __ATOMIC_SEQ_CST);
+        if(e != 0 && e < oldest)
+            oldest = e;
+    }
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < rcu_cnt; ++i)
+    {
+        if(rcu_list[i].epoch < oldest)
+            free(rcu_list[i].ptr);
+        else
+            rcu_list[kept++] = rcu_list[i];
+    }
+    rcu_cnt = kept;
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+/* unpublish the view of root_dir[@idx] */
+void view_drop(int idx){
+    rcu_retire(__atomic_exchange_n(file_view + idx, NULL, __ATOMIC_SEQ_CST));
+}
+
+/* free every copy, at unmount when no reader is left */
+void rcu_free(){
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        free(file_view[i]);
+        file_view[i] = NULL;
+    }
+    free(dir_view);
+    dir_view = NULL;
+    for (uint32_t i = 0; i < rcu_cnt; ++i)
+        free(rcu_list[i].ptr);
+    rcu_cnt = 0;
+}
+
+
+
+/******************* Range Locks *********************/
+/* Threads writing disjoint parts of one file, like the chunks of an upload,
+ * do not wait for each other:
+ * - io_range[i] holds the logical blocks of root_dir[i] being read (shared)
+ *   or written (exclusive). lock_file() takes all of them, range_writev()
+ *   only the ones it writes, and a locked read the ones it reads.
+ * - adv_range[i] holds the bytes locked through fs_lock_range(), each range
+ *   owned by a file descriptor. They are advisory: I/O ignores them.
+ * range_writev() finds the blocks to write under file_lock[i] shared, holding
+ * free ones (fat_held) for those past the end of the chain, writes them under
+ * no file_lock, then links the held blocks and grows the file under file_lock[i]
+ * exclusive. Concurrent extenders each link their own blocks, the ones of a
+ * writer further out leave a hole for the others to fill. file_wr[i] counts the
+ * writers in between, lock-free reads of root_dir[i] take the lock meanwhile.
+*/
+#define RANGE_END UINT64_MAX
+
+struct Range {
+    uint64_t    lo, hi;        // [lo, hi)
+    int         owner;         // descriptor of an advisory lock, -1 for the ones of libfs
+    bool        excl;
+    struct Range * next;
+};
+
+struct RangeSet {
+    pthread_mutex_t m;         // taken last
+    pthread_cond_t  c;         // a range went away
+    struct Range *  head;
+};
+
+#define RANGE_SET_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL }
+struct RangeSet io_range[FS_FILE_MAX_COUNT] = { [0 ... FS_FILE_MAX_COUNT - 1] = RANGE_SET_INITIALIZER };
+struct RangeSet adv_range[FS_FILE_MAX_COUNT] = { [0 ... FS_FILE_MAX_COUNT - 1] = RANGE_SET_INITIALIZER };
+struct Range file_range[FS_FILE_MAX_COUNT];  // the whole file, held by lock_file()
+uint32_t file_wr[FS_FILE_MAX_COUNT];         // range writers of root_dir[i] writing blocks
+
+/* [@lo, @hi) overlaps a range of @s which @owner cannot share */
+bool range_conflict(struct RangeSet * s, uint64_t lo, uint64_t hi, int owner, bool excl){
+    for (struct Range * r = s->head; r != NULL; r = r->next)
+    {
+        if(r->lo < hi && lo < r->hi && (r->excl || excl) && (owner < 0 || r->owner != owner))
+            return true;
+    }
+    return false;
+}
+
+/* wait until [@lo, @hi) is free, then hold it in @s through @r */
+void range_lock(struct RangeSet * s, struct Range * r, uint64_t lo, uint64_t hi, int owner, bool excl){
+    pthread_mutex_lock(&s->m);
+    while(range_conflict(s, lo, hi, owner, excl))
+        pthread_cond_wait(&s->c, &s->m);
+    r->lo = lo; // @r may be file_range[], free only now
+    r->hi = hi;
+    r->owner = owner;
+    r->excl = excl;
+    r->next = s->head;
+    s->head = r;
+    pthread_mutex_unlock(&s->m);
+}
+
+void range_unlock(struct RangeSet * s, struct Range * r){
+    pthread_mutex_lock(&s->m);
+    struct Range ** p = &s->head;
+    while(*p != r)
+        p = &(*p)->next;
+    *p = r->next;
+    pthread_cond_broadcast(&s->c);
+    pthread_mutex_unlock(&s->m);
+}
+
+/* give back what @owner holds of [@lo, @hi) in @s, its ranges were allocated
+ * return -1 if a range to split in two cannot be allocated, nothing changes then
+*/
+int range_release(struct RangeSet * s, int owner, uint64_t lo, uint64_t hi){
+    pthread_mutex_lock(&s->m);
+    struct Range * spare = NULL; // one for each range split in two
+    for (struct Range * r = s->head; r != NULL; r = r->next)
+    {
+        if(r->owner == owner && r->lo < lo && hi < r->hi){
+            struct Range * n = malloc(sizeof(struct Range));
+            if(n == NULL){
+                while(spare != NULL){
+                    n = spare->next;
+                    free(spare);
+                    spare = n;
+                }
+                pthread_mutex_unlock(&s->m);
+                return -1;
+            }
+            n->next = spare;
+            spare = n;
+        }
+    }
+
+    for (struct Range ** p = &s->head; *p != NULL;)
+    {
+        struct Range * r = *p;
+        if(r->owner != owner || r->hi <= lo || hi <= r->lo){
+            p = &r->next;
+            continue;
+        }
+        if(lo <= r->lo && r->hi <= hi){ // all of it
+            *p = r->next;
+            free(r);
+            continue;
+        }
+        if(r->lo < lo && hi < r->hi){ // the middle, the part after it goes to a new range
+            struct Range * n = spare;
+            spare = spare->next;
+            *n = *r;
+            n->lo = hi;
+            r->next = n;
+            r->hi = lo;
+            p = &n->next;
+            continue;
+        }
+        if(r->lo < lo)
+            r->hi = lo;
+        else
+            r->lo = hi;
+        p = &r->next;
+    }
+    pthread_cond_broadcast(&s->c);
+    pthread_mutex_unlock(&s->m);
+    return 0;
+}
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+/* the lock taken by @expr is released at the end of the enclosing block */
+#define HOLD(type, release, expr) type CONCAT(held_, __LINE__) __attribute__((cleanup(release))) = (expr)
+#define HOLD_DIR() HOLD(pthread_mutex_t *, unlock_mutex, lock_mutex(&dir_lock))
+#define HOLD_META() HOLD(pthread_mutex_t *, unlock_mutex, lock_mutex(&meta_lock))
+#define HOLD_FILE(entry) HOLD(pthread_rwlock_t *, unlock_file, lock_file(entry))
+#define HOLD_ALL() HOLD(int, unlock_all, lock_all())
+
+pthread_mutex_t * lock_mutex(pthread_mutex_t * m){
+    pthread_mutex_lock(m);
+    if(m == &meta_lock)
+        ++meta_taken;
+    return m;
+}
+
+void unlock_mutex(pthread_mutex_t ** m){
+    pthread_mutex_unlock(*m);
+}
+
+/* take file_lock[@idx] exclusive, lock-free readers of root_dir[@idx] start over */
+void file_wrlock(int idx){
+    pthread_rwlock_wrlock(file_lock + idx);
+    __atomic_add_fetch(file_seq + idx, 1, __ATOMIC_SEQ_CST);
+    view_mark[idx] = meta_taken;
+}
+
+void file_wrunlock(int idx){
+    if(view_mark[idx] != meta_taken) // it may have moved blocks
+        view_drop(idx);
+    __atomic_add_fetch(file_seq + idx, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(file_lock + idx);
+}
+
+/* lock the whole of root_dir[@entry] to write it */
+pthread_rwlock_t * lock_file(direntry_t entry){
+    int idx = entry - root_dir;
+    range_lock(io_range + idx, file_range + idx, 0, RANGE_END, -1, true);
+    file_wrlock(idx);
+    return file_lock + idx;
+}
+
+void unlock_file(pthread_rwlock_t ** l){
+    int idx = *l - file_lock;
+    file_wrunlock(idx);
+    range_unlock(io_range + idx, file_range + idx);
+}
+
+/* every file, then the directory and the metadata */
+int lock_all(){
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        range_lock(io_range + i, file_range + i, 0, RANGE_END, -1, true);
+        pthread_rwlock_wrlock(file_lock + i);
+        __atomic_add_fetch(file_seq + i, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_lock(&dir_lock);
+    pthread_mutex_lock(&meta_lock);
+    return 1;
+}
 
+void unlock_all(int * held){
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_unlock(&dir_lock);
+    for (int i = FS_FILE_MAX_COUNT - 1; i >= 0; --i)
+    {
+        view_drop(i);
+        __atomic_add_fetch(file_seq + i, 1, __ATOMIC_SEQ_CST);
+        pthread_rwlock_unlock(file_lock + i);
+        range_unlock(io_range + i, file_range + i);
+    }
+}
 
 
 /******************* helper function*********************/
 
+struct FileDescriptor * get_fd(int fd){
+    return fd_slab[fd / FD_SLAB] + fd % FD_SLAB;
+}
+
 /* used to check the validation of the input file descirptor number */
 bool is_valid_fd(int fd){
-    if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || filedes[fd] == NULL) 
+    if(fd < 0 || fd >= __atomic_load_n(&fd_top, __ATOMIC_ACQUIRE) \
+        || __atomic_load_n(&get_fd(fd)->file_entry, __ATOMIC_ACQUIRE) == NULL)
         return false;
     else return true;
 }
 
-/* get valid file descirptor number */
-int get_valid_fd(){
-    if(filedes == NULL || fd_cnt >= FS_OPEN_MAX_COUNT){
-        eprintf("get_valid_fd: fail\n");
+/* get valid file descirptor number for @entry, first in the list of its descriptors
+ * return -1 if FS_OPEN_MAX_COUNT are open
+*/
+int get_valid_fd(direntry_t entry){
+    int idx = entry - root_dir;
+    pthread_mutex_lock(&fd_lock);
+    int fd = fd_free;
+    if(fd >= 0)
+        fd_free = get_fd(fd)->next;
+    else if(fd_top < FS_OPEN_MAX_COUNT && (fd_top % FD_SLAB != 0 \
+        || (fd_slab[fd_top / FD_SLAB] = calloc(FD_SLAB, sizeof(struct FileDescriptor))) != NULL)) // a new slab
+        fd = fd_top;
+    if(fd < 0){
+        pthread_mutex_unlock(&fd_lock);
+        eprintf("get_valid_fd: no available file descirptor\n");
         return -1;
     }
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
-        if(filedes[i] == NULL)
-            return i;
 
-    eprintf("get_valid_fd: no available file descirptor\n");
-    return -1;
+    struct FileDescriptor * f = get_fd(fd);
+    f->offset = 0;
+    f->wbuf = NULL;
+    f->wbuf_lo = f->wbuf_hi = f->wbuf_held = 0;
+    f->prev = -1;
+    f->next = fd_first[idx];
+    if(f->next >= 0)
+        get_fd(f->next)->prev = fd;
+    __atomic_store_n(&f->file_entry, entry, __ATOMIC_RELEASE);
+    __atomic_store_n(fd_first + idx, fd, __ATOMIC_RELEASE); // flush_file() may walk the list meanwhile
+    if(fd == fd_top)
+        __atomic_store_n(&fd_top, fd + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&fd_cnt, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fd_lock);
+    return fd;
+}
+
+/* @fd leaves the list of its file and is invalid from now on, the caller holds dir_lock */
+void fd_unlink(int fd){
+    struct FileDescriptor * f = get_fd(fd);
+    pthread_mutex_lock(&fd_lock);
+    if(f->prev >= 0)
+        get_fd(f->prev)->next = f->next;
+    else
+        __atomic_store_n(fd_first + (f->file_entry - root_dir), f->next, __ATOMIC_RELEASE);
+    if(f->next >= 0)
+        get_fd(f->next)->prev = f->prev;
+    __atomic_store_n(&f->file_entry, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fd_lock);
+}
+
+/* @fd is free again, once nothing refers to its number */
+void fd_put(int fd){
+    pthread_mutex_lock(&fd_lock);
+    get_fd(fd)->next = fd_free;
+    fd_free = fd;
+    __atomic_sub_fetch(&fd_cnt, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fd_lock);
 }
 
 /* get file directory entry pointer according to id 
@@ -163,6 +731,11 @@ struct RootDirEntry * get_dir(int id){
     // return (struct RootDirEntry *)(root_dir + id * sizeof(struct RootDirEntry));
 }
 
+/* size of the file of @entry as it reads, see Compressed Files */
+uint32_t entry_size(direntry_t entry){
+    return entry->zip ? entry->zip_sz : entry->file_sz;
+}
+
 
 void print_data(){
     uint16_t * fat16 = fat;
@@ -198,22 +771,26 @@ uint16_t * get_fat(int id){
 
 /* get next free data block
  */
+void fp_forget(uint16_t blk); // see Block Fingerprints
+
 int32_t get_free_blk_idx(){
     if(fat == NULL || sp == NULL)
         return -1;
-    if(sp->data_blk_count - sp->fat_used == 0) {
+    if(sp->data_blk_count - sp->fat_used - held_cnt == 0) {
         eprintf("data blk exhausted\n");
         return -1;
     }       
 
-    uint16_t i = 1;
-    uint16_t * tmp = fat;
-    tmp++; // skip #0 fat
+    uint16_t i = fat_hint > 1 ? fat_hint : 1; // entries below the hint are all in use
+    uint16_t * tmp = fat + i;
     // for (tmp = fat; i < sp->fat_blk_count * BLOCK_SIZE / 2 ; ++i, tmp += sizeof( uint16_t ))
     // for (; i < sp->fat_blk_count * BLOCK_SIZE / 2 ; ++i, tmp++)
     for (; i < sp->data_blk_count ; ++i, tmp++)
-        if (*tmp == 0 )
+        if (*tmp == 0 && !(jr && jr->freed[i]) && !(fat_held && fat_held[i])){
+            fat_hint = i;
+            fp_forget(i);
             return (int32_t)i;
+        }
     // if( i == sp->fat_blk_count * BLOCK_SIZE / 2)
     if( i == sp->data_blk_count)
         eprintf("fat exhausted\n");
@@ -221,6 +798,146 @@ int32_t get_free_blk_idx(){
     return -1;
 }
 
+/******************* Block Reference Count *********************/
+/* Clones share FAT chains. ref[b] counts the references to data block b beyond
+ * the first one, a reference being a directory entry or a FAT entry pointing
+ * to b. Since a block has a single successor, once a chain reaches a block with
+ * a count, the rest of it is shared too. Cloning a file only counts its first
+ * block; a shared block is copied before its data or FAT entry change.
+ * The table holds one 16-bit count per data block, snapshots keep references
+ * as well. It lives in data blocks chained from sp->ref_blk, created by the
+ * first share and freed with the last one.
+*/
+uint16_t * ref = NULL;
+uint32_t ref_total = 0;             // sum of ref[], the table goes away at 0
+uint8_t ref_dirty = 0;
+
+/* the counts are read without meta_lock by cursors of other files, see Locking */
+uint16_t get_ref(uint16_t blk){
+    return ref ? __atomic_load_n(ref + blk, __ATOMIC_RELAXED) : 0;
+}
+
+void ref_inc(uint16_t blk){
+    __atomic_store_n(ref + blk, ref[blk] + 1, __ATOMIC_RELAXED);
+    ++ref_total;
+    ref_dirty = 1;
+}
+
+void ref_dec(uint16_t blk){
+    __atomic_store_n(ref + blk, ref[blk] - 1, __ATOMIC_RELAXED);
+    --ref_total;
+    ref_dirty = 1;
+}
+
+/* update FAT entry @id to @val
+ * remember the FAT block it belongs to, so write_meta() only writes back what changed
+*/
+void set_fat(uint16_t id, uint16_t val){
+    fat[id] = val;
+    fat_dirty[id / FAT_PER_BLK] = 1;
+    if(val == 0 && id < fat_hint)
+        fat_hint = id;
+    if(jr == NULL)
+        return;
+    if(!jr->fat_mark[id]){ // logged by the next commit
+        jr->fat_mark[id] = 1;
+        jr->fat_list[jr->fat_cnt++] = id;
+    }
+    if(val == 0 && !jr->freed[id]){
+        jr->freed[id] = 1;
+        ++jr->freed_cnt;
+        if(id < jr->freed_min)
+            jr->freed_min = id;
+    }
+}
+
+/* metadata kept in data blocks goes through these two: with a journal, a write
+ * waits in memory until its transaction commits, reads see it meanwhile
+*/
+struct MetaImage * find_image(uint16_t blk){
+    for (uint32_t i = 0; jr && i < jr->img_cnt; ++i)
+        if(jr->img[i].blk == blk)
+            return jr->img + i;
+    return NULL;
+}
+
+int meta_block_read(uint16_t blk, void * buf){
+    struct MetaImage * m = find_image(blk);
+    if(m == NULL)
+        return block_read(sp->data_blk + blk, buf);
+    memcpy(buf, m->data, BLOCK_SIZE);
+    return 0;
+}
+
+int meta_block_write(uint16_t blk, const void * buf){
+    if(jr == NULL)
+        return block_write(sp->data_blk + blk, buf);
+    struct MetaImage * m = find_image(blk);
+    if(m == NULL){
+        if(jr->img_cnt == jr->img_cap){
+            struct MetaImage * img = realloc(jr->img, (jr->img_cap + 8) * sizeof(struct MetaImage));
+            if(img == NULL)
+                return -1;
+            jr->img = img;
+            jr->img_cap += 8;
+        }
+        m = jr->img + jr->img_cnt++;
+        m->blk = blk;
+    }
+    memcpy(m->data, buf, BLOCK_SIZE);
+    return 0;
+}
+
+/* free the whole chain starting at data block @blk in a single pass
+ * stop at the first block another chain still points to, dropping one reference
+ * sp->fat_used is updated once at the end
+ * return the number of released blocks
+*/
+int release_chain(uint16_t blk){
+    if(sp == NULL || fat == NULL)
+        return -1;
+
+    int n = 0;
+    while(blk != FAT_EOC && blk != 0 && blk < sp->data_blk_count){
+        if(get_ref(blk) > 0){ // the rest is shared
+            ref_dec(blk);
+            break;
+        }
+        uint16_t next = fat[blk];
+        set_fat(blk, 0);
+        ++n;
+        blk = next;
+    }
+    sp->fat_used -= n;
+    return n;
+}
+
+/* allocate a chain of @n zeroed data blocks, for the regions of the disk
+ * return its first block, FAT_EOC if the disk is full
+*/
+uint16_t zero_chain(size_t n){
+    char zero_buffer[BLOCK_SIZE];
+    memset(zero_buffer, 0, BLOCK_SIZE);
+    uint16_t head = FAT_EOC, prev = FAT_EOC;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0 || block_write(sp->data_blk + temp, zero_buffer) < 0){
+            if(head != FAT_EOC)
+                release_chain(head);
+            return FAT_EOC;
+        }
+        set_fat(temp, FAT_EOC);
+        if(prev == FAT_EOC)
+            head = temp;
+        else
+            set_fat(prev, temp);
+        sp->fat_used += 1;
+        prev = temp;
+    }
+    return head;
+}
+
 /* calculate how many blocks needed for a file of size @sz */
 int file_blk_count(uint32_t sz){
     if(sz == 0) return 1;
@@ -231,6 +948,260 @@ int file_blk_count(uint32_t sz){
     else return k;
 }
 
+/* number of blocks needed by a file of @sz bytes, 0 for an empty file */
+uint32_t size_to_blk(size_t sz){
+    return (sz + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/* read the table of a mounted disk, nothing to do if no block is shared */
+int load_refs(){
+    if(sp->ref_blk == 0)
+        return 0;
+    ref = calloc(BLOCK_SIZE, size_to_blk(sp->data_blk_count * sizeof(uint16_t)));
+    if(ref == NULL)
+        return -1;
+
+    uint16_t blk = sp->ref_blk;
+    for (uint8_t * p = (uint8_t *)ref; blk != FAT_EOC && blk != 0; p += BLOCK_SIZE, blk = fat[blk])
+    {
+        if(meta_block_read(blk, p) < 0)
+            return -1;
+    }
+    for (int i = 0; i < sp->data_blk_count; ++i)
+        ref_total += ref[i];
+    return 0;
+}
+
+/* create an empty table before the first block gets shared
+ * the memory of a table which went away is used again
+ * return -1 if the disk is full
+*/
+int ref_create(){
+    if(sp->ref_blk != 0)
+        return 0;
+    uint32_t n = size_to_blk(sp->data_blk_count * sizeof(uint16_t));
+    if(ref == NULL && (ref = calloc(BLOCK_SIZE, n)) == NULL)
+        return -1;
+
+    uint16_t prev = FAT_EOC;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0){
+            release_chain(sp->ref_blk);
+            sp->ref_blk = 0;
+            return -1;
+        }
+        set_fat(temp, FAT_EOC);
+        if(prev == FAT_EOC)
+            sp->ref_blk = temp;
+        else
+            set_fat(prev, temp);
+        sp->fat_used += 1;
+        prev = temp;
+    }
+    ref_dirty = 1;
+    return 0;
+}
+
+/* write the table back, or release its blocks once nothing is shared
+ * the memory stays until fs_umount(), readers may be looking at it
+*/
+int flush_refs(){
+    if(ref == NULL || sp->ref_blk == 0)
+        return 0;
+    if(ref_total == 0){ // all zero, release_chain() below frees every block
+        uint16_t blk = sp->ref_blk;
+        sp->ref_blk = 0;
+        release_chain(blk);
+        return 0;
+    }
+    if(!ref_dirty)
+        return 0;
+
+    uint16_t blk = sp->ref_blk;
+    for (uint8_t * p = (uint8_t *)ref; blk != FAT_EOC; p += BLOCK_SIZE, blk = fat[blk])
+    {
+        if(meta_block_write(blk, p) < 0)
+            return -1;
+    }
+    ref_dirty = 0;
+    return 0;
+}
+
+/******************* Block Fingerprints *********************/
+/* In dedup mode fp[b] is a 32-bit hash of the bytes of data block b, 0 if not
+ * known. The write paths hash the blocks they write, see fp_note(), and a block
+ * is forgotten when it is allocated, so only blocks of files ever have one. It
+ * is a hint: a block may have changed since through a path which does not hash
+ * it, nothing is shared before the bytes are compared, see Deduplication.
+ * fp_head[], fp_next[] and fp_prev[] chain the blocks of each bucket, the index
+ * lookups go through. The table lives in data blocks chained from
+ * sp->dedup_blk, written back with the metadata; dedup is on while there is one.
+*/
+#define FP_BUCKETS 4096
+#define FP_PER_BLK (BLOCK_SIZE / sizeof(uint32_t))
+
+uint32_t * fp = NULL;
+uint16_t * fp_next = NULL;          // next block in the same bucket, FAT_EOC at the end
+uint16_t * fp_prev = NULL;          // previous one, FAT_EOC for the first
+uint16_t fp_head[FP_BUCKETS];
+uint8_t * fp_dirty = NULL;          // blocks of the table changed since the last write back
+uint8_t fp_file[FS_FILE_MAX_COUNT]; // root_dir[i] wrote blocks since dedup_file() looked at it
+pthread_mutex_t fp_lock = PTHREAD_MUTEX_INITIALIZER; // the table and its buckets, taken last
+
+typedef uint64_t fp_vec __attribute__((vector_size(16)));
+
+/* one round of a lane pair: the 32x32->64 bit multiply is a single SSE2 instruction */
+static inline fp_vec fp_round(fp_vec acc, const char * p, fp_vec key){
+    fp_vec w;
+    memcpy(&w, p, sizeof(w));
+    fp_vec x = w ^ key;
+    return acc + w + (x & 0xffffffff) * (x >> 32);
+}
+
+/* hash of the BLOCK_SIZE bytes at @data, never 0
+ * eight 64-bit lanes accumulated the way XXH3 does, in four vectors kept in registers
+*/
+uint32_t fp_hash(const void * data){
+    static const fp_vec key[4] = {
+        { 0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull }, { 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull },
+        { 0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull }, { 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull },
+    };
+    fp_vec a = { 1, 2 }, b = { 3, 4 }, c = { 5, 6 }, d = { 7, 8 };
+    const char * p = data;
+    for (size_t i = 0; i < BLOCK_SIZE; i += 4 * sizeof(fp_vec))
+    {
+        a = fp_round(a, p + i, key[0]);
+        b = fp_round(b, p + i + 16, key[1]);
+        c = fp_round(c, p + i + 32, key[2]);
+        d = fp_round(d, p + i + 48, key[3]);
+    }
+    fp_vec acc[4] = { a, b, c, d };
+    uint64_t h = BLOCK_SIZE;
+    for (int k = 0; k < 4; ++k)
+        for (int j = 0; j < 2; ++j)
+        {
+            h = (h ^ acc[k][j]) * 0x9e3779b185ebca87ull;
+            h ^= h >> 29;
+        }
+    uint32_t r = h ^ (h >> 32);
+    return r ? r : 1;
+}
+
+/* take block @blk out of its bucket, the caller holds fp_lock */
+void fp_unlink(uint16_t blk){
+    if(fp[blk] == 0)
+        return;
+    if(fp_prev[blk] != FAT_EOC)
+        fp_next[fp_prev[blk]] = fp_next[blk];
+    else
+        fp_head[fp[blk] % FP_BUCKETS] = fp_next[blk];
+    if(fp_next[blk] != FAT_EOC)
+        fp_prev[fp_next[blk]] = fp_prev[blk];
+    fp[blk] = 0;
+    fp_dirty[blk / FP_PER_BLK] = 1;
+}
+
+/* give block @blk fingerprint @h, the caller holds fp_lock */
+void fp_set(uint16_t blk, uint32_t h){
+    if(fp[blk] == h)
+        return;
+    fp_unlink(blk);
+    uint16_t * head = fp_head + h % FP_BUCKETS;
+    fp[blk] = h;
+    fp_prev[blk] = FAT_EOC;
+    fp_next[blk] = *head;
+    if(*head != FAT_EOC)
+        fp_prev[*head] = blk;
+    *head = blk;
+    fp_dirty[blk / FP_PER_BLK] = 1;
+}
+
+/* data block @blk of root_dir[@idx] now holds the BLOCK_SIZE bytes at @content */
+void fp_note(int idx, uint16_t blk, const void * content){
+    if(fp == NULL) // dedup is off
+        return;
+    uint32_t h = fp_hash(content);
+    pthread_mutex_lock(&fp_lock);
+    fp_set(blk, h);
+    fp_file[idx] = 1;
+    pthread_mutex_unlock(&fp_lock);
+}
+
+/* block @blk is being allocated, whatever it held is gone */
+void fp_forget(uint16_t blk){
+    if(fp == NULL || __atomic_load_n(fp + blk, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&fp_lock);
+    fp_unlink(blk);
+    pthread_mutex_unlock(&fp_lock);
+}
+
+/* empty table and index for the mounted disk */
+int fp_alloc(){
+    uint32_t n = size_to_blk(sp->data_blk_count * sizeof(uint32_t));
+    fp = calloc(n, BLOCK_SIZE);
+    fp_next = malloc(sp->data_blk_count * sizeof(uint16_t));
+    fp_prev = malloc(sp->data_blk_count * sizeof(uint16_t));
+    fp_dirty = calloc(n, 1);
+    memset(fp_head, 0xFF, sizeof(fp_head)); // FAT_EOC
+    memset(fp_file, 0, sizeof(fp_file));
+    return (fp && fp_next && fp_prev && fp_dirty) ? 0 : -1;
+}
+
+void fp_free(){
+    free(fp);
+    free(fp_next);
+    free(fp_prev);
+    free(fp_dirty);
+    fp = NULL;
+    fp_next = fp_prev = NULL;
+    fp_dirty = NULL;
+}
+
+/* read the table of a mounted disk and index it, nothing to do if dedup is off */
+int load_fps(){
+    if(sp->dedup_blk == 0)
+        return 0;
+    if(fp_alloc() < 0)
+        return -1;
+
+    uint16_t blk = sp->dedup_blk;
+    for (uint8_t * p = (uint8_t *)fp; blk != FAT_EOC && blk != 0; p += BLOCK_SIZE, blk = fat[blk])
+    {
+        if(meta_block_read(blk, p) < 0)
+            return -1;
+    }
+    for (uint16_t i = 0; i < sp->data_blk_count; ++i)
+    {
+        uint32_t h = fp[i];
+        fp[i] = 0;
+        if(h != 0 && fat[i] != 0) // what a crash left of freed blocks goes
+            fp_set(i, h);
+    }
+    return 0;
+}
+
+/* write the blocks of the table which changed back */
+int flush_fps(){
+    if(fp == NULL || sp->dedup_blk == 0)
+        return 0;
+    char buf[BLOCK_SIZE];
+    uint16_t blk = sp->dedup_blk;
+    for (uint32_t i = 0; blk != FAT_EOC && blk != 0; ++i, blk = fat[blk])
+    {
+        pthread_mutex_lock(&fp_lock); // writers hash blocks without meta_lock
+        bool dirty = fp_dirty[i];
+        fp_dirty[i] = 0;
+        memcpy(buf, (uint8_t *)fp + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        pthread_mutex_unlock(&fp_lock);
+        if(dirty && meta_block_write(blk, buf) < 0)
+            return -1;
+    }
+    return 0;
+}
+
 /* get next free file directory entry index;
  * check the duplicated existed filename by @filename
  * return index number; -1 if fail. set the entry_ptr address 
@@ -338,44 +1309,690 @@ int get_directory_entry(const char * filename, void *  entry_ptr){
 */
 
 
-/* resume the fat as zero ( free ) again
- * update the sp->fat_used
-*/
-int erase_fat(uint16_t * id){ // recursion to erase
-    if(sp == NULL || root_dir == NULL || id == NULL)
+/* publish the names of root_dir for fs_open(), the caller holds dir_lock */
+int dir_publish(){
+    struct DirView * v = malloc(sizeof(struct DirView));
+    if(v == NULL){ // no copy at all, lookups take dir_lock until the next one
+        rcu_retire(__atomic_exchange_n(&dir_view, NULL, __ATOMIC_SEQ_CST));
         return -1;
-
-    // if(*id == 0xFFFF){
-    //     *id = 0;
-    //     sp->fat_used -= 1; // careful
-    //     return 0;
-    // }
-
-    while((*id) != 0xFFFF){
-        uint16_t next = *id;
-        *id = 0;
-        sp->fat_used -= 1;
-        id = get_fat(next);
     }
-    *id = 0;
-    sp->fat_used -= 1;
-    // uint16_t * next = fat + sizeof(uint16_t) * (*id);
-    // erase_fat(next);
-    
-    // *id = 0;
-    // sp->fat_used -= 1;
-
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        v->gen[i] = dir_gen[i];
+        memcpy(v->name[i], root_dir[i].filename, FS_FILENAME_LEN);
+    }
+    rcu_retire(__atomic_exchange_n(&dir_view, v, __ATOMIC_SEQ_CST));
     return 0;
 }
 
-/* not used
-uint16_t id_to_real_blk(int i){
-    // if sp == NULL || root_dir == NULL;
-    return i + sp->data_blk;
-} 
+/* look @filename up without lock, set @gen to the generation of its entry
+ * return its index in root_dir, -1 if not found
 */
-
-
+int dir_lookup(const char * filename, uint32_t * gen){
+    int idx = -1;
+    if(rcu_enter()){
+        struct DirView * v = __atomic_load_n(&dir_view, __ATOMIC_ACQUIRE);
+        for (int i = 0; v && i < FS_FILE_MAX_COUNT; ++i)
+        {
+            if(strncmp(v->name[i], filename, FS_FILENAME_LEN) == 0){
+                idx = i;
+                *gen = v->gen[i];
+                break;
+            }
+        }
+        rcu_exit();
+        if(v != NULL)
+            return idx;
+    }
+    HOLD_DIR(); // nothing published since the mount, or no reader slot left
+    if(dir_view == NULL)
+        dir_publish();
+    idx = get_directory_entry(filename, NULL);
+    if(idx >= 0)
+        *gen = dir_gen[idx];
+    return idx;
+}
+
+/* take a reference on root_dir[@idx], false if it is being removed */
+bool pin_idx(int idx){
+    uint32_t n = __atomic_load_n(file_open + idx, __ATOMIC_ACQUIRE);
+    while(n != FILE_DYING && !__atomic_compare_exchange_n(file_open + idx, &n, n + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+    return n != FILE_DYING;
+}
+
+/* take a reference on the file named @filename for a new descriptor, without lock
+ * return its index in root_dir, -1 if there is no such file or it is being removed
+*/
+int pin_entry(const char * filename){
+    for (bool waited = false;;)
+    {
+        uint32_t gen = 0;
+        int idx = dir_lookup(filename, &gen);
+        if(idx < 0)
+            return -1;
+        if(!pin_idx(idx)){ // removed or replaced under dir_lock, look again once that is done
+            if(waited)
+                return -1;
+            waited = true;
+            pthread_mutex_lock(&dir_lock);
+            pthread_mutex_unlock(&dir_lock);
+            continue;
+        }
+        if(__atomic_load_n(dir_gen + idx, __ATOMIC_SEQ_CST) == gen)
+            return idx;
+        __atomic_sub_fetch(file_open + idx, 1, __ATOMIC_SEQ_CST); // removed meanwhile, the slot may be another file
+    }
+}
+
+void unpin_entry(int idx){
+    __atomic_sub_fetch(file_open + idx, 1, __ATOMIC_SEQ_CST);
+}
+
+/* whether root_dir[@idx] has descriptors */
+bool entry_busy(int idx){
+    return __atomic_load_n(file_open + idx, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* make sure root_dir[@idx] is not open and stays so until clear_entry(),
+ * or entry_keep() if it is not removed after all
+*/
+bool entry_retire(int idx){
+    uint32_t none = 0;
+    return __atomic_compare_exchange_n(file_open + idx, &none, FILE_DYING, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void entry_keep(int idx){
+    __atomic_store_n(file_open + idx, 0, __ATOMIC_SEQ_CST);
+}
+
+/* resume the fat as zero ( free ) again
+ * update the sp->fat_used
+*/
+int erase_fat(uint16_t * id){ // recursion to erase
+    if(sp == NULL || root_dir == NULL || id == NULL)
+        return -1;
+
+    // one entry at a time, each followed by a full write_meta(), was too slow for big files
+    if(release_chain(id - fat) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**************** sparse file *************/
+/* A sparse file keeps the list of its holes (runs of logical blocks without
+ * any data block) in its own chain of data blocks, starting at @hole_blk of
+ * its directory entry; 0 means no hole. The FAT chain of the file only links
+ * the allocated blocks in logical order, so logical block n lives at chain
+ * position n minus the number of hole blocks before it.
+ * On disk the hole chain holds: uint32_t count, uint32_t unused, then @count
+ * struct HoleRun sorted by @start.
+*/
+struct HoleRun {
+    uint32_t start;     // first logical block of the hole
+    uint32_t len;       // number of blocks in the hole
+}__attribute__((packed));
+
+struct HoleList {
+    uint32_t count;
+    uint32_t cap;
+    uint8_t  dirty;     // write back by write_meta()
+    struct HoleRun * run;
+};
+
+#define HOLE_HDR_SZ 8
+
+struct HoleList * holes[FS_FILE_MAX_COUNT]; // loaded on demand, same index as root_dir
+
+/* the position cursor of a file, walks logical blocks and the FAT chain together
+ * @blk is the data block of @lblk, or the next data block when @lblk is in a hole
+ * @prev is the data block before @blk, FAT_EOC at the head of the chain
+ * @shared is the first chain position known to be shared with a clone, past @pos it may not be known yet
+*/
+struct BlkCursor {
+    direntry_t entry;
+    int        idx;     // index in root_dir
+    uint32_t   lblk;    // logical block number
+    uint32_t   run;     // first hole run which ends after @lblk
+    uint32_t   pos;     // position of @blk in the chain
+    uint32_t   shared;  // UINT32_MAX if none
+    uint16_t   prev;
+    uint16_t   blk;
+};
+
+/* check whether @n bytes of @buf are all zero
+ * 64 bytes a time with SSE2, stop as soon as a non-zero chunk is seen
+*/
+bool is_zero_blk(const void * buf, size_t n){
+    const uint8_t * p = buf;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= n; i += 64)
+    {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return false;
+    }
+#else
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        if(v != 0)
+            return false;
+    }
+#endif
+    for (; i < n; ++i)
+        if(p[i] != 0)
+            return false;
+    return true;
+}
+
+struct HoleList * get_holes(direntry_t entry);
+
+/* whether the hole list of @entry is there if it needs one, cursors rely on it */
+bool holes_ready(direntry_t entry){
+    return entry->hole_blk == 0 || get_holes(entry) != NULL;
+}
+
+/* get the hole list of @entry, NULL if it has never been sparse
+ * read from its hole chain the first time, readers of the file may come together
+*/
+struct HoleList * get_holes(direntry_t entry){
+    int idx = entry - root_dir;
+    struct HoleList * loaded = __atomic_load_n(holes + idx, __ATOMIC_ACQUIRE);
+    if(loaded != NULL || entry->hole_blk == 0)
+        return loaded;
+    HOLD_META();
+    if(holes[idx] != NULL)
+        return holes[idx];
+
+    char bounce_buffer[BLOCK_SIZE];
+    uint16_t blk = entry->hole_blk;
+    if(meta_block_read(blk, bounce_buffer) < 0)
+        return NULL;
+
+    struct HoleList * h = calloc(1, sizeof(struct HoleList));
+    if(h == NULL)
+        return NULL;
+    memcpy(&h->count, bounce_buffer, sizeof(uint32_t));
+    h->cap = h->count + 16;
+    h->run = malloc(h->cap * sizeof(struct HoleRun));
+    if(h->run == NULL){
+        free(h);
+        return NULL;
+    }
+
+    /* the runs stream over the hole chain right after the header */
+    size_t total = HOLE_HDR_SZ + h->count * sizeof(struct HoleRun);
+    size_t done = HOLE_HDR_SZ;
+    while(done < total){
+        size_t blk_off = done % BLOCK_SIZE;
+        if(blk_off == 0){
+            blk = fat[blk];
+            if(blk == FAT_EOC || meta_block_read(blk, bounce_buffer) < 0){
+                eprintf("get_holes: broken hole chain\n");
+                h->count = (done - HOLE_HDR_SZ) / sizeof(struct HoleRun);
+                break;
+            }
+        }
+        size_t n = clamp(BLOCK_SIZE - blk_off, total - done);
+        memcpy((char *)h->run + done - HOLE_HDR_SZ, bounce_buffer + blk_off, n);
+        done += n;
+    }
+
+    __atomic_store_n(holes + idx, h, __ATOMIC_RELEASE);
+    return h;
+}
+
+/* make sure the hole chain of @entry can store @count runs, allocating blocks if needed
+ * return -1 if the disk is full
+*/
+int hole_reserve(direntry_t entry, uint32_t count){
+    int idx = entry - root_dir;
+    if(holes[idx] == NULL){
+        holes[idx] = calloc(1, sizeof(struct HoleList));
+        if(holes[idx] == NULL)
+            return -1;
+    }
+    struct HoleList * h = holes[idx];
+    if(count > h->cap){
+        struct HoleRun * run = realloc(h->run, (count + 16) * sizeof(struct HoleRun));
+        if(run == NULL)
+            return -1;
+        h->run = run;
+        h->cap = count + 16;
+    }
+
+    uint32_t need = size_to_blk(HOLE_HDR_SZ + count * sizeof(struct HoleRun));
+    uint32_t have = 0;
+    uint16_t blk = entry->hole_blk, prev = FAT_EOC;
+    while(blk != 0 && blk != FAT_EOC){
+        ++have;
+        prev = blk;
+        blk = fat[blk];
+    }
+    for (; have < need; ++have)
+    {
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0)
+            return -1;
+        set_fat(temp, FAT_EOC);
+        if(prev == FAT_EOC)
+            entry->hole_blk = temp;
+        else
+            set_fat(prev, temp);
+        sp->fat_used += 1;
+        prev = temp;
+    }
+    return 0;
+}
+
+/* shrink the hole chain of @entry to what its runs need, free it when there is no hole left */
+void hole_fit(direntry_t entry){
+    struct HoleList * h = holes[entry - root_dir];
+    if(h == NULL || entry->hole_blk == 0)
+        return;
+
+    h->dirty = 1;
+    if(h->count == 0){
+        release_chain(entry->hole_blk);
+        entry->hole_blk = 0;
+        h->dirty = 0;
+        return;
+    }
+    uint32_t need = size_to_blk(HOLE_HDR_SZ + h->count * sizeof(struct HoleRun));
+    uint16_t blk = entry->hole_blk;
+    for (uint32_t i = 1; i < need; ++i)
+        blk = fat[blk];
+    if(fat[blk] != FAT_EOC){
+        uint16_t rest = fat[blk];
+        set_fat(blk, FAT_EOC);
+        release_chain(rest);
+    }
+}
+
+/* write the hole list of root_dir[@idx] back to its hole chain */
+int flush_holes(int idx){
+    struct HoleList * h = holes[idx];
+    if(h == NULL || !h->dirty || root_dir[idx].hole_blk == 0)
+        return 0;
+
+    char bounce_buffer[BLOCK_SIZE];
+    size_t total = HOLE_HDR_SZ + h->count * sizeof(struct HoleRun);
+    uint16_t blk = root_dir[idx].hole_blk;
+    for (size_t done = 0; done < total && blk != FAT_EOC; done += BLOCK_SIZE, blk = fat[blk])
+    {
+        size_t n = clamp(BLOCK_SIZE, total - done);
+        memset(bounce_buffer, 0, BLOCK_SIZE);
+        if(done == 0){
+            memcpy(bounce_buffer, &h->count, sizeof(uint32_t));
+            memcpy(bounce_buffer + HOLE_HDR_SZ, h->run, n - HOLE_HDR_SZ);
+        }
+        else
+            memcpy(bounce_buffer, (const char *)h->run + done - HOLE_HDR_SZ, n);
+        if(meta_block_write(blk, bounce_buffer) < 0)
+            return -1;
+    }
+    h->dirty = 0;
+    return 0;
+}
+
+/* drop the cached hole list of root_dir[@idx] */
+void drop_holes(int idx){
+    if(holes[idx] == NULL)
+        return;
+    free(holes[idx]->run);
+    free(holes[idx]);
+    holes[idx] = NULL;
+}
+
+/* mark logical blocks [@start, @start + @len) of @entry as a hole, merging with the neighbors
+ * return -1 if the hole chain cannot grow
+*/
+int hole_add(direntry_t entry, uint32_t start, uint32_t len){
+    struct HoleList * h = get_holes(entry);
+    if(len == 0)
+        return 0;
+    if(hole_reserve(entry, (h ? h->count : 0) + 1) < 0)
+        return -1;
+    h = holes[entry - root_dir];
+
+    uint32_t i = 0;
+    while(i < h->count && h->run[i].start + h->run[i].len < start)
+        ++i;
+    if(i < h->count && h->run[i].start <= start + len){ // touches run i, merge
+        uint32_t end = pickmax(h->run[i].start + h->run[i].len, start + len);
+        h->run[i].start = clamp(h->run[i].start, start);
+        h->run[i].len = end - h->run[i].start;
+        while(i + 1 < h->count && h->run[i + 1].start <= end){ // swallow the following runs
+            end = pickmax(end, h->run[i + 1].start + h->run[i + 1].len);
+            h->run[i].len = end - h->run[i].start;
+            memmove(h->run + i + 1, h->run + i + 2, (h->count - i - 2) * sizeof(struct HoleRun));
+            --h->count;
+        }
+    }
+    else{
+        memmove(h->run + i + 1, h->run + i, (h->count - i) * sizeof(struct HoleRun));
+        h->run[i].start = start;
+        h->run[i].len = len;
+        ++h->count;
+    }
+    hole_fit(entry);
+    return 0;
+}
+
+/* logical block @lblk of @entry is not a hole anymore
+ * return -1 if splitting the run needs a hole chain block and the disk is full
+*/
+int hole_remove(direntry_t entry, uint32_t lblk){
+    struct HoleList * h = get_holes(entry);
+    if(h == NULL)
+        return 0;
+
+    uint32_t i = 0;
+    while(i < h->count && h->run[i].start + h->run[i].len <= lblk)
+        ++i;
+    if(i == h->count || h->run[i].start > lblk)
+        return 0;
+
+    struct HoleRun * r = h->run + i;
+    if(r->len == 1){
+        memmove(r, r + 1, (h->count - i - 1) * sizeof(struct HoleRun));
+        --h->count;
+    }
+    else if(lblk == r->start){
+        ++r->start;
+        --r->len;
+    }
+    else if(lblk == r->start + r->len - 1)
+        --r->len;
+    else{ // split in two
+        if(hole_reserve(entry, h->count + 1) < 0)
+            return -1;
+        r = h->run + i;
+        memmove(r + 1, r, (h->count - i) * sizeof(struct HoleRun));
+        r[1].start = lblk + 1;
+        r[1].len = r->start + r->len - lblk - 1;
+        r->len = lblk - r->start;
+        ++h->count;
+    }
+    hole_fit(entry);
+    return 0;
+}
+
+/* forget the holes at or after logical block @nblk (file shrunk to @nblk blocks) */
+void hole_trim(direntry_t entry, uint32_t nblk){
+    struct HoleList * h = get_holes(entry);
+    if(h == NULL)
+        return;
+    while(h->count > 0 && h->run[h->count - 1].start >= nblk)
+        --h->count;
+    if(h->count > 0 && h->run[h->count - 1].start + h->run[h->count - 1].len > nblk)
+        h->run[h->count - 1].len = nblk - h->run[h->count - 1].start;
+    hole_fit(entry);
+}
+
+/* find the first hole run of the cursor again after the hole list changed */
+void cursor_sync(struct BlkCursor * cur){
+    struct HoleList * h = holes[cur->idx];
+    if(h == NULL){
+        cur->run = 0;
+        return;
+    }
+    if(cur->run > 0)
+        --cur->run;
+    if(cur->run > h->count)
+        cur->run = h->count;
+    while(cur->run > 0 && h->run[cur->run - 1].start + h->run[cur->run - 1].len > cur->lblk)
+        --cur->run;
+    while(cur->run < h->count && h->run[cur->run].start + h->run[cur->run].len <= cur->lblk)
+        ++cur->run;
+}
+
+/* place @cur on logical block @lblk of @entry */
+void cursor_seek(struct BlkCursor * cur, direntry_t entry, uint32_t lblk){
+    struct HoleList * h = get_holes(entry);
+    uint32_t skip = 0;
+
+    cur->entry = entry;
+    cur->idx = entry - root_dir;
+    cur->lblk = lblk;
+    cur->run = 0;
+    for (; h && cur->run < h->count && h->run[cur->run].start < lblk; ++cur->run)
+    {
+        struct HoleRun * r = h->run + cur->run;
+        if(r->start + r->len > lblk){ // @lblk is inside this run
+            skip += lblk - r->start;
+            break;
+        }
+        skip += r->len;
+    }
+
+    cur->prev = FAT_EOC;
+    cur->blk = entry->first_data_blk;
+    cur->pos = 0;
+    cur->shared = UINT32_MAX;
+    for (;; ++cur->pos){
+        if(cur->shared == UINT32_MAX && cur->blk != FAT_EOC && get_ref(cur->blk) > 0)
+            cur->shared = cur->pos;
+        if(cur->pos == lblk - skip || cur->blk == FAT_EOC)
+            break;
+        cur->prev = cur->blk;
+        cur->blk = fat[cur->blk];
+    }
+}
+
+bool cursor_in_hole(struct BlkCursor * cur){
+    struct HoleList * h = holes[cur->idx];
+    return h && cur->run < h->count && h->run[cur->run].start <= cur->lblk;
+}
+
+/* the logical block of the cursor has its own data block */
+bool cursor_has_data(struct BlkCursor * cur){
+    return !cursor_in_hole(cur) && cur->blk != FAT_EOC;
+}
+
+void cursor_next(struct BlkCursor * cur){
+    if(cursor_has_data(cur)){
+        cur->prev = cur->blk;
+        cur->blk = fat[cur->blk];
+        ++cur->pos;
+        if(cur->shared == UINT32_MAX && cur->blk != FAT_EOC && get_ref(cur->blk) > 0)
+            cur->shared = cur->pos;
+    }
+    ++cur->lblk;
+
+    struct HoleList * h = holes[cur->idx];
+    while(h && cur->run < h->count && h->run[cur->run].start + h->run[cur->run].len <= cur->lblk)
+        ++cur->run;
+}
+
+/* give the file of @cur its own copy of the chain positions from @cur->shared to @upto,
+ * so their data and FAT entries can change; the copy of @upto is linked to the rest
+ * of the shared chain, which gains a reference
+ * return -1 if the disk is full, the chain is left as it was
+*/
+int cursor_unshare(struct BlkCursor * cur, uint32_t upto){
+    if(cur->shared > upto)
+        return 0;
+
+    direntry_t entry = cur->entry;
+    uint16_t prev = FAT_EOC, blk = entry->first_data_blk;
+    for (uint32_t i = 0; i < cur->shared; ++i)
+    {
+        prev = blk;
+        blk = fat[blk];
+    }
+
+    uint16_t orig = blk, head = FAT_EOC, tail = FAT_EOC;
+    uint16_t new_prev = cur->prev, new_blk = cur->blk;
+    char bounce_buffer[BLOCK_SIZE];
+    for (uint32_t i = cur->shared; i <= upto && blk != FAT_EOC; ++i, blk = fat[blk])
+    {
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0 || block_read(sp->data_blk + blk, bounce_buffer) < 0 \
+            || block_write(sp->data_blk + temp, bounce_buffer) < 0){
+            if(head != FAT_EOC)
+                release_chain(head);
+            return -1;
+        }
+        set_fat(temp, FAT_EOC);
+        sp->fat_used += 1;
+        if(tail == FAT_EOC)
+            head = temp;
+        else
+            set_fat(tail, temp);
+        tail = temp;
+
+        if(i + 1 == cur->pos)
+            new_prev = temp;
+        if(i == cur->pos)
+            new_blk = temp;
+    }
+
+    set_fat(tail, blk); // @blk is the first block left shared
+    if(blk != FAT_EOC)
+        ref_inc(blk);
+    else
+        entry->last_data_blk = tail;
+    ref_dec(orig);
+    if(prev == FAT_EOC)
+        entry->first_data_blk = head;
+    else
+        set_fat(prev, head);
+
+    cur->prev = new_prev;
+    cur->blk = new_blk;
+    cur->shared = (blk != FAT_EOC) ? upto + 1 : UINT32_MAX;
+    return 0;
+}
+
+/* link the newly written data block @blk at the cursor, in a hole or past the end of the chain
+ * return -1 if the hole cannot be split, or if the block before is shared and cannot be copied
+*/
+int cursor_link(struct BlkCursor * cur, uint16_t blk){
+    set_fat(blk, FAT_EOC); // taken, so a copy made below cannot land on it
+    sp->fat_used += 1;
+    if((cur->pos > 0 && cursor_unshare(cur, cur->pos - 1) < 0) \
+        || (cursor_in_hole(cur) && hole_remove(cur->entry, cur->lblk) < 0)){
+        set_fat(blk, 0);
+        sp->fat_used -= 1;
+        return -1;
+    }
+    cursor_sync(cur);
+    set_fat(blk, cur->blk);
+
+    if(cur->prev == FAT_EOC)
+        cur->entry->first_data_blk = blk;
+    else
+        set_fat(cur->prev, blk);
+    if(cur->blk == FAT_EOC)
+        cur->entry->last_data_blk = blk;
+    cur->blk = blk;
+    if(cur->shared != UINT32_MAX) // the shared part moved one position down
+        ++cur->shared;
+    return 0;
+}
+
+/* make the logical block of the cursor read as zeros, without a data block when possible
+ * return -1 if the disk is full
+*/
+int cursor_zero(struct BlkCursor * cur){
+    if(cursor_in_hole(cur))
+        return 0;
+    if(cur->blk != FAT_EOC && cur->pos > 0 && cursor_unshare(cur, cur->pos - 1) < 0) // the block before changes
+        return -1;
+
+    struct HoleList * h = get_holes(cur->entry);
+    if(hole_reserve(cur->entry, (h ? h->count : 0) + 1) < 0){ // no room to record a hole, keep a block of zeros
+        char zero_buffer[BLOCK_SIZE];
+        memset(zero_buffer, 0, BLOCK_SIZE);
+        if(cur->blk != FAT_EOC){
+            if(cursor_unshare(cur, cur->pos) < 0)
+                return -1;
+            return block_write(sp->data_blk + cur->blk, zero_buffer);
+        }
+
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0 || block_write(sp->data_blk + temp, zero_buffer) < 0)
+            return -1;
+        return cursor_link(cur, temp);
+    }
+
+    if(cur->blk != FAT_EOC){ // unlink and free the data block
+        uint16_t next = fat[cur->blk];
+        if(cur->prev == FAT_EOC)
+            cur->entry->first_data_blk = next;
+        else
+            set_fat(cur->prev, next);
+        if(next == FAT_EOC)
+            cur->entry->last_data_blk = cur->prev;
+        if(get_ref(cur->blk) > 0){ // still used by a clone, which keeps pointing to @next
+            ref_dec(cur->blk);
+            if(next != FAT_EOC)
+                ref_inc(next);
+            else
+                cur->shared = UINT32_MAX;
+        }
+        else{
+            set_fat(cur->blk, 0);
+            sp->fat_used -= 1;
+            if(cur->shared != UINT32_MAX)
+                --cur->shared;
+        }
+        cur->blk = next;
+        if(cur->shared == UINT32_MAX && next != FAT_EOC && get_ref(next) > 0)
+            cur->shared = cur->pos;
+    }
+    hole_add(cur->entry, cur->lblk, 1); // cannot fail after hole_reserve()
+    cursor_sync(cur);
+    return 0;
+}
+
+/* zero the bytes of @entry between its end and the end of its last block,
+ * they may hold stale data from before a truncate
+*/
+int zero_tail(direntry_t entry){
+    if(entry->file_sz % BLOCK_SIZE == 0)
+        return 0;
+
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, entry->file_sz / BLOCK_SIZE);
+    if(!cursor_has_data(&cur))
+        return 0;
+
+    char bounce_buffer[BLOCK_SIZE];
+    if(block_read(sp->data_blk + cur.blk, bounce_buffer) < 0)
+        return -1;
+    memset(bounce_buffer + entry->file_sz % BLOCK_SIZE, 0, BLOCK_SIZE - entry->file_sz % BLOCK_SIZE);
+    if(cursor_unshare(&cur, cur.pos) < 0)
+        return -1;
+    return block_write(sp->data_blk + cur.blk, bounce_buffer);
+}
+
+/* prepare @entry for a write at @offset beyond its end: the blocks in between become a hole */
+int make_gap(direntry_t entry, size_t offset){
+    if(zero_tail(entry) < 0)
+        return -1;
+    uint32_t old_nblk = size_to_blk(entry->file_sz);
+    uint32_t lblk = offset / BLOCK_SIZE;
+    if(lblk > old_nblk)
+        return hole_add(entry, old_nblk, lblk - old_nblk);
+    return 0;
+}
+
+/* not used
+uint16_t id_to_real_blk(int i){
+    // if sp == NULL || root_dir == NULL;
+    return i + sp->data_blk;
+} 
+*/
+
+
 /**************** helper-II for @fs_mount, @fs_umount and etc. *************/
 /*
  * read root directory block to update @sp->fat_used and @sp->rdir_used
@@ -403,7 +2020,7 @@ void sp_setup(){
     }
 
     ++fat16;
-    for (int i = 0; i < sp->data_blk_count; ++i, ++fat16)
+    for (int i = 1; i < sp->data_blk_count; ++i, ++fat16) // entry 0 is counted above
     {
         if(*fat16 != 0)
             ++(sp->fat_used);
@@ -427,1229 +2044,5039 @@ void sp_setup(){
     */
 }
 
-/* write back meta-information
- * helper-II for @fs_umount and etc. 
- * also update the meta-information when write, delete a file
+/******************* Metadata Journal *********************/
+/* write_meta() logs what changed since the last commit instead of writing it
+ * in place: superblock and root directory entries by comparing with their
+ * logged copy, FAT entries as (index, value), or their whole FAT block when
+ * most of it changed, and the images of data blocks holding metadata.
+ * JOURNAL_GROUP operations are committed together, as one sequential write.
+ * The FAT, root directory and superblock are written in place (checkpointed)
+ * when half of the ring is used and at fs_umount(), which leaves the journal
+ * empty for the reference implementation. fs_mount() replays what the last
+ * checkpoint missed. A block freed by the running transaction is not reused
+ * before it commits, or a crash could leave it in two files.
 */
-int write_meta(){
-    /* should not happen
-    if(sp->fat_used >= sp->data_blk_count)
-        sp->fat_used = sp->data_blk_count;
-    */ 
-    if(sp == NULL || root_dir == NULL || fat == NULL){
-        eprintf("no virtual disk mounted to write_meta");
-        return -1;
-    }
-    if(block_write(0, (void *)sp) < 0)
-    {
-        eprintf("fs_umount write back sp error\n");
-        return -1; 
+#define JOURNAL_MAGIC 0x4A534345      // "ECSJ"
+#define JOURNAL_MIN_BLKS 8
+#define JOURNAL_GROUP 16              // operations committed together at most
+#define JOURNAL_DATA_SZ (BLOCK_SIZE - 16)
+#define SB_LOG_SZ offsetof(struct SuperBlock, unused)
+
+static char JOURNAL_NAME[8] = "ECS150JR";
+
+/* FNV-1a of a ring block, @sum has to be 0 */
+uint32_t journal_sum(const struct JournalBlk * b){
+    const uint8_t * p = (const uint8_t *)b;
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < BLOCK_SIZE; ++i)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+/* the running transaction is on disk, start the next one */
+void journal_done(){
+    for (uint32_t i = 0; i < jr->fat_cnt; ++i)
+        jr->fat_mark[jr->fat_list[i]] = 0;
+    jr->fat_cnt = 0;
+    if(jr->freed_cnt > 0){
+        memset(jr->freed, 0, sp->data_blk_count);
+        if(jr->freed_min < fat_hint)
+            fat_hint = jr->freed_min;
+        jr->freed_cnt = 0;
+        jr->freed_min = UINT16_MAX;
     }
-    if(block_write(sp->rdir_blk, root_dir) < 0)// write back
+    jr->img_cnt = 0;
+    jr->ops = 0;
+    memcpy(jr->sp_log, sp, SB_LOG_SZ);
+    memcpy(jr->rdir_log, root_dir, BLOCK_SIZE);
+}
+
+/* write the metadata in place and empty the ring
+ * images are only left when a transaction did not fit in the ring
+*/
+int journal_checkpoint(){
+    for (uint32_t i = 0; i < jr->img_cnt; ++i)
     {
-        eprintf("fs_umount write back dir error\n");
-        return -1; 
+        if(fat[jr->img[i].blk] != 0 && block_write(sp->data_blk + jr->img[i].blk, jr->img[i].data) < 0)
+            return -1;
     }
+    if(block_write(0, (void *)sp) < 0 || block_write(sp->rdir_blk, root_dir) < 0)
+        return -1;
     for (int i = 0; i < sp->fat_blk_count; ++i)
     {
-        if(block_write(1 + i, fat + BLOCK_SIZE * i) < 0)// write back
-        {
-            eprintf("fs_umount write back fat blk %d error\n", i);
-            return -1; 
-        }
+        if(!fat_dirty[i])
+            continue;
+        if(block_write(1 + i, fat + FAT_PER_BLK * i) < 0)
+            return -1;
+        fat_dirty[i] = 0;
     }
+
+    struct JournalHdr hdr;
+    memset(&hdr, 0, BLOCK_SIZE);
+    memcpy(hdr.signature, JOURNAL_NAME, 8);
+    hdr.seq = jr->seq;
+    hdr.tail = jr->head;
+    hdr.len = jr->len;
+    if(block_write(sp->data_blk + jr->blk[0], &hdr) < 0)
+        return -1;
+    jr->used = 0;
+    journal_done();
     return 0;
 }
-/*
- * free space to sp, root_dir, and fat; set to zero for all of them
- * fail return -1; succeed return 0;
- * from TA: Part of this task should probably include closing the virtual disk
-*/
-void clear(){
-    if(sp) {
-        free(sp);
-        sp = NULL;
+
+/* log everything changed since the last commit as one transaction */
+int journal_commit(){
+    size_t cap = 1 + SB_LOG_SZ + FS_FILE_MAX_COUNT * (2 + sizeof(struct RootDirEntry)) \
+        + jr->fat_cnt * 5 + sp->fat_blk_count * (2 + BLOCK_SIZE) + jr->img_cnt * (3 + BLOCK_SIZE);
+    char * rec = malloc(cap);
+    if(rec == NULL)
+        return -1;
+    size_t n = 0;
+
+    if(memcmp(sp, jr->sp_log, SB_LOG_SZ) != 0){
+        rec[n++] = 'S';
+        memcpy(rec + n, sp, SB_LOG_SZ);
+        n += SB_LOG_SZ;
     }
-    if(root_dir){
-        free(root_dir);
-        root_dir = NULL;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        if(memcmp(root_dir + i, jr->rdir_log + i, sizeof(struct RootDirEntry)) == 0)
+            continue;
+        rec[n++] = 'D';
+        rec[n++] = i;
+        memcpy(rec + n, root_dir + i, sizeof(struct RootDirEntry));
+        n += sizeof(struct RootDirEntry);
     }
-    if(fat)
+    uint32_t cnt[256] = {0};
+    for (uint32_t i = 0; i < jr->fat_cnt; ++i)
+        ++cnt[jr->fat_list[i] / FAT_PER_BLK];
+    for (uint32_t i = 0; i < jr->fat_cnt; ++i)
     {
-        free(fat);
-        fat = NULL;
+        uint16_t id = jr->fat_list[i];
+        if(cnt[id / FAT_PER_BLK] * 5 > BLOCK_SIZE) // logged as a whole block below
+            continue;
+        rec[n++] = 'F';
+        memcpy(rec + n, &id, sizeof(uint16_t));
+        memcpy(rec + n + 2, fat + id, sizeof(uint16_t));
+        n += 4;
+    }
+    for (int i = 0; i < sp->fat_blk_count; ++i)
+    {
+        if(cnt[i] * 5 <= BLOCK_SIZE)
+            continue;
+        rec[n++] = 'T';
+        rec[n++] = i;
+        memcpy(rec + n, fat + FAT_PER_BLK * i, BLOCK_SIZE);
+        n += BLOCK_SIZE;
+    }
+    for (uint32_t i = 0; i < jr->img_cnt; ++i)
+    {
+        if(fat[jr->img[i].blk] == 0) // freed meanwhile
+            continue;
+        rec[n++] = 'B';
+        memcpy(rec + n, &jr->img[i].blk, sizeof(uint16_t));
+        memcpy(rec + n + 2, jr->img[i].data, BLOCK_SIZE);
+        n += 2 + BLOCK_SIZE;
+    }
+    if(n == 0){
+        free(rec);
+        journal_done();
+        return 0;
     }
 
-    if(disk) free(disk);
-    disk = NULL;
-    // dir_entry = NULL;
-    // fat16 = NULL;
-    fd_cnt = 0;
-
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+    uint32_t nblk = (n + JOURNAL_DATA_SZ - 1) / JOURNAL_DATA_SZ;
+    if(nblk > jr->len - jr->used){ // too big for the ring, written in place without the journal
+        free(rec);
+        eprintf("journal_commit: transaction of %u blocks, checkpoint\n", nblk);
+        return journal_checkpoint();
+    }
+    struct JournalBlk b;
+    for (uint32_t i = 0; i < nblk; ++i)
     {
-        if(filedes[i] != NULL) // should n't happen actually
-        {
-            fs_close(i); 
-            free(filedes[i]);
-            filedes[i] = NULL;
-            eprintf("alert file descriptor %d is not clear, force to be closed\n",i);
+        size_t off = i * JOURNAL_DATA_SZ;
+        memset(&b, 0, BLOCK_SIZE);
+        b.magic = JOURNAL_MAGIC;
+        b.seq = jr->seq;
+        b.len = clamp(JOURNAL_DATA_SZ, n - off);
+        b.commit = (i == nblk - 1);
+        memcpy(b.data, rec + off, b.len);
+        b.sum = journal_sum(&b);
+        if(block_write(sp->data_blk + jr->blk[1 + jr->head], &b) < 0){
+            free(rec);
+            return -1;
         }
+        jr->head = (jr->head + 1) % jr->len;
+        ++jr->used;
     }
+    free(rec);
+    ++jr->seq;
 
+    /* committed, the images can go in place */
+    for (uint32_t i = 0; i < jr->img_cnt; ++i)
+    {
+        if(fat[jr->img[i].blk] != 0 && block_write(sp->data_blk + jr->img[i].blk, jr->img[i].data) < 0)
+            return -1;
+    }
+    journal_done();
+    if(jr->used > jr->len / 2) // keep room for the next group
+        return journal_checkpoint();
+    return 0;
 }
 
-
-/*
- * alloc space to sp, root_dir, and fat; set to zero for all of them
- * initialize filedes, fd_cnt
- * initialize sp_setup()
- * fail return -1; succeed return 0;
- * unused for the first time
+/* apply the @n bytes of records of one committed transaction in memory
+ * only the images of the last one are kept: those of the older transactions
+ * reached their blocks before the next commit, and the blocks may hold file
+ * data by now
 */
-int init_alloc(){
-
-    sp = calloc(BLOCK_SIZE, 1);
-    root_dir = calloc(BLOCK_SIZE, 1);
-    if(sp == NULL || root_dir == NULL){
-        clear();
-        return -1;
+void journal_apply(const char * rec, size_t n){
+    jr->img_cnt = 0;
+    size_t i = 0;
+    while(i < n){
+        char type = rec[i++];
+        if(type == 'S'){
+            memcpy(sp, rec + i, SB_LOG_SZ);
+            i += SB_LOG_SZ;
+        }
+        else if(type == 'D'){
+            memcpy(root_dir + (uint8_t)rec[i], rec + i + 1, sizeof(struct RootDirEntry));
+            i += 1 + sizeof(struct RootDirEntry);
+        }
+        else if(type == 'F'){
+            uint16_t id;
+            memcpy(&id, rec + i, sizeof(uint16_t));
+            if(id < sp->data_blk_count){
+                memcpy(fat + id, rec + i + 2, sizeof(uint16_t));
+                fat_dirty[id / FAT_PER_BLK] = 1;
+            }
+            i += 4;
+        }
+        else if(type == 'T'){
+            uint8_t k = rec[i];
+            if(k < sp->fat_blk_count){
+                memcpy(fat + FAT_PER_BLK * k, rec + i + 1, BLOCK_SIZE);
+                fat_dirty[k] = 1;
+            }
+            i += 1 + BLOCK_SIZE;
+        }
+        else if(type == 'B'){
+            uint16_t blk;
+            memcpy(&blk, rec + i, sizeof(uint16_t));
+            meta_block_write(blk, rec + i + 2);
+            i += 2 + BLOCK_SIZE;
+        }
+        else{
+            eprintf("journal_apply: unknown record %d\n", type);
+            return;
+        }
     }
+}
 
-    if(block_read(0, (void *)sp) < 0) { clear(); return -1; }
-    fat = calloc(BLOCK_SIZE, sp->fat_blk_count); // need reading sp block!!!
-    if(fat == NULL){
-        clear();
+/* replay the committed transactions from the tail of the ring
+ * stop at the first block torn, stale, or of a transaction never committed
+*/
+int journal_replay(){
+    char * rec = malloc((size_t)jr->len * JOURNAL_DATA_SZ);
+    if(rec == NULL)
         return -1;
+    struct JournalBlk b;
+    size_t n = 0;
+    uint32_t pos = jr->head;
+    for (uint32_t i = 0; i < jr->len; ++i, pos = (pos + 1) % jr->len)
+    {
+        if(block_read(sp->data_blk + jr->blk[1 + pos], &b) < 0)
+            break;
+        uint32_t sum = b.sum;
+        b.sum = 0;
+        if(b.magic != JOURNAL_MAGIC || b.seq != jr->seq || b.len > JOURNAL_DATA_SZ || journal_sum(&b) != sum)
+            break;
+        memcpy(rec + n, b.data, b.len);
+        n += b.len;
+        if(b.commit){
+            journal_apply(rec, n);
+            n = 0;
+            ++jr->seq;
+            jr->head = (pos + 1) % jr->len;
+            jr->used = i + 1;
+        }
     }
-
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
-        filedes[i] = NULL;
-    fd_cnt = 0;
-
-    return 0;   
+    free(rec);
+    return 0;
 }
 
-/** version 1. 0
- * fs_mount - Mount a file system
- * @diskname: Name of the virtual disk file
- *
- * Open the virtual disk file @diskname and mount the file system that it
- * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
- *
- * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
-
- */
-int fs_mount(const char *diskname)
-{
-    if (block_disk_open(diskname) != 0) return -1;
-    disk = malloc(strlen(diskname) + 1);
-    strcpy(disk, diskname);
+void journal_free(){
+    if(jr == NULL)
+        return;
+    free(jr->blk);
+    free(jr->fat_list);
+    free(jr->fat_mark);
+    free(jr->freed);
+    free(jr->sp_log);
+    free(jr->rdir_log);
+    free(jr->img);
+    free(jr);
+    jr = NULL;
+}
 
-    if(init_alloc() < 0) return -1; // fail why
+/* open the journal of a mounted disk and replay it, nothing to do without one
+ * a read-only mount replays in memory only
+*/
+int journal_load(){
+    if(sp->journal_blk == 0)
+        return 0;
 
-    /* super block read */
-    // sp = malloc(BLOCK_SIZE); 
-    // if(sp == NULL) { clear(); return -1; }
+    struct JournalHdr hdr;
+    uint32_t n = 0;
+    for (uint16_t blk = sp->journal_blk; blk != FAT_EOC && blk != 0 && n <= sp->data_blk_count; blk = fat[blk])
+        ++n;
+    if(block_read(sp->data_blk + sp->journal_blk, &hdr) < 0 || strncmp(hdr.signature, JOURNAL_NAME, 8) != 0 \
+        || n < 2 || hdr.len != n - 1 || hdr.tail >= hdr.len){
+        eprintf("journal_load: bad journal\n");
+        return -1;
+    }
 
-    // memset(sp, 0, BLOCK_SIZE); // from TA: memset is redundant since you're overwriting the whole block anyway.
-    // if(block_read(0, (void *)sp) < 0) { clear(); return -1; } // put into init_alloc
-    /*
-    if(strncmp(sp->signature, FS_NAME, 8) != 0){
-        clear();
-        eprintf("fs_mount: non ECS150FS file system\n");
+    jr = calloc(1, sizeof(struct Journal));
+    if(jr == NULL)
+        return -1;
+    jr->blk = malloc(n * sizeof(uint16_t));
+    jr->fat_list = malloc(sp->data_blk_count * sizeof(uint16_t));
+    jr->fat_mark = calloc(sp->data_blk_count, 1);
+    jr->freed = calloc(sp->data_blk_count, 1);
+    jr->sp_log = calloc(BLOCK_SIZE, 1);
+    jr->rdir_log = calloc(BLOCK_SIZE, 1);
+    if(jr->blk == NULL || jr->fat_list == NULL || jr->fat_mark == NULL || jr->freed == NULL \
+        || jr->sp_log == NULL || jr->rdir_log == NULL){
+        journal_free();
         return -1;
     }
-    if(block_disk_count() != sp->total_blk_count)
-    {
-        clear();
-        eprintf("fs_mount: incorrect block size in metadata\n");
+    uint16_t blk = sp->journal_blk;
+    for (uint32_t i = 0; i < n; ++i, blk = fat[blk])
+        jr->blk[i] = blk;
+    jr->len = hdr.len;
+    jr->head = hdr.tail;
+    jr->seq = hdr.seq;
+    jr->freed_min = UINT16_MAX;
+
+    if(journal_replay() < 0)
         return -1;
+    if(read_only){ // the images stay in memory for meta_block_read()
+        memcpy(jr->sp_log, sp, SB_LOG_SZ);
+        memcpy(jr->rdir_log, root_dir, BLOCK_SIZE);
+        return 0;
     }
-    if(sp->data_blk_count > (sp->fat_blk_count * BLOCK_SIZE / 2))
-    {
-        clear();
-        eprintf("fs_mount: fat size and block size dismatch\n");
+    return journal_checkpoint();
+}
+
+/* write back meta-information
+ * helper-II for @fs_umount and etc. 
+ * also update the meta-information when write, delete a file
+*/
+int write_meta(){
+    /* should not happen
+    if(sp->fat_used >= sp->data_blk_count)
+        sp->fat_used = sp->data_blk_count;
+    */ 
+    if(sp == NULL || root_dir == NULL || fat == NULL){
+        eprintf("no virtual disk mounted to write_meta");
         return -1;
     }
-    */
-    if(strncmp(sp->signature, FS_NAME, 8) != 0 \
-        || block_disk_count() != sp->total_blk_count \
-        || sp->data_blk_count > (sp->fat_blk_count * BLOCK_SIZE / 2) ){
-        clear();
-        eprintf("fs_mount: fail\n");
+    if(read_only) // a snapshot, the disk may be in use by a writer
+        return 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) // hole lists go before the metadata pointing to them
+    {
+        if(flush_holes(i) < 0)
+            return -1;
+    }
+    if(flush_refs() < 0 || flush_fps() < 0)
         return -1;
+    if(jr != NULL){ // logged, the checkpoint writes it in place
+        ++jr->ops;
+        if(jr->ops >= JOURNAL_GROUP || jr->freed_cnt > 0 \
+            || jr->fat_cnt * 5 + jr->img_cnt * BLOCK_SIZE > jr->len / 4 * JOURNAL_DATA_SZ)
+            return journal_commit();
+        return 0;
     }
-
-    /* root_dir read; fat block read */
-    // root_dir = malloc(BLOCK_SIZE);
-    // if(root_dir == NULL) { clear(); return -1; }
-    // memset(root_dir, 0, BLOCK_SIZE);
-    if(block_read(sp->rdir_blk, root_dir) < 0){
-        eprintf("fs_mount: read root dir error\n");
-        clear(); 
+    if(block_write(0, (void *)sp) < 0)
+    {
+        eprintf("fs_umount write back sp error\n");
+        return -1; 
+    }
+    if(block_write(sp->rdir_blk, root_dir) < 0)// write back
+    {
+        eprintf("fs_umount write back dir error\n");
         return -1; 
     }
-
-    // dir_entry = get_dir(0);
-    // dir_entry = (struct RootDirEntry *)root_dir;
-    
-
-    // fat = malloc(BLOCK_SIZE * sp->fat_blk_count);
-    // if(fat == NULL) { clear(); return -1; }
-    // memset(fat, 0, BLOCK_SIZE * sp->fat_blk_count);
     for (int i = 0; i < sp->fat_blk_count; ++i)
     {
-        if(block_read(i+1, fat + BLOCK_SIZE * i) < 0){
-            eprintf("fs_mount: read %d th(from 0) fat block error\n", i);
-            clear();
-            return -1;
+        if(!fat_dirty[i]) // untouched since the last write back
+            continue;
+        if(block_write(1 + i, fat + FAT_PER_BLK * i) < 0)// write back
+        {
+            eprintf("fs_umount write back fat blk %d error\n", i);
+            return -1; 
         }
+        fat_dirty[i] = 0;
     }
-    // fat16 = get_fat(0);
-    // fat16 = (uint16_t *)fat;
+    return 0;
+}
+/******************* Batches *********************/
+/* Between fs_batch_begin() and fs_batch_commit(), fs_create(), fs_delete(),
+ * the writes and fs_truncate() only change the metadata in memory: they call
+ * meta_update() instead of write_meta(), and the commit writes it all back
+ * once, after the data blocks which went to the disk meanwhile. Any other
+ * call of write_meta() (fs_fsync(), snapshots, fs_umount()...) commits what
+ * the batch did so far. Batches nest, and span the whole mount.
+*/
+uint32_t batch_depth = 0;           // guarded by meta_lock
 
+int flush_pending(); // defined with the write buffers
 
-    sp_setup(); // for fat_used and rdir_used
-    write_meta(); // for data used
+/* write_meta() unless a batch is open */
+int meta_update(){
+    HOLD_META();
+    if(batch_depth > 0)
+        return 0;
+    return write_meta();
+}
 
+int fs_batch_begin(void)
+{
+    if(sp == NULL || read_only) return -1;
+    HOLD_META();
+    ++batch_depth;
     return 0;
 }
-/**/
 
-/* version 2.0 fail , it fails at info 
-int fs_mount(const char *diskname)
+int fs_batch_commit(void)
 {
-    if (block_disk_open(diskname) != 0) return -1;
-    
-    // if(init_alloc() < 0) return -1; // allocate error
-    if(init_alloc() < 0) {
-        eprintf("alloc error\n");
+    if(sp == NULL) return -1;
+    HOLD_ALL(); // the buffered data first, then all the metadata
+    if(batch_depth == 0)
         return -1;
-    }
-
-    if(block_read(0, (void *)sp) < 0) {
-        clear();
-        eprintf("fs_mount read superblock error\n");
+    if(--batch_depth > 0) // the outer one commits
+        return 0;
+    if(flush_pending() < 0 || write_meta() < 0 || (jr != NULL && journal_commit() < 0))
         return -1;
+    return 0;
+}
+
+/******************* Vectored I/O *********************/
+/* A walk over the buffers of a struct iovec array, so that file_readv() and
+ * file_writev() fill or drain all of them along one pass over the FAT chain.
+*/
+struct IoCursor {
+    const struct iovec * iov;
+    int    cnt;
+    int    i;       // current buffer
+    size_t off;     // offset in it
+};
+
+/* total length of the @cnt buffers of @iov, SIZE_MAX if it overflows */
+size_t iov_total(const struct iovec *iov, int cnt){
+    size_t total = 0;
+    for (int i = 0; i < cnt; ++i)
+    {
+        if(iov[i].iov_len > SIZE_MAX - total)
+            return SIZE_MAX;
+        total += iov[i].iov_len;
     }
-    if(strncmp(sp->signature, FS_NAME, 8) != 0){
-        clear();
-        eprintf("fs_mount non ECS150FS file system\n");
-        return -1;
+    return total;
+}
+
+/* step over the buffers which are used up or empty */
+void io_settle(struct IoCursor *ic){
+    while(ic->i < ic->cnt && ic->off == ic->iov[ic->i].iov_len){
+        ++ic->i;
+        ic->off = 0;
     }
-    sp_setup();
+}
 
-    if(block_read(sp->rdir_blk, root_dir) < 0){
-        eprintf("fs_mount read root dir error\n");
-        clear();
-        return -1;
+void io_init(struct IoCursor *ic, const struct iovec *iov, int cnt){
+    ic->iov = iov;
+    ic->cnt = cnt;
+    ic->i = 0;
+    ic->off = 0;
+    io_settle(ic);
+}
+
+/* the address of the next @n bytes if one buffer holds them all, and move past
+ * them; NULL otherwise, the cursor stays
+*/
+void * io_take(struct IoCursor *ic, size_t n){
+    if(ic->i == ic->cnt || ic->iov[ic->i].iov_len - ic->off < n)
+        return NULL;
+    void * p = (char *)ic->iov[ic->i].iov_base + ic->off;
+    ic->off += n;
+    io_settle(ic);
+    return p;
+}
+
+/* copy the next @n bytes of the buffers to @mem, or from @mem when @to_iov */
+void io_copy(struct IoCursor *ic, void *mem, size_t n, bool to_iov){
+    while(n > 0 && ic->i < ic->cnt){
+        size_t k = clamp(ic->iov[ic->i].iov_len - ic->off, n);
+        char * p = (char *)ic->iov[ic->i].iov_base + ic->off;
+        if(to_iov)
+            memcpy(p, mem, k);
+        else
+            memcpy(mem, p, k);
+        mem = (char *)mem + k;
+        n -= k;
+        ic->off += k;
+        io_settle(ic);
     }
-    // dir_entry = (struct RootDirEntry *)root_dir;
-    dir_entry = get_dir(0); // not necessary
+}
 
-    for (int i = 0; i < sp->fat_blk_count; ++i)
+/******************* Write Log *********************/
+/* fs_log_mount() sends small overwrites to a log instead of merging each into
+ * its block (a read and a write, plus the metadata): a write no larger than
+ * LOG_MAX_WRITE inside one existing block of the file is appended to the
+ * segment in memory, segments reach the disk one after the other when full,
+ * and at fs_close(). fs_read() lays the extents over what the blocks hold.
+ * Cleaning merges all the extents of a block and writes it once with
+ * file_write(); it runs when the log fills up, before any operation which
+ * could move or drop logged bytes, at fs_umount(), and at fs_mount() to apply
+ * the log left by a crash.
+*/
+#define LOG_MAGIC 0x4C534345          // "ECSL"
+#define LOG_MIN_BLKS 16
+#define LOG_MAX_BLKS 64
+#define LOG_REC_HDR 7
+#define LOG_MAX_WRITE (BLOCK_SIZE / 2)
+
+static char LOG_NAME[8] = "ECS150LG";
+
+/* checksum of a segment, taken with @sum = 0, one every few records: four
+ * lanes of 64-bit words rather than the bytes of journal_sum() one by one
+*/
+uint32_t log_sum(const struct JournalBlk * b){
+    const char * p = (const char *)b;
+    uint64_t h[4] = { 0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull };
+    for (int i = 0; i < BLOCK_SIZE; i += 4 * sizeof(uint64_t))
     {
-        if(block_read(i+1, fat + BLOCK_SIZE * i) < 0){
-            eprintf("fs_mount read %d th(from 1) fat block error\n", i);
-            clear();
-            return -1;
+        for (int k = 0; k < 4; ++k)
+        {
+            uint64_t w;
+            memcpy(&w, p + i + k * sizeof(uint64_t), sizeof(uint64_t));
+            h[k] = (h[k] ^ w) * 0x100000001B3ull;
         }
     }
-    fat16 = get_fat(0);
+    uint64_t r = h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+    return r ^ r >> 32;
+}
 
-    return 0;
+/* defined with fs_write() and fs_read() */
+size_t file_writev(direntry_t w_dir_entry, size_t offset, const struct iovec *iov, int iovcnt);
+size_t file_write(direntry_t w_dir_entry, size_t offset, const void *buf, size_t count);
+int file_readv(direntry_t dir_entry, size_t offset, const struct iovec *iov, int iovcnt);
+int file_read(direntry_t dir_entry, size_t offset, void *buf, size_t count);
+/* defined with the asynchronous and the parallel reads, and the mapped views */
+void async_stop();
+void par_stop();
+int fd_read_par(int fd, size_t offset, void * buf, size_t count);
+int image_fd();
+void image_close();
+/* defined with the compressed files */
+int zip_writev(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt);
+int zip_readv(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt);
+int zip_truncate(direntry_t entry, size_t size);
+/* defined with the deduplication */
+int dedup_file(direntry_t entry);
+/* defined with the range locks */
+void range_unhold(const uint16_t * blk, uint32_t n);
+int range_hold(uint16_t * blk, uint32_t n);
+
+void log_free(){
+    if(lg == NULL)
+        return;
+    free(lg->blk);
+    free(lg->data);
+    free(lg->ext);
+    free(lg);
+    lg = NULL;
 }
-*/
 
+/* remember the record at @rec, @rec is inside lg->data */
+int log_add_ext(const char * rec){
+    if(lg->ext_cnt == lg->ext_cap){
+        struct LogExt * ext = realloc(lg->ext, (lg->ext_cap + 64) * sizeof(struct LogExt));
+        if(ext == NULL)
+            return -1;
+        lg->ext = ext;
+        lg->ext_cap += 64;
+    }
+    struct LogExt * e = lg->ext + lg->ext_cnt++;
+    e->idx = rec[0];
+    memcpy(&e->off, rec + 1, sizeof(uint32_t));
+    memcpy(&e->len, rec + 5, sizeof(uint16_t));
+    e->data = rec + LOG_REC_HDR - lg->data;
+    ++lg->file_cnt[e->idx];
+    return 0;
+}
 
+/* write the segment being filled */
+int log_sync(){
+    if(lg == NULL || !lg->dirty)
+        return 0;
+    struct JournalBlk b;
+    memset(&b, 0, BLOCK_SIZE);
+    b.magic = LOG_MAGIC;
+    b.seq = lg->gen;
+    b.len = lg->fill;
+    memcpy(b.data, lg->data + (size_t)lg->seg * JOURNAL_DATA_SZ, lg->fill);
+    b.sum = log_sum(&b);
+    if(block_write(sp->data_blk + lg->blk[1 + lg->seg], &b) < 0)
+        return -1;
+    lg->dirty = 0;
+    return 0;
+}
 
- 
+/* order of cleaning: by file, then block, then age */
+int log_cmp(const void * a, const void * b){
+    const struct LogExt * x = lg->ext + *(const uint32_t *)a;
+    const struct LogExt * y = lg->ext + *(const uint32_t *)b;
+    if(x->idx != y->idx)
+        return x->idx - y->idx;
+    if(x->off / BLOCK_SIZE != y->off / BLOCK_SIZE)
+        return x->off / BLOCK_SIZE < y->off / BLOCK_SIZE ? -1 : 1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
 
+/* merge the extents into their blocks, then start a new generation of the log */
+int log_clean(){
+    if(lg == NULL || lg->ext_cnt == 0 || read_only)
+        return 0;
 
-/**
- * fs_umount - Unmount file system
- *
- * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
- *
- * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
- * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+    uint32_t * order = malloc(lg->ext_cnt * sizeof(uint32_t));
+    if(order == NULL)
+        return -1;
+    for (uint32_t i = 0; i < lg->ext_cnt; ++i)
+        order[i] = i;
+    qsort(order, lg->ext_cnt, sizeof(uint32_t), log_cmp);
 
-√ write back all meta-information so that the disk persistently reflects all changes that were made to the file system (such as new files that are created, data that is written, ...). 
+    char bounce_buffer[BLOCK_SIZE];
+    for (uint32_t i = 0; i < lg->ext_cnt;)
+    {
+        struct LogExt * e = lg->ext + order[i];
+        direntry_t entry = root_dir + e->idx;
+        size_t base = e->off / BLOCK_SIZE * BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE, entry->file_sz - base);
+        if(file_read(entry, base, bounce_buffer, n) != (int)n){
+            free(order);
+            return -1;
+        }
+        for (; i < lg->ext_cnt; ++i)
+        {
+            e = lg->ext + order[i];
+            if(root_dir + e->idx != entry || e->off / BLOCK_SIZE * BLOCK_SIZE != base)
+                break;
+            memcpy(bounce_buffer + e->off - base, lg->data + e->data, e->len);
+        }
+        if(file_write(entry, base, bounce_buffer, n) != n){
+            free(order);
+            return -1;
+        }
+    }
+    free(order);
+    /* the blocks copied from shared ones must be known before the log goes */
+    if(write_meta() < 0 || (jr != NULL && journal_commit() < 0))
+        return -1;
 
-√ close the disk. The function returns 0 on success, and -1 when the disk disk_name could not be closed or when data could not be written to the disk (this should not happen).
+    struct JournalHdr hdr;
+    memset(&hdr, 0, BLOCK_SIZE);
+    memcpy(hdr.signature, LOG_NAME, 8);
+    hdr.seq = lg->gen + 1;
+    hdr.len = lg->len;
+    if(block_write(sp->data_blk + lg->blk[0], &hdr) < 0)
+        return -1;
+    ++lg->gen;
+    lg->seg = 0;
+    lg->fill = 0;
+    lg->dirty = 0;
+    lg->ext_cnt = 0;
+    memset(lg->file_cnt, 0, sizeof(lg->file_cnt));
+    return 0;
+}
+
+/* append a write of @count bytes of @buf at @offset of @entry */
+int log_append(direntry_t entry, size_t offset, const void * buf, size_t count){
+    if(lg->fill + LOG_REC_HDR + count > JOURNAL_DATA_SZ){
+        if(lg->seg + 1 == lg->len){ // full, no need to write the last segment
+            if(log_clean() < 0)
+                return -1;
+        }
+        else{
+            if(log_sync() < 0)
+                return -1;
+            ++lg->seg;
+            lg->fill = 0;
+        }
+    }
+    char * rec = lg->data + (size_t)lg->seg * JOURNAL_DATA_SZ + lg->fill;
+    uint32_t off = offset;
+    uint16_t len = count;
+    rec[0] = entry - root_dir;
+    memcpy(rec + 1, &off, sizeof(uint32_t));
+    memcpy(rec + 5, &len, sizeof(uint16_t));
+    memcpy(rec + LOG_REC_HDR, buf, count);
+    if(log_add_ext(rec) < 0)
+        return -1;
+    lg->fill += LOG_REC_HDR + count;
+    lg->dirty = 1;
+    return 0;
+}
+
+/* whether the block at @offset of @entry has data and no clone shares it,
+ * so that writing it never takes a free block
+*/
+bool blk_owned(direntry_t entry, size_t offset){
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, offset / BLOCK_SIZE);
+    return cursor_has_data(&cur) && cur.shared > cur.pos;
+}
+
+/* a write the log can take: small, inside one block the file already has
+ * and shares with no clone, so cleaning never needs a free block
+*/
+bool log_fits(direntry_t entry, size_t offset, size_t count){
+    if(lg == NULL || count == 0 || count > LOG_MAX_WRITE || offset + count > entry->file_sz \
+        || offset / BLOCK_SIZE != (offset + count - 1) / BLOCK_SIZE)
+        return false;
+    return blk_owned(entry, offset);
+}
+
+/* lay the logged bytes of @entry over the @count bytes read at @offset */
+void log_overlay(direntry_t entry, size_t offset, void * buf, size_t count){
+    int idx = entry - root_dir;
+    if(lg == NULL || lg->file_cnt[idx] == 0)
+        return;
+    for (uint32_t i = 0; i < lg->ext_cnt; ++i)
+    {
+        struct LogExt * e = lg->ext + i;
+        if(e->idx != idx || e->off >= offset + count || e->off + e->len <= offset)
+            continue;
+        size_t from = pickmax(e->off, offset);
+        size_t to = clamp(e->off + e->len, offset + count);
+        memcpy((char *)buf + from - offset, lg->data + e->data + from - e->off, to - from);
+    }
+}
+
+/* whether the log holds bytes of @entry between @offset and @offset + @count */
+bool log_overlaps(direntry_t entry, size_t offset, size_t count){
+    int idx = entry - root_dir;
+    if(lg == NULL || lg->file_cnt[idx] == 0)
+        return false;
+    for (uint32_t i = 0; i < lg->ext_cnt; ++i)
+    {
+        struct LogExt * e = lg->ext + i;
+        if(e->idx == idx && e->off < offset + count && e->off + e->len > offset)
+            return true;
+    }
+    return false;
+}
+
+/* read the write log of a mounted disk and apply it
+ * it stays loaded for fs_log_mount(), and for fs_readonly_mount() which reads
+ * over it instead; a snapshot leaves it alone
+*/
+int log_load(){
+    if(sp->log_blk == 0 || (read_only && !shared_ro))
+        return 0;
+
+    struct JournalHdr hdr;
+    uint32_t n = 0;
+    for (uint16_t blk = sp->log_blk; blk != FAT_EOC && blk != 0 && n <= sp->data_blk_count; blk = fat[blk])
+        ++n;
+    if(block_read(sp->data_blk + sp->log_blk, &hdr) < 0 || strncmp(hdr.signature, LOG_NAME, 8) != 0 \
+        || n < 2 || hdr.len != n - 1){
+        eprintf("log_load: bad write log\n");
+        return -1;
+    }
+
+    lg = calloc(1, sizeof(struct WriteLog));
+    if(lg == NULL)
+        return -1;
+    lg->blk = malloc(n * sizeof(uint16_t));
+    lg->data = malloc((size_t)hdr.len * JOURNAL_DATA_SZ);
+    if(lg->blk == NULL || lg->data == NULL){
+        log_free();
+        return -1;
+    }
+    uint16_t blk = sp->log_blk;
+    for (uint32_t i = 0; i < n; ++i, blk = fat[blk])
+        lg->blk[i] = blk;
+    lg->len = hdr.len;
+    lg->gen = hdr.seq;
+
+    struct JournalBlk b;
+    for (uint32_t i = 0; i < lg->len; ++i)
+    {
+        if(block_read(sp->data_blk + lg->blk[1 + i], &b) < 0)
+            return -1;
+        uint32_t sum = b.sum;
+        b.sum = 0;
+        if(b.magic != LOG_MAGIC || b.seq != lg->gen || b.len > JOURNAL_DATA_SZ \
+            || (log_sum(&b) != sum && journal_sum(&b) != sum)) // or a segment of an older log
+            break;
+        char * seg = lg->data + (size_t)i * JOURNAL_DATA_SZ;
+        memcpy(seg, b.data, b.len);
+        for (uint32_t k = 0; k + LOG_REC_HDR <= b.len;)
+        {
+            uint32_t off;
+            uint16_t len;
+            memcpy(&off, seg + k + 1, sizeof(uint32_t));
+            memcpy(&len, seg + k + 5, sizeof(uint16_t));
+            direntry_t entry = root_dir + (uint8_t)seg[k];
+            if((uint8_t)seg[k] >= FS_FILE_MAX_COUNT || k + LOG_REC_HDR + len > b.len)
+                break;
+            if(entry->filename[0] != 0 && (size_t)off + len <= entry->file_sz && log_add_ext(seg + k) < 0)
+                return -1;
+            k += LOG_REC_HDR + len;
+        }
+    }
+
+    if(shared_ro){ // what a crash left stays in the log
+        if(lg->ext_cnt == 0)
+            log_free();
+        return 0;
+    }
+    if(log_clean() < 0)
+        return -1;
+    if(!log_mode)
+        log_free();
+    return 0;
+}
+
+/* reserve the write log of a disk mounted by fs_log_mount(), a 16th of the
+ * disk within bounds: the more writes a cleaning takes in, the more of them
+ * land in the same blocks and merge
+*/
+int log_create(){
+    uint32_t len = clamp(pickmax(sp->data_blk_count / 16, LOG_MIN_BLKS), LOG_MAX_BLKS);
+    uint16_t head = zero_chain(1 + len);
+    if(head == FAT_EOC)
+        return -1;
+    struct JournalHdr hdr;
+    memset(&hdr, 0, BLOCK_SIZE);
+    memcpy(hdr.signature, LOG_NAME, 8);
+    hdr.seq = 1;
+    hdr.len = len;
+    sp->log_blk = head;
+    if(block_write(sp->data_blk + head, &hdr) < 0 || write_meta() < 0)
+        return -1;
+    return log_load();
+}
+
+/******************* Write Buffer *********************/
+/* Small writes through a file descriptor gather in its buffer as long as they
+ * stay in one block and next to each other, then reach the block with one
+ * file_write(): one read at most for many records instead of one each. The
+ * buffer goes out when the writes move to another block, at fs_lseek(),
+ * fs_fsync() and fs_close(), and before anything else looks at the file.
+ * The bytes in the blocks stay older than those in the write log, so the log
+ * goes first when it holds bytes of the same block.
+ * A buffer over a block the file does not own yet holds a free one for it (see
+ * Range Locks), so a write the disk has no room for fails at once, and the
+ * bytes of a buffer which could not go out stay in it for the next try.
+*/
+
+/* whether writing @count bytes at @offset of @entry only rewrites blocks the
+ * file owns alone: nothing to allocate, copy, or turn into a hole, so no
+ * metadata changes and meta_lock is not needed; the caller holds the file_lock
+ * no block can become shared meanwhile, only fs_clone() and snapshots do it
+*/
+bool write_in_place(direntry_t entry, size_t offset, size_t count){
+    if(lg != NULL || entry->hole_blk != 0 || count == 0 || offset + count > entry->file_sz)
+        return false;
+    uint32_t last = (offset + count - 1) / BLOCK_SIZE;
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, offset / BLOCK_SIZE);
+    while(cur.lblk < last && cur.blk != FAT_EOC)
+        cursor_next(&cur);
+    return cur.blk != FAT_EOC && cur.shared > cur.pos;
+}
+
+/* make sure the write log holds no bytes of @entry, before its blocks change */
+int log_flush_file(direntry_t entry){
+    if(lg == NULL || lg->file_cnt[entry - root_dir] == 0)
+        return 0;
+    HOLD_META();
+    return log_clean();
+}
+
+/* forget what the buffer of @fd holds, and the block held for it */
+void wbuf_drop(int fd){
+    struct FileDescriptor * f = get_fd(fd);
+    if(f->wbuf_lo == f->wbuf_hi)
+        return;
+    f->wbuf_lo = f->wbuf_hi = 0;
+    __atomic_sub_fetch(wbuf_cnt + (f->file_entry - root_dir), 1, __ATOMIC_SEQ_CST);
+    if(f->wbuf_held != 0){
+        range_unhold(&f->wbuf_held, 1);
+        f->wbuf_held = 0;
+    }
+}
+
+/* write what the buffer of @fd holds, the caller holds the file_lock
+ * the bytes stay in the buffer if they cannot go out
+*/
+int wbuf_flush(int fd){
+    struct FileDescriptor * f = get_fd(fd);
+    if(f->wbuf_lo == f->wbuf_hi)
+        return 0;
+    direntry_t entry = f->file_entry;
+    size_t off = f->wbuf_blk + f->wbuf_lo, n = f->wbuf_hi - f->wbuf_lo, done = 0;
+
+    if(write_in_place(entry, off, n))
+        done = file_write(entry, off, f->wbuf + off - f->wbuf_blk, n);
+    else{
+        HOLD_META();
+        if(!log_overlaps(entry, f->wbuf_blk, BLOCK_SIZE) || log_clean() == 0){
+            if(f->wbuf_held != 0) // file_write() takes it, or another one
+                range_unhold(&f->wbuf_held, 1);
+            done = file_write(entry, off, f->wbuf + off - f->wbuf_blk, n);
+            meta_update();
+            if(f->wbuf_held != 0 && done != n && range_hold(&f->wbuf_held, 1) < 0)
+                f->wbuf_held = 0;
+        }
+    }
+    if(done != n)
+        return -1; // the bytes wait in the buffer
+    wbuf_drop(fd);
+    return 0;
+}
+
+/* flush the buffers of every descriptor of @entry but @except */
+int flush_file(direntry_t entry, int except){
+    if(__atomic_load_n(wbuf_cnt + (entry - root_dir), __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    HOLD_DIR(); // descriptors only leave the list under it, fs_open() adds some meanwhile
+    for (int i = __atomic_load_n(fd_first + (entry - root_dir), __ATOMIC_ACQUIRE); i >= 0; i = get_fd(i)->next)
+    {
+        if(i != except && wbuf_flush(i) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* the write log, then every buffer, before an operation which may move blocks around
+ * the caller holds lock_all()
+*/
+int flush_pending(){
+    if(log_clean() < 0)
+        return -1;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        for (int fd = __atomic_load_n(fd_first + i, __ATOMIC_ACQUIRE); fd >= 0; fd = get_fd(fd)->next)
+            if(wbuf_flush(fd) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+/* buffer @count bytes, less than a block, at @start in the file of @fd
+ * return how many are buffered, fewer if the disk has no block for them, -1 on error
+*/
+int wbuf_write(int fd, size_t start, const void * buf, size_t count){
+    struct FileDescriptor * f = get_fd(fd);
+    if(f->wbuf == NULL && (f->wbuf = malloc(BLOCK_SIZE)) == NULL)
+        return -1;
+
+    size_t done = 0;
+    while(done < count){
+        size_t offset = start + done;
+        size_t blk = offset / BLOCK_SIZE * BLOCK_SIZE;
+        size_t lo = offset - blk;
+        size_t n = clamp(BLOCK_SIZE - lo, count - done);
+        if(f->wbuf_lo != f->wbuf_hi && (f->wbuf_blk != blk || lo > f->wbuf_hi || lo + n < f->wbuf_lo)){
+            if(wbuf_flush(fd) < 0) // not next to what it holds
+                return -1;
+        }
+        if(f->wbuf_lo == f->wbuf_hi){
+            if(!blk_owned(f->file_entry, blk) && range_hold(&f->wbuf_held, 1) < 0)
+                return done; // full, as file_write() would be
+            f->wbuf_blk = blk;
+            f->wbuf_lo = f->wbuf_hi = lo;
+            __atomic_add_fetch(wbuf_cnt + (f->file_entry - root_dir), 1, __ATOMIC_SEQ_CST);
+        }
+        memcpy(f->wbuf + lo, (const char *)buf + done, n);
+        f->wbuf_lo = clamp(f->wbuf_lo, lo);
+        f->wbuf_hi = pickmax(f->wbuf_hi, lo + n);
+        done += n;
+    }
+    return done;
+}
+
+/* write the buffers of @iov into the file of @fd at @offset, through the
+ * write log or the write buffer when they are small
+ * the core of fs_write(), fs_pwrite() and fs_writev(), the offset of @fd stays
+ * the caller holds the file_lock
+ * return the number of bytes written, -1 on error
+*/
+int fd_writev(int fd, size_t offset, const struct iovec *iov, int iovcnt){
+    direntry_t w_dir_entry = get_fd(fd)->file_entry;
+    size_t count = iov_total(iov, iovcnt);
+    if(count == 0) return 0;
+
+    if(flush_file(w_dir_entry, fd) < 0) // the other descriptors wrote before
+        return -1;
+    if(w_dir_entry->zip){ // whole chunks, neither logged nor buffered
+        HOLD_META();
+        int real_count = zip_writev(w_dir_entry, offset, iov, iovcnt);
+        meta_update();
+        return real_count;
+    }
+    struct FileDescriptor * f = get_fd(fd);
+    size_t done = 0;
+    if(log_fits(w_dir_entry, offset, count)){ // no metadata changes
+        if(f->wbuf_lo != f->wbuf_hi && f->wbuf_blk == offset / BLOCK_SIZE * BLOCK_SIZE && wbuf_flush(fd) < 0)
+            return -1;
+        HOLD_META();
+        for (int i = 0; i < iovcnt; done += iov[i++].iov_len)
+        {
+            if(iov[i].iov_len > 0 && log_append(w_dir_entry, offset + done, iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+        }
+        return done;
+    }
+    if(count < BLOCK_SIZE && offset + count <= FILE_SZ_MAX){ // gathered with the next ones
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            int n = wbuf_write(fd, offset + done, iov[i].iov_base, iov[i].iov_len);
+            if(n < 0)
+                return -1;
+            done += n;
+            if(n < (int)iov[i].iov_len)
+                break;
+        }
+        return done;
+    }
+    if(wbuf_flush(fd) < 0)
+        return -1;
+    if(write_in_place(w_dir_entry, offset, count))
+        return file_writev(w_dir_entry, offset, iov, iovcnt);
+
+    HOLD_META();
+    if(log_flush_file(w_dir_entry) < 0) // older bytes must not land over these
+        return -1;
+
+    size_t real_count = file_writev(w_dir_entry, offset, iov, iovcnt);
+
+    meta_update();
+
+    return real_count;
+}
+
+/* give back the held data blocks @blk[0..@n) */
+void range_unhold(const uint16_t * blk, uint32_t n){
+    HOLD_META();
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        fat_held[blk[i]] = 0;
+        --held_cnt;
+        if(blk[i] < fat_hint)
+            fat_hint = blk[i];
+    }
+}
+
+/* hold @n free data blocks into @blk for a write in progress, see Range Locks
+ * return -1 if the disk does not have them, none is held then
+*/
+int range_hold(uint16_t * blk, uint32_t n){
+    if(n == 0)
+        return 0;
+    HOLD_META();
+    if(fat_held == NULL && (fat_held = calloc(sp->data_blk_count, 1)) == NULL)
+        return -1;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0){
+            range_unhold(blk, i);
+            return -1;
+        }
+        fat_held[temp] = 1;
+        ++held_cnt;
+        blk[i] = temp;
+    }
+    return 0;
+}
+
+/* find the data blocks a write of @count bytes at @offset goes to into @blk:
+ * the ones of the chain of @entry, then held free ones past its end
+ * @grow is set if the write makes the file bigger
+ * return how many are in the chain, -1 if the write has to take the file_lock:
+ * buffered bytes, a hole or a shared block in the way, a gap after a partial last block,
+ * or a compressed file
+*/
+int range_prepare(direntry_t entry, size_t offset, size_t count, uint16_t * blk, bool * grow){
+    int idx = entry - root_dir;
+    uint32_t first = offset / BLOCK_SIZE, nblk = (offset + count - 1) / BLOCK_SIZE + 1 - first;
+    int kept = -1;
+
+    pthread_rwlock_rdlock(file_lock + idx);
+    uint32_t end = size_to_blk(entry->file_sz);
+    if(__atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) == 0 && !entry->zip && holes_ready(entry) \
+        && (offset <= entry->file_sz || entry->file_sz % BLOCK_SIZE == 0)){ // make_gap() has nothing to zero
+        struct BlkCursor cur;
+        cursor_seek(&cur, entry, first);
+        uint32_t i = 0;
+        for (; i < nblk && first + i < end && cursor_has_data(&cur); ++i, cursor_next(&cur))
+            blk[i] = cur.blk;
+        if(cur.shared == UINT32_MAX && (i == nblk || first + i >= end))
+            kept = i;
+    }
+    *grow = offset + count > entry->file_sz;
+    if(kept >= 0 && range_hold(blk + kept, nblk - kept) < 0)
+        kept = -1; // the file_lock path writes what fits
+    pthread_rwlock_unlock(file_lock + idx);
+    return kept;
+}
+
+/* write @count bytes of @iov at @offset into the blocks @blk of range_prepare(),
+ * the first @kept of which are in the chain, with no file_lock held
+ * return the number of bytes written
+*/
+size_t range_data(int idx, size_t offset, const struct iovec *iov, int iovcnt, size_t count, const uint16_t * blk, int kept){
+    __atomic_add_fetch(file_wr + idx, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(file_seq + idx, 2, __ATOMIC_SEQ_CST); // lock-free reads around it start over
+
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+    char bounce_buffer[BLOCK_SIZE];
+    size_t done = 0;
+    for (int i = 0; done < count; ++i)
+    {
+        size_t blk_off = (offset + done) % BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE - blk_off, count - done);
+        const void * content = (n == BLOCK_SIZE) ? io_take(&ic, n) : NULL;
+
+        if(content == NULL){
+            if(n < BLOCK_SIZE){ // a block of the chain keeps the rest, a new one is zeros
+                if(i >= kept)
+                    memset(bounce_buffer, 0, BLOCK_SIZE);
+                else if(block_read(sp->data_blk + blk[i], bounce_buffer) < 0)
+                    break;
+            }
+            io_copy(&ic, bounce_buffer + blk_off, n, false);
+            content = bounce_buffer;
+        }
+        if(block_write(sp->data_blk + blk[i], content) < 0)
+            break;
+        fp_note(idx, blk[i], content);
+        done += n;
+    }
+
+    __atomic_add_fetch(file_seq + idx, 2, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(file_wr + idx, 1, __ATOMIC_SEQ_CST);
+    return done;
+}
+
+/* link the held blocks @blk[@kept..@nblk) into @entry once range_data() wrote @done
+ * bytes at @offset, and grow the file; what was not written is given back
+ * the caller holds the file_lock and meta_lock
+ * return the number of bytes written, -2 if @entry ended on a partial block
+ * before @offset meanwhile, nothing is linked then
+*/
+int range_link(direntry_t entry, size_t offset, size_t done, const uint16_t * blk, uint32_t kept, uint32_t nblk){
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t written = done ? (offset + done - 1) / BLOCK_SIZE + 1 - first : 0;
+    uint32_t old_sz = entry->file_sz;
+    if(offset > old_sz && old_sz % BLOCK_SIZE != 0){ // make_gap() would zero the block of another writer
+        range_unhold(blk + kept, nblk - kept);
+        return -2;
+    }
+
+    uint32_t linked = kept, given = kept; // blocks in the file, held blocks dealt with
+    if(written > kept && (offset <= old_sz || make_gap(entry, offset) == 0)){
+        struct BlkCursor cur;
+        cursor_seek(&cur, entry, first + kept);
+        for (; linked < written; ++linked, cursor_next(&cur))
+        {
+            range_unhold(blk + linked, 1); // taken by cursor_link(), free again if it fails
+            if(cursor_link(&cur, blk[linked]) < 0)
+                break;
+        }
+        given = (linked < written) ? linked + 1 : linked;
+    }
+    range_unhold(blk + given, nblk - given);
+
+    size_t real_count = done;
+    if(linked < written) // the bytes up to the first block left out
+        real_count = linked ? clamp(done, (size_t)(first + linked) * BLOCK_SIZE - offset) : 0;
+    if(real_count == 0 && offset > old_sz) // nothing written, forget the new hole
+        hole_trim(entry, size_to_blk(old_sz));
+    else if(offset + real_count > entry->file_sz)
+        entry->file_sz = offset + real_count;
+    return real_count;
+}
+
+/* fd_writev() of one block or more under a range lock of the blocks it writes,
+ * without the file_lock while the data goes to disk, see Range Locks
+ * return the number of bytes written, -2 if it has to go through fd_writev()
+ * under the file_lock: the write log, buffered bytes, holes or shared blocks
+*/
+int range_writev(int fd, size_t offset, const struct iovec *iov, int iovcnt){
+    direntry_t entry = get_fd(fd)->file_entry;
+    int idx = entry - root_dir;
+    size_t count = iov_total(iov, iovcnt);
+    if(lg != NULL || count < BLOCK_SIZE || count > INT_MAX || offset + count > FILE_SZ_MAX)
+        return -2;
+    uint32_t first = offset / BLOCK_SIZE, nblk = (offset + count - 1) / BLOCK_SIZE + 1 - first;
+    uint16_t * blk = malloc(nblk * sizeof(uint16_t));
+    if(blk == NULL)
+        return -2;
+
+    struct Range r;
+    range_lock(io_range + idx, &r, first, first + nblk, -1, true);
+    bool grow;
+    int real_count = -2;
+    int kept = range_prepare(entry, offset, count, blk, &grow);
+    if(kept >= 0){
+        size_t done = range_data(idx, offset, iov, iovcnt, count, blk, kept);
+        if((uint32_t)kept == nblk && !grow) // blocks and size stay, like write_in_place()
+            real_count = done;
+        else{
+            file_wrlock(idx);
+            {
+                HOLD_META();
+                real_count = range_link(entry, offset, done, blk, kept, nblk);
+                if(real_count >= 0)
+                    meta_update();
+            }
+            file_wrunlock(idx);
+        }
+    }
+    range_unlock(io_range + idx, &r);
+    free(blk);
+    return real_count;
+}
+
+/* file_readv() with the bytes of the write log over those of the blocks, the
+ * log stays as it is meanwhile
+*/
+int log_readv(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt){
+    int real_count = file_readv(entry, offset, iov, iovcnt);
+    size_t done = 0;
+    for (int i = 0; i < iovcnt && done < (size_t)pickmax(real_count, 0); ++i)
+    {
+        size_t n = clamp(iov[i].iov_len, real_count - done);
+        log_overlay(entry, offset + done, iov[i].iov_base, n);
+        done += n;
+    }
+    return real_count;
+}
+
+/* read the file of @entry at @offset into the buffers of @iov, with the newer
+ * bytes of the write log laid over the blocks
+ * the core of fs_read(), fs_pread() and fs_readv()
+ * the caller holds the file_lock, with the buffers flushed
+ * return the number of bytes read, -1 on error
+*/
+int entry_readv(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt){
+    if(entry->zip) // never in the log
+        return zip_readv(entry, offset, iov, iovcnt);
+    if(lg == NULL) // the blocks are all there is
+        return file_readv(entry, offset, iov, iovcnt);
+    if(shared_ro) // nothing cleans the log, see Read-only Mounts
+        return log_readv(entry, offset, iov, iovcnt);
+
+    HOLD_META(); // no cleaning between the blocks and the log
+    return log_readv(entry, offset, iov, iovcnt);
+}
+
+/* entry_readv() of the file of @fd, its offset stays */
+int fd_readv(int fd, size_t offset, const struct iovec *iov, int iovcnt){
+    return entry_readv(get_fd(fd)->file_entry, offset, iov, iovcnt);
+}
+
+struct ReadHold {
+    pthread_rwlock_t *  l;     // NULL if nothing is held
+    struct Range        r;
+};
+
+/* lock the blocks of root_dir[@entry] under @count bytes at @offset, none for 0,
+ * and the file, to read them shared, once the buffers of its descriptors are
+ * flushed under the exclusive lock
+ * @h->l is NULL if they cannot be written, no lock is held then
+*/
+void lock_file_read(struct ReadHold * h, direntry_t entry, size_t offset, size_t count){
+    int idx = entry - root_dir;
+    uint64_t lo = offset / BLOCK_SIZE, hi = count ? ((uint64_t)offset + count - 1) / BLOCK_SIZE + 1 : lo;
+    h->l = NULL;
+    for (;;)
+    {
+        range_lock(io_range + idx, &h->r, lo, hi, -1, false);
+        pthread_rwlock_rdlock(file_lock + idx);
+        if(__atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) == 0)
+            break;
+        pthread_rwlock_unlock(file_lock + idx);
+        range_unlock(io_range + idx, &h->r);
+        HOLD_FILE(entry);
+        if(flush_file(entry, -1) < 0)
+            return;
+    }
+    h->l = file_lock + idx;
+}
+
+void unlock_file_read(struct ReadHold * h){
+    if(h->l == NULL)
+        return;
+    pthread_rwlock_unlock(h->l);
+    range_unlock(io_range + (h->l - file_lock), &h->r);
+}
+#define HOLD_FILE_READ(h, entry, offset, count) struct ReadHold h __attribute__((cleanup(unlock_file_read))); lock_file_read(&h, entry, offset, count)
+
+/* publish the view of @entry for lock-free reads, the caller holds its file_lock
+ * with the buffers flushed; nothing to do in log mode, the log overlays the blocks,
+ * nor for a compressed file, its blocks are not its bytes
+*/
+void view_build(direntry_t entry){
+    int idx = entry - root_dir;
+    if(lg != NULL || entry->zip || __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE) != NULL || !holes_ready(entry))
+        return;
+    uint32_t nblk = size_to_blk(entry->file_sz);
+    struct FileView * v = malloc(sizeof(struct FileView) + nblk * sizeof(uint16_t));
+    if(v == NULL)
+        return;
+    v->size = entry->file_sz;
+    v->nblk = nblk;
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, 0);
+    for (uint32_t i = 0; i < nblk; ++i, cursor_next(&cur))
+        v->blk[i] = cursor_has_data(&cur) ? cur.blk : FAT_EOC;
+
+    struct FileView * none = NULL; // other readers may build it as well
+    if(!__atomic_compare_exchange_n(file_view + idx, &none, v, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        free(v);
+}
+
+/* read root_dir[@idx] at @offset into the buffers of @iov through its view, without lock
+ * return the number of bytes read, -1 on disk error, -2 if it has to be read
+ * under the file_lock: no view, a writer, or bytes in the write buffers
+*/
+int view_readv(int idx, size_t offset, const struct iovec *iov, int iovcnt){
+    uint32_t seq = __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST);
+    if(seq % 2 == 1 || __atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) != 0 \
+        || __atomic_load_n(file_wr + idx, __ATOMIC_SEQ_CST) != 0 || !rcu_enter())
+        return -2;
+    struct FileView * v = __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE);
+    if(v == NULL){
+        rcu_exit();
+        return -2;
+    }
+
+    size_t real_count = offset >= v->size ? 0 : clamp(v->size - offset, iov_total(iov, iovcnt));
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+    char bounce_buffer[BLOCK_SIZE];
+    size_t buf_idx = 0;
+    while(buf_idx < real_count){
+        size_t blk_off = offset % BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE - blk_off, real_count - buf_idx);
+        uint16_t blk = v->blk[offset / BLOCK_SIZE];
+        void * direct = (n == BLOCK_SIZE) ? io_take(&ic, n) : NULL;
+        char * dst = direct ? direct : bounce_buffer;
+
+        if(blk == FAT_EOC) // a hole reads back as zeros
+            memset(dst + (direct ? 0 : blk_off), 0, n);
+        else if(block_read(blk + sp->data_blk, dst) < 0)
+            break;
+        if(direct == NULL)
+            io_copy(&ic, bounce_buffer + blk_off, n, true);
+        buf_idx += n;
+        offset += n;
+    }
+    rcu_exit();
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST) != seq) // the blocks may have changed hands
+        return -2;
+    return buf_idx < real_count ? -1 : (int)buf_idx;
+}
+
+/* size of root_dir[@idx] from its view, without lock, -1 if it has to be locked */
+int view_stat(int idx){
+    uint32_t seq = __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST);
+    if(seq % 2 == 1 || __atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) != 0 || !rcu_enter())
+        return -1;
+    struct FileView * v = __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE);
+    int64_t size = v ? (int64_t)v->size : -1;
+    rcu_exit();
+    return size > INT_MAX || __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST) != seq ? -1 : size;
+}
+
+/* fd_readv() through the view of the file, or under its file_lock shared,
+ * publishing the view for the next reads
+*/
+int fd_readv_rcu(int fd, size_t offset, const struct iovec *iov, int iovcnt){
+    if(shared_ro) // nothing moves, see Read-only Mounts
+        return fd_readv(fd, offset, iov, iovcnt);
+    direntry_t entry = get_fd(fd)->file_entry;
+    int real_count = view_readv(entry - root_dir, offset, iov, iovcnt);
+    if(real_count != -2)
+        return real_count;
+
+    HOLD_FILE_READ(h, entry, offset, iov_total(iov, iovcnt));
+    if(h.l == NULL) return -1;
+    view_build(entry);
+    return fd_readv(fd, offset, iov, iovcnt);
+}
+
+/******************* Read-only Mounts *********************/
+/* fs_readonly_mount() never writes the image, so any number of processes may
+ * mount it at once. The FAT and the root directory, which follow the
+ * superblock on the disk, are not read into memory of our own: they are mapped
+ * from the image, the pages of the page cache shared by every process which
+ * mounts it. Nothing changes them once mounted, so reads take no lock: they go
+ * straight to the blocks, without the views, the hole lists being loaded by
+ * the mount. Only a journal to replay makes the mapping private, each page it
+ * changes becoming a copy of this process; what a crash left in the write log
+ * is read over the blocks, and stays there.
+*/
+char * meta_map = NULL;             // blocks 1 to sp->rdir_blk of the image, NULL if they were read
+size_t meta_map_len = 0;
+
+/* map the FAT and the root directory in place of the copies of init_alloc() */
+int map_meta(){
+    int img = image_fd();
+    if(img < 0 || sp->rdir_blk != sp->fat_blk_count + 1)
+        return -1;
+    size_t len = (size_t)sp->rdir_blk * BLOCK_SIZE;
+    bool replay = sp->journal_blk != 0;
+    char * base = mmap(NULL, len, PROT_READ | (replay ? PROT_WRITE : 0), replay ? MAP_PRIVATE : MAP_SHARED, img, BLOCK_SIZE);
+    if(base == MAP_FAILED)
+        return -1;
+    free(fat);
+    free(root_dir);
+    fat = (uint16_t *)base;
+    root_dir = (direntry_t)(base + (size_t)sp->fat_blk_count * BLOCK_SIZE);
+    meta_map = base;
+    meta_map_len = len;
+    return 0;
+}
+
+void unmap_meta(){
+    if(meta_map == NULL)
+        return;
+    munmap(meta_map, meta_map_len);
+    meta_map = NULL;
+    fat = NULL;
+    root_dir = NULL;
+}
+
+/*
+ * free space to sp, root_dir, and fat; set to zero for all of them
+ * fail return -1; succeed return 0;
+ * from TA: Part of this task should probably include closing the virtual disk
+*/
+void clear(){
+    batch_depth = 0;
+    unmap_meta();
+    if(sp) {
+        free(sp);
+        sp = NULL;
+    }
+    if(root_dir){
+        free(root_dir);
+        root_dir = NULL;
+    }
+    if(fat)
+    {
+        free(fat);
+        fat = NULL;
+    }
+    if(fat_dirty)
+    {
+        free(fat_dirty);
+        fat_dirty = NULL;
+    }
+    fat_hint = 1;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+        drop_holes(i);
+    if(ref)
+    {
+        free(ref);
+        ref = NULL;
+    }
+    ref_total = 0;
+    ref_dirty = 0;
+    fp_free();
+    journal_free();
+    log_free();
+    memset(wbuf_cnt, 0, sizeof(wbuf_cnt));
+    free(fat_held);
+    fat_held = NULL;
+    held_cnt = 0;
+    memset(file_open, 0, sizeof(file_open));
+    rcu_free();
+    image_close();
+    log_mode = false;
+    read_only = false;
+    shared_ro = false;
+
+    if(disk) free(disk);
+    disk = NULL;
+    // dir_entry = NULL;
+    // fat16 = NULL;
+    fd_cnt = 0;
+
+    for (int i = 0; i < fd_top; ++i)
+    {
+        if(get_fd(i)->file_entry != NULL) // should n't happen actually
+        {
+            free(get_fd(i)->wbuf); // the disk is gone, nothing can be flushed
+            eprintf("alert file descriptor %d is not clear, force to be closed\n",i);
+        }
+    }
+    for (int i = 0; i * FD_SLAB < fd_top; ++i)
+    {
+        free(fd_slab[i]);
+        fd_slab[i] = NULL;
+    }
+    fd_top = 0;
+    fd_free = -1;
+    memset(fd_first, -1, sizeof(fd_first));
+
+}
+
+
+/*
+ * alloc space to sp, root_dir, and fat; set to zero for all of them
+ * initialize fd_cnt
+ * initialize sp_setup()
+ * fail return -1; succeed return 0;
+ * unused for the first time
+*/
+int init_alloc(){
+
+    sp = calloc(BLOCK_SIZE, 1);
+    root_dir = calloc(BLOCK_SIZE, 1);
+    if(sp == NULL || root_dir == NULL){
+        clear();
+        return -1;
+    }
+
+    if(block_read(0, (void *)sp) < 0) { clear(); return -1; }
+    fat = calloc(BLOCK_SIZE, sp->fat_blk_count); // need reading sp block!!!
+    fat_dirty = calloc(sp->fat_blk_count, 1);
+    if(fat == NULL || fat_dirty == NULL){
+        clear();
+        return -1;
+    }
+
+    fd_cnt = 0;
+
+    return 0;   
+}
+
+/** version 1. 0
+ * fs_mount - Mount a file system
+ * @diskname: Name of the virtual disk file
+ *
+ * Open the virtual disk file @diskname and mount the file system that it
+ * contains. A file system needs to be mounted before files can be read from it
+ * with fs_read() or written to it with fs_write().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+
+ */
+int fs_mount(const char *diskname)
+{
+    if ((shared_ro ? block_disk_open_ro(diskname) : block_disk_open(diskname)) != 0) return -1;
+    disk = malloc(strlen(diskname) + 1);
+    strcpy(disk, diskname);
+
+    if(init_alloc() < 0) return -1; // fail why
+
+    /* super block read */
+    // sp = malloc(BLOCK_SIZE); 
+    // if(sp == NULL) { clear(); return -1; }
+
+    // memset(sp, 0, BLOCK_SIZE); // from TA: memset is redundant since you're overwriting the whole block anyway.
+    // if(block_read(0, (void *)sp) < 0) { clear(); return -1; } // put into init_alloc
+    /*
+    if(strncmp(sp->signature, FS_NAME, 8) != 0){
+        clear();
+        eprintf("fs_mount: non ECS150FS file system\n");
+        return -1;
+    }
+    if(block_disk_count() != sp->total_blk_count)
+    {
+        clear();
+        eprintf("fs_mount: incorrect block size in metadata\n");
+        return -1;
+    }
+    if(sp->data_blk_count > (sp->fat_blk_count * BLOCK_SIZE / 2))
+    {
+        clear();
+        eprintf("fs_mount: fat size and block size dismatch\n");
+        return -1;
+    }
+    */
+    if(strncmp(sp->signature, FS_NAME, 8) != 0 \
+        || block_disk_count() != sp->total_blk_count \
+        || sp->data_blk_count > (sp->fat_blk_count * BLOCK_SIZE / 2) ){
+        clear();
+        eprintf("fs_mount: fail\n");
+        return -1;
+    }
+
+    /* root_dir read; fat block read */
+    // root_dir = malloc(BLOCK_SIZE);
+    // if(root_dir == NULL) { clear(); return -1; }
+    // memset(root_dir, 0, BLOCK_SIZE);
+    if(shared_ro){
+        if(map_meta() < 0){
+            eprintf("fs_mount: map metadata error\n");
+            clear();
+            return -1;
+        }
+    }
+    else if(block_read(sp->rdir_blk, root_dir) < 0){
+        eprintf("fs_mount: read root dir error\n");
+        clear(); 
+        return -1; 
+    }
+
+    // dir_entry = get_dir(0);
+    // dir_entry = (struct RootDirEntry *)root_dir;
+    
+
+    // fat = malloc(BLOCK_SIZE * sp->fat_blk_count);
+    // if(fat == NULL) { clear(); return -1; }
+    // memset(fat, 0, BLOCK_SIZE * sp->fat_blk_count);
+    for (int i = 0; i < sp->fat_blk_count && !shared_ro; ++i)
+    {
+        if(block_read(i+1, fat + FAT_PER_BLK * i) < 0){
+            eprintf("fs_mount: read %d th(from 0) fat block error\n", i);
+            clear();
+            return -1;
+        }
+    }
+    // fat16 = get_fat(0);
+    // fat16 = (uint16_t *)fat;
+    if(journal_load() < 0){ // before anything reads metadata from data blocks
+        eprintf("fs_mount: replay journal error\n");
+        clear();
+        return -1;
+    }
+    if(load_refs() < 0){
+        eprintf("fs_mount: read reference count table error\n");
+        clear();
+        return -1;
+    }
+    if(load_fps() < 0){
+        eprintf("fs_mount: read fingerprint table error\n");
+        clear();
+        return -1;
+    }
+
+
+    sp_setup(); // for fat_used and rdir_used
+    write_meta(); // for data used
+    if(log_load() < 0){ // a crash may have left writes in the log
+        eprintf("fs_mount: apply write log error\n");
+        clear();
+        return -1;
+    }
+
+    return 0;
+}
+/**/
+
+/* version 2.0 fail , it fails at info 
+int fs_mount(const char *diskname)
+{
+    if (block_disk_open(diskname) != 0) return -1;
+    
+    // if(init_alloc() < 0) return -1; // allocate error
+    if(init_alloc() < 0) {
+        eprintf("alloc error\n");
+        return -1;
+    }
+
+    if(block_read(0, (void *)sp) < 0) {
+        clear();
+        eprintf("fs_mount read superblock error\n");
+        return -1;
+    }
+    if(strncmp(sp->signature, FS_NAME, 8) != 0){
+        clear();
+        eprintf("fs_mount non ECS150FS file system\n");
+        return -1;
+    }
+    sp_setup();
+
+    if(block_read(sp->rdir_blk, root_dir) < 0){
+        eprintf("fs_mount read root dir error\n");
+        clear();
+        return -1;
+    }
+    // dir_entry = (struct RootDirEntry *)root_dir;
+    dir_entry = get_dir(0); // not necessary
+
+    for (int i = 0; i < sp->fat_blk_count; ++i)
+    {
+        if(block_read(i+1, fat + BLOCK_SIZE * i) < 0){
+            eprintf("fs_mount read %d th(from 1) fat block error\n", i);
+            clear();
+            return -1;
+        }
+    }
+    fat16 = get_fat(0);
+
+    return 0;
+}
+*/
+
+
+
+ 
+
+
+/**
+ * fs_umount - Unmount file system
+ *
+ * Unmount the currently mounted file system and close the underlying virtual
+ * disk file.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the virtual disk
+ * cannot be closed, or if there are still open file descriptors. 0 otherwise.
+
+√ write back all meta-information so that the disk persistently reflects all changes that were made to the file system (such as new files that are created, data that is written, ...). 
+
+√ close the disk. The function returns 0 on success, and -1 when the disk disk_name could not be closed or when data could not be written to the disk (this should not happen).
+
+√ provide persistent storage. -- write_meta
+This means that whenever umount_fs is called, all meta-information and file data (that you could temporarily have only in memory; depending on your implementation) must be written out to disk.
+*/
+int fs_umount(void)
+{
+    /* TODO: Phase 1 */
+    /* write back: super block, fat, dir*/
+    if(sp == NULL)
+        return -1;  // no underlying virtual disk was opened
+
+    async_stop(); // the asynchronous calls in flight finish first
+    par_stop();
+    HOLD_ALL();
+    if(flush_pending() < 0 || write_meta() < 0 ) return -1; 
+    // if(block_write(0, (void *)sp) < 0)
+    // {
+    //     eprintf("fs_umount write back sp error\n");
+    //     return -1; 
+    // }
+    // if(block_write(sp->rdir_blk, root_dir) < 0)// write back
+    // {
+    //     eprintf("fs_umount write back dir error\n");
+    //     return -1; 
+    // }
+    // for (int i = 0; i < sp->fat_blk_count; ++i)
+    // {
+    //     if(block_write(1 + i, fat + BLOCK_SIZE * i) < 0)// write back
+    //     {
+    //         eprintf("fs_umount write back dir error\n");
+    //         return -1; 
+    //     }
+    // }
+
+    if(__atomic_load_n(&fd_cnt, __ATOMIC_SEQ_CST) > 0){
+        eprintf("there are files open, unable to umount\n");
+        return -1;
+    }
+    if(jr != NULL && !read_only && (journal_commit() < 0 || journal_checkpoint() < 0))
+        return -1;
+    // for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
+    // {
+    //     if(filedes[i] != NULL){
+    //         free(filedes[i]);
+    //         filedes[i] = NULL; 
+    //     }
+            
+    // }
+
+
+    if(block_disk_close() < 0) { //cannot be closed
+        eprintf("fs_umount error\n");
+        return -1; 
+    }
+
+    clear();
+    return 0;
+}
+
+
+/**
+ * fs_info - Display information about file system
+ *
+ * Display some information about the currently mounted file system.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+int fs_info(void)
+{
+    if(sp == NULL || disk == NULL) {
+        eprintf("fs_info: no underlying virtual disk was mounted sucessfully\n");
+        return -1;
+    }
+    HOLD_DIR();
+    HOLD_META();
+    printf("FS Info:\n");
+    // eprintf("signature=%s\n",sp->signature); // non-terminator
+    // eprintf("%.*s\n", 8, sp->signature); // works
+
+    printf("total_blk_count=%d\n",sp->total_blk_count);
+    printf("fat_blk_count=%d\n",sp->fat_blk_count);
+    printf("rdir_blk=%d\n",sp->rdir_blk);
+    printf("data_blk=%d\n",sp->data_blk);
+    printf("data_blk_count=%d\n",sp->data_blk_count);
+
+    printf("fat_free_ratio=%d/%d\n", (sp->data_blk_count - sp->fat_used), sp->data_blk_count);
+    printf("rdir_free_ratio=%d/%d\n", (FS_FILE_MAX_COUNT - sp->rdir_used),FS_FILE_MAX_COUNT);
+
+    uint16_t * fat16 = fat;
+    for (int i = 0; i < sp->data_blk_count; ++i, ++fat16)
+        oprintf("fat[%d]:%d\n", i, *fat16);
+
+    if(db)
+        print_data();
+
+    /* my info for debug
+    eprintf("unused[0]=%d\n", (uint8_t)(sp->unused)[0]); // unused[0]=0
+
+    if(dir_entry->filename == NULL)
+        eprintf("root_dir[0].filename == NULL!!!\n");
+    else eprintf("root_dir[0].filename != NULL...\n");
+    eprintf("root_dir[0].filename[0]=%d\n", (int)(dir_entry->filename[0])); // root_dir[0].filename=(null)
+
+    memset(dir_entry, 0, sizeof(dir_entry->filename));
+    eprintf("after memeset(0), root_dir[0].filename=%s\n", dir_entry->filename); // root_dir[0].filename=(null)
+    eprintf("fat[0]=%d\n", *fat16); // fat[0]=65535
+    */
+    return 0;
+}
+
+/* take a free entry of the root directory for an empty file named @filename
+ * the caller holds dir_lock and meta_lock, and publishes the directory
+ * return NULL if the name is taken or the directory is full
+*/
+direntry_t new_entry(const char * filename){
+    direntry_t dir_entry = NULL;
+    if(get_valid_directory_entry(filename, (void *)&dir_entry) < 0)
+        return NULL; // no valid dir entry
+    strcpy(dir_entry->filename, filename);
+    dir_entry->file_sz = 0;
+    dir_entry->open = 0;
+    dir_entry->first_data_blk = FAT_EOC; 
+    dir_entry->last_data_blk = FAT_EOC; // from TA: This variable should not be used in a way where you assume it will be ready for you, since you are expected to be able to read files created by fs_ref. You don't actually recalculate these values when mounting the filesystem, so it feels like your logic will probably be assuming their presence always.
+    dir_entry->hole_blk = 0;
+    dir_entry->zip = 0;
+    dir_entry->zip_sz = 0;
+
+    sp->rdir_used += 1; // how to deal with @setup_sp
+    return dir_entry;
+}
+
+/**
+ * fs_create - Create a new file
+ * @filename: File name
+ *
+ * Create a new and empty file named @filename in the root directory of the
+ * mounted file system. String @filename must be NULL-terminated and its total
+ * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
+ * character).
+ *
+ * Return: -1 if @filename is invalid, if a file named @filename already exists,
+ * or if string @filename is too long, or if the root directory already contains
+ * %FS_FILE_MAX_COUNT files. 0 otherwise.
+
+
+ This function creates a new file with name in the root directory of your file system. The file is initially empty. The maximum length for a file name is 15 characters. Also, there can be at most 64 files in the directory. Upon successful completion, a value of 0 is returned. fs_create returns -1 on failure. It is a failure when the file with name already exists, when the file name is too long (it exceeds 15 characters), or when there are already 64 files present in the root directory. Note that to access a file that is created, it has to be subsequently opened.
+ */
+
+int fs_create(const char *filename)
+{
+    /* TODO: Phase 2 */
+    if(sp == NULL || root_dir == NULL || read_only){
+        eprintf("fs_create: no vd mounted or root dir read, or read only\n");
+        return -1;
+    }
+    /* @filename is invalid; or string @filename is too long*/
+    if (filename == NULL || \
+        strlen(filename) == 0 || \
+        filename[0] == 0 || \
+        strlen(filename) >= FS_FILENAME_LEN ) // strlen doesn't include NULL char
+    {
+        eprintf("fs_create: filaname is invalid\n");
+        return -1;
+    }
+    HOLD_DIR();
+    HOLD_META();
+    /* a file named @filename already exists; or the root directory already contains
+ * %FS_FILE_MAX_COUNT files*/
+    // packed to function get_direntry_idx(const char*)
+    // int i;
+    // for (i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    // {
+    //     /* code */
+    //     if(strcmp(dir[i]->filename, filename) == 0){
+    //         eprintf("fs_create: @filename already exists error\n");
+    //         return -1;
+    //     }
+    //     if(dir[i]->filename == NULL)
+    //         break;
+    // }
+    // if(i == FS_FILE_MAX_COUNT){
+    //     eprintf("fs_create: root directory full error\n");
+    //     return -1;
+    // }
+    if(new_entry(filename) == NULL)
+        return -1;
+
+    dir_publish();
+    meta_update(); 
+    return 0;
+}
+
+
+/* free the directory entry root_dir[@idx] and its hole chain, retired by entry_retire()
+ * the data chain is left to the caller, it may have been handed to another file
+*/
+void clear_entry(int idx){
+    direntry_t entry = get_dir(idx);
+    if(entry->hole_blk != 0) // sparse file
+        release_chain(entry->hole_blk);
+    drop_holes(idx);
+    view_drop(idx);
+
+    memset(entry, 0, sizeof(struct RootDirEntry));
+    sp->rdir_used -= 1;
+    __atomic_add_fetch(dir_gen + idx, 1, __ATOMIC_SEQ_CST);
+    dir_publish();
+    entry_keep(idx); // free to open again, by the next file there
+}
+
+/**
+ * fs_delete - Delete a file
+ * @filename: File name
+ *
+ * Delete the file named @filename from the root directory of the mounted file
+ * system.
+ *
+ * Return: -1 if @filename is invalid, if there is no file named @filename to
+ * delete, or if file @filename is currently open. 0 otherwise.
+
+ This function deletes the file with name from the root directory of your file system and frees all data blocks and meta-information that correspond to that file. The file that is being deleted must not be open. That is, there cannot be any open file descriptor that refers to the file name. When the file is open at the time that fs_delete is called, the call fails and the file is not deleted. Upon successful completion, a value of 0 is returned. fs_delete returns -1 on failure. It is a failure when the file with name does not exist. It is also a failure when the file is currently open (i.e., there exists at least one open file descriptor that is associated with this file).
+
+ */
+int fs_delete(const char *filename)
+{
+    /* TODO: Phase 2 */
+    if(read_only) return -1;
+    HOLD_DIR();
+    HOLD_META();
+    direntry_t cur_entry = NULL;
+    int entry_id = get_directory_entry(filename, (void *)&cur_entry);
+    if(entry_id < 0) return -1; // not found or sp, dir == NULL
+    // cur_entry = get_dir(entry_id);
+
+    // or if file @filename is currently open. 0 otherwise.
+
+    // cur_entry = root_dir + sizeof(struct RootDirEntry) * entry_id;
+    // if(dir[entry_id]->open > 0)
+    if(!entry_retire(entry_id)){
+        eprintf("fs_delete: the file is open now, uable to close\n");
+        return -1;
+    }
+    if(log_flush_file(cur_entry) < 0){ // logged bytes go to their blocks first
+        entry_keep(entry_id);
+        return -1;
+    }
+
+    if(cur_entry->first_data_blk != FAT_EOC) // not empty file
+        release_chain(cur_entry->first_data_blk);
+    clear_entry(entry_id);
+    meta_update();
+
+    return 0;
+}
+
+int fs_rename(const char *oldname, const char *newname, int flags)
+{
+    if(sp == NULL || read_only || newname == NULL || strlen(newname) == 0 \
+        || strlen(newname) >= FS_FILENAME_LEN || (flags & ~FS_RENAME_REPLACE)) return -1;
+    HOLD_DIR();
+    HOLD_META();
+    direntry_t entry = NULL, target = NULL;
+    int idx = get_directory_entry(oldname, (void *)&entry);
+    if(idx < 0)
+        return -1;
+    int target_id = get_directory_entry(newname, (void *)&target);
+    if(target_id == idx) // the same name
+        return 0;
+    if(target_id >= 0){
+        if(!(flags & FS_RENAME_REPLACE) || !entry_retire(target_id)){
+            eprintf("fs_rename: %s exists or is open\n", newname);
+            return -1;
+        }
+        if(log_flush_file(target) < 0){
+            entry_keep(target_id);
+            return -1;
+        }
+    }
+
+    /* both names change in the same published copy, fs_open() sees the
+     * replaced file or the renamed one, never none
+    */
+    memset(entry->filename, 0, FS_FILENAME_LEN);
+    strcpy(entry->filename, newname);
+    if(target_id >= 0){
+        if(target->first_data_blk != FAT_EOC)
+            release_chain(target->first_data_blk);
+        clear_entry(target_id);
+    }
+    else
+        dir_publish();
+    return meta_update();
+}
+
+
+/**
+ * fs_ls - List files on file system
+ *
+ * List information about the files located in the root directory.
+ *
+ * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ */
+
+void print_file(struct RootDirEntry * fentry, bool debug){
+    printf("file: %s, size: %d, data_blk: %d\n", fentry->filename, entry_size(fentry), fentry->first_data_blk);
+    // for debug, print fat
+    if(debug && fentry->first_data_blk != FAT_EOC){ // Joël: put debug in front to make it clear if I use it like this, but I change my mind
+        oprintf("open: %d\n", file_open[fentry - root_dir]);
+
+        uint16_t *tmp = get_fat(fentry->first_data_blk);
+        oprintf("first fat id = %d\n", fentry->first_data_blk);
+        while(*tmp != FAT_EOC){
+            oprintf("-> %d\t", *tmp);
+            tmp = get_fat(*tmp);
+        }
+            
+        oprintf(" END\n");
+    }
+}
+int fs_ls(void)
+{
+    /* TODO: Phase 2 */
+    if(sp == NULL || root_dir == NULL){
+        eprintf("no underlying virtual disk was opened\n");
+        return -1;
+    }
+
+    HOLD_DIR();
+    printf("FS Ls:\n");
+
+    // dir_entry = get_dir(0);
+    direntry_t dir_entry = root_dir;
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i, ++dir_entry)
+    {
+        // dir_entry = get_dir(i);
+        if((dir_entry->filename)[0] != 0){
+            print_file(dir_entry, db);
+            // oprintf("file: %s, size: %d, data_blk: %d\n", dir_entry->filename, dir_entry->file_sz, dir_entry->first_data_blk);
+        }
+    }
+
+
+    return 0;
+}
+
+
+
+/**
+ * fs_open - Open a file
+ * @filename: File name
+ *
+ * Open file named @filename for reading and writing, and return the
+ * corresponding file descriptor. The file descriptor is a non-negative integer
+ * that is used subsequently to access the contents of the file. The file offset
+ * of the file descriptor is set to 0 initially (beginning of the file). If the
+ * same file is opened multiple files, fs_open() must return distinct file
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
+ * simultaneously.
+ *
+ * Return: -1 if @filename is invalid, there is no file named @filename to open,
+ * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
+ * return the file descriptor.
+ */
+int fs_open(const char *filename)
+{
+    /* TODO: Phase 3 */
+    if(sp == NULL || root_dir == NULL || filename == NULL || strlen(filename) == 0 || strlen(filename) >= FS_FILENAME_LEN) // from TA: neglects to check for empty string
+        return -1;
+
+    int entry_id = pin_entry(filename); // no lock, see Lock-free Reads
+    if(entry_id < 0) return -1; // not found or sp, dir == NULL
+    direntry_t dir_entry = get_dir(entry_id);
+
+    // dir_entry = get_dir(entry_id);
+    // ++(dir_entry->open); // not here
+
+    int fd = get_valid_fd(dir_entry);
+    if(fd < 0){
+        unpin_entry(entry_id);
+        return -1;
+    }
+
+    /*
+    if(fs_lseek(fd, 0) < 0){ // actually unecessary, already set zero // from Bradley: Avoid calling external library functions internally this way, since you have to pay error checking overhead more than once. Better to implement internal calls for purposes such as these.
+        free(get_fd(fd));
+        return -1;
+    }
+    */
+
+    return fd;
+}
+
+/**
+ * fs_close - Close a file
+ * @fd: File descriptor
+ *
+ * Close file descriptor @fd.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). 0 otherwise.
+
+
+ The file descriptor fildes is closed. A closed file descriptor can no longer be used to access the corresponding file. Upon successful completion, a value of 0 is returned. In case the file descriptor fildes does not exist or is not open, the function returns -1.
+
+ */
+int fs_close(int fd)
+{
+    /* TODO: Phase 3 */
+    // if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || filedes[fd] == NULL)  return -1;
+    if(!is_valid_fd(fd)) return -1;
+
+    struct FileDescriptor * f = get_fd(fd);
+    direntry_t dir_entry = f->file_entry;
+    
+    int ret = 0; // what was written through @fd is on disk once closed
+    {
+        HOLD_FILE(dir_entry);
+        if(wbuf_flush(fd) < 0){
+            ret = -1;
+            wbuf_drop(fd); // closed anyway
+        }
+        HOLD_DIR(); // flush_file() of another thread may be looking at it
+        fd_unlink(fd);
+    }
+    dedup_file(dir_entry); // in dedup mode, before the entry can go
+    {
+        HOLD_META();
+        if(log_sync() < 0)
+            ret = -1;
+    }
+    range_release(adv_range + (dir_entry - root_dir), fd, 0, RANGE_END); // nothing to split
+    free(f->wbuf);
+    fd_put(fd);
+    unpin_entry(dir_entry - root_dir);
+    
+    return ret; // closed anyway
+}
+
+
+/**
+ * fs_stat - Get file status
+ * @fd: File descriptor
+ *
+ * Get the current size of the file pointed by file descriptor @fd.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the current size of file.
+ */
+int fs_stat(int fd)
+{
+    /* TODO: Phase 3 */
+    if(!is_valid_fd(fd))
+        return -1;
+    if(shared_ro)
+        return entry_size(get_fd(fd)->file_entry);
+    int size = view_stat(get_fd(fd)->file_entry - root_dir);
+    if(size >= 0)
+        return size;
+    HOLD_FILE_READ(h, get_fd(fd)->file_entry, 0, 0); // buffered writes may grow it
+    if(h.l == NULL)
+        return -1;
+    view_build(get_fd(fd)->file_entry);
+
+    // dir_entry = filedes[fd]->file_entry;
+
+    return entry_size(get_fd(fd)->file_entry);
+    // return dir_entry->file_sz;
+}
+
+
+/**
+ * fs_lseek - Set file offset
+ * @fd: File descriptor
+ * @offset: File offset
+ *
+ * Set the file offset (used for read and write operations) associated with file
+ * descriptor @fd to the argument @offset. To append to a file, one can call
+ * fs_lseek(fd, fs_stat(fd));
+ *
+ * The offset can be set beyond the end of the file. A later fs_write() then
+ * leaves a hole between the old end of file and @offset: the file becomes
+ * sparse and the hole reads back as zeros without using any data block.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is out of bounds (beyond the maximum file size of
+ * INT_MAX bytes). 0 otherwise.
+ */
+int fs_lseek(int fd, size_t offset)
+{
+    /* TODO: Phase 3 */
+    if(!is_valid_fd(fd)) return -1;
+
+    // dir_entry = (struct RootDirEntry *)(filedes[fd]->file_entry);
+    // if(offset > dir_entry->file_sz) return -1;
+
+
+    if(offset > FILE_SZ_MAX) return -1; // past the end of file is fine, a later write leaves a hole
+    HOLD_FILE(get_fd(fd)->file_entry);
+    if(wbuf_flush(fd) < 0) return -1;
+
+    get_fd(fd)->offset = offset;
+
+    return 0;
+}
+
+
+// int fs_write(int fd, void *buf, size_t count)
+uint16_t get_offset_blk(int fd, size_t offset){
+    if(!is_valid_fd(fd)){
+        return 0; // impossible
+    }
+
+    // dir_entry = filedes[fd]->file_entry;
+    // if(offset == 0) return dir_entry->first_data_blk;
+    if(offset >= get_fd(fd)->file_entry->file_sz){
+        // eprintf("get_offset_blk fail: offset is larger than file size\n");
+        return 0;
+    }
+    
+    int no_blk = file_blk_count(offset);
+    uint16_t blk = get_fd(fd)->file_entry->first_data_blk;
+    while(no_blk > 1){ // need some error check
+        blk = *(get_fat(blk)); //impossible NULL pointer
+        no_blk -= 1;
+    }
+
+    return blk; 
+}
+
+
+
+/**
+ * fs_write - Write to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Attempt to write @count bytes of data from buffer pointer by @buf into the
+ * file referenced by file descriptor @fd. It is assumed that @buf holds at
+ * least @count bytes.
+ *
+ * When the function attempts to write past the end of the file, the file is
+ * automatically extended to hold the additional bytes. If the underlying disk
+ * runs out of space while performing a write operation, fs_write() should write
+ * as many bytes as possible. The number of written bytes can therefore be
+ * smaller than @count (it can even be 0 if there is no more space on disk).
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually written.
+
+ √ calculate the real count written
+ √ set up the FAT index (should after written success )
+ √ write the content
+ √ update file entry(should after written success)
+ */
+/* write the buffers of @iov into @w_dir_entry at @offset, one pass over the chain
+ * the core of fs_write(), metadata is left for the caller to write back
+ * return the number of bytes actually written
+*/
+size_t file_writev(direntry_t w_dir_entry, size_t offset, const struct iovec *iov, int iovcnt)
+{
+    size_t count = clamp(iov_total(iov, iovcnt), FILE_SZ_MAX - offset);
+    if(count == 0 || !holes_ready(w_dir_entry)) return 0;
+
+    size_t real_count = 0;
+    uint32_t old_sz = w_dir_entry->file_sz;
+
+    /* writing past the end of file leaves a hole behind */
+    if(offset > old_sz && make_gap(w_dir_entry, offset) < 0)
+        return 0;
+    bool sparse = (w_dir_entry->hole_blk != 0); // zero blocks of sparse files become holes
+
+    struct BlkCursor cur;
+    cursor_seek(&cur, w_dir_entry, offset / BLOCK_SIZE);
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+
+    char bounce_buffer[BLOCK_SIZE]; // save free
+    while(real_count < count){
+        size_t blk_off = offset % BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE - blk_off, count - real_count);
+        bool has_data = cursor_has_data(&cur);
+        const void * content = (n == BLOCK_SIZE) ? io_take(&ic, n) : NULL; // straight from one buffer
+
+        if(content == NULL){
+            if(n < BLOCK_SIZE){ // merge with what the block already holds
+                if(!has_data || (blk_off == 0 && offset + n >= old_sz)) // nothing to keep in a hole, a new block, or past the end
+                    memset(bounce_buffer, 0, BLOCK_SIZE);
+                else if(block_read(sp->data_blk + cur.blk, bounce_buffer) < 0)
+                    break;
+            }
+            io_copy(&ic, bounce_buffer + blk_off, n, false); // gather the pieces of the buffers
+            content = bounce_buffer;
+        }
+
+        if(sparse && is_zero_blk(content, BLOCK_SIZE)){
+            if(cursor_zero(&cur) < 0)
+                break;
+        }
+        else if(has_data){
+            if(cursor_unshare(&cur, cur.pos) < 0 || block_write(sp->data_blk + cur.blk, content) < 0)
+                break;
+            fp_note(w_dir_entry - root_dir, cur.blk, content);
+        }
+        else{ // find the next valid block, link it only after it is written
+            int32_t temp = get_free_blk_idx();
+            if(temp < 0) {
+                eprintf("fs_write: no block any more\n");
+                break; // no block available
+            }
+            if(block_write(sp->data_blk + temp, content) < 0 || cursor_link(&cur, temp) < 0)
+                break;
+            fp_note(w_dir_entry - root_dir, temp, content);
+        }
+
+        real_count += n;
+        offset += n;
+        cursor_next(&cur);
+    }
+
+    if(real_count == 0) // nothing written, forget the new hole
+        hole_trim(w_dir_entry, size_to_blk(old_sz));
+    else if(offset > w_dir_entry->file_sz)
+        w_dir_entry->file_sz = offset;
+
+    return real_count;
+}
+
+/* write @count bytes of @buf into @w_dir_entry at @offset, see file_writev() */
+size_t file_write(direntry_t w_dir_entry, size_t offset, const void *buf, size_t count)
+{
+    struct iovec v = { (void *)buf, count };
+    return file_writev(w_dir_entry, offset, &v, 1);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    if(!is_valid_fd(fd) || read_only) return -1;
+
+    struct iovec v = { buf, count };
+    int real_count = range_writev(fd, get_fd(fd)->offset, &v, 1);
+    if(real_count == -2){
+        HOLD_FILE(get_fd(fd)->file_entry);
+        real_count = fd_writev(fd, get_fd(fd)->offset, &v, 1);
+    }
+    if(real_count > 0)
+        get_fd(fd)->offset += real_count;
+
+    return real_count;
+}
+
+
+/* fs_write version 1.0, without offset, work
+
+int fs_write(int fd, void *buf, size_t count)
+{
+    if(!is_valid_fd(fd)) return -1;
+    if(sp->data_blk_count == sp->fat_used ) return 0; // not error -1; return "written" count 0;
+
+    struct RootDirEntry * w_dir_entry = (struct RootDirEntry *)(get_fd(fd)->file_entry);
+
+    if(w_dir_entry->unused[0] == 'w') return -1; // others are writing this file
+
+    int real_count = count;
+
+    if(real_count == 0){ // write 0 B
+        w_dir_entry->unused[0] = 'n'; 
+        return real_count;
+    }
+
+    if( w_dir_entry->first_data_blk == 0xFFFF){ // no blk assign
+        w_dir_entry->first_data_blk = get_free_blk_idx();
+        if(w_dir_entry->first_data_blk == -1){ // not valid fat
+            // memset(w_dir_entry->filename, 0, sizeof(w_dir_entry->filename)); // make it free again.
+            w_dir_entry->first_data_blk = 0xFFFF; // according to fs_ref.x result, occupy the rdir, no dota block
+            return -1; // unmount?
+        }
+
+        w_dir_entry->last_data_blk = w_dir_entry->first_data_blk;
+        fat16 = get_fat(w_dir_entry->first_data_blk);
+        *fat16 = 0xFFFF;
+        sp->fat_used += 1; // !!!!
+    }
+    // w_dir_entry->first_data_blk = get_free_blk_idx(); // entry, should assign block here, in case the file size is 0;
+    // if(w_dir_entry->first_data_blk == -1){ // not valid fat
+    //     memset(w_dir_entry->filename, 0, sizeof(w_dir_entry->filename)); // make it free again.
+    //     return -1; // unmount?
+    // }
+    // w_dir_entry->last_data_blk = w_dir_entry->first_data_blk;
+    // fat16 = get_fat(w_dir_entry->first_data_blk);
+    // *fat16 = 0xFFFF;
+
+    int file_sz_old = w_dir_entry->file_sz;
+    int file_sz_new = file_sz_old + count;
+    int blk_old = file_blk_count(file_sz_old); // block count needed
+    // blk_old = (blk_old == 0 ? 1 : blk_old);
+    int blk_new = file_blk_count(file_sz_new);
+
+    uint16_t old_last = w_dir_entry->last_data_blk;
+
+    int blk_more = blk_new - blk_old;
+    if(blk_more > sp->data_blk_count - sp->fat_used){
+        blk_more = sp->data_blk_count - sp->fat_used;
+        real_count = (blk_more + blk_old) * BLOCK_SIZE - w_dir_entry->file_sz;
+    }
+        
+
+    if(blk_old != blk_new){
+        //set up the blk;        
+        while(blk_more > 0){
+            int next = get_free_blk_idx();
+            // if(next == -1) break; // no valid fat; actually impossible
+            uint16_t * fat_entry = get_fat(w_dir_entry->last_data_blk);
+            *fat_entry = next;
+            fat_entry = get_fat(next);
+            *fat_entry = 0xFFFF; // if not, the "next" block still available
+            // *(get_fat(w_dir_entry->last_data_blk)) = next ; // update the fat chain
+            w_dir_entry->last_data_blk = next;
+            blk_more -= 1;
+            sp->fat_used += 1;
+        }
+        // if(blk_more != 0) // succeed to write all; error, fat entry migth be bigger than block entry
+        //     real_count = (blk_new - blk_more) * BLOCK_SIZE - file_sz_old; // actually impossible
+
+        *(get_fat(w_dir_entry->last_data_blk)) = 0xFFFF; 
+    }
+
+    //start to write 
+    //1. get remaining content in the old last blk
+    //2. cat the old and new real_count
+    //3. write the whole block
+
+    //write the old last blk specially
+    //write the other blocks as a whole
+
+    // int blk_more_real = blk_new - blk_old - blk_more;
+    // ? fat index, and actual index, id should think about
+    // uint16_t truncate = w_dir_entry->file_sz % BLOCK_SIZE;
+    // if(truncate == 0){
+
+    // }
+    // else{
+    //     void * buf_temp = malloc(BLOCK_SIZE);
+    //     if(block_read(0, buf_temp) < 0) 
+    //     memcpy(buf_temp, )
+    // }
+    //     truncate += real_count;
+
+    // int block_write(size_t block, const void *buf), block start from 0
+
+    void * bounce_buffer = malloc(BLOCK_SIZE);
+    memset(bounce_buffer, 0, BLOCK_SIZE);
+
+    if(block_read(sp->data_blk + old_last, bounce_buffer) < 0) return -1; // should free bounce_buffer before return -1
+    // size_t truncate = strlen(bounce_buffer); // or should I use truncate = w_dir_entry->file_sz % BLOCK_SIZE // error
+    if(fs_lseek(fd, fs_stat(fd)) < 0)
+        return -1; 
+    size_t truncate = (get_fd(fd)->offset) % BLOCK_SIZE;
+    size_t buf_idx = clamp(BLOCK_SIZE - truncate, real_count);
+    memcpy(bounce_buffer + truncate, buf, buf_idx);
+    if(block_write(sp->data_blk + old_last, bounce_buffer) < 0 ) return -1; 
+
+    int temp_count = real_count;
+    temp_count -= buf_idx;
+    int temp_blk_id = *(get_fat(old_last));     
+    while(temp_count > 0){ // into the loop, temp_blk_id != 0xFFFF       
+        // truncate = clamp(temp_count, BLOCK_SIZE);//reuse the var truncate 
+        if(temp_count > BLOCK_SIZE)
+            block_write(sp->data_blk + temp_blk_id, buf + buf_idx); // < 0 should return -1;
+        else {
+            memset(bounce_buffer, 0, BLOCK_SIZE);
+            memcpy(bounce_buffer, buf + buf_idx, temp_count);
+            block_write(sp->data_blk + temp_blk_id, bounce_buffer);
+        }
+
+        buf_idx += BLOCK_SIZE;
+        temp_count -= BLOCK_SIZE;
+        temp_blk_id = *(get_fat(temp_blk_id));
+    }
+
+    free(bounce_buffer);
+
+    w_dir_entry->unused[0] = 'n';
+
+    w_dir_entry->file_sz += real_count;
+
+    meta_update();
+    return real_count;
+}
+
+*/
+/**
+ * fs_read - Read from a file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Attempt to read @count bytes of data from the file referenced by file
+ * descriptor @fd into buffer pointer by @buf. It is assumed that @buf is large
+ * enough to hold at least @count bytes.
+ *
+ * The number of bytes read can be smaller than @count if there are less than
+ * @count bytes until the end of the file (it can even be 0 if the file offset
+ * is at the end of the file). The file offset of the file descriptor is
+ * implicitly incremented by the number of bytes that were actually read.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+
+
+ This function attempts to read nbyte bytes of data from the file referenced by the descriptor fildes into the buffer pointed to by buf. The function assumes that the buffer buf is large enough to hold at least nbyte bytes. When the function attempts to read past the end of the file, it reads all bytes until the end of the file. Upon successful completion, the number of bytes that were actually read is returned. This number could be smaller than nbyte when attempting to read past the end of the file (when trying to read while the file pointer is at the end of the file, the function returns zero). In case of failure, the function returns -1. It is a failure when the file descriptor fildes is not valid. The read function implicitly increments the file pointer by the number of bytes that were actually read.
+
+ int block_read(size_t block, void *buf);
+ */
+
+/* read @dir_entry at @offset into the buffers of @iov, one pass over the chain
+ * the core of fs_read(), return the number of bytes read, -1 on disk error
+*/
+int file_readv(direntry_t dir_entry, size_t offset, const struct iovec *iov, int iovcnt)
+{
+    if(offset >= dir_entry->file_sz) // also covers a file truncated under this fd
+        return 0;
+    if(!holes_ready(dir_entry))
+        return -1;
+    size_t real_count = clamp(dir_entry->file_sz - offset, iov_total(iov, iovcnt));
+
+    struct BlkCursor cur;
+    cursor_seek(&cur, dir_entry, offset / BLOCK_SIZE);
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+
+    char bounce_buffer[BLOCK_SIZE]; //void *bounce_buffer = malloc(BLOCK_SIZE);
+    size_t buf_idx = 0;
+    while(buf_idx < real_count){
+        size_t blk_off = offset % BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE - blk_off, real_count - buf_idx);
+        void * direct = (n == BLOCK_SIZE) ? io_take(&ic, n) : NULL;
+
+        if(direct != NULL){ // read the whole block directly
+            if(!cursor_has_data(&cur)) // a hole reads back as zeros
+                memset(direct, 0, n);
+            else if(block_read(cur.blk + sp->data_blk, direct) < 0)
+                return -1;
+        }
+        else{ // scatter over the buffers
+            if(!cursor_has_data(&cur))
+                memset(bounce_buffer + blk_off, 0, n);
+            else if(block_read(cur.blk + sp->data_blk, bounce_buffer) < 0)
+                return -1;
+            io_copy(&ic, bounce_buffer + blk_off, n, true);
+        }
+
+        buf_idx += n;
+        offset += n;
+        cursor_next(&cur);
+    }
+
+    return buf_idx;
+}
+
+/* read up to @count bytes of @dir_entry at @offset into @buf, see file_readv() */
+int file_read(direntry_t dir_entry, size_t offset, void *buf, size_t count)
+{
+    struct iovec v = { buf, count };
+    return file_readv(dir_entry, offset, &v, 1);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    if(!is_valid_fd(fd)) return -1;
+
+    int real_count = fd_read_par(fd, get_fd(fd)->offset, buf, count);
+    if(real_count > 0)
+        get_fd(fd)->offset += real_count;
+
+    return real_count;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    if(!is_valid_fd(fd)) return -1;
+
+    return fd_read_par(fd, offset, buf, count);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+    if(!is_valid_fd(fd) || read_only || offset > FILE_SZ_MAX) return -1;
+
+    struct iovec v = { buf, count };
+    int real_count = range_writev(fd, offset, &v, 1);
+    if(real_count != -2)
+        return real_count;
+    HOLD_FILE(get_fd(fd)->file_entry);
+    return fd_writev(fd, offset, &v, 1);
+}
 
-√ provide persistent storage. -- write_meta
-This means that whenever umount_fs is called, all meta-information and file data (that you could temporarily have only in memory; depending on your implementation) must be written out to disk.
-*/
-int fs_umount(void)
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
 {
-    /* TODO: Phase 1 */
-    /* write back: super block, fat, dir*/
-    if(sp == NULL)
-        return -1;  // no underlying virtual disk was opened
+    if(!is_valid_fd(fd) || iovcnt < 0 || iov_total(iov, iovcnt) > INT_MAX) return -1;
 
-    if(write_meta() < 0 ) return -1; 
-    // if(block_write(0, (void *)sp) < 0)
-    // {
-    //     eprintf("fs_umount write back sp error\n");
-    //     return -1; 
-    // }
-    // if(block_write(sp->rdir_blk, root_dir) < 0)// write back
-    // {
-    //     eprintf("fs_umount write back dir error\n");
-    //     return -1; 
-    // }
-    // for (int i = 0; i < sp->fat_blk_count; ++i)
-    // {
-    //     if(block_write(1 + i, fat + BLOCK_SIZE * i) < 0)// write back
-    //     {
-    //         eprintf("fs_umount write back dir error\n");
-    //         return -1; 
-    //     }
-    // }
+    int real_count = fd_readv_rcu(fd, get_fd(fd)->offset, iov, iovcnt);
+    if(real_count > 0)
+        get_fd(fd)->offset += real_count;
 
-    if(fd_cnt > 0){
-        eprintf("there are files open, unable to umount\n");
-        return -1;
+    return real_count;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    if(!is_valid_fd(fd) || read_only || iovcnt < 0 || iov_total(iov, iovcnt) > INT_MAX) return -1;
+
+    int real_count = range_writev(fd, get_fd(fd)->offset, iov, iovcnt);
+    if(real_count == -2){
+        HOLD_FILE(get_fd(fd)->file_entry);
+        real_count = fd_writev(fd, get_fd(fd)->offset, iov, iovcnt);
     }
-    // for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i)
-    // {
-    //     if(filedes[i] != NULL){
-    //         free(filedes[i]);
-    //         filedes[i] = NULL; 
-    //     }
-            
-    // }
+    if(real_count > 0)
+        get_fd(fd)->offset += real_count;
 
+    return real_count;
+}
 
-    if(block_disk_close() < 0) { //cannot be closed
-        eprintf("fs_umount error\n");
-        return -1; 
+/* version 1.0 without offset
+int fs_read(int fd, void *buf, size_t count)
+{
+    if(!is_valid_fd(fd)) return -1;
+    dir_entry = get_fd(fd)->file_entry;
+
+    size_t offset = get_fd(fd)->offset;
+    size_t real_count = clamp(dir_entry->file_sz - offset, count);
+    void *bounce_buffer = malloc(BLOCK_SIZE);
+    int i = 0;
+    uint16_t temp_blk_id = dir_entry->first_data_blk; 
+    while(count > 0){
+        if(count >= BLOCK_SIZE){
+            if(block_read(temp_blk_id + sp->data_blk, buf + i) < 0 ) return -1;
+            i += BLOCK_SIZE;
+        }
+        else{
+            memset(bounce_buffer, 0, BLOCK_SIZE);
+            if(block_read(temp_blk_id + sp->data_blk, bounce_buffer) < 0 ) return -1;
+            memcpy(buf+i, bounce_buffer, count);
+        }
+
+        temp_blk_id = *(get_fat(temp_blk_id));
+        count -= BLOCK_SIZE;
     }
 
-    clear();
-    return 0;
+    free(bounce_buffer);
+
+    if(fs_lseek(fd, real_count) < 0) return -1;
+ 
+    return real_count;
 }
+*/
+
+
+/* shrink @entry to @size bytes, the FAT chain is cut after the last data block
+ * to keep and the remainder is released in one pass
+ * return -1 if that block is shared and cannot be copied
+*/
+int file_shrink(direntry_t entry, uint32_t size){
+    uint32_t new_nblk = size_to_blk(size);
 
+    struct BlkCursor cur; // @prev is the last data block to keep, @blk the first to drop
+    cursor_seek(&cur, entry, new_nblk);
+    if(cur.prev != FAT_EOC && cur.blk != FAT_EOC && cursor_unshare(&cur, cur.pos - 1) < 0)
+        return -1;
+    if(cur.prev == FAT_EOC){
+        release_chain(entry->first_data_blk);
+        entry->first_data_blk = FAT_EOC;
+    }
+    else if(cur.blk != FAT_EOC){ // cut the chain, then free the remainder at once
+        set_fat(cur.prev, FAT_EOC);
+        release_chain(cur.blk);
+    }
+    entry->last_data_blk = cur.prev;
+    hole_trim(entry, new_nblk);
+    entry->file_sz = size;
+    return 0;
+}
 
 /**
- * fs_info - Display information about file system
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @size: New size of the file
  *
- * Display some information about the currently mounted file system.
+ * Shrinking cuts the FAT chain after the last data block before the new end
+ * of file and releases the rest of the chain in one pass. Growing leaves a
+ * hole, unless the hole list cannot be stored, then zeros are written.
  *
- * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ * Return: -1 if file descriptor @fd is invalid, if @size cannot be stored, or
+ * if the disk runs out of space while growing. 0 otherwise.
  */
-int fs_info(void)
+int fs_truncate(int fd, size_t size)
 {
-    if(sp == NULL || disk == NULL) {
-        eprintf("fs_info: no underlying virtual disk was mounted sucessfully\n");
+    if(!is_valid_fd(fd) || size > FILE_SZ_MAX || read_only) return -1;
+
+    direntry_t t_dir_entry = get_fd(fd)->file_entry;
+    HOLD_FILE(t_dir_entry);
+    if(flush_file(t_dir_entry, -1) < 0) // pending bytes go to their blocks first
+        return -1;
+    HOLD_META();
+    if(log_flush_file(t_dir_entry) < 0)
         return -1;
+    if(t_dir_entry->zip){
+        if(zip_truncate(t_dir_entry, size) < 0){
+            meta_update();
+            return -1;
+        }
+        return meta_update();
     }
-    printf("FS Info:\n");
-    // eprintf("signature=%s\n",sp->signature); // non-terminator
-    // eprintf("%.*s\n", 8, sp->signature); // works
 
-    printf("total_blk_count=%d\n",sp->total_blk_count);
-    printf("fat_blk_count=%d\n",sp->fat_blk_count);
-    printf("rdir_blk=%d\n",sp->rdir_blk);
-    printf("data_blk=%d\n",sp->data_blk);
-    printf("data_blk_count=%d\n",sp->data_blk_count);
+    uint32_t old_nblk = size_to_blk(t_dir_entry->file_sz);
+    uint32_t new_nblk = size_to_blk(size);
 
-    printf("fat_free_ratio=%d/%d\n", (sp->data_blk_count - sp->fat_used), sp->data_blk_count);
-    printf("rdir_free_ratio=%d/%d\n", (FS_FILE_MAX_COUNT - sp->rdir_used),FS_FILE_MAX_COUNT);
+    if(size > t_dir_entry->file_sz){
+        if(zero_tail(t_dir_entry) < 0)
+            return -1;
+        if(new_nblk > old_nblk && hole_add(t_dir_entry, old_nblk, new_nblk - old_nblk) < 0){
+            /* no room for the hole list, write zeros through the write path */
+            char zero_buffer[BLOCK_SIZE];
+            memset(zero_buffer, 0, BLOCK_SIZE);
+
+            uint32_t old_sz = t_dir_entry->file_sz;
+            while(t_dir_entry->file_sz < size){ // not fs_write(), the file_lock is held and a short write would only be buffered
+                size_t n = clamp(size - t_dir_entry->file_sz, BLOCK_SIZE);
+                if(file_write(t_dir_entry, t_dir_entry->file_sz, zero_buffer, n) != n)
+                    break;
+            }
+            if(t_dir_entry->file_sz == size)
+                return meta_update();
 
-    uint16_t * fat16 = fat;
-    for (int i = 0; i < sp->data_blk_count; ++i, ++fat16)
-        oprintf("fat[%d]:%d\n", i, *fat16);
+            file_shrink(t_dir_entry, old_sz); // disk full, keep the old size
+            meta_update();
+            return -1;
+        }
+    }
+    else if(size < t_dir_entry->file_sz && file_shrink(t_dir_entry, size) < 0){
+        meta_update();
+        return -1;
+    }
+    t_dir_entry->file_sz = size;
 
-    if(db)
-        print_data();
+    return meta_update();
+}
 
-    /* my info for debug
-    eprintf("unused[0]=%d\n", (uint8_t)(sp->unused)[0]); // unused[0]=0
 
-    if(dir_entry->filename == NULL)
-        eprintf("root_dir[0].filename == NULL!!!\n");
-    else eprintf("root_dir[0].filename != NULL...\n");
-    eprintf("root_dir[0].filename[0]=%d\n", (int)(dir_entry->filename[0])); // root_dir[0].filename=(null)
+/**
+ * fs_punch_hole - Deallocate a range of a file
+ * @fd: File descriptor
+ * @offset: Start of the range
+ * @len: Length of the range
+ *
+ * Blocks fully inside the range are unlinked from the chain and freed, the
+ * partial blocks at both ends get zeros.
+ *
+ * Return: -1 if file descriptor @fd is invalid, or if a block cannot be
+ * updated. 0 otherwise.
+ */
+int fs_punch_hole(int fd, size_t offset, size_t len)
+{
+    if(!is_valid_fd(fd) || read_only) return -1;
 
-    memset(dir_entry, 0, sizeof(dir_entry->filename));
-    eprintf("after memeset(0), root_dir[0].filename=%s\n", dir_entry->filename); // root_dir[0].filename=(null)
-    eprintf("fat[0]=%d\n", *fat16); // fat[0]=65535
-    */
-    return 0;
+    direntry_t p_dir_entry = get_fd(fd)->file_entry;
+    HOLD_FILE(p_dir_entry);
+    if(flush_file(p_dir_entry, -1) < 0) // pending bytes go to their blocks first
+        return -1;
+    HOLD_META();
+    if(p_dir_entry->zip || log_flush_file(p_dir_entry) < 0)
+        return -1;
+
+    size_t end = clamp(offset + clamp(len, UINT32_MAX), (size_t)p_dir_entry->file_sz);
+    if(offset >= end)
+        return 0;
+
+    struct BlkCursor cur;
+    cursor_seek(&cur, p_dir_entry, offset / BLOCK_SIZE);
+
+    char bounce_buffer[BLOCK_SIZE];
+    int ret = 0;
+    for (size_t blk_start = cur.lblk * (size_t)BLOCK_SIZE; blk_start < end; blk_start += BLOCK_SIZE)
+    {
+        /* bytes past the end of file do not count, a partial last block can go as a whole */
+        size_t blk_end = clamp(blk_start + BLOCK_SIZE, (size_t)p_dir_entry->file_sz);
+        size_t from = pickmax(offset, blk_start);
+        size_t to = clamp(end, blk_end);
+
+        if(cursor_has_data(&cur)){
+            if(from == blk_start && to == blk_end){
+                if(cursor_zero(&cur) < 0){
+                    ret = -1;
+                    break;
+                }
+            }
+            else{
+                if(block_read(sp->data_blk + cur.blk, bounce_buffer) < 0){
+                    ret = -1;
+                    break;
+                }
+                memset(bounce_buffer + from - blk_start, 0, to - from);
+                if(cursor_unshare(&cur, cur.pos) < 0 || block_write(sp->data_blk + cur.blk, bounce_buffer) < 0){
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        cursor_next(&cur);
+    }
+
+    if(write_meta() < 0)
+        return -1;
+    return ret;
+}
+
+/* append the bytes of @from starting at @offset to the end of @to, through the write path
+ * the fallback of fs_concat() and fs_split() when the cut is not block aligned
+ * return -1 if the disk runs out of space, @to keeps its old size then
+*/
+int copy_tail(direntry_t to, direntry_t from, size_t offset){
+    uint32_t old_sz = to->file_sz;
+    size_t chunk = BLOCK_SIZE * 16;
+    char * buf = malloc(chunk);
+    if(buf == NULL)
+        return -1;
+
+    int ret = 0;
+    while(offset < from->file_sz){
+        int n = file_read(from, offset, buf, chunk);
+        if(n <= 0 || file_write(to, to->file_sz, buf, n) != (size_t)n){
+            ret = -1;
+            break;
+        }
+        offset += n;
+    }
+    free(buf);
+
+    if(ret < 0 && to->file_sz > old_sz)
+        file_shrink(to, old_sz);
+    return ret;
 }
 
 /**
- * fs_create - Create a new file
- * @filename: File name
+ * fs_concat - Append a file to another one
+ * @dst: File name of the file to extend
+ * @src: File name of the file to append
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * When the size of @dst is a multiple of BLOCK_SIZE, the last data block of
+ * @dst is linked to the first data block of @src and the hole list of @src is
+ * shifted after the blocks of @dst, no data block is read or written.
+ * Otherwise every byte of @src would move inside its block, so @src is copied.
  *
- * Return: -1 if @filename is invalid, if a file named @filename already exists,
- * or if string @filename is too long, or if the root directory already contains
- * %FS_FILE_MAX_COUNT files. 0 otherwise.
-
-
- This function creates a new file with name in the root directory of your file system. The file is initially empty. The maximum length for a file name is 15 characters. Also, there can be at most 64 files in the directory. Upon successful completion, a value of 0 is returned. fs_create returns -1 on failure. It is a failure when the file with name already exists, when the file name is too long (it exceeds 15 characters), or when there are already 64 files present in the root directory. Note that to access a file that is created, it has to be subsequently opened.
+ * Return: -1 if either file does not exist or is open, if they are the same
+ * file, if the result is too large, or if the disk runs out of space. 0
+ * otherwise.
  */
-
-int fs_create(const char *filename)
+int fs_concat(const char *dst, const char *src)
 {
-    /* TODO: Phase 2 */
-    if(sp == NULL || root_dir == NULL){
-        eprintf("fs_create: no vd mounted or root dir read\n");
+    if(read_only) return -1;
+    HOLD_ALL();
+    if(flush_pending() < 0) return -1;
+    direntry_t d_entry = NULL, s_entry = NULL;
+    if(get_directory_entry(dst, (void *)&d_entry) < 0)
+        return -1;
+    int s_id = get_directory_entry(src, (void *)&s_entry);
+    if(s_id < 0 || d_entry == s_entry || d_entry->zip || s_entry->zip)
+        return -1;
+    if(entry_busy(d_entry - root_dir) || !entry_retire(s_id)){
+        eprintf("fs_concat: the file is open now\n");
         return -1;
     }
-    /* @filename is invalid; or string @filename is too long*/
-    if (filename == NULL || \
-        strlen(filename) == 0 || \
-        filename[0] == 0 || \
-        strlen(filename) >= FS_FILENAME_LEN ) // strlen doesn't include NULL char
-    {
-        eprintf("fs_create: filaname is invalid\n");
+    if((uint64_t)d_entry->file_sz + s_entry->file_sz > FILE_SZ_MAX){
+        entry_keep(s_id);
         return -1;
     }
-    /* a file named @filename already exists; or the root directory already contains
- * %FS_FILE_MAX_COUNT files*/
-    // packed to function get_direntry_idx(const char*)
-    // int i;
-    // for (i = 0; i < FS_FILE_MAX_COUNT; ++i)
-    // {
-    //     /* code */
-    //     if(strcmp(dir[i]->filename, filename) == 0){
-    //         eprintf("fs_create: @filename already exists error\n");
-    //         return -1;
-    //     }
-    //     if(dir[i]->filename == NULL)
-    //         break;
-    // }
-    // if(i == FS_FILE_MAX_COUNT){
-    //     eprintf("fs_create: root directory full error\n");
-    //     return -1;
-    // }
-    direntry_t dir_entry = NULL;
-    int entry_id = get_valid_directory_entry(filename, (void *)&dir_entry);
-    if(entry_id < 0)
-        return -1; // no valid dir entry 
-    // the ith entry is available
-    // dir_entry = root_dir + entry_id * sizeof(struct RootDirEntry);
 
-    // dir_entry = get_dir(entry_id); 
-    strcpy(dir_entry->filename, filename);
-    dir_entry->file_sz = 0;
-    dir_entry->open = 0;
-    dir_entry->first_data_blk = FAT_EOC; 
-    dir_entry->last_data_blk = FAT_EOC; // from TA: This variable should not be used in a way where you assume it will be ready for you, since you are expected to be able to read files created by fs_ref. You don't actually recalculate these values when mounting the filesystem, so it feels like your logic will probably be assuming their presence always.
-    memset(dir_entry->unused, 0, 7); // from TA: If it's unused, you probably shouldn't bother touching it.
+    if(d_entry->file_sz % BLOCK_SIZE != 0){
+        if(copy_tail(d_entry, s_entry, 0) < 0){
+            entry_keep(s_id);
+            write_meta();
+            return -1;
+        }
+        if(s_entry->first_data_blk != FAT_EOC)
+            release_chain(s_entry->first_data_blk);
+        clear_entry(s_id);
+        return write_meta();
+    }
 
-    sp->rdir_used += 1; // how to deal with @setup_sp
+    uint32_t d_nblk = d_entry->file_sz / BLOCK_SIZE;
+    struct BlkCursor cur; // @prev is the last data block of @dst
+    cursor_seek(&cur, d_entry, d_nblk);
+    if(s_entry->first_data_blk != FAT_EOC && cur.prev != FAT_EOC && cursor_unshare(&cur, cur.pos - 1) < 0){
+        entry_keep(s_id);
+        write_meta();
+        return -1;
+    }
 
-    write_meta(); 
-    return 0;
-}
+    struct HoleList * d_holes = get_holes(d_entry);
+    struct HoleList * s_holes = get_holes(s_entry);
+    if(s_holes && s_holes->count > 0){
+        /* room for every run first, so the splice cannot fail half way */
+        if(hole_reserve(d_entry, (d_holes ? d_holes->count : 0) + s_holes->count) < 0){
+            hole_fit(d_entry);
+            entry_keep(s_id);
+            write_meta();
+            return -1;
+        }
+        for (uint32_t i = 0; i < s_holes->count; ++i)
+            hole_add(d_entry, s_holes->run[i].start + d_nblk, s_holes->run[i].len);
+    }
+
+    /* the chain of @src goes right after the last data block of @dst, which is not shared */
+    if(s_entry->first_data_blk != FAT_EOC){
+        if(cur.prev == FAT_EOC)
+            d_entry->first_data_blk = s_entry->first_data_blk;
+        else
+            set_fat(cur.prev, s_entry->first_data_blk);
+        d_entry->last_data_blk = s_entry->last_data_blk;
+    }
+    d_entry->file_sz += s_entry->file_sz;
 
+    clear_entry(s_id);
+    return write_meta();
+}
 
 /**
- * fs_delete - Delete a file
- * @filename: File name
+ * fs_split - Move the end of a file to a new file
+ * @src: File name of the file to split
+ * @offset: Where to split
+ * @newname: File name of the new file
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * When @offset is a multiple of BLOCK_SIZE, the FAT chain of @src is cut at
+ * the first data block past @offset, which becomes the head of @newname, and
+ * the holes past @offset move along. Otherwise the end of @src is copied.
  *
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
-
- This function deletes the file with name from the root directory of your file system and frees all data blocks and meta-information that correspond to that file. The file that is being deleted must not be open. That is, there cannot be any open file descriptor that refers to the file name. When the file is open at the time that fs_delete is called, the call fails and the file is not deleted. Upon successful completion, a value of 0 is returned. fs_delete returns -1 on failure. It is a failure when the file with name does not exist. It is also a failure when the file is currently open (i.e., there exists at least one open file descriptor that is associated with this file).
-
+ * Return: -1 if @src does not exist or is open, if @offset is past the end of
+ * @src, if @newname cannot be created, or if the disk runs out of space. 0
+ * otherwise.
  */
-int fs_delete(const char *filename)
+int fs_split(const char *src, size_t offset, const char *newname)
 {
-    /* TODO: Phase 2 */
-    direntry_t cur_entry = NULL;
-    int entry_id = get_directory_entry(filename, (void *)&cur_entry);
-    if(entry_id < 0) return -1; // not found or sp, dir == NULL
-    // cur_entry = get_dir(entry_id);
-
-    // or if file @filename is currently open. 0 otherwise.
+    if(read_only) return -1;
+    HOLD_ALL();
+    if(flush_pending() < 0) return -1;
+    direntry_t s_entry = NULL, n_entry = NULL;
+    if(get_directory_entry(src, (void *)&s_entry) < 0)
+        return -1;
+    if(entry_busy(s_entry - root_dir)){
+        eprintf("fs_split: the file is open now\n");
+        return -1;
+    }
+    if(s_entry->zip || offset > s_entry->file_sz || fs_create(newname) < 0)
+        return -1;
+    get_directory_entry(newname, (void *)&n_entry);
 
-    // cur_entry = root_dir + sizeof(struct RootDirEntry) * entry_id;
-    // if(dir[entry_id]->open > 0)
-    if(cur_entry->open > 0){
-        eprintf("fs_delete: the file is open now, uable to close\n");
+    if(offset % BLOCK_SIZE != 0){
+        if(copy_tail(n_entry, s_entry, offset) < 0 || file_shrink(s_entry, offset) < 0){
+            fs_delete(newname);
+            return -1;
+        }
+        return write_meta();
+    }
+
+    uint32_t lblk = offset / BLOCK_SIZE;
+    struct BlkCursor cur; // cut between @prev and @blk, the holes past the cut do not count
+    cursor_seek(&cur, s_entry, lblk);
+    if(cur.prev != FAT_EOC && cur.blk != FAT_EOC && cursor_unshare(&cur, cur.pos - 1) < 0){
+        fs_delete(newname);
         return -1;
     }
 
-    if(cur_entry->first_data_blk != FAT_EOC){ // not empty file
-        uint16_t * fat16 =  get_fat(cur_entry->first_data_blk);
-        erase_fat(fat16); // how about return -1?
+    struct HoleList * s_holes = get_holes(s_entry);
+    if(s_holes){
+        uint32_t i = 0, moved;
+        while(i < s_holes->count && s_holes->run[i].start + s_holes->run[i].len <= lblk)
+            ++i;
+        moved = s_holes->count - i;
+        if(moved > 0 && hole_reserve(n_entry, moved) < 0){
+            fs_delete(newname);
+            return -1;
+        }
+        for (; i < s_holes->count; ++i)
+        {
+            uint32_t start = pickmax(s_holes->run[i].start, lblk);
+            hole_add(n_entry, start - lblk, s_holes->run[i].start + s_holes->run[i].len - start);
+        }
+        hole_trim(s_entry, lblk);
     }
-    
-    memset(cur_entry, 0, sizeof(struct RootDirEntry));
 
-    sp->rdir_used -= 1;
-    write_meta();
+    if(cur.blk != FAT_EOC){
+        n_entry->first_data_blk = cur.blk;
+        n_entry->last_data_blk = s_entry->last_data_blk;
+        if(cur.prev == FAT_EOC)
+            s_entry->first_data_blk = FAT_EOC;
+        else
+            set_fat(cur.prev, FAT_EOC);
+        s_entry->last_data_blk = cur.prev;
+    }
+    n_entry->file_sz = s_entry->file_sz - offset;
+    s_entry->file_sz = offset;
 
-    return 0;
+    return write_meta();
 }
 
-
 /**
- * fs_ls - List files on file system
+ * fs_clone - Create a copy-on-write copy of a file
+ * @src: File name of the file to copy
+ * @dst: File name of the new file
  *
- * List information about the files located in the root directory.
+ * The new entry points to the FAT chain of @src and only the first block of
+ * the chain gets a reference, so no data block is copied. The hole list of a
+ * sparse file is copied. The shared blocks are copied later, by whichever
+ * file changes them first.
  *
- * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
+ * Return: -1 if @src does not exist or is being written, if @dst cannot be
+ * created, or if there is no room for the reference count table. 0 otherwise.
  */
-
-void print_file(struct RootDirEntry * fentry, bool debug){
-    printf("file: %s, size: %d, data_blk: %d\n", fentry->filename, fentry->file_sz, fentry->first_data_blk);
-    // for debug, print fat
-    if(debug && fentry->first_data_blk != FAT_EOC){ // Joël: put debug in front to make it clear if I use it like this, but I change my mind
-        oprintf("open: %d\n", fentry->open);
-
-        uint16_t *tmp = get_fat(fentry->first_data_blk);
-        oprintf("first fat id = %d\n", fentry->first_data_blk);
-        while(*tmp != FAT_EOC){
-            oprintf("-> %d\t", *tmp);
-            tmp = get_fat(*tmp);
-        }
-            
-        oprintf(" END\n");
-    }
-}
-int fs_ls(void)
+int fs_clone(const char *src, const char *dst)
 {
-    /* TODO: Phase 2 */
-    if(sp == NULL || root_dir == NULL){
-        eprintf("no underlying virtual disk was opened\n");
+    if(read_only) return -1;
+    HOLD_ALL();
+    if(flush_pending() < 0) return -1;
+    direntry_t s_entry = NULL, d_entry = NULL;
+    if(get_directory_entry(src, (void *)&s_entry) < 0)
+        return -1;
+    if(fs_create(dst) < 0)
         return -1;
+    get_directory_entry(dst, (void *)&d_entry);
+
+    struct HoleList * s_holes = get_holes(s_entry);
+    if(s_holes && s_holes->count > 0){
+        if(hole_reserve(d_entry, s_holes->count) < 0){
+            fs_delete(dst);
+            return -1;
+        }
+        struct HoleList * d_holes = holes[d_entry - root_dir];
+        memcpy(d_holes->run, s_holes->run, s_holes->count * sizeof(struct HoleRun));
+        d_holes->count = s_holes->count;
+        d_holes->dirty = 1;
     }
 
-    printf("FS Ls:\n");
+    if(s_entry->first_data_blk != FAT_EOC){
+        if(ref_create() < 0){
+            fs_delete(dst);
+            return -1;
+        }
+        ref_inc(s_entry->first_data_blk);
+        d_entry->first_data_blk = s_entry->first_data_blk;
+        d_entry->last_data_blk = s_entry->last_data_blk;
+    }
+    d_entry->file_sz = s_entry->file_sz;
+    d_entry->zip = s_entry->zip;
+    d_entry->zip_sz = s_entry->zip_sz;
 
-    // dir_entry = get_dir(0);
-    direntry_t dir_entry = root_dir;
+    return write_meta();
+}
 
-    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i, ++dir_entry)
+/* copy the chain starting at @blk block by block into newly allocated blocks
+ * return the first block of the copy, FAT_EOC if the disk is full
+*/
+uint16_t copy_chain(uint16_t blk){
+    uint16_t head = FAT_EOC, tail = FAT_EOC;
+    char bounce_buffer[BLOCK_SIZE];
+    for (; blk != FAT_EOC && blk != 0; blk = fat[blk])
     {
-        // dir_entry = get_dir(i);
-        if((dir_entry->filename)[0] != 0){
-            print_file(dir_entry, db);
-            // oprintf("file: %s, size: %d, data_blk: %d\n", dir_entry->filename, dir_entry->file_sz, dir_entry->first_data_blk);
+        int32_t temp = get_free_blk_idx();
+        if(temp < 0 || meta_block_read(blk, bounce_buffer) < 0 \
+            || block_write(sp->data_blk + temp, bounce_buffer) < 0){
+            if(head != FAT_EOC)
+                release_chain(head);
+            return FAT_EOC;
         }
+        set_fat(temp, FAT_EOC);
+        sp->fat_used += 1;
+        if(tail == FAT_EOC)
+            head = temp;
+        else
+            set_fat(tail, temp);
+        tail = temp;
     }
+    return head;
+}
 
-
-    return 0;
+/* read the snapshot table into @table, all empty if there is no snapshot yet */
+int read_snaps(struct SnapEntry * table){
+    if(sp->snap_blk == 0){
+        memset(table, 0, BLOCK_SIZE);
+        return 0;
+    }
+    return meta_block_read(sp->snap_blk, table);
 }
 
+/* give back what fs_snapshot_create() took for the first @n entries of
+ * @frozen, and @snap_blk unless it is the table already on disk
+*/
+void snap_undo(direntry_t frozen, int n, uint16_t snap_blk){
+    for (int i = 0; i < n; ++i, ++frozen)
+    {
+        if(frozen->filename[0] == 0)
+            continue;
+        if(frozen->first_data_blk != FAT_EOC)
+            ref_dec(frozen->first_data_blk);
+        if(frozen->hole_blk != 0 && frozen->hole_blk != FAT_EOC)
+            release_chain(frozen->hole_blk);
+    }
+    if(snap_blk != sp->snap_blk)
+        release_chain(snap_blk);
+    flush_refs(); // the reference table goes if the snapshot made it
+}
 
+/* find the snapshot named @name in @table, -1 if none */
+int find_snap(struct SnapEntry * table, const char * name){
+    if(name == NULL)
+        return -1;
+    for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; ++i)
+    {
+        if(table[i].name[0] != 0 && strncmp(table[i].name, name, FS_FILENAME_LEN) == 0)
+            return i;
+    }
+    return -1;
+}
 
 /**
- * fs_open - Open a file
- * @filename: File name
+ * fs_snapshot_create - Take a snapshot of the file system
+ * @name: Name of the snapshot
  *
- * Open file named @filename for reading and writing, and return the
- * corresponding file descriptor. The file descriptor is a non-negative integer
- * that is used subsequently to access the contents of the file. The file offset
- * of the file descriptor is set to 0 initially (beginning of the file). If the
- * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * The root directory is frozen into a data block and every file in it takes
+ * a reference on its first data block, so later writes copy the blocks they
+ * would change, see cursor_unshare(). The FAT needs no copy: the entries of
+ * shared blocks never change. Hole lists are updated in place, so they are
+ * copied. The space needed is checked first, the snapshot is all or nothing.
  *
- * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * Return: -1 if @name is invalid or already taken, if there are already
+ * %FS_SNAPSHOT_MAX_COUNT snapshots, or if the disk runs out of space. 0
+ * otherwise.
  */
-int fs_open(const char *filename)
+int fs_snapshot_create(const char *name)
 {
-    /* TODO: Phase 3 */
-    if(fd_cnt >= FS_OPEN_MAX_COUNT || filename == NULL || strlen(filename) == 0 || strlen(filename) >= FS_FILENAME_LEN) // from TA: neglects to check for empty string
+    if(sp == NULL || read_only) return -1;
+    HOLD_ALL();
+    if(flush_pending() < 0) return -1;
+    if(name == NULL || strlen(name) == 0 || strlen(name) >= FS_FILENAME_LEN)
+        return -1;
+    if(write_meta() < 0) // hole lists on disk before their chains are copied
         return -1;
 
-    direntry_t dir_entry = NULL;
-    int entry_id = get_directory_entry(filename, (void *)&dir_entry);
-    if(entry_id < 0) return -1; // not found or sp, dir == NULL
-    // or if file @filename is currently open. 0 otherwise.
-
-    int fd = get_valid_fd();
-    if(fd < 0) return -1;
-
-    // dir_entry = get_dir(entry_id);
-    // ++(dir_entry->open); // not here
-
-    filedes[fd] = malloc(sizeof(struct FileDescriptor));
-    if(filedes[fd] == NULL) return -1;
-
-    filedes[fd]->file_entry = dir_entry;
-    filedes[fd]->offset = 0;
+    struct SnapEntry table[FS_SNAPSHOT_MAX_COUNT];
+    if(read_snaps(table) < 0 || find_snap(table, name) >= 0)
+        return -1;
+    int slot;
+    for (slot = 0; slot < FS_SNAPSHOT_MAX_COUNT && table[slot].name[0] != 0; ++slot);
+    if(slot == FS_SNAPSHOT_MAX_COUNT){
+        eprintf("fs_snapshot_create: too many snapshots\n");
+        return -1;
+    }
 
-    /*
-    if(fs_lseek(fd, 0) < 0){ // actually unecessary, already set zero // from Bradley: Avoid calling external library functions internally this way, since you have to pay error checking overhead more than once. Better to implement internal calls for purposes such as these.
-        free(filedes[fd]);
+    /* count the blocks first, so the snapshot cannot stop half way */
+    uint32_t need = 1 + (sp->snap_blk == 0);
+    bool shares = false;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        if(root_dir[i].filename[0] == 0)
+            continue;
+        shares |= (root_dir[i].first_data_blk != FAT_EOC);
+        for (uint16_t blk = root_dir[i].hole_blk; blk != 0 && blk != FAT_EOC; blk = fat[blk])
+            ++need;
+    }
+    if(shares && sp->ref_blk == 0)
+        need += size_to_blk(sp->data_blk_count * sizeof(uint16_t));
+    if(sp->data_blk_count - sp->fat_used - held_cnt < need){ // fs_import() may hold some meanwhile
+        eprintf("fs_snapshot_create: no space for the snapshot\n");
         return -1;
     }
+
+    /* nothing on disk points to the blocks taken below before the table is
+     * written, so a failure gives them back and leaves the disk as it was
     */
+    uint16_t snap_blk = sp->snap_blk != 0 ? sp->snap_blk : zero_chain(1);
+    if(snap_blk == FAT_EOC)
+        return -1;
+    if(shares && ref_create() < 0){
+        snap_undo(NULL, 0, snap_blk);
+        return -1;
+    }
 
-    ++(dir_entry->open);
-    dir_entry->unused[0] = 'o';
+    char frozen_buffer[BLOCK_SIZE];
+    direntry_t frozen = (direntry_t)frozen_buffer;
+    memcpy(frozen, root_dir, BLOCK_SIZE);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i, ++frozen)
+    {
+        if(frozen->filename[0] == 0)
+            continue;
+        frozen->open = 0;
+        if(frozen->hole_blk != 0 && frozen->hole_blk != FAT_EOC \
+            && (frozen->hole_blk = copy_chain(frozen->hole_blk)) == FAT_EOC){
+            snap_undo((direntry_t)frozen_buffer, i, snap_blk);
+            return -1;
+        }
+        if(frozen->first_data_blk != FAT_EOC)
+            ref_inc(frozen->first_data_blk);
+    }
+    frozen = (direntry_t)frozen_buffer;
 
-    ++fd_cnt;
+    int32_t temp = get_free_blk_idx();
+    if(temp < 0){
+        snap_undo(frozen, FS_FILE_MAX_COUNT, snap_blk);
+        return -1;
+    }
+    set_fat(temp, FAT_EOC);
+    sp->fat_used += 1;
+
+    strcpy(table[slot].name, name);
+    table[slot].rdir_blk = temp;
+    table[slot].fat_used = sp->fat_used;
+    table[slot].rdir_used = sp->rdir_used;
+    if(block_write(sp->data_blk + temp, frozen_buffer) < 0 || meta_block_write(snap_blk, table) < 0){
+        release_chain(temp);
+        snap_undo(frozen, FS_FILE_MAX_COUNT, snap_blk);
+        return -1;
+    }
+    sp->snap_blk = snap_blk;
 
-    return fd;
+    return write_meta();
 }
 
 /**
- * fs_close - Close a file
- * @fd: File descriptor
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
  *
- * Close file descriptor @fd.
+ * Every file of the snapshot releases its chain like fs_delete(), which
+ * drops a reference or frees the blocks nothing else uses anymore.
  *
- * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * Return: -1 if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name)
+{
+    if(sp == NULL || read_only) return -1;
+    HOLD_ALL();
+
+    struct SnapEntry table[FS_SNAPSHOT_MAX_COUNT];
+    int slot;
+    if(read_snaps(table) < 0 || (slot = find_snap(table, name)) < 0)
+        return -1;
 
+    char frozen_buffer[BLOCK_SIZE];
+    direntry_t frozen = (direntry_t)frozen_buffer;
+    if(meta_block_read(table[slot].rdir_blk, frozen_buffer) < 0)
+        return -1;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i, ++frozen)
+    {
+        if(frozen->filename[0] == 0)
+            continue;
+        if(frozen->first_data_blk != FAT_EOC)
+            release_chain(frozen->first_data_blk);
+        if(frozen->hole_blk != 0)
+            release_chain(frozen->hole_blk);
+    }
+    release_chain(table[slot].rdir_blk);
+    memset(table + slot, 0, sizeof(struct SnapEntry));
+
+    int left = 0;
+    for (int i = 0; i < FS_SNAPSHOT_MAX_COUNT; ++i)
+        left += (table[i].name[0] != 0);
+    if(left == 0){
+        release_chain(sp->snap_blk);
+        sp->snap_blk = 0;
+    }
+    else if(meta_block_write(sp->snap_blk, table) < 0)
+        return -1;
 
- The file descriptor fildes is closed. A closed file descriptor can no longer be used to access the corresponding file. Upon successful completion, a value of 0 is returned. In case the file descriptor fildes does not exist or is not open, the function returns -1.
+    return write_meta();
+}
 
+/**
+ * fs_snapshot_mount - Mount a snapshot read-only
+ * @diskname: Name of the virtual disk file
+ * @name: Name of the snapshot
+ *
+ * Mount like fs_mount(), then replace the root directory and the superblock
+ * counters with the frozen ones. Nothing is written to the disk until
+ * fs_umount(), so a writer may keep using the disk meanwhile.
+ *
+ * Return: -1 if the disk cannot be mounted, or if there is no snapshot named
+ * @name. 0 otherwise.
  */
-int fs_close(int fd)
+int fs_snapshot_mount(const char *diskname, const char *name)
 {
-    /* TODO: Phase 3 */
-    // if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || filedes[fd] == NULL)  return -1;
-    if(!is_valid_fd(fd)) return -1;
-
-    // direntry_t dir_entry = filedes[fd]->file_entry;
-    
-    filedes[fd]->file_entry->open -= 1;
-    filedes[fd]->file_entry->unused[0] = 'x';
+    read_only = true; // before fs_mount(), which writes back otherwise
+    if(fs_mount(diskname) < 0){
+        read_only = false;
+        return -1;
+    }
 
-    free(filedes[fd]);
-    filedes[fd] = NULL;
+    struct SnapEntry table[FS_SNAPSHOT_MAX_COUNT];
+    int slot;
+    if(read_snaps(table) < 0 || (slot = find_snap(table, name)) < 0 \
+        || meta_block_read(table[slot].rdir_blk, root_dir) < 0){
+        eprintf("fs_snapshot_mount: no snapshot %s\n", name);
+        fs_umount();
+        return -1;
+    }
+    sp->fat_used = table[slot].fat_used;
+    sp->rdir_used = table[slot].rdir_used;
 
-    fd_cnt--;
-    
     return 0;
 }
 
-
 /**
- * fs_stat - Get file status
- * @fd: File descriptor
+ * fs_journal_create - Add a metadata journal to the file system
+ * @nblocks: Number of blocks of the journal, header included
  *
- * Get the current size of the file pointed by file descriptor @fd.
+ * The journal is a chain of data blocks like any file, so disks formatted by
+ * fs_make stay usable by the reference implementation as long as they are
+ * unmounted cleanly. It is used from now on and by every later fs_mount().
  *
- * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the current size of file.
+ * Return: -1 if no file system is mounted or it already has a journal, if
+ * @nblocks is lower than 8, or if the disk has not that many free blocks. 0
+ * otherwise.
  */
-int fs_stat(int fd)
+int fs_journal_create(size_t nblocks)
 {
-    /* TODO: Phase 3 */
-    if(!is_valid_fd(fd)) 
+    if(sp == NULL || read_only) return -1;
+    HOLD_ALL();
+    if(sp->journal_blk != 0) return -1;
+    if(nblocks < JOURNAL_MIN_BLKS || nblocks > (size_t)(sp->data_blk_count - sp->fat_used))
         return -1;
 
-    // dir_entry = filedes[fd]->file_entry;
+    uint16_t head = zero_chain(nblocks);
+    if(head == FAT_EOC)
+        return -1;
+    sp->journal_blk = head;
+
+    struct JournalHdr hdr;
+    memset(&hdr, 0, BLOCK_SIZE);
+    memcpy(hdr.signature, JOURNAL_NAME, 8);
+    hdr.seq = 1;
+    hdr.len = nblocks - 1;
+    if(block_write(sp->data_blk + sp->journal_blk, &hdr) < 0 || write_meta() < 0)
+        return -1;
 
-    return filedes[fd]->file_entry->file_sz;
-    // return dir_entry->file_sz;
+    return journal_load();
+}
+
+/**
+ * fs_log_mount - Mount a file system in log-structured write mode
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount like fs_mount(), reserving the write log the first time. Small
+ * overwrites then go to the log and reach their blocks when it is cleaned.
+ *
+ * Return: -1 if the disk cannot be mounted, or if it has no room for the
+ * write log. 0 otherwise.
+ */
+int fs_log_mount(const char *diskname)
+{
+    log_mode = true; // before fs_mount(), which drops the log otherwise
+    if(fs_mount(diskname) < 0){
+        log_mode = false;
+        return -1;
+    }
+    if(lg == NULL && log_create() < 0){
+        fs_umount();
+        return -1;
+    }
+    return 0;
 }
 
+int fs_readonly_mount(const char *diskname)
+{
+    read_only = shared_ro = true; // before fs_mount(), which reads the metadata otherwise
+    if(fs_mount(diskname) < 0){
+        read_only = shared_ro = false;
+        return -1;
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) // reads take no lock from now on
+    {
+        if(root_dir[i].filename[0] != 0 && !holes_ready(root_dir + i)){
+            fs_umount();
+            return -1;
+        }
+    }
+    return 0;
+}
 
 /**
- * fs_lseek - Set file offset
+ * fs_fsync - Write back what is pending for a file descriptor
  * @fd: File descriptor
- * @offset: File offset
  *
- * Set the file offset (used for read and write operations) associated with file
- * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * Flush the write buffer of @fd and the segment of the write log being filled,
+ * then commit the metadata journal, so everything written so far survives a
+ * crash.
  *
- * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open), or if @offset is out of bounds (beyond the end of the file). 0
- * otherwise.
-
+ * Return: -1 if file descriptor @fd is invalid, or if the data cannot be
+ * written. 0 otherwise.
  */
-int fs_lseek(int fd, size_t offset)
+int fs_fsync(int fd)
+{
+    if(!is_valid_fd(fd)) return -1;
+    {
+        HOLD_FILE(get_fd(fd)->file_entry);
+        if(wbuf_flush(fd) < 0)
+            return -1;
+    }
+    HOLD_META();
+    if(log_sync() < 0 || (batch_depth > 0 && write_meta() < 0)) // a batch commits so far
+        return -1;
+    if(jr != NULL && !read_only && journal_commit() < 0)
+        return -1;
+    return 0;
+}
+
+int fs_lock_range(int fd, size_t offset, size_t len, int exclusive)
+{
+    if(!is_valid_fd(fd)) return -1;
+    struct Range * r = malloc(sizeof(struct Range));
+    if(r == NULL)
+        return -1;
+    uint64_t hi = (len == 0 || offset + len < offset) ? RANGE_END : offset + len; // 0 up to the end, however far
+    range_lock(adv_range + (get_fd(fd)->file_entry - root_dir), r, offset, hi, fd, exclusive != 0);
+    return 0;
+}
+
+int fs_unlock_range(int fd, size_t offset, size_t len)
 {
-    /* TODO: Phase 3 */
     if(!is_valid_fd(fd)) return -1;
+    uint64_t hi = (len == 0 || offset + len < offset) ? RANGE_END : offset + len;
+    return range_release(adv_range + (get_fd(fd)->file_entry - root_dir), fd, offset, hi);
+}
 
-    // dir_entry = (struct RootDirEntry *)(filedes[fd]->file_entry);
-    // if(offset > dir_entry->file_sz) return -1;
 
+/******************* Asynchronous I/O *********************/
+/* fs_read_async() and fs_write_async() queue a request and return. A pool of
+ * ASYNC_WORKERS threads, started by the first request and stopped by
+ * fs_umount(), runs them through fs_pread() and fs_pwrite(). A read is cut
+ * into pieces of ASYNC_PIECE bytes which the workers read at once, each one
+ * looked up in the view of the file, so the blocks of the chain are read in
+ * parallel rather than one after the other. A write stays in one piece, a
+ * short write must not leave the bytes after it written. The last piece
+ * done calls the callback of the request, or queues its completion for
+ * fs_async_reap() and signals async_efd. The completion is part of the
+ * request, so a worker never has to allocate to deliver it.
+*/
+#define ASYNC_WORKERS 4
+#define ASYNC_PIECE (16 * BLOCK_SIZE)
+
+struct AsyncReq;
+
+struct AsyncJob {
+    struct AsyncReq *   req;
+    size_t              offset;    // in the request
+    size_t              len;
+    struct AsyncJob *   next;
+};
+
+struct AsyncDone {
+    struct fs_completion    c;
+    struct AsyncDone *      next;
+};
+
+struct AsyncReq {
+    struct AsyncDone    done;      // first, fs_async_reap() frees the request through it
+    int                 fd;
+    bool                write;
+    char *              buf;
+    size_t              offset;    // in the file
+    fs_async_cb         cb;
+    void *              data;
+    int                 left;      // pieces not done yet
+    int                 result;    // bytes done, -1 once a piece failed
+    struct AsyncJob     job[];
+};
+
+pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_more = PTHREAD_COND_INITIALIZER;   // a job was queued, or stop
+pthread_cond_t async_idle = PTHREAD_COND_INITIALIZER;   // a request was done
+struct AsyncJob * async_head = NULL;                     // jobs, first in first out
+struct AsyncJob * async_tail = NULL;
+struct AsyncDone * done_head = NULL;                     // completions without callback
+struct AsyncDone * done_tail = NULL;
+pthread_t async_tid[ASYNC_WORKERS];
+int async_cnt = 0;                                       // workers running
+bool async_run = false;
+uint32_t async_busy = 0;                                 // requests queued or running
+int async_efd = -1;
+
+/* @req is done: call it back, or queue its completion, which needs no memory
+ * the request itself waits in the queue until fs_async_reap() frees it
+*/
+void async_done(struct AsyncReq * req){
+    if(req->cb != NULL){
+        req->cb(req->fd, req->result, req->data);
+        free(req);
+    }
+    else{
+        struct AsyncDone * d = &req->done;
+        d->c.fd = req->fd;
+        d->c.result = req->result;
+        d->c.data = req->data;
+        d->next = NULL;
+        uint64_t one = 1;
+        pthread_mutex_lock(&async_lock);
+        if(done_tail == NULL)
+            done_head = d;
+        else
+            done_tail->next = d;
+        done_tail = d;
+        if(write(async_efd, &one, sizeof(one)) < 0) // one count per completion queued
+            eprintf("async_done: eventfd\n");
+        pthread_mutex_unlock(&async_lock);
+    }
+    pthread_mutex_lock(&async_lock);
+    --async_busy;
+    pthread_cond_broadcast(&async_idle);
+    pthread_mutex_unlock(&async_lock);
+}
+
+void * async_worker(void * arg){
+    pthread_mutex_lock(&async_lock);
+    for (;;)
+    {
+        while(async_head == NULL && async_run)
+            pthread_cond_wait(&async_more, &async_lock);
+        struct AsyncJob * j = async_head;
+        if(j == NULL) // stopped
+            break;
+        async_head = j->next;
+        if(async_head == NULL)
+            async_tail = NULL;
+        pthread_mutex_unlock(&async_lock);
+
+        struct AsyncReq * req = j->req;
+        int n = req->write ? fs_pwrite(req->fd, req->buf + j->offset, j->len, req->offset + j->offset) \
+            : fs_pread(req->fd, req->buf + j->offset, j->len, req->offset + j->offset);
+        if(n < 0)
+            __atomic_store_n(&req->result, -1, __ATOMIC_SEQ_CST);
+        else{
+            int r = __atomic_load_n(&req->result, __ATOMIC_SEQ_CST);
+            while(r >= 0 && !__atomic_compare_exchange_n(&req->result, &r, r + n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                ;
+        }
+        if(__atomic_sub_fetch(&req->left, 1, __ATOMIC_ACQ_REL) == 0)
+            async_done(req);
+
+        pthread_mutex_lock(&async_lock);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
+}
+
+/* start the workers and the completion queue, the caller holds async_lock
+ * return -1 if not even one worker can be created
+*/
+int async_start(){
+    if(async_efd < 0 && (async_efd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC)) < 0)
+        return -1;
+    async_run = true;
+    while(async_cnt < ASYNC_WORKERS && pthread_create(async_tid + async_cnt, NULL, async_worker, NULL) == 0)
+        ++async_cnt;
+    return async_cnt > 0 ? 0 : -1;
+}
+
+/* wait for the requests in flight, then stop the workers */
+void async_stop(){
+    pthread_mutex_lock(&async_lock);
+    while(async_busy > 0)
+        pthread_cond_wait(&async_idle, &async_lock);
+    async_run = false;
+    pthread_cond_broadcast(&async_more);
+    pthread_t tid[ASYNC_WORKERS]; // a request right after may start new ones
+    int cnt = async_cnt;
+    memcpy(tid, async_tid, sizeof(tid));
+    async_cnt = 0;
+    pthread_mutex_unlock(&async_lock);
+    for (int i = 0; i < cnt; ++i)
+        pthread_join(tid[i], NULL);
+}
+
+/* queue @count bytes at @offset of @fd, cut in pieces of @piece bytes */
+int async_submit(int fd, bool write, void * buf, size_t count, size_t offset, size_t piece, fs_async_cb cb, void * data){
+    if(!is_valid_fd(fd) || count > INT_MAX || (write && read_only))
+        return -1;
+    int njob = count ? (count + piece - 1) / piece : 1;
+    struct AsyncReq * req = malloc(sizeof(struct AsyncReq) + njob * sizeof(struct AsyncJob));
+    if(req == NULL)
+        return -1;
+    req->fd = fd;
+    req->write = write;
+    req->buf = buf;
+    req->offset = offset;
+    req->cb = cb;
+    req->data = data;
+    req->left = njob;
+    req->result = 0;
+    for (int i = 0; i < njob; ++i)
+    {
+        req->job[i].req = req;
+        req->job[i].offset = i * piece;
+        req->job[i].len = clamp(piece, count - i * piece);
+        req->job[i].next = (i + 1 < njob) ? req->job + i + 1 : NULL;
+    }
+
+    pthread_mutex_lock(&async_lock);
+    if(async_start() < 0){
+        pthread_mutex_unlock(&async_lock);
+        free(req);
+        return -1;
+    }
+    if(async_tail == NULL)
+        async_head = req->job;
+    else
+        async_tail->next = req->job;
+    async_tail = req->job + njob - 1;
+    ++async_busy;
+    pthread_cond_broadcast(&async_more);
+    pthread_mutex_unlock(&async_lock);
+    return 0;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, size_t offset, fs_async_cb cb, void *data)
+{
+    return async_submit(fd, false, buf, count, offset, ASYNC_PIECE, cb, data);
+}
+
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset, fs_async_cb cb, void *data)
+{
+    if(offset > FILE_SZ_MAX) return -1;
+    return async_submit(fd, true, (void *)buf, count, offset, pickmax(count, 1), cb, data);
+}
+
+int fs_async_fd(void)
+{
+    pthread_mutex_lock(&async_lock);
+    if(async_efd < 0)
+        async_efd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE | EFD_CLOEXEC);
+    pthread_mutex_unlock(&async_lock);
+    return async_efd;
+}
 
-    if(offset > filedes[fd]->file_entry->file_sz) return -1;
+int fs_async_reap(struct fs_completion *c, int max)
+{
+    if(c == NULL || max < 0) return -1;
+    int n = 0;
+    pthread_mutex_lock(&async_lock);
+    while(n < max && done_head != NULL){
+        struct AsyncDone * d = done_head;
+        uint64_t one;
+        if(read(async_efd, &one, sizeof(one)) < 0)
+            break;
+        done_head = d->next;
+        if(done_head == NULL)
+            done_tail = NULL;
+        c[n++] = d->c;
+        free(d); // the request it is part of
+    }
+    pthread_mutex_unlock(&async_lock);
+    return n;
+}
 
-    filedes[fd]->offset = offset;
+/******************* Parallel Reads *********************/
+/* A large fs_read() or fs_pread() is fanned out. The view of the file already
+ * resolves its chain into the data block of each logical block, so the range
+ * is cut into pieces of PAR_PIECE bytes which the caller and up to
+ * par_want - 1 threads of a pool read at once, straight into the buffer of
+ * the caller. Without lock the read is checked as in view_readv(): after a
+ * writer it is done again, under the lock shared, where the pieces are read
+ * in parallel as well.
+*/
+#define PAR_MAX_WORKERS 16
+#define PAR_PIECE (64 * BLOCK_SIZE)
+#define PAR_MIN (4 * PAR_PIECE)           // smaller reads stay serial
+
+struct ParRead {
+    struct FileView *   v;
+    char *              buf;
+    size_t              offset;           // in the file
+    size_t              count;
+    uint32_t            npiece;
+    uint32_t            next;             // next piece to take
+    int                 active;           // helpers inside, under par_lock
+    int                 cap;              // helpers allowed in
+    int                 err;
+    struct ParRead *    link;
+};
 
+pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t par_more = PTHREAD_COND_INITIALIZER;    // a read was queued, or stop
+pthread_cond_t par_out = PTHREAD_COND_INITIALIZER;     // a helper left a read
+struct ParRead * par_head = NULL;                       // reads still taking helpers
+pthread_t par_tid[PAR_MAX_WORKERS - 1];
+int par_cnt = 0;                                        // helpers running
+bool par_run = false;
+int par_want = 4;                                       // threads per read, the caller included
+
+/* read piece @i of @r, which begins at the PAR_PIECE boundary */
+int par_piece(struct ParRead * r, uint32_t i){
+    size_t pos = pickmax(r->offset, (r->offset / PAR_PIECE + i) * PAR_PIECE);
+    size_t end = clamp((r->offset / PAR_PIECE + i + 1) * PAR_PIECE, r->offset + r->count);
+    char bounce_buffer[BLOCK_SIZE];
+    while(pos < end){
+        size_t blk_off = pos % BLOCK_SIZE;
+        size_t n = clamp(BLOCK_SIZE - blk_off, end - pos);
+        uint16_t blk = r->v->blk[pos / BLOCK_SIZE];
+        char * dst = r->buf + (pos - r->offset);
+
+        if(blk == FAT_EOC) // a hole reads back as zeros
+            memset(dst, 0, n);
+        else if(n == BLOCK_SIZE){
+            if(block_read(blk + sp->data_blk, dst) < 0)
+                return -1;
+        }
+        else{
+            if(block_read(blk + sp->data_blk, bounce_buffer) < 0)
+                return -1;
+            memcpy(dst, bounce_buffer + blk_off, n);
+        }
+        pos += n;
+    }
     return 0;
 }
 
+/* take pieces of @r until none is left */
+void par_work(struct ParRead * r){
+    uint32_t i;
+    while((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->npiece)
+        if(par_piece(r, i) < 0)
+            __atomic_store_n(&r->err, 1, __ATOMIC_RELAXED);
+}
 
-// int fs_write(int fd, void *buf, size_t count)
-uint16_t get_offset_blk(int fd, size_t offset){
-    if(!is_valid_fd(fd)){
-        return 0; // impossible
+void * par_worker(void * arg){
+    pthread_mutex_lock(&par_lock);
+    for (;;)
+    {
+        struct ParRead * r = par_head;
+        while(r != NULL && (r->active >= r->cap || __atomic_load_n(&r->next, __ATOMIC_RELAXED) >= r->npiece))
+            r = r->link;
+        if(r == NULL){
+            if(!par_run)
+                break;
+            pthread_cond_wait(&par_more, &par_lock);
+            continue;
+        }
+        ++r->active;
+        pthread_mutex_unlock(&par_lock);
+        par_work(r);
+        pthread_mutex_lock(&par_lock);
+        if(--r->active == 0) // the caller may be waiting to return
+            pthread_cond_broadcast(&par_out);
     }
+    pthread_mutex_unlock(&par_lock);
+    return NULL;
+}
 
-    // dir_entry = filedes[fd]->file_entry;
-    // if(offset == 0) return dir_entry->first_data_blk;
-    if(offset >= filedes[fd]->file_entry->file_sz){
-        // eprintf("get_offset_blk fail: offset is larger than file size\n");
-        return 0;
-    }
-    
-    int no_blk = file_blk_count(offset);
-    uint16_t blk = filedes[fd]->file_entry->first_data_blk;
-    while(no_blk > 1){ // need some error check
-        blk = *(get_fat(blk)); //impossible NULL pointer
-        no_blk -= 1;
+/* stop the helpers, at unmount when no read is left */
+void par_stop(){
+    pthread_mutex_lock(&par_lock);
+    par_run = false;
+    pthread_cond_broadcast(&par_more);
+    pthread_t tid[PAR_MAX_WORKERS - 1];
+    int cnt = par_cnt;
+    memcpy(tid, par_tid, sizeof(tid));
+    par_cnt = 0;
+    pthread_mutex_unlock(&par_lock);
+    for (int i = 0; i < cnt; ++i)
+        pthread_join(tid[i], NULL);
+}
+
+/* read @count bytes at @offset through the view @v into @buf with @want threads
+ * the caller keeps @v alive, return the number of bytes read, -1 on disk error
+*/
+int par_readv(struct FileView * v, size_t offset, void * buf, size_t count, int want){
+    size_t real_count = offset >= v->size ? 0 : clamp(v->size - offset, count);
+    struct ParRead r = {
+        .v = v, .buf = buf, .offset = offset, .count = real_count,
+        .npiece = real_count ? (offset + real_count - 1) / PAR_PIECE - offset / PAR_PIECE + 1 : 0,
+        .cap = want - 1,
+    };
+    pthread_mutex_lock(&par_lock);
+    par_run = true;
+    while(par_cnt < want - 1 && pthread_create(par_tid + par_cnt, NULL, par_worker, NULL) == 0)
+        ++par_cnt;
+    r.link = par_head;
+    par_head = &r;
+    pthread_cond_broadcast(&par_more);
+    pthread_mutex_unlock(&par_lock);
+
+    par_work(&r);
+
+    pthread_mutex_lock(&par_lock);
+    struct ParRead ** p = &par_head;
+    while(*p != &r)
+        p = &(*p)->link;
+    *p = r.link;
+    while(r.active > 0)
+        pthread_cond_wait(&par_out, &par_lock);
+    pthread_mutex_unlock(&par_lock);
+    return r.err ? -1 : (int)real_count;
+}
+
+/* fd_readv_rcu() of one buffer, fanned out once it is large enough */
+int fd_read_par(int fd, size_t offset, void * buf, size_t count){
+    struct iovec iov = { buf, count };
+    int want = __atomic_load_n(&par_want, __ATOMIC_RELAXED);
+    if(count < PAR_MIN || want <= 1 || shared_ro)
+        return fd_readv_rcu(fd, offset, &iov, 1);
+
+    direntry_t entry = get_fd(fd)->file_entry;
+    int idx = entry - root_dir;
+    uint32_t seq = __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST);
+    if(seq % 2 == 0 && __atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) == 0 \
+        && __atomic_load_n(file_wr + idx, __ATOMIC_SEQ_CST) == 0 && rcu_enter()){
+        struct FileView * v = __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE);
+        int real_count = v ? par_readv(v, offset, buf, count, want) : -2;
+        rcu_exit();
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(real_count != -2 && __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST) == seq)
+            return real_count;
     }
 
-    return blk; 
+    HOLD_FILE_READ(h, entry, offset, count);
+    if(h.l == NULL) return -1;
+    view_build(entry);
+    struct FileView * v = __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE);
+    if(v == NULL) // log mode, or out of memory
+        return fd_readv(fd, offset, &iov, 1);
+    return par_readv(v, offset, buf, count, want);
 }
 
+int fs_read_workers(int workers)
+{
+    if(workers < 1 || workers > PAR_MAX_WORKERS) return -1;
+    return __atomic_exchange_n(&par_want, workers, __ATOMIC_RELAXED);
+}
 
+/******************* Mapped Views *********************/
+/* fs_mmap() maps the data blocks of a file from the image itself, opened a
+ * second time by the first call, see image_fd(). The length is reserved first,
+ * then each run of consecutive blocks is mapped over it at its place
+ * (MAP_FIXED) and each hole as anonymous zeros: a file in one run is one
+ * mapping, a fragmented one is stitched from several. In log mode the latest
+ * bytes may be in the log, there the view is a copy, as it is when the pages
+ * are larger than a block or mapping fails.
+*/
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+int image_desc = -1;               // the image, opened again by image_fd()
 
-/**
- * fs_write - Write to a file
- * @fd: File descriptor
- * @buf: Data buffer to write in the file
- * @count: Number of bytes of data to be written
- *
- * Attempt to write @count bytes of data from buffer pointer by @buf into the
- * file referenced by file descriptor @fd. It is assumed that @buf holds at
- * least @count bytes.
- *
- * When the function attempts to write past the end of the file, the file is
- * automatically extended to hold the additional bytes. If the underlying disk
- * runs out of space while performing a write operation, fs_write() should write
- * as many bytes as possible. The number of written bytes can therefore be
- * smaller than @count (it can even be 0 if there is no more space on disk).
- *
- * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+/* a descriptor of the image of our own, for what disk.c does not do: mapping
+ * and moving data in the kernel. Read-only if the image cannot be written, or
+ * must not be.
+*/
+int image_fd(){
+    pthread_mutex_lock(&image_lock);
+    if(image_desc < 0 && !shared_ro)
+        image_desc = open(disk, O_RDWR | O_CLOEXEC);
+    if(image_desc < 0)
+        image_desc = open(disk, O_RDONLY | O_CLOEXEC);
+    int img = image_desc;
+    pthread_mutex_unlock(&image_lock);
+    return img;
+}
 
- √ calculate the real count written
- √ set up the FAT index (should after written success )
- √ write the content
- √ update file entry(should after written success)
- */
-int fs_write(int fd, void *buf, size_t count)
-{
-    if(!is_valid_fd(fd)) return -1;
+/* at unmount, the views mapped stay valid */
+void image_close(){
+    pthread_mutex_lock(&image_lock);
+    if(image_desc >= 0)
+        close(image_desc);
+    image_desc = -1;
+    pthread_mutex_unlock(&image_lock);
+}
 
-    direntry_t w_dir_entry = filedes[fd]->file_entry;
-    if(w_dir_entry->unused[0] == 'w'){ // from Bradley: Really should not be making your operations dependent on parts of the data in the padding regions.
-        eprintf("other writing continues, unable to write\n");
+/* map the blocks of @entry from logical block @first over the @nblk blocks at @base
+ * return -1 if one run cannot be mapped
+*/
+int map_runs(direntry_t entry, uint32_t first, uint32_t nblk, char * base, int prot, int flags){
+    int img = image_fd();
+    if(img < 0 || !holes_ready(entry))
         return -1;
-    }
-    if(count == 0) return 0;
-
-    size_t offset = filedes[fd]->offset;
-    // if(offset > w_dir_entry->file_sz) // impossible here
-    //     return -1;
 
-    /* start to write */
-    uint16_t * fat16;
-    w_dir_entry->unused[0] = 'w';
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, first);
+    uint32_t i = 0;
+    while(i < nblk){
+        bool data = cursor_has_data(&cur);
+        uint16_t blk = cur.blk;
+        uint32_t n = 1;
+        for (cursor_next(&cur); i + n < nblk; ++n, cursor_next(&cur))
+            if(cursor_has_data(&cur) != data || (data && cur.blk != blk + n))
+                break;
+        void * at = base + (size_t)i * BLOCK_SIZE;
+        void * p = data ? mmap(at, (size_t)n * BLOCK_SIZE, prot, flags | MAP_FIXED, img, (off_t)(sp->data_blk + blk) * BLOCK_SIZE) \
+            : mmap(at, (size_t)n * BLOCK_SIZE, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if(p == MAP_FAILED)
+            return -1;
+        i += n;
+    }
+    return 0;
+}
 
-    if( w_dir_entry->first_data_blk == FAT_EOC){ // if empty file, no blk assign; we allocate a new block
-        int32_t temp = get_free_blk_idx();
-        if(temp < 0) return 0;
+void *fs_mmap(int fd, size_t offset, size_t len, int flags)
+{
+    if(!is_valid_fd(fd) || len == 0 || (flags & ~FS_MAP_PRIVATE)) return NULL;
+
+    direntry_t entry = get_fd(fd)->file_entry;
+    HOLD_FILE_READ(h, entry, offset, len); // flushed, and the chain stays put meanwhile
+    if(h.l == NULL || entry->zip || offset > entry->file_sz || len > entry->file_sz - offset) return NULL;
+
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t nblk = (offset + len - 1) / BLOCK_SIZE - first + 1;
+    size_t map_len = (size_t)nblk * BLOCK_SIZE;
+    int prot = PROT_READ | ((flags & FS_MAP_PRIVATE) ? PROT_WRITE : 0);
+    char * base = mmap(NULL, map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return NULL;
 
-        w_dir_entry->first_data_blk = (uint16_t)temp;
-        w_dir_entry->last_data_blk = (uint16_t)temp;
-        fat16 = get_fat(w_dir_entry->first_data_blk);
-        *fat16 = 0xFFFF;
-        sp->fat_used += 1; // !!!!
+    if(lg != NULL || BLOCK_SIZE % sysconf(_SC_PAGESIZE) != 0 \
+        || map_runs(entry, first, nblk, base, prot, (flags & FS_MAP_PRIVATE) ? MAP_PRIVATE : MAP_SHARED) < 0){
+        // a copy in place of the reservation
+        struct iovec v = { base + offset % BLOCK_SIZE, len };
+        if(mmap(base, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED \
+            || fd_readv(fd, offset, &v, 1) != (int)len || mprotect(base, map_len, prot) < 0){
+            munmap(base, map_len);
+            return NULL;
+        }
     }
+    return base + offset % BLOCK_SIZE;
+}
+
+int fs_munmap(void *addr, size_t len)
+{
+    if(addr == NULL || len == 0) return -1;
+    size_t delta = (uintptr_t)addr % BLOCK_SIZE; // the view began on a block
+    return munmap((char *)addr - delta, (delta + len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+}
 
-    size_t real_count = count;
-    int32_t leftover_count = real_count;
-    uint16_t write_blk;
-    // size_t expand = 0;
-    // uint16_t new_blk[8192];
+/******************* Host Transfers *********************/
+/* fs_import() and fs_export() move a whole file between a host descriptor and
+ * the image without the bytes going through a buffer of ours, a run of
+ * consecutive data blocks at a time: copy_file_range() between two files,
+ * splice() when one side is a pipe, and only then a bounce buffer. An
+ * imported file is written into held blocks first, then linked to a new entry
+ * with one metadata commit, so a crash leaves either all of it or nothing.
+*/
 
-    /* get the first block written to */
-    if(offset == 0){
-        write_blk = w_dir_entry->first_data_blk;
+/* write @n bytes of @buf to @out, at *@out_off and after it, or at its file offset for NULL */
+int host_write(int out, off_t * out_off, const char * buf, size_t n){
+    while(n > 0){
+        ssize_t w = out_off ? pwrite(out, buf, n, *out_off) : write(out, buf, n);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            return -1;
+        if(out_off)
+            *out_off += w;
+        buf += w;
+        n -= w;
     }
-    else if(offset == w_dir_entry->file_sz){ // for appending 
-        int32_t temp = get_free_blk_idx();
+    return 0;
+}
 
-        if(temp < 0) {
-            w_dir_entry->unused[0] = 'n';
-            return 0; // no block available
+/* move @len bytes from @in to @out, at the offsets given and after them, or at
+ * their file offsets for NULL, in the kernel when it can
+ * return -1 if it fails or @in ends before @len bytes
+*/
+int host_move(int in, off_t * in_off, int out, off_t * out_off, size_t len){
+    char bounce_buffer[BLOCK_SIZE];
+    int how = 0; // copy_file_range(), splice(), then the bounce buffer
+    while(len > 0){
+        ssize_t n;
+        if(how == 0)
+            n = copy_file_range(in, in_off, out, out_off, len, 0);
+        else if(how == 1)
+            n = splice(in, in_off, out, out_off, len, 0);
+        else{
+            size_t want = clamp(BLOCK_SIZE, len);
+            n = in_off ? pread(in, bounce_buffer, want, *in_off) : read(in, bounce_buffer, want);
+            if(n > 0){
+                if(in_off)
+                    *in_off += n;
+                if(host_write(out, out_off, bounce_buffer, n) < 0)
+                    return -1;
+            }
+        }
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && how < 2 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS \
+            || errno == EOPNOTSUPP || errno == EBADF)){ // not between these descriptors
+            ++how;
+            continue;
         }
+        if(n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
 
-        write_blk = (uint16_t) temp;
-        // new_blk[expand++] = write_blk;
+/* write logical blocks [@from, @to) of a host file of @size bytes, @host_fd,
+ * into its data blocks @blk, zeros after the end in the last one
+*/
+int import_data(int host_fd, const uint16_t * blk, uint32_t from, uint32_t to, size_t size){
+    int img = image_fd();
+    if(img < 0)
+        return -1;
+    off_t hoff = (off_t)from * BLOCK_SIZE;
+    uint32_t full = clamp(to, size / BLOCK_SIZE);
+    for (uint32_t i = from, n; i < full; i += n)
+    {
+        for (n = 1; i + n < full && blk[i + n] == blk[i] + n; ++n)
+            ;
+        off_t ioff = (off_t)(sp->data_blk + blk[i]) * BLOCK_SIZE;
+        if(host_move(host_fd, &hoff, img, &ioff, (size_t)n * BLOCK_SIZE) < 0)
+            return -1;
     }
-    else {
-        write_blk = get_offset_blk(fd, offset);
+    if(full < to){ // the partial last block
+        char bounce_buffer[BLOCK_SIZE];
+        memset(bounce_buffer, 0, BLOCK_SIZE);
+        size_t n = size % BLOCK_SIZE;
+        if(pread(host_fd, bounce_buffer, n, hoff) != (ssize_t)n \
+            || block_write(sp->data_blk + blk[full], bounce_buffer) < 0)
+            return -1;
     }
+    return 0;
+}
 
-    /* write the first block */
-    char bounce_buffer[BLOCK_SIZE]; // save free 
-    memset(bounce_buffer, 0, BLOCK_SIZE);
-    // void * bounce_buffer = calloc(BLOCK_SIZE, 1); // from Bradley: If you only need the memory for the duration of a function and know the size beforehand, allocating on the stack may be better because you avoid the overhead of needing to request memory from the system and marking it used.
-    int buf_idx = 0;
-    if(block_read(write_blk + sp->data_blk, bounce_buffer) < 0 ){ // from Bradley, Should not always have to read.
-        // free(bounce_buffer);
-        w_dir_entry->unused[0] = 'n';
-        return 0;
+/* make the held data blocks @blk the chain of the new file @entry of @size bytes
+ * the caller holds meta_lock
+*/
+void import_link(direntry_t entry, const uint16_t * blk, uint32_t nblk, size_t size){
+    range_unhold(blk, nblk);
+    for (uint32_t i = 0; i < nblk; ++i)
+        set_fat(blk[i], i + 1 < nblk ? blk[i + 1] : FAT_EOC);
+    sp->fat_used += nblk;
+    if(nblk > 0){
+        entry->first_data_blk = blk[0];
+        entry->last_data_blk = blk[nblk - 1];
     }
+    entry->file_sz = size;
+}
 
-    // buf_idx = clamp(BLOCK_SIZE - w_dir_entry->file_sz % BLOCK_SIZE, leftover_count);
-    buf_idx = clamp(BLOCK_SIZE - offset % BLOCK_SIZE, leftover_count);
-    // memcpy(bounce_buffer + w_dir_entry->file_sz % BLOCK_SIZE, buf, buf_idx);
-    memcpy(bounce_buffer + offset % BLOCK_SIZE, buf, buf_idx);
-    
-    if(block_write(sp->data_blk + write_blk, bounce_buffer) < 0){
-        w_dir_entry->unused[0] = 'n';
-        // free(bounce_buffer);
-        return 0;
-    } // write the first blk
-
-    leftover_count -= buf_idx;
-    fat16 = get_fat(write_blk);
-    if(*fat16 == 0){
-        *fat16 = FAT_EOC;
-        sp->fat_used += 1;
+/* write @n zeros to @out, for a hole */
+int host_zeros(int out, size_t n){
+    char zero_buffer[BLOCK_SIZE];
+    memset(zero_buffer, 0, BLOCK_SIZE);
+    for (size_t k; n > 0; n -= k)
+    {
+        k = clamp(BLOCK_SIZE, n);
+        if(host_write(out, NULL, zero_buffer, k) < 0)
+            return -1;
     }
-    offset += buf_idx;
+    return 0;
+}
 
-    /* write the left-over data 
-     * if it's the last hold data block
-     * update filesize
-    */
-    while(leftover_count > 0){
-        if(*fat16 != FAT_EOC){ // write directly
-            write_blk = *fat16;
-            if(leftover_count > BLOCK_SIZE){ // block_write directly
-                if(block_write(sp->data_blk + write_blk, buf+buf_idx) < 0){
-                    w_dir_entry->unused[0] = 'n';
-                    // free(bounce_buffer);
-                    break;
-                }
-                buf_idx += BLOCK_SIZE;
-                leftover_count -= BLOCK_SIZE;
-                offset += BLOCK_SIZE;
-            }
-            else{
-                if(block_read(write_blk + sp->data_blk, bounce_buffer) < 0 ){
-                    // free(bounce_buffer);
-                    w_dir_entry->unused[0] = 'n';
-                    break;
-                }
-                memcpy(bounce_buffer, buf + buf_idx, leftover_count);
-                if(block_write(sp->data_blk + write_blk, buf+buf_idx) < 0){
-                    w_dir_entry->unused[0] = 'n';
-                    // free(bounce_buffer);
-                    break;
-                }
-                offset += leftover_count;
-                leftover_count = 0;
+/* copy the @size bytes of @entry to @host_fd, the caller holds its file_lock */
+int export_data(direntry_t entry, int host_fd, size_t size){
+    int img = image_fd();
+    if(img < 0 || !holes_ready(entry))
+        return -1;
+    if(lg != NULL || entry->zip){ // the latest bytes may be in the log, or have to be decompressed
+        char * buf = malloc(16 * BLOCK_SIZE);
+        size_t pos = 0;
+        while(buf != NULL && pos < size){
+            struct iovec v = { buf, clamp(16 * BLOCK_SIZE, size - pos) };
+            if(entry_readv(entry, pos, &v, 1) != (int)v.iov_len || host_write(host_fd, NULL, buf, v.iov_len) < 0)
                 break;
-            }
+            pos += v.iov_len;
         }
-        else{ // find the next valid block to write
-            int32_t temp = get_free_blk_idx();
-            if(temp < 0) {
-                w_dir_entry->unused[0] = 'n';
-                eprintf("fs_write: no block any more\n");
-                break; // no block available
-            }
-            write_blk = (uint16_t) temp;
-
-            if(leftover_count > BLOCK_SIZE){
-                if(block_write(sp->data_blk + write_blk, buf+buf_idx) < 0){
-                    w_dir_entry->unused[0] = 'n';
-                    // free(bounce_buffer);
-                    break;
-                }
-                buf_idx += BLOCK_SIZE;
-                leftover_count -= BLOCK_SIZE;
-                offset += BLOCK_SIZE;
-            }
-            else {
-                memset(bounce_buffer, 0, BLOCK_SIZE);
-                memcpy(bounce_buffer, buf + buf_idx, leftover_count);
-                if(block_write(write_blk + sp->data_blk, bounce_buffer) < 0 ){
-                    // free(bounce_buffer);
-                    w_dir_entry->unused[0] = 'n';
-                    break;
-                }
+        free(buf);
+        return pos == size ? 0 : -1;
+    }
 
-                offset += leftover_count;
-                leftover_count = 0;
-            }
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, 0);
+    for (size_t pos = 0, n; pos < size; pos += n)
+    {
+        bool data = cursor_has_data(&cur);
+        uint16_t blk = cur.blk;
+        for (n = 1, cursor_next(&cur); pos + n * BLOCK_SIZE < size; ++n, cursor_next(&cur))
+            if(cursor_has_data(&cur) != data || (data && cur.blk != blk + n))
+                break;
+        n = clamp(n * BLOCK_SIZE, size - pos);
+        off_t ioff = (off_t)(sp->data_blk + blk) * BLOCK_SIZE;
+        if((data ? host_move(img, &ioff, host_fd, NULL, n) : host_zeros(host_fd, n)) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-            *fat16 = write_blk; // at last update fat_used 
-            fat16 = get_fat(write_blk);
-            *fat16 = FAT_EOC;
-            sp->fat_used += 1;            
-        }
-        fat16 = get_fat(write_blk);
+/* hold @n free data blocks into @blk, consecutive ones if the disk has a run
+ * that long (first fit), see range_hold()
+ * return -1 if the disk does not have them, none is held then
+*/
+int hold_run(uint16_t * blk, uint32_t n){
+    if(n == 0)
+        return 0;
+    HOLD_META();
+    if(fat_held == NULL && (fat_held = calloc(sp->data_blk_count, 1)) == NULL)
+        return -1;
+    uint32_t i = pickmax(fat_hint, 1), run = 0;
+    for (; i < sp->data_blk_count && run < n; ++i)
+        run = (fat[i] == 0 && !(jr && jr->freed[i]) && !fat_held[i]) ? run + 1 : 0;
+    if(run < n) // scattered then
+        return range_hold(blk, n);
+    for (uint32_t k = 0; k < n; ++k)
+    {
+        blk[k] = i - n + k;
+        fat_held[blk[k]] = 1;
     }
-    /* first version
-    while(leftover_count > 0){
-        // get the next written block
-        if(expand > 0){
-            int32_t temp = get_free_blk_idx();
-            if(temp < 0) 
-                break; // no more block
-            write_blk = (uint16_t) temp;
-            new_blk[expand++] = write_blk;
-        }
-        else{ // 不用找新的，但是可能解下来需要找新的
-            write_blk = *(get_fat(write_blk));
-            if(write_blk == 0xFFFF){
-                int32_t temp = get_free_blk_idx();
-                if(temp < 0) 
-                    break; // no more block
-                write_blk = (uint16_t) temp;
-                new_blk[expand++] = write_blk;
-            }
-        }
-        //write
-        if(leftover_count >= BLOCK_SIZE){
-            if(block_write(sp->data_blk + write_blk, buf + buf_idx) < 0){
-                w_dir_entry->unused[0] = 'n';
-                free(bounce_buffer);
-                return 0;
-            }
-            buf_idx += BLOCK_SIZE;
+    held_cnt += n;
+    return 0;
+}
 
-        }
-        else{
-            if(block_read(write_blk + sp->data_blk, bounce_buffer) < 0 ){
-                free(bounce_buffer);
-                w_dir_entry->unused[0] = 'n';
-                return 0;
-            }
-            memcpy(bounce_buffer, buf + buf_idx, leftover_count);
-            if(block_write(sp->data_blk + write_blk, bounce_buffer) < 0){
-                free(bounce_buffer);
-                w_dir_entry->unused[0] = 'n';
-                return 0;
-            }
-        }
-        leftover_count -= BLOCK_SIZE;
-    } // while end
-     
-    
-    //update the metadata
-    if(leftover_count > 0) {
-        real_count -= leftover_count;
-    }
-    if(real_count + offset > w_dir_entry->file_sz)
-        w_dir_entry->file_sz = real_count + offset; 
-    // else if(w_dir_entry->file_sz == 0){
-    //     w_dir_entry->file_sz = real_count;
-    // }
-    fat16 = get_fat(w_dir_entry->last_data_blk);
-    size_t i = 0;
-    sp->fat_used += expand;
-    while(expand > 0){
-        *fat16 = new_blk[i];
-        fat16 = get_fat(new_blk[i]);
-        w_dir_entry->last_data_blk = new_blk[i];
+int fs_import(int host_fd, const char *filename)
+{
+    struct stat st;
+    if(sp == NULL || read_only || filename == NULL || strlen(filename) == 0 \
+        || strlen(filename) >= FS_FILENAME_LEN || fstat(host_fd, &st) < 0 \
+        || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > INT_MAX) return -1;
+
+    uint32_t nblk = size_to_blk(st.st_size);
+    uint16_t * blk = malloc(pickmax(nblk, 1) * sizeof(uint16_t));
+    if(blk == NULL)
+        return -1;
+    if(hold_run(blk, nblk) < 0){
+        free(blk);
+        return -1;
+    }
+    if(import_data(host_fd, blk, 0, nblk, st.st_size) < 0){
+        range_unhold(blk, nblk);
+        free(blk);
+        return -1;
+    }
 
-        i += 1;
-        expand -= 1;
+    HOLD_DIR();
+    HOLD_META();
+    direntry_t entry = new_entry(filename);
+    if(entry == NULL){
+        range_unhold(blk, nblk);
+        free(blk);
+        return -1;
     }
-    *fat16 = 0xFFFF;
-    */
-    real_count -= leftover_count;
-    w_dir_entry->file_sz = pickmax(filedes[fd]->offset + real_count, w_dir_entry->file_sz); //should not use offset
-    filedes[fd]->offset = offset;
+    import_link(entry, blk, nblk, st.st_size);
+    free(blk);
 
-    write_meta();
-    w_dir_entry->unused[0] = 'n';
-    // if(bounce_buffer) free(bounce_buffer);
-    
-    return real_count;
+    dir_publish();
+    if(write_meta() < 0)
+        return -1;
+    return st.st_size;
 }
 
+int fs_export(const char *filename, int host_fd)
+{
+    if(sp == NULL || filename == NULL) return -1;
+    int idx = pin_entry(filename); // kept from removal, without a descriptor
+    if(idx < 0) return -1;
+    direntry_t entry = get_dir(idx);
+    int ret = -1;
+    {
+        HOLD_FILE_READ(h, entry, 0, UINT32_MAX);
+        if(h.l != NULL && entry_size(entry) <= INT_MAX && export_data(entry, host_fd, entry_size(entry)) == 0)
+            ret = entry_size(entry);
+    }
+    unpin_entry(idx);
+    return ret;
+}
 
-/* fs_write version 1.0, without offset, work
+/******************* Bulk Import *********************/
+/* fs_import_dir() brings all the regular files of a host directory in at once:
+ * the blocks of each file are held as one run when the disk has it, a pool of
+ * threads moves the data as in fs_import(), IMPORT_PIECE blocks per job from
+ * any of the files, and the entries are all made with one metadata commit at
+ * the end. It is all or nothing.
+*/
+#define IMPORT_PIECE 256                 // blocks per job, 1 MiB
+#define IMPORT_MAX_WORKERS 16
+
+struct ImportFile {
+    char        name[FS_FILENAME_LEN];
+    int         fd;
+    size_t      size;
+    uint32_t    nblk;
+    uint16_t *  blk;          // held until linked, NULL before
+};
 
-int fs_write(int fd, void *buf, size_t count)
-{
-    if(!is_valid_fd(fd)) return -1;
-    if(sp->data_blk_count == sp->fat_used ) return 0; // not error -1; return "written" count 0;
+struct ImportJob {
+    struct ImportFile * f;
+    int                 nfile;
+    uint32_t            next;       // next piece, counted over the files in order
+    int                 err;
+};
 
-    struct RootDirEntry * w_dir_entry = (struct RootDirEntry *)(filedes[fd]->file_entry);
+void * import_worker(void * arg){
+    struct ImportJob * j = arg;
+    for (;;)
+    {
+        uint32_t p = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+        int i = 0;
+        for (; i < j->nfile; ++i) // to the file and its piece
+        {
+            uint32_t npiece = (j->f[i].nblk + IMPORT_PIECE - 1) / IMPORT_PIECE;
+            if(p < npiece)
+                break;
+            p -= npiece;
+        }
+        if(i == j->nfile)
+            return NULL;
+        struct ImportFile * f = j->f + i;
+        if(import_data(f->fd, f->blk, p * IMPORT_PIECE, clamp(p * IMPORT_PIECE + IMPORT_PIECE, f->nblk), f->size) < 0)
+            __atomic_store_n(&j->err, 1, __ATOMIC_RELAXED);
+    }
+}
 
-    if(w_dir_entry->unused[0] == 'w') return -1; // others are writing this file
+int import_cmp(const void * a, const void * b){
+    return strcmp(((const struct ImportFile *)a)->name, ((const struct ImportFile *)b)->name);
+}
 
-    int real_count = count;
+/* whether the root directory has room for the @n files of @f under their names */
+bool import_fits(const struct ImportFile * f, int n){
+    if(sp->rdir_used + n > FS_FILE_MAX_COUNT)
+        return false;
+    for (int i = 0; i < n; ++i)
+    {
+        if(get_directory_entry(f[i].name, NULL) >= 0)
+            return false;
+    }
+    return true;
+}
 
-    if(real_count == 0){ // write 0 B
-        w_dir_entry->unused[0] = 'n'; 
-        return real_count;
+int fs_import_dir(const char *host_dir, int workers)
+{
+    if(sp == NULL || read_only || host_dir == NULL || workers < 1 || workers > IMPORT_MAX_WORKERS) return -1;
+    DIR * d = opendir(host_dir);
+    struct ImportFile * f = calloc(FS_FILE_MAX_COUNT, sizeof(struct ImportFile));
+    int nfile = 0, ret = -1;
+    if(d == NULL || f == NULL)
+        goto out;
+
+    struct dirent * de;
+    while((de = readdir(d)) != NULL){
+        struct stat st;
+        int fd = openat(dirfd(d), de->d_name, O_RDONLY | O_CLOEXEC);
+        if(fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){ // only the regular files readable
+            if(fd >= 0)
+                close(fd);
+            continue;
+        }
+        if(nfile == FS_FILE_MAX_COUNT || strlen(de->d_name) >= FS_FILENAME_LEN || st.st_size > INT_MAX){
+            close(fd);
+            goto out;
+        }
+        strcpy(f[nfile].name, de->d_name);
+        f[nfile].fd = fd;
+        f[nfile].size = st.st_size;
+        f[nfile++].nblk = size_to_blk(st.st_size);
+    }
+    qsort(f, nfile, sizeof(struct ImportFile), import_cmp); // entries in name order
+    {
+        HOLD_DIR();
+        if(!import_fits(f, nfile))
+            goto out;
+    }
+    for (int i = 0; i < nfile; ++i)
+    {
+        uint16_t * blk = malloc(pickmax(f[i].nblk, 1) * sizeof(uint16_t));
+        if(blk == NULL || hold_run(blk, f[i].nblk) < 0){
+            free(blk);
+            goto out;
+        }
+        f[i].blk = blk;
     }
 
-    if( w_dir_entry->first_data_blk == 0xFFFF){ // no blk assign
-        w_dir_entry->first_data_blk = get_free_blk_idx();
-        if(w_dir_entry->first_data_blk == -1){ // not valid fat
-            // memset(w_dir_entry->filename, 0, sizeof(w_dir_entry->filename)); // make it free again.
-            w_dir_entry->first_data_blk = 0xFFFF; // according to fs_ref.x result, occupy the rdir, no dota block
-            return -1; // unmount?
+    pthread_t tid[IMPORT_MAX_WORKERS];
+    struct ImportJob job = { f, nfile, 0, 0 };
+    int started = 0;
+    while(started < workers - 1 && pthread_create(tid + started, NULL, import_worker, &job) == 0)
+        ++started;
+    import_worker(&job);
+    for (int i = 0; i < started; ++i)
+        pthread_join(tid[i], NULL);
+    if(job.err)
+        goto out;
+
+    {
+        HOLD_DIR();
+        HOLD_META();
+        if(!import_fits(f, nfile)) // taken meanwhile
+            goto out;
+        for (int i = 0; i < nfile; ++i)
+        {
+            import_link(new_entry(f[i].name), f[i].blk, f[i].nblk, f[i].size);
+            free(f[i].blk);
+            f[i].blk = NULL;
         }
+        dir_publish();
+        if(write_meta() == 0)
+            ret = nfile;
+    }
 
-        w_dir_entry->last_data_blk = w_dir_entry->first_data_blk;
-        fat16 = get_fat(w_dir_entry->first_data_blk);
-        *fat16 = 0xFFFF;
-        sp->fat_used += 1; // !!!!
+out:
+    for (int i = 0; i < nfile; ++i)
+    {
+        if(f[i].blk != NULL)
+            range_unhold(f[i].blk, f[i].nblk);
+        free(f[i].blk);
+        close(f[i].fd);
     }
-    // w_dir_entry->first_data_blk = get_free_blk_idx(); // entry, should assign block here, in case the file size is 0;
-    // if(w_dir_entry->first_data_blk == -1){ // not valid fat
-    //     memset(w_dir_entry->filename, 0, sizeof(w_dir_entry->filename)); // make it free again.
-    //     return -1; // unmount?
-    // }
-    // w_dir_entry->last_data_blk = w_dir_entry->first_data_blk;
-    // fat16 = get_fat(w_dir_entry->first_data_blk);
-    // *fat16 = 0xFFFF;
+    free(f);
+    if(d != NULL)
+        closedir(d);
+    return ret;
+}
 
-    int file_sz_old = w_dir_entry->file_sz;
-    int file_sz_new = file_sz_old + count;
-    int blk_old = file_blk_count(file_sz_old); // block count needed
-    // blk_old = (blk_old == 0 ? 1 : blk_old);
-    int blk_new = file_blk_count(file_sz_new);
+/******************* Directory Listing *********************/
+/* fs_readdir() and fs_stat_name() report files without descriptors: the names
+ * come from the published copy of the directory, and the size and blocks of a
+ * file from its view, see Lock-free Reads. A file without view is pinned like
+ * by fs_open() and read under its file_lock shared, which builds the view for
+ * the next time.
+*/
 
-    uint16_t old_last = w_dir_entry->last_data_blk;
+/* size, first data block and runs of consecutive data blocks of @v into @ent */
+void view_dirent(const struct FileView * v, struct fs_dirent * ent){
+    ent->size = v->size;
+    ent->first_blk = FAT_EOC;
+    ent->extents = 0;
+    for (uint32_t i = 0; i < v->nblk; ++i)
+    {
+        if(v->blk[i] == FAT_EOC)
+            continue;
+        if(ent->first_blk == FAT_EOC)
+            ent->first_blk = v->blk[i];
+        if(i == 0 || v->blk[i - 1] == FAT_EOC || v->blk[i] != v->blk[i - 1] + 1)
+            ++ent->extents;
+    }
+}
 
-    int blk_more = blk_new - blk_old;
-    if(blk_more > sp->data_blk_count - sp->fat_used){
-        blk_more = sp->data_blk_count - sp->fat_used;
-        real_count = (blk_more + blk_old) * BLOCK_SIZE - w_dir_entry->file_sz;
+/* same from root_dir[@idx] itself, the caller holds its file_lock */
+void entry_dirent(direntry_t entry, struct fs_dirent * ent){
+    ent->size = entry_size(entry);
+    ent->first_blk = entry->first_data_blk;
+    ent->extents = 0;
+    uint32_t nblk = size_to_blk(entry->file_sz);
+    int32_t prev = -1;
+    struct BlkCursor cur;
+    cursor_seek(&cur, entry, 0);
+    for (uint32_t i = 0; i < nblk; ++i, cursor_next(&cur))
+    {
+        if(!cursor_has_data(&cur)){
+            prev = -1;
+            continue;
+        }
+        if(prev < 0 || cur.blk != prev + 1)
+            ++ent->extents;
+        prev = cur.blk;
+    }
+}
+
+/* fill @ent but its name for root_dir[@idx], if it is still the entry of generation @gen
+ * return -1 if it was removed meanwhile
+*/
+int entry_stat(int idx, uint32_t gen, struct fs_dirent * ent){
+    uint32_t seq = __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST);
+    if(seq % 2 == 0 && __atomic_load_n(wbuf_cnt + idx, __ATOMIC_SEQ_CST) == 0 && rcu_enter()){
+        struct FileView * v = __atomic_load_n(file_view + idx, __ATOMIC_ACQUIRE);
+        if(v != NULL)
+            view_dirent(v, ent);
+        rcu_exit();
+        if(v != NULL && __atomic_load_n(file_seq + idx, __ATOMIC_SEQ_CST) == seq \
+            && __atomic_load_n(dir_gen + idx, __ATOMIC_SEQ_CST) == gen)
+            return 0;
     }
-        
 
-    if(blk_old != blk_new){
-        //set up the blk;        
-        while(blk_more > 0){
-            int next = get_free_blk_idx();
-            // if(next == -1) break; // no valid fat; actually impossible
-            uint16_t * fat_entry = get_fat(w_dir_entry->last_data_blk);
-            *fat_entry = next;
-            fat_entry = get_fat(next);
-            *fat_entry = 0xFFFF; // if not, the "next" block still available
-            // *(get_fat(w_dir_entry->last_data_blk)) = next ; // update the fat chain
-            w_dir_entry->last_data_blk = next;
-            blk_more -= 1;
-            sp->fat_used += 1;
+    if(!pin_idx(idx))
+        return -1;
+    int ret = -1;
+    if(__atomic_load_n(dir_gen + idx, __ATOMIC_SEQ_CST) == gen){
+        direntry_t entry = get_dir(idx);
+        HOLD_FILE_READ(h, entry, 0, 0); // buffered writes may grow it
+        if(h.l != NULL){
+            view_build(entry);
+            entry_dirent(entry, ent);
+            ret = 0;
         }
-        // if(blk_more != 0) // succeed to write all; error, fat entry migth be bigger than block entry
-        //     real_count = (blk_new - blk_more) * BLOCK_SIZE - file_sz_old; // actually impossible
+    }
+    unpin_entry(idx);
+    return ret;
+}
 
-        *(get_fat(w_dir_entry->last_data_blk)) = 0xFFFF; 
+int fs_readdir(fs_readdir_cb cb, void *data)
+{
+    if(sp == NULL || cb == NULL) return -1;
+    struct DirView names; // one copy, the callback may take its time
+    bool copied = false;
+    if(rcu_enter()){
+        struct DirView * v = __atomic_load_n(&dir_view, __ATOMIC_ACQUIRE);
+        if(v != NULL){
+            memcpy(&names, v, sizeof(struct DirView));
+            copied = true;
+        }
+        rcu_exit();
+    }
+    if(!copied){
+        HOLD_DIR();
+        for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+        {
+            names.gen[i] = dir_gen[i];
+            memcpy(names.name[i], root_dir[i].filename, FS_FILENAME_LEN);
+        }
     }
 
-    //start to write 
-    //1. get remaining content in the old last blk
-    //2. cat the old and new real_count
-    //3. write the whole block
+    int n = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+    {
+        struct fs_dirent ent;
+        if(names.name[i][0] == 0 || entry_stat(i, names.gen[i], &ent) < 0)
+            continue;
+        memcpy(ent.name, names.name[i], FS_FILENAME_LEN);
+        ent.name[FS_FILENAME_LEN - 1] = 0;
+        ++n;
+        if(cb(&ent, data) != 0)
+            break;
+    }
+    return n;
+}
 
-    //write the old last blk specially
-    //write the other blocks as a whole
+int fs_stat_name(const char *filename, struct fs_dirent *ent)
+{
+    if(sp == NULL || filename == NULL || strlen(filename) == 0 || strlen(filename) >= FS_FILENAME_LEN) return -1;
+    struct fs_dirent tmp;
+    if(ent == NULL)
+        ent = &tmp;
+    for (bool waited = false;; waited = true)
+    {
+        uint32_t gen = 0;
+        int idx = dir_lookup(filename, &gen);
+        if(idx < 0)
+            return -1;
+        if(entry_stat(idx, gen, ent) == 0){
+            strcpy(ent->name, filename);
+            return ent->size > INT_MAX ? -1 : (int)ent->size;
+        }
+        if(waited)
+            return -1;
+        pthread_mutex_lock(&dir_lock); // removed or replaced meanwhile, look again once that is done
+        pthread_mutex_unlock(&dir_lock);
+    }
+}
 
-    // int blk_more_real = blk_new - blk_old - blk_more;
-    // ? fat index, and actual index, id should think about
-    // uint16_t truncate = w_dir_entry->file_sz % BLOCK_SIZE;
-    // if(truncate == 0){
+/******************* Compressed Files *********************/
+/* The bytes of a compressed file are cut in chunks of ZIP_CHUNK, each
+ * compressed on its own, so a read decompresses the chunks it covers and a
+ * write recompresses the ones it changes. The blocks of the file hold a layout
+ * walked with the usual cursors: logical block 0 is the chunk index, one
+ * uint32_t per chunk with the size it takes, 0 for a chunk never written, which
+ * reads as zeros, and ZIP_RAW set when it is stored as is because compressing
+ * it does not save a block. Chunk c takes up to ZIP_SLOT_BLKS logical blocks
+ * from 1 + c * ZIP_SLOT_BLKS, those it does not use are holes. @file_sz is the
+ * size of the layout, up to the end of the last chunk, @zip_sz the size of the
+ * file. A chunk never holds bytes past @zip_sz, truncation recompresses it.
+ * Compressed files are not logged nor buffered, and have no view.
+*/
+#define ZIP_SLOT_BLKS 16
+#define ZIP_CHUNK (ZIP_SLOT_BLKS * BLOCK_SIZE)
+#define ZIP_CHUNKS (BLOCK_SIZE / sizeof(uint32_t))
+#define ZIP_MAX ((size_t)ZIP_CHUNKS * ZIP_CHUNK)
+#define ZIP_RAW 0x80000000u
+
+/* offset in the layout of chunk @c */
+size_t zip_slot(uint32_t c){
+    return BLOCK_SIZE + (size_t)c * ZIP_CHUNK;
+}
 
-    // }
-    // else{
-    //     void * buf_temp = malloc(BLOCK_SIZE);
-    //     if(block_read(0, buf_temp) < 0) 
-    //     memcpy(buf_temp, )
-    // }
-    //     truncate += real_count;
+/* the chunk index of @entry into @index, zeros if it has none yet */
+int zip_index_read(direntry_t entry, uint32_t * index){
+    memset(index, 0, BLOCK_SIZE);
+    return file_read(entry, 0, index, BLOCK_SIZE) < 0 ? -1 : 0;
+}
 
-    // int block_write(size_t block, const void *buf), block start from 0
+/* bytes [@from, @want) of chunk @c of @entry into the same place of @buf, zeros past
+ * its end; the ones before @from are decompressed as well, unless it is stored as is
+ * @tmp holds ZIP_CHUNK bytes
+*/
+int zip_load(direntry_t entry, const uint32_t * index, uint32_t c, char * buf, size_t from, size_t want, char * tmp){
+    uint32_t len = index[c] & ~ZIP_RAW;
+    int n = 0;
+    if(len > ZIP_CHUNK)
+        return -1;
+    if(index[c] & ZIP_RAW){
+        n = pickmax(clamp(len, want), from);
+        if(file_read(entry, zip_slot(c) + from, buf + from, n - from) != n - (int)from)
+            return -1;
+    }
+    else if(len > 0 && (file_read(entry, zip_slot(c), tmp, len) != (int)len || (n = lz4_decompress(tmp, len, buf, want)) < 0))
+        return -1;
+    if((size_t)n < want)
+        memset(buf + n, 0, want - n);
+    return 0;
+}
 
-    void * bounce_buffer = malloc(BLOCK_SIZE);
-    memset(bounce_buffer, 0, BLOCK_SIZE);
+/* store chunk @c of @entry, the @len bytes of @buf, and record it in @index;
+ * the blocks of its slot it no longer takes become holes, or go if it is the last one
+ * the caller holds the file_lock and meta_lock
+ * return -1 if the disk is full, the chunk is left as it was
+*/
+int zip_store(direntry_t entry, uint32_t * index, uint32_t c, const char * buf, size_t len, char * tmp){
+    uint32_t nblk = size_to_blk(len);
+    int packed = nblk > 1 ? lz4_compress(buf, len, tmp, (nblk - 1) * BLOCK_SIZE) : 0; // has to save a block
+    const char * data = packed > 0 ? tmp : buf;
+    size_t stored = packed > 0 ? (size_t)packed : len;
+    uint32_t new_nblk = size_to_blk(stored), old_nblk = size_to_blk(index[c] & ~ZIP_RAW);
+
+    /* the old bytes are overwritten in place, a block missing halfway would lose them */
+    if(new_nblk > old_nblk && sp->data_blk_count - sp->fat_used - held_cnt < (int)(new_nblk - old_nblk))
+        return -1;
+    if(stored > 0 && file_write(entry, zip_slot(c), data, stored) != stored)
+        return -1;
 
-    if(block_read(sp->data_blk + old_last, bounce_buffer) < 0) return -1; // should free bounce_buffer before return -1
-    // size_t truncate = strlen(bounce_buffer); // or should I use truncate = w_dir_entry->file_sz % BLOCK_SIZE // error
-    if(fs_lseek(fd, fs_stat(fd)) < 0)
-        return -1; 
-    size_t truncate = (filedes[fd]->offset) % BLOCK_SIZE;
-    size_t buf_idx = clamp(BLOCK_SIZE - truncate, real_count);
-    memcpy(bounce_buffer + truncate, buf, buf_idx);
-    if(block_write(sp->data_blk + old_last, bounce_buffer) < 0 ) return -1; 
+    size_t end = zip_slot(c) + stored;
+    if(entry->file_sz <= zip_slot(c + 1)){ // the last chunk
+        if(entry->file_sz > end && file_shrink(entry, end) < 0)
+            return -1;
+    }
+    else if(new_nblk < old_nblk){
+        struct BlkCursor cur;
+        cursor_seek(&cur, entry, zip_slot(c) / BLOCK_SIZE + new_nblk);
+        for (uint32_t i = new_nblk; i < old_nblk; ++i, cursor_next(&cur))
+            if(cursor_zero(&cur) < 0)
+                return -1;
+    }
+    index[c] = (packed > 0 || len == 0) ? stored : stored | ZIP_RAW;
+    return 0;
+}
 
-    int temp_count = real_count;
-    temp_count -= buf_idx;
-    int temp_blk_id = *(get_fat(old_last));     
-    while(temp_count > 0){ // into the loop, temp_blk_id != 0xFFFF       
-        // truncate = clamp(temp_count, BLOCK_SIZE);//reuse the var truncate 
-        if(temp_count > BLOCK_SIZE)
-            block_write(sp->data_blk + temp_blk_id, buf + buf_idx); // < 0 should return -1;
-        else {
-            memset(bounce_buffer, 0, BLOCK_SIZE);
-            memcpy(bounce_buffer, buf + buf_idx, temp_count);
-            block_write(sp->data_blk + temp_blk_id, bounce_buffer);
-        }
+/* buffers of one operation on a compressed file */
+struct ZipBufs {
+    uint32_t * index;
+    char *     buf;     // a chunk decompressed
+    char *     tmp;     // a chunk compressed
+};
 
-        buf_idx += BLOCK_SIZE;
-        temp_count -= BLOCK_SIZE;
-        temp_blk_id = *(get_fat(temp_blk_id));
-    }
+struct ZipBufs zip_alloc(){
+    struct ZipBufs z = { malloc(BLOCK_SIZE), malloc(ZIP_CHUNK), malloc(ZIP_CHUNK) };
+    return z;
+}
 
-    free(bounce_buffer);
+void zip_free(struct ZipBufs * z){
+    free(z->index);
+    free(z->buf);
+    free(z->tmp);
+}
+#define HOLD_ZIP(z) struct ZipBufs z __attribute__((cleanup(zip_free))) = zip_alloc()
 
-    w_dir_entry->unused[0] = 'n';
+/* the buffers are there, and @index holds the chunk index of @entry */
+bool zip_ready(struct ZipBufs * z, direntry_t entry){
+    return z->index && z->buf && z->tmp && zip_index_read(entry, z->index) == 0;
+}
 
-    w_dir_entry->file_sz += real_count;
+/* entry_readv() of a compressed file, decompressing the chunks it covers */
+int zip_readv(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt){
+    if(offset >= entry->zip_sz)
+        return 0;
+    size_t count = clamp(entry->zip_sz - offset, iov_total(iov, iovcnt));
+    HOLD_ZIP(z);
+    if(!zip_ready(&z, entry))
+        return -1;
 
-    write_meta();
-    return real_count;
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+    size_t done = 0;
+    while(done < count){
+        uint32_t c = (offset + done) / ZIP_CHUNK;
+        size_t lo = (offset + done) % ZIP_CHUNK;
+        size_t n = clamp(ZIP_CHUNK - lo, count - done);
+        if(zip_load(entry, z.index, c, z.buf, lo, lo + n, z.tmp) < 0)
+            return -1;
+        io_copy(&ic, z.buf + lo, n, true);
+        done += n;
+    }
+    return done;
 }
 
+/* file_writev() of a compressed file, recompressing the chunks it covers
+ * the caller holds the file_lock and meta_lock
+ * return the number of bytes written, up to the first chunk which cannot be stored
 */
-/**
- * fs_read - Read from a file
- * @fd: File descriptor
- * @buf: Data buffer to be filled with data
- * @count: Number of bytes of data to be read
- *
- * Attempt to read @count bytes of data from the file referenced by file
- * descriptor @fd into buffer pointer by @buf. It is assumed that @buf is large
- * enough to hold at least @count bytes.
- *
- * The number of bytes read can be smaller than @count if there are less than
- * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
- *
- * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+int zip_writev(direntry_t entry, size_t offset, const struct iovec *iov, int iovcnt){
+    size_t count = offset >= ZIP_MAX ? 0 : clamp(iov_total(iov, iovcnt), ZIP_MAX - offset);
+    if(count == 0)
+        return 0;
+    HOLD_ZIP(z);
+    if(!zip_ready(&z, entry))
+        return -1;
+    /* the index comes first, written back below in place */
+    if(entry->file_sz < BLOCK_SIZE && file_write(entry, 0, z.index, BLOCK_SIZE) != BLOCK_SIZE)
+        return 0;
 
+    struct IoCursor ic;
+    io_init(&ic, iov, iovcnt);
+    size_t done = 0;
+    while(done < count){
+        uint32_t c = (offset + done) / ZIP_CHUNK;
+        size_t lo = (offset + done) % ZIP_CHUNK;
+        size_t n = clamp(ZIP_CHUNK - lo, count - done);
+        size_t base = (size_t)c * ZIP_CHUNK;
+        size_t len = entry->zip_sz > base ? clamp(entry->zip_sz - base, ZIP_CHUNK) : 0;
+        if((lo > 0 || n < len) && zip_load(entry, z.index, c, z.buf, 0, ZIP_CHUNK, z.tmp) < 0) // partly rewritten
+            break;
+        io_copy(&ic, z.buf + lo, n, false);
+        if(zip_store(entry, z.index, c, z.buf, pickmax(len, lo + n), z.tmp) < 0)
+            break;
+        done += n;
+        if(offset + done > entry->zip_sz)
+            entry->zip_sz = offset + done;
+    }
 
- This function attempts to read nbyte bytes of data from the file referenced by the descriptor fildes into the buffer pointed to by buf. The function assumes that the buffer buf is large enough to hold at least nbyte bytes. When the function attempts to read past the end of the file, it reads all bytes until the end of the file. Upon successful completion, the number of bytes that were actually read is returned. This number could be smaller than nbyte when attempting to read past the end of the file (when trying to read while the file pointer is at the end of the file, the function returns zero). In case of failure, the function returns -1. It is a failure when the file descriptor fildes is not valid. The read function implicitly increments the file pointer by the number of bytes that were actually read.
+    if(done > 0 && file_write(entry, 0, z.index, BLOCK_SIZE) != BLOCK_SIZE)
+        return -1;
+    return done;
+}
 
- int block_read(size_t block, void *buf);
- */
+/* fs_truncate() of a compressed file, the caller holds the file_lock and meta_lock */
+int zip_truncate(direntry_t entry, size_t size){
+    if(size > ZIP_MAX)
+        return -1;
+    if(size >= entry->zip_sz){ // the chunks past the old end read as zeros
+        entry->zip_sz = size;
+        return 0;
+    }
+    HOLD_ZIP(z);
+    if(!zip_ready(&z, entry))
+        return -1;
 
-// offset is 4096 there is problem
-int fs_read(int fd, void *buf, size_t count)
+    uint32_t c = size / ZIP_CHUNK, keep = c + (size % ZIP_CHUNK != 0); // chunks left
+    if(entry->file_sz > zip_slot(keep) && file_shrink(entry, zip_slot(keep)) < 0)
+        return -1;
+    for (uint32_t i = keep; i < ZIP_CHUNKS; ++i)
+        z.index[i] = 0;
+    if(keep > c && z.index[c] != 0){ // drop the bytes past the new end from the last one
+        if(zip_load(entry, z.index, c, z.buf, 0, size % ZIP_CHUNK, z.tmp) < 0 || zip_store(entry, z.index, c, z.buf, size % ZIP_CHUNK, z.tmp) < 0)
+            return -1;
+    }
+    entry->zip_sz = size;
+
+    uint32_t last = keep; // the layout ends with the last chunk written
+    while(last > 0 && z.index[last - 1] == 0)
+        --last;
+    if(last == 0) // nothing but the index
+        return file_shrink(entry, 0);
+    size_t end = zip_slot(last - 1) + (z.index[last - 1] & ~ZIP_RAW);
+    if(entry->file_sz > end && file_shrink(entry, end) < 0)
+        return -1;
+    return file_write(entry, 0, z.index, BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+}
+
+int fs_set_compression(const char *filename, int flags)
 {
-    /* TODO: Phase 4 */
-    if(!is_valid_fd(fd)) return -1;
-    direntry_t dir_entry = filedes[fd]->file_entry;
+    if(sp == NULL || read_only || filename == NULL || (flags & ~FS_COMPRESS_LZ4)) return -1;
+    int idx = pin_entry(filename); // kept from removal, without a descriptor
+    if(idx < 0) return -1;
+    direntry_t entry = get_dir(idx);
+    int ret = -1;
+    {
+        HOLD_FILE(entry);
+        if(flush_file(entry, -1) == 0){ // buffered bytes would make it non-empty
+            HOLD_META();
+            if(entry->file_sz == 0 && entry_size(entry) == 0){
+                entry->zip = flags;
+                ret = meta_update();
+            }
+        }
+    }
+    unpin_entry(idx);
+    return ret;
+}
 
-    size_t offset = filedes[fd]->offset;
-    int32_t real_count = clamp(dir_entry->file_sz - offset, count);
-    if(real_count == 0)
-        return 0;
+/******************* Deduplication *********************/
+/* Files holding the same bytes share their blocks through the reference
+ * counts, like clones. A data block has a single successor in the FAT, so two
+ * chains can only share their ends: a block goes when another one holds the
+ * same bytes and is followed by the very same blocks. Copies of a file end up
+ * in one chain, files which only differ at the start share the rest, not the
+ * other way round. A shared block is copied before it changes, see
+ * cursor_unshare(). In dedup mode, once a descriptor which wrote closes, the
+ * end of its file is looked up in the fingerprint index, see Block
+ * Fingerprints. fs_dedup() goes over every chain of the disk, hashing it all.
+ * Sharing a block of another file takes lock_all(): its owner may be
+ * rewriting it in place otherwise, see write_in_place().
+*/
+
+/* a block of another chain with the bytes of data block @blk and followed by
+ * @next, FAT_EOC if there is none; @buf holds two blocks, the first gets the
+ * bytes of @blk, the caller holds lock_all()
+*/
+uint16_t dedup_twin(uint16_t blk, uint16_t next, char * buf){
+    if(block_read(sp->data_blk + blk, buf) < 0)
+        return FAT_EOC;
+    uint32_t h = fp_hash(buf);
+    HOLD(pthread_mutex_t *, unlock_mutex, lock_mutex(&fp_lock));
+    fp_set(blk, h); // it may have changed without being hashed
+    for (uint16_t y = fp_head[h % FP_BUCKETS]; y != FAT_EOC; y = fp_next[y])
+    {
+        if(fp[y] != h || y == blk || fat[y] != next)
+            continue;
+        if(block_read(sp->data_blk + y, buf + BLOCK_SIZE) == 0 && memcmp(buf, buf + BLOCK_SIZE, BLOCK_SIZE) == 0)
+            return y;
+    }
+    return FAT_EOC;
+}
 
-    uint16_t read_blk = get_offset_blk(fd, offset); // error when offset = 4096 * N
+/* give the longest end of the chain of @entry, the @n blocks of which are in
+ * @blk, to identical blocks of other chains, the caller holds lock_all()
+ * return the number of blocks freed, -1 if the reference counts cannot be stored
+*/
+int dedup_tail(direntry_t entry, const uint16_t * blk, uint32_t n, char * buf){
+    uint32_t shared = 0; // the chain is shared from @blk[@shared] on, only the first one has a count
+    while(shared < n && get_ref(blk[shared]) == 0)
+        ++shared;
+    uint16_t next = shared < n ? blk[shared] : FAT_EOC; // what the block before has to point to
+    uint32_t from = shared;  // @blk[@from..@shared - 1] go
+    for (uint32_t i = shared; i-- > 0;)
+    {
+        uint16_t twin = dedup_twin(blk[i], next, buf);
+        if(twin == FAT_EOC)
+            break;
+        next = twin;
+        from = i;
+    }
+    if(from == shared)
+        return 0;
+    if(ref_create() < 0)
+        return -1;
 
-    if(read_blk == 0) return -1; // nothing can be read
-    if(offset > 0 && offset % BLOCK_SIZE == 0) 
-        read_blk += 1;
+    if(from == 0)
+        entry->first_data_blk = next;
+    else
+        set_fat(blk[from - 1], next);
+    ref_inc(next);
+    int freed = release_chain(blk[from]); // up to the blocks it shared before, which lose a reference
+    uint16_t last = next;
+    while(fat[last] != FAT_EOC)
+        last = fat[last];
+    entry->last_data_blk = last;
+    return freed;
+}
 
-    //read first block
-    int32_t leftover_count = real_count;
-    // void *bounce_buffer = calloc(BLOCK_SIZE, 1);
-    char bounce_buffer[BLOCK_SIZE]; //void *bounce_buffer = malloc(BLOCK_SIZE);
-    memset(bounce_buffer, 0, BLOCK_SIZE);
-    int buf_idx = 0;
-    if(block_read(read_blk + sp->data_blk, bounce_buffer) < 0 ){
-        // free(bounce_buffer);
+/* in dedup mode, share the end of the file of @entry if it wrote blocks since
+ * the last time; the caller holds no lock, and keeps @entry from going away
+ * return the number of blocks freed, -1 on error
+*/
+int dedup_file(direntry_t entry){
+    int idx = entry - root_dir;
+    if(fp == NULL || !__atomic_load_n(fp_file + idx, __ATOMIC_RELAXED))
+        return 0;
+    HOLD_ALL();
+    if(fp == NULL)
+        return 0;
+    fp_file[idx] = 0;
+
+    uint32_t n = 0;
+    for (uint16_t b = entry->first_data_blk; b != FAT_EOC && n < sp->data_blk_count; b = fat[b])
+        ++n;
+    uint16_t * blk = malloc(pickmax(n, 1) * sizeof(uint16_t));
+    char * buf = malloc(2 * BLOCK_SIZE);
+    int freed = -1;
+    if(blk != NULL && buf != NULL){
+        uint16_t b = entry->first_data_blk;
+        for (uint32_t i = 0; i < n; ++i, b = fat[b])
+            blk[i] = b;
+        freed = dedup_tail(entry, blk, n, buf);
+    }
+    free(blk);
+    free(buf);
+    if(freed > 0 && meta_update() < 0)
         return -1;
+    return freed;
+}
+
+/* the root directory and the frozen ones of the snapshots: the entries which
+ * start chains of data blocks, @frozen gets the frozen directories of the
+ * snapshots of @table, NULL for a free slot
+ * return the number of entries in @root
+*/
+int dedup_roots(struct SnapEntry * table, char ** frozen, direntry_t * root){
+    int n = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; ++i)
+        if(root_dir[i].filename[0] != 0 && root_dir[i].first_data_blk != FAT_EOC)
+            root[n++] = root_dir + i;
+    for (int s = 0; s < FS_SNAPSHOT_MAX_COUNT; ++s)
+    {
+        frozen[s] = NULL;
+        if(table[s].name[0] == 0)
+            continue;
+        if((frozen[s] = malloc(BLOCK_SIZE)) == NULL || meta_block_read(table[s].rdir_blk, frozen[s]) < 0)
+            return -1;
+        direntry_t e = (direntry_t)frozen[s];
+        for (int i = 0; i < FS_FILE_MAX_COUNT; ++i, ++e)
+            if(e->filename[0] != 0 && e->first_data_blk != FAT_EOC)
+                root[n++] = e;
     }
+    return n;
+}
 
-    // memcpy(buf + buf_idx, bounce_buffer + offset % BLOCK_SIZE, clamp(real_count_temp, BLOCK_SIZE));
-    memcpy(buf + buf_idx, bounce_buffer + offset % BLOCK_SIZE, clamp(leftover_count, BLOCK_SIZE - offset % BLOCK_SIZE));
+/* the buffers of dedup_all() */
+struct DedupBufs {
+    uint32_t *  depth;     // blocks from each data block to the end of its chain, 0 if no chain has it
+    uint16_t *  canon;     // block each data block goes to, itself if it stays
+    uint16_t *  order;     // data blocks by depth
+    uint32_t *  start;     // first one of each depth in @order
+    direntry_t * root;
+    char *      frozen[FS_SNAPSHOT_MAX_COUNT];
+    char *      buf;
+};
 
-    buf_idx += clamp(leftover_count, BLOCK_SIZE - offset % BLOCK_SIZE);
+void dedup_free(struct DedupBufs * d){
+    free(d->depth);
+    free(d->canon);
+    free(d->order);
+    free(d->start);
+    free(d->root);
+    for (int s = 0; s < FS_SNAPSHOT_MAX_COUNT; ++s)
+        free(d->frozen[s]);
+    free(d->buf);
+}
 
-    offset += buf_idx; // update offset
-    leftover_count -= buf_idx; // remaining // leftover_count -= BLOCK_SIZE; // error
-    // if(leftover_count < 0) leftover_count = 0; // no need
+/* fill @d->depth from the chains of the @n entries of @d->root, and sort the
+ * data blocks by depth into @d->order, the last blocks of the chains first
+ * return the number of data blocks, -1 if a chain loops
+*/
+int dedup_sort(struct DedupBufs * d, int n){
+    uint32_t cnt = 0, max_depth = 0;
+    for (int r = 0; r < n; ++r)
+    {
+        uint32_t top = 0; // @canon is the stack of the blocks not seen yet
+        uint16_t b = d->root[r]->first_data_blk;
+        for (; b != FAT_EOC && d->depth[b] == 0; b = fat[b])
+        {
+            if(top == sp->data_blk_count)
+                return -1;
+            d->canon[top++] = b;
+        }
+        uint32_t depth = (b == FAT_EOC) ? 0 : d->depth[b];
+        cnt += top;
+        while(top > 0)
+            d->depth[d->canon[--top]] = ++depth;
+        max_depth = pickmax(max_depth, depth);
+    }
 
-    read_blk = *(get_fat(read_blk));
+    if((d->start = calloc(max_depth + 2, sizeof(uint32_t))) == NULL)
+        return -1;
+    for (uint16_t b = 0; b < sp->data_blk_count; ++b)
+        if(d->depth[b] != 0)
+            ++d->start[d->depth[b] + 1];
+    for (uint32_t i = 1; i <= max_depth + 1; ++i)
+        d->start[i] += d->start[i - 1];
+    for (uint16_t b = 0; b < sp->data_blk_count; ++b)
+        if(d->depth[b] != 0)
+            d->order[d->start[d->depth[b]]++] = b;
+    return cnt;
+}
 
-    while(leftover_count > 0 && read_blk != FAT_EOC){
-        if(leftover_count >= BLOCK_SIZE){
-            if(block_read(read_blk + sp->data_blk, buf + buf_idx) < 0){
-                // free(bounce_buffer);
-                return -1;
-            }
-            buf_idx += BLOCK_SIZE;
-            leftover_count -= BLOCK_SIZE;
+/* the block data block @b is followed by once the blocks after it went */
+uint16_t dedup_next(const struct DedupBufs * d, uint16_t b){
+    return fat[b] == FAT_EOC ? FAT_EOC : d->canon[fat[b]];
+}
 
-            offset += BLOCK_SIZE;
-        }
-        else{
-            if(block_read(read_blk + sp->data_blk, bounce_buffer) < 0){
-                // free(bounce_buffer);
+/* the pass of fs_dedup(), with @fp empty for the index it rebuilds
+ * the caller holds lock_all()
+*/
+int dedup_all(struct fs_dedup_stats * st){
+    struct SnapEntry table[FS_SNAPSHOT_MAX_COUNT];
+    if(read_snaps(table) < 0)
+        return -1;
+    struct DedupBufs d __attribute__((cleanup(dedup_free))) = {
+        .depth = calloc(sp->data_blk_count, sizeof(uint32_t)),
+        .canon = malloc(sp->data_blk_count * sizeof(uint16_t)),
+        .order = malloc(sp->data_blk_count * sizeof(uint16_t)),
+        .root = malloc(FS_FILE_MAX_COUNT * (1 + FS_SNAPSHOT_MAX_COUNT) * sizeof(direntry_t)),
+        .buf = malloc(2 * BLOCK_SIZE),
+    };
+    if(!d.depth || !d.canon || !d.order || !d.root || !d.buf)
+        return -1;
+    int nroot = dedup_roots(table, d.frozen, d.root);
+    int nblk = nroot < 0 ? -1 : dedup_sort(&d, nroot);
+    if(nblk < 0)
+        return -1;
+
+    /* the last blocks first, so the blocks after the ones compared already went */
+    memset(fp, 0, size_to_blk(sp->data_blk_count * sizeof(uint32_t)) * BLOCK_SIZE);
+    memset(fp_head, 0xFF, sizeof(fp_head)); // FAT_EOC
+    memset(fp_dirty, 1, size_to_blk(sp->data_blk_count * sizeof(uint32_t)));
+    memset(fp_file, 0, sizeof(fp_file));
+    uint32_t merged = 0;
+    for (int i = 0; i < nblk; ++i)
+    {
+        uint16_t b = d.order[i];
+        d.canon[b] = b;
+        if(block_read(sp->data_blk + b, d.buf) < 0)
+            return -1;
+        uint32_t h = fp_hash(d.buf);
+        uint16_t next = dedup_next(&d, b);
+        for (uint16_t y = fp_head[h % FP_BUCKETS]; y != FAT_EOC; y = fp_next[y])
+        {
+            if(fp[y] != h || dedup_next(&d, y) != next)
+                continue;
+            if(block_read(sp->data_blk + y, d.buf + BLOCK_SIZE) < 0)
                 return -1;
+            if(memcmp(d.buf, d.buf + BLOCK_SIZE, BLOCK_SIZE) == 0){
+                d.canon[b] = y;
+                break;
             }
-            memcpy(buf + buf_idx, bounce_buffer, leftover_count);
-            buf_idx += leftover_count; // unnecessary acutally
-            leftover_count = 0;
-
-            offset += leftover_count;
         }
+        if(d.canon[b] == b)
+            fp_set(b, h);
+        else
+            ++merged;
+    }
+    uint32_t logical = 0;
+    for (int r = 0; r < nroot; ++r)
+        logical += d.depth[d.root[r]->first_data_blk];
+    if(st != NULL){
+        st->logical = logical;
+        st->physical = nblk - merged;
+        st->freed = merged;
+    }
+    if(merged == 0)
+        return write_meta();
+
+    uint32_t need = (sp->ref_blk == 0) ? size_to_blk(sp->data_blk_count * sizeof(uint16_t)) : 0;
+    uint32_t avail = sp->data_blk_count - sp->fat_used - held_cnt;
+    if(avail + merged < need){
+        eprintf("fs_dedup: no space for the reference count table\n");
+        return -1;
+    }
+    if(avail >= need && ref_create() < 0) // before anything changes, unless it takes the blocks which go
+        return -1;
 
-        // real_count_temp -= BLOCK_SIZE;
-        read_blk = *(get_fat(read_blk));
+    /* point everything at the blocks which stay, then recount the references */
+    for (int i = 0; i < nblk; ++i)
+    {
+        uint16_t b = d.order[i];
+        if(d.canon[b] == b && dedup_next(&d, b) != fat[b])
+            set_fat(b, dedup_next(&d, b));
+    }
+    for (int r = 0; r < nroot; ++r)
+    {
+        direntry_t e = d.root[r];
+        e->first_data_blk = d.canon[e->first_data_blk];
+        if(e->last_data_blk < sp->data_blk_count && d.depth[e->last_data_blk] == 1)
+            e->last_data_blk = d.canon[e->last_data_blk];
+    }
+    for (int i = 0; i < nblk; ++i)
+    {
+        uint16_t b = d.order[i];
+        if(d.canon[b] != b){
+            set_fat(b, 0);
+            sp->fat_used -= 1;
+        }
     }
+    if(ref_create() < 0)
+        return -1;
 
-    // free(bounce_buffer);
-    real_count -= leftover_count;
-    // if(fs_lseek(fd, real_count + offset) < 0) return -1;
+    uint32_t * cnt = d.depth; // references to each data block
+    for (int i = 0; i < nblk; ++i)
+        cnt[d.order[i]] = 0;
+    for (int i = 0; i < nblk; ++i)
+        if(d.canon[d.order[i]] == d.order[i] && fat[d.order[i]] != FAT_EOC)
+            ++cnt[fat[d.order[i]]];
+    for (int r = 0; r < nroot; ++r)
+        ++cnt[d.root[r]->first_data_blk];
+    for (int i = 0; i < nblk; ++i)
+    {
+        uint16_t b = d.order[i];
+        uint16_t r = (d.canon[b] == b && cnt[b] > 0) ? cnt[b] - 1 : 0;
+        ref_total += r - ref[b];
+        __atomic_store_n(ref + b, r, __ATOMIC_RELAXED);
+    }
+    ref_dirty = 1;
 
-    filedes[fd]->offset = offset;
+    for (int s = 0; s < FS_SNAPSHOT_MAX_COUNT; ++s)
+        if(d.frozen[s] != NULL && meta_block_write(table[s].rdir_blk, d.frozen[s]) < 0)
+            return -1;
+    return write_meta();
+}
 
-    return real_count - leftover_count;
+/* drop the fingerprint table, the caller holds lock_all() */
+int dedup_off(){
+    release_chain(sp->dedup_blk);
+    sp->dedup_blk = 0;
+    fp_free();
+    return write_meta();
 }
 
-/* version 1.0 without offset
-int fs_read(int fd, void *buf, size_t count)
+int fs_dedup(struct fs_dedup_stats *st)
 {
-    if(!is_valid_fd(fd)) return -1;
-    dir_entry = filedes[fd]->file_entry;
+    if(sp == NULL || read_only) return -1;
+    HOLD_ALL();
+    if(flush_pending() < 0) return -1;
+    bool kept = (fp != NULL); // the index of dedup mode, rebuilt; otherwise one for the pass
+    if(!kept && fp_alloc() < 0){
+        fp_free();
+        return -1;
+    }
+    int ret = dedup_all(st);
+    if(!kept)
+        fp_free();
+    return ret;
+}
 
-    size_t offset = filedes[fd]->offset;
-    size_t real_count = clamp(dir_entry->file_sz - offset, count);
-    void *bounce_buffer = malloc(BLOCK_SIZE);
-    int i = 0;
-    uint16_t temp_blk_id = dir_entry->first_data_blk; 
-    while(count > 0){
-        if(count >= BLOCK_SIZE){
-            if(block_read(temp_blk_id + sp->data_blk, buf + i) < 0 ) return -1;
-            i += BLOCK_SIZE;
-        }
-        else{
-            memset(bounce_buffer, 0, BLOCK_SIZE);
-            if(block_read(temp_blk_id + sp->data_blk, bounce_buffer) < 0 ) return -1;
-            memcpy(buf+i, bounce_buffer, count);
+int fs_set_dedup(int on)
+{
+    if(sp == NULL || read_only) return -1;
+    HOLD_ALL();
+    if(on && sp->dedup_blk == 0){
+        if(flush_pending() < 0)
+            return -1;
+        uint16_t head = zero_chain(size_to_blk(sp->data_blk_count * sizeof(uint32_t)));
+        if(head == FAT_EOC)
+            return -1;
+        if(fp_alloc() < 0){
+            fp_free();
+            release_chain(head);
+            return -1;
         }
-
-        temp_blk_id = *(get_fat(temp_blk_id));
-        count -= BLOCK_SIZE;
+        sp->dedup_blk = head;
+        if(dedup_all(NULL) == 0) // index what the disk holds already, and share it
+            return 0;
+        dedup_off();
+        return -1;
     }
-
-    free(bounce_buffer);
-
-    if(fs_lseek(fd, real_count) < 0) return -1;
- 
-    return real_count;
+    if(!on && sp->dedup_blk != 0)
+        return dedup_off();
+    return 0;
 }
-*/
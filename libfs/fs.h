@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -11,7 +12,10 @@
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+#define FS_OPEN_MAX_COUNT 16384
+
+/** Maximum number of snapshots */
+#define FS_SNAPSHOT_MAX_COUNT 128
 
 /**
  * fs_mount - Mount a file system
@@ -73,6 +77,27 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/** fs_rename() flag: replace the file which has the new name */
+#define FS_RENAME_REPLACE 1
+
+/**
+ * fs_rename - Rename a file
+ * @oldname: File name of the file to rename
+ * @newname: New file name
+ * @flags: 0, or FS_RENAME_REPLACE to replace a file named @newname
+ *
+ * Give the file @oldname the name @newname. Only its directory entry changes:
+ * no data block is read or written, and its open file descriptors stay valid.
+ * With FS_RENAME_REPLACE, a file named @newname is deleted in the same
+ * metadata update, so that a concurrent fs_open() of @newname opens either
+ * the replaced file or the renamed one.
+ *
+ * Return: -1 if there is no file named @oldname, if @newname or @flags is
+ * invalid, or if a file named @newname exists and FS_RENAME_REPLACE is not
+ * given or it is open. 0 otherwise, also when @oldname and @newname are the same.
+ */
+int fs_rename(const char *oldname, const char *newname, int flags);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +107,56 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * struct fs_dirent - Description of a file
+ * @name: File name
+ * @size: Size of the file in bytes
+ * @first_blk: First data block, 0xFFFF if the file has none
+ * @extents: Number of runs of consecutive data blocks the file is made of
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	uint16_t first_blk;
+	uint32_t extents;
+};
+
+/**
+ * fs_readdir_cb - Callback of fs_readdir()
+ * @ent: Description of a file, valid during the call only
+ * @data: Pointer given to fs_readdir()
+ *
+ * Return: 0 to go on with the next file, anything else to stop.
+ */
+typedef int (*fs_readdir_cb)(const struct fs_dirent *ent, void *data);
+
+/**
+ * fs_readdir - Go through the files of the file system
+ * @cb: Function called for each file
+ * @data: Pointer passed to @cb
+ *
+ * Call @cb for each file of the root directory, in directory order, without
+ * opening them. The names are those of the directory when the call starts: a
+ * file removed meanwhile is skipped, and one created meanwhile is not seen.
+ * @cb may call the other functions of the file system but fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if @cb is NULL. Otherwise
+ * return the number of files @cb was called for.
+ */
+int fs_readdir(fs_readdir_cb cb, void *data);
+
+/**
+ * fs_stat_name - Get the description of a file by name
+ * @filename: File name
+ * @ent: Description to be filled, or NULL for the size only
+ *
+ * Same as fs_stat() without a file descriptor.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no file named
+ * @filename. Otherwise return the size of the file.
+ */
+int fs_stat_name(const char *filename, struct fs_dirent *ent);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -107,7 +182,8 @@ int fs_open(const char *filename);
  * Close file descriptor @fd.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the bytes of small writes it still held could not be written
+ * (@fd is closed anyway). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -131,9 +207,13 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset can be set beyond the end of the file. A later fs_write() then
+ * leaves a hole between the old end of file and @offset: the file becomes
+ * sparse and the hole reads back as zeros without using any data block.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open), or if @offset is out of bounds (beyond the end of the file). 0
- * otherwise.
+ * open), or if @offset is out of bounds (beyond the maximum file size of
+ * INT_MAX bytes). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -152,6 +232,10 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * Likewise a file never grows past INT_MAX bytes.
+ *
+ * In a sparse file, a block which only holds zeros after the write is turned
+ * into a hole instead of being written.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually written.
@@ -178,4 +262,579 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read at @offset instead of the file offset of the file
+ * descriptor @fd, which is left untouched.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of the
+ * file descriptor @fd, which is left untouched. Writing past the end of the
+ * file leaves a hole, as after fs_lseek().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is past the largest file size. Otherwise return the
+ * number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read() with the bytes going to the buffers of @iov one after the
+ * other, each filled up to its iov_len before the next one. The file is walked
+ * once for all of them.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iovcnt is negative, or if the buffers add up to more than
+ * INT_MAX bytes. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers holding the data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() with the bytes taken from the buffers of @iov one after
+ * the other. The file is walked once for all of them.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iovcnt is negative, or if the buffers add up to more than
+ * INT_MAX bytes. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @size: New size of the file
+ *
+ * Set the size of the file referenced by file descriptor @fd to @size bytes.
+ * When shrinking, the data blocks past the new end of file are released. When
+ * growing, the file is extended with a hole, which reads back as zeros.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @size is larger than INT_MAX, or if the file cannot be extended to
+ * @size bytes. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_punch_hole - Deallocate a range of a file
+ * @fd: File descriptor
+ * @offset: Start of the range
+ * @len: Length of the range in bytes
+ *
+ * Deallocate the data blocks of the file referenced by file descriptor @fd
+ * which are fully inside the range [@offset, @offset + @len), and zero the
+ * remaining bytes of the range. The range reads back as zeros afterwards and
+ * the size of the file does not change. The part of the range beyond the end
+ * of the file is ignored.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the range cannot be updated. 0 otherwise.
+ */
+int fs_punch_hole(int fd, size_t offset, size_t len);
+
+/**
+ * fs_concat - Append a file to another file
+ * @dst: File name of the file to extend
+ * @src: File name of the file to append
+ *
+ * Append the content of file @src to the end of file @dst, then remove @src
+ * from the root directory. When the size of @dst is a multiple of BLOCK_SIZE,
+ * the data blocks of @src are handed over to @dst without being copied.
+ *
+ * Return: -1 if no file named @dst or @src exists, if @dst and @src are the
+ * same file, if either file is currently open, or if the disk runs out of
+ * space. 0 otherwise.
+ */
+int fs_concat(const char *dst, const char *src);
+
+/**
+ * fs_split - Split a file in two
+ * @src: File name of the file to split
+ * @offset: Offset where the file is split
+ * @newname: File name of the new file
+ *
+ * Move the content of file @src past @offset to a new file named @newname,
+ * @src is left with its first @offset bytes. When @offset is a multiple of
+ * BLOCK_SIZE, the data blocks are handed over to @newname without being
+ * copied.
+ *
+ * Return: -1 if no file named @src exists, if @src is currently open, if
+ * @offset is larger than the size of @src, if @newname cannot be created, or
+ * if the disk runs out of space. 0 otherwise.
+ */
+int fs_split(const char *src, size_t offset, const char *newname);
+
+/**
+ * fs_clone - Clone a file
+ * @src: File name of the file to clone
+ * @dst: File name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src. The two
+ * files share their data blocks, a shared block is only copied when one of the
+ * files writes to it.
+ *
+ * Return: -1 if no file named @src exists, if @src is currently being written,
+ * if @dst cannot be created, or if the disk runs out of space. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Freeze the current content of every file of the mounted file system under
+ * the name @name. The blocks of the snapshot are shared with the files, a
+ * shared block is only copied when a file writes to it. The maximum length for
+ * a snapshot name is the same as for a file name.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * mounted read-only, if @name is invalid or already used by a snapshot, if
+ * there are already %FS_SNAPSHOT_MAX_COUNT snapshots, or if the disk runs out
+ * of space. 0 otherwise.
+ */
+int fs_snapshot_create(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Delete the snapshot named @name and free the blocks only the snapshot still
+ * uses.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if the file system is
+ * mounted read-only, or if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot
+ * @diskname: Name of the virtual disk file
+ * @name: Name of the snapshot
+ *
+ * Open the virtual disk file @diskname and mount the snapshot named @name of
+ * the file system it contains, read-only. Files are opened and read as with
+ * fs_mount(), every function which would modify the file system fails. The
+ * virtual disk is not written, not even by fs_umount().
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_mount(const char *diskname, const char *name);
+
+/**
+ * fs_journal_create - Add a metadata journal to the file system
+ * @nblocks: Number of blocks of the journal
+ *
+ * Reserve @nblocks data blocks of the currently mounted file system for a
+ * journal of its metadata. Metadata changes are then logged as compact records
+ * and committed a group of operations at a time, the FAT, root directory and
+ * superblock being written in place only once the journal fills up and at
+ * fs_umount(). After a crash, fs_mount() replays the committed changes, so the
+ * file system is left as it was after one of its last operations.
+ *
+ * Return: -1 if no FS is currently mounted, if it already has a journal, if
+ * @nblocks is lower than 8, or if there are not @nblocks free data blocks. 0
+ * otherwise.
+ */
+int fs_journal_create(size_t nblocks);
+
+/**
+ * fs_log_mount - Mount a file system for small random writes
+ * @diskname: Name of the virtual disk file
+ *
+ * Mount the file system of @diskname like fs_mount(). Small writes which
+ * overwrite part of a single block of a file are then appended to a log region
+ * of the disk instead of being merged into their block one by one; reads see
+ * them right away. The log is written sequentially, reaches the disk when a
+ * segment fills up and at fs_close(), and is compacted into the files when it
+ * is full, before other operations which need it, and at fs_umount(). The
+ * first log-structured mount reserves a 16th of the data blocks for the log,
+ * 17 to 65 of them.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if there is no room for the log. 0 otherwise.
+ */
+int fs_log_mount(const char *diskname);
+
+/**
+ * fs_readonly_mount - Mount a file system read-only, shared with other processes
+ * @diskname: Name of the virtual disk file
+ *
+ * Open the virtual disk file @diskname read-only and mount the file system it
+ * contains. Files are opened and read as with fs_mount(), every function which
+ * would modify the file system fails, and the virtual disk is never written,
+ * not even by fs_umount(). The FAT and the root directory are mapped from the
+ * virtual disk rather than copied, so any number of processes can mount it at
+ * once and share them, and reads take no lock. A writer must not use the disk
+ * meanwhile.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_readonly_mount(const char *diskname);
+
+/**
+ * fs_fsync - Synchronize a file
+ * @fd: File descriptor
+ *
+ * Small writes (less than a block) through @fd are gathered in memory while
+ * they follow each other within a block, and only written when they move to
+ * another block, at fs_lseek(), at fs_close() or here. Write back these bytes,
+ * the pending part of the write log, and commit the metadata journal, so that
+ * every write done so far survives a crash.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the pending data cannot be written. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * struct fs_completion - Completion of an asynchronous call
+ * @fd: File descriptor of the call
+ * @result: What fs_pread() or fs_pwrite() would have returned
+ * @data: Pointer given to the call
+ */
+struct fs_completion {
+	int fd;
+	int result;
+	void *data;
+};
+
+/**
+ * fs_async_cb - Callback of an asynchronous call
+ * @fd: File descriptor of the call
+ * @result: What fs_pread() or fs_pwrite() would have returned
+ * @data: Pointer given to the call
+ *
+ * Called from a thread of the file system, it should not block for long, as
+ * it holds up the other calls meanwhile, and must not call fs_umount().
+ */
+typedef void (*fs_async_cb)(int fd, int result, void *data);
+
+/**
+ * fs_read_async - Read from a file at a given offset, without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ * @cb: Function called once the read is done, or NULL
+ * @data: Pointer passed to @cb or found in the completion
+ *
+ * Queue the fs_pread() of @count bytes at @offset into @buf and return right
+ * away. A large read is cut into pieces read in parallel by the threads of
+ * the file system. Once the read is done, @cb is called, or if @cb is NULL a
+ * completion is queued for fs_async_reap() and fs_async_fd() becomes readable.
+ * @buf must stay valid and @fd open until then. fs_umount() waits for the
+ * calls still running.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @count is larger than INT_MAX, or if the call cannot be queued. 0
+ * otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, size_t offset,
+		  fs_async_cb cb, void *data);
+
+/**
+ * fs_write_async - Write to a file at a given offset, without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ * @cb: Function called once the write is done, or NULL
+ * @data: Pointer passed to @cb or found in the completion
+ *
+ * Same as fs_read_async() for fs_pwrite(). Writes queued one after the other
+ * may run in any order, or at the same time.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @count is larger than INT_MAX, if @offset is past the largest
+ * file size, or if the call cannot be queued. 0 otherwise.
+ */
+int fs_write_async(int fd, const void *buf, size_t count, size_t offset,
+		   fs_async_cb cb, void *data);
+
+/**
+ * fs_async_fd - Get the file descriptor of the completion queue
+ *
+ * Get an eventfd which is readable (for poll(), select() or epoll) while the
+ * completion queue of the asynchronous calls without callback is not empty.
+ * Do not read it, fs_async_reap() does. It stays open until the program ends.
+ *
+ * Return: -1 if the eventfd cannot be created. The file descriptor otherwise.
+ */
+int fs_async_fd(void);
+
+/**
+ * fs_async_reap - Take completions out of the completion queue
+ * @c: Array to be filled with completions
+ * @max: Number of entries of @c
+ *
+ * Move up to @max completions of asynchronous calls without callback into @c,
+ * oldest first, without waiting.
+ *
+ * Return: -1 if @c is NULL or @max is negative. Otherwise return the number of
+ * completions moved, 0 if the queue is empty.
+ */
+int fs_async_reap(struct fs_completion *c, int max);
+
+/**
+ * fs_read_workers - Set how many threads read a large range
+ * @workers: Number of threads, between 1 and 16
+ *
+ * A call to fs_read() or fs_pread() of 1 MiB or more is cut into pieces read
+ * at once by @workers threads, the calling one included, straight into its
+ * buffer. With 1 the calling thread reads it alone. The default is 4.
+ *
+ * Return: -1 if @workers is out of bounds. Otherwise return the previous
+ * number of threads.
+ */
+int fs_read_workers(int workers);
+
+/** fs_mmap() flag: a private copy-on-write view, writable, never written back */
+#define FS_MAP_PRIVATE 1
+
+/**
+ * fs_mmap - Map a range of a file into memory
+ * @fd: File descriptor
+ * @offset: File offset of the range
+ * @len: Length of the range, in bytes
+ * @flags: 0 for a read-only view, or FS_MAP_PRIVATE
+ *
+ * Give a view of @len bytes of the file at @offset without copying them: the
+ * data blocks are mapped from the virtual disk file, several mappings side by
+ * side if the file is fragmented, and holes read as zeros. The view reflects
+ * later writes in place to the same blocks, but not the blocks a file gets
+ * afterwards by copy-on-write, truncation or deletion. The bytes of its last
+ * block past @len are unspecified. It stays valid until fs_munmap(), even
+ * after the file is closed or the file system unmounted.
+ *
+ * Return: NULL if file descriptor @fd is invalid (out of bounds or not
+ * currently open), if @len is 0, if the range is not within the file, if
+ * @flags is invalid, or if the view cannot be made. The address of the view
+ * otherwise.
+ */
+void *fs_mmap(int fd, size_t offset, size_t len, int flags);
+
+/**
+ * fs_munmap - Release a view of a file
+ * @addr: Address returned by fs_mmap()
+ * @len: Length given to fs_mmap()
+ *
+ * Return: -1 if @addr is NULL, if @len is 0, or if the view cannot be
+ * released. 0 otherwise.
+ */
+int fs_munmap(void *addr, size_t len);
+
+/**
+ * fs_batch_begin - Start a batch of metadata operations
+ *
+ * Until the matching fs_batch_commit(), fs_create(), fs_delete(), the writes
+ * and fs_truncate() change the metadata in memory only, instead of writing it
+ * back each time. The batch covers every thread using the file system.
+ * Batches nest, only the outermost commit writes back. Other operations which
+ * write metadata back, such as fs_fsync() or fs_snapshot_create(), commit the
+ * batch so far. On a disk with a journal, the blocks freed in a batch are
+ * reused once it commits.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is mounted read-only. 0
+ * otherwise.
+ */
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_commit - Commit a batch of metadata operations
+ *
+ * Write back the data still buffered, then the metadata changed since
+ * fs_batch_begin(), at once: one journal transaction if the disk has a
+ * journal, each changed block of metadata written once otherwise.
+ *
+ * Return: -1 if no FS is currently mounted, if no batch was started, or if
+ * the metadata cannot be written. 0 otherwise.
+ */
+int fs_batch_commit(void);
+
+/**
+ * fs_import - Create a file from a host file
+ * @host_fd: Descriptor of a regular host file, open for reading
+ * @filename: File name
+ *
+ * Create the file @filename with the whole content of @host_fd, read from its
+ * start whatever its file offset. The data goes from the host file to the
+ * virtual disk file within the kernel when it can, and the file appears with
+ * all of it or not at all.
+ *
+ * Return: -1 if @host_fd is not a regular file or is larger than INT_MAX
+ * bytes, if @filename is invalid or already exists, if the root directory or
+ * the disk is full, if the host file cannot be read, or if the metadata cannot
+ * be written back. Otherwise return the number of bytes imported.
+ */
+int fs_import(int host_fd, const char *filename);
+
+/**
+ * fs_export - Copy a file to a host descriptor
+ * @filename: File name
+ * @host_fd: Host descriptor open for writing: a file, a pipe or a socket
+ *
+ * Write the whole content of the file @filename to @host_fd, at its file
+ * offset, within the kernel when it can. Holes are written as zeros.
+ *
+ * Return: -1 if there is no file named @filename, if it is larger than
+ * INT_MAX bytes, or if @host_fd cannot be written. Otherwise return the
+ * number of bytes exported.
+ */
+int fs_export(const char *filename, int host_fd);
+
+/**
+ * fs_import_dir - Create files from all the regular files of a host directory
+ * @host_dir: Path of the host directory
+ * @workers: Number of threads moving the data, between 1 and 16
+ *
+ * Create one file per regular file of @host_dir, under the same name and with
+ * the same content, as fs_import() would. Other entries, such as directories,
+ * are skipped. The data of each file is given consecutive blocks when the disk
+ * has them, the files are copied by @workers threads at once, and they all
+ * appear together, in name order, or none of them does.
+ *
+ * Return: -1 if @workers is out of range, if @host_dir cannot be read, if one
+ * of its files has an invalid name, already exists, is larger than INT_MAX
+ * bytes or cannot be read, if the root directory or the disk cannot hold
+ * them all, or if the metadata cannot be written back. Otherwise return the
+ * number of files imported.
+ */
+int fs_import_dir(const char *host_dir, int workers);
+
+/**
+ * fs_lock_range - Lock a range of a file
+ * @fd: File descriptor
+ * @offset: Start of the range
+ * @len: Length of the range in bytes, 0 for up to the end of the file however
+ *       far it grows
+ * @exclusive: Non-zero for an exclusive lock, 0 for a shared one
+ *
+ * Lock the bytes [@offset, @offset + @len) of the file referenced by file
+ * descriptor @fd, waiting until no other file descriptor holds a lock which
+ * overlaps the range and is exclusive, or would be (shared locks only exclude
+ * exclusive ones). The lock belongs to @fd, overlapping locks of @fd do not
+ * wait for each other, and it lasts until fs_unlock_range() or fs_close().
+ *
+ * Locks are advisory: fs_read() and fs_write() do not check them. Writes of a
+ * block or more to disjoint ranges of one file by different threads do not
+ * wait for each other anyway, a lock is for threads which have to agree on who
+ * writes where, or readers which must not see a range being updated.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there is no memory for the lock. 0 otherwise.
+ */
+int fs_lock_range(int fd, size_t offset, size_t len, int exclusive);
+
+/**
+ * fs_unlock_range - Unlock a range of a file
+ * @fd: File descriptor
+ * @offset: Start of the range
+ * @len: Length of the range in bytes, 0 for up to the end of the file
+ *
+ * Release the parts of the locks of file descriptor @fd which lie in the range
+ * [@offset, @offset + @len). A lock which extends on both sides of the range is
+ * split in two.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if there is no memory to split a lock. 0 otherwise.
+ */
+int fs_unlock_range(int fd, size_t offset, size_t len);
+
+/** fs_set_compression() flag: compress the data with LZ4 */
+#define FS_COMPRESS_LZ4 1
+
+/**
+ * fs_set_compression - Turn compression of a file on or off
+ * @filename: File name
+ * @flags: 0, or FS_COMPRESS_LZ4 to compress the data of the file
+ *
+ * Change how the data of the empty file @filename is stored. The data of a
+ * compressed file is cut in chunks of 64 KiB compressed one by one, so
+ * reading a range only decompresses the chunks it covers, and writing a range
+ * recompresses them. A chunk which does not compress is stored as is. Writes
+ * of whole chunks are the cheapest. Compression is transparent to the other
+ * calls, which all report the size of the data, but a compressed file holds
+ * at most 64 MiB, and fs_punch_hole(), fs_concat(), fs_split() and fs_mmap()
+ * fail on it.
+ *
+ * Return: -1 if no FS is currently mounted or it is mounted read-only, if
+ * there is no file named @filename or it is not empty, or if @flags is
+ * invalid. 0 otherwise.
+ */
+int fs_set_compression(const char *filename, int flags);
+
+/**
+ * struct fs_dedup_stats - Outcome of fs_dedup()
+ * @logical: Data blocks of the files, and of the files of the snapshots, as
+ * many times as files hold them
+ * @physical: Data blocks they take on the disk
+ * @freed: Data blocks given back by the call
+ */
+struct fs_dedup_stats {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t freed;
+};
+
+/**
+ * fs_dedup - Share the identical data blocks of the files
+ * @st: Filled with the outcome if not NULL
+ *
+ * Hash every data block of the files and of the snapshots, and give back the
+ * ones another block holds the same bytes of: files share blocks like clones
+ * do, and a shared block is copied before it changes. A data block has a
+ * single successor, so only the ends of files can be shared: copies of a file
+ * share all their blocks, files which differ at the start share the rest, and
+ * files which differ towards the end share nothing before the difference.
+ * The bytes are compared before sharing anything.
+ *
+ * Return: -1 if no FS is currently mounted or it is mounted read-only, or if
+ * the disk has no room for the reference counts. Otherwise return 0.
+ */
+int fs_dedup(struct fs_dedup_stats *st);
+
+/**
+ * fs_set_dedup - Turn dedup mode on or off
+ * @on: 1 to turn it on, 0 to turn it off
+ *
+ * Dedup mode is a setting of the disk, kept until it is turned off. Turning it
+ * on does what fs_dedup() does, and keeps an index of the fingerprints of the
+ * data blocks on the disk. Then the blocks the writes go through are hashed
+ * on the way, and once a descriptor which wrote is closed the end of its file
+ * is shared with identical blocks the index knows, as fs_dedup() would.
+ * Closing such a descriptor stops the other calls meanwhile. Turning it off
+ * leaves the blocks shared so far as they are.
+ *
+ * Return: -1 if no FS is currently mounted or it is mounted read-only, or if
+ * the disk runs out of space. 0 otherwise.
+ */
+int fs_set_dedup(int on);
+
 #endif /* _FS_H */
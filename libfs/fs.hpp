@@ -0,0 +1,368 @@
+#ifndef _FS_HPP
+#define _FS_HPP
+
+/*
+ * C++20 front-end of libfs: RAII file handles, and coroutines awaiting
+ * fs_read_async() and fs_write_async() on a small bundled executor.
+ *
+ *	libfs::Executor ex;
+ *	libfs::Fs fs(ex);
+ *	ex.spawn([&]() -> libfs::Task<> {
+ *		libfs::File f = libfs::File::open("name");
+ *		int n = co_await fs.read(f, std::span(buf));
+ *	}());
+ *	ex.run();
+ *
+ * Nothing here allocates per request: the state of an operation lives in the
+ * awaiter, which is part of the coroutine frame, and is queued back to the
+ * executor through an intrusive list. Errors are reported as by the C API,
+ * with -1 results and invalid handles, not exceptions.
+ */
+
+#include <coroutine>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "fs.h"
+}
+
+namespace libfs {
+
+class Executor;
+
+/**
+ * File - Move-only handle of an open file
+ *
+ * Closed with fs_close() when destroyed, which must not happen while one of
+ * its operations is still in flight. The handle keeps its own offset for the
+ * reads and writes which are not given one.
+ */
+class File {
+public:
+	File() = default;
+	explicit File(int fd) : fd_(fd) {}
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+	File(File &&o) noexcept : fd_(std::exchange(o.fd_, -1)), pos_(o.pos_) {}
+	File &operator=(File &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			fd_ = std::exchange(o.fd_, -1);
+			pos_ = o.pos_;
+		}
+		return *this;
+	}
+	~File() { close(); }
+
+	/* invalid if fs_open() fails */
+	static File open(const char *name) { return File(fs_open(name)); }
+
+	explicit operator bool() const { return fd_ >= 0; }
+	int fd() const { return fd_; }
+	int release() { return std::exchange(fd_, -1); }
+	size_t tell() const { return pos_; }
+	void seek(size_t pos) { pos_ = pos; }
+	int size() const { return fs_stat(fd_); }
+
+	/* -1 if fs_close() fails; the handle is invalid afterwards anyway */
+	int close()
+	{
+		if (fd_ < 0)
+			return 0;
+		return fs_close(std::exchange(fd_, -1));
+	}
+
+private:
+	friend class Fs;
+
+	int fd_ = -1;
+	size_t pos_ = 0;
+};
+
+/*
+ * State of one operation, embedded in the awaiter. The libfs worker which
+ * completes it only stores the result and queues it to the executor, the
+ * coroutine is resumed on the thread running Executor::run().
+ */
+struct IoState {
+	Executor *ex;
+	std::coroutine_handle<> h;
+	int result = -1;
+	IoState *next = nullptr;
+};
+
+/**
+ * Executor - Single-threaded loop resuming coroutines
+ *
+ * Runs the spawned tasks on the thread calling run(), and resumes them when
+ * their operations complete.
+ */
+class Executor {
+public:
+	Executor() = default;
+	Executor(const Executor &) = delete;
+	Executor &operator=(const Executor &) = delete;
+
+	template <typename T> void spawn(T &&task)
+	{
+		runq_.push_back(task.handle());
+		tasks_.push_back(task.release());
+	}
+
+	/* run until all the spawned tasks are done, then free them */
+	void run()
+	{
+		for (;;) {
+			while (!runq_.empty()) {
+				std::coroutine_handle<> h = runq_.front();
+				runq_.pop_front();
+				h.resume();
+			}
+			if (all_done())
+				break;
+
+			IoState *s;
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				cv_.wait(lk, [this] { return done_ != nullptr; });
+				s = std::exchange(done_, nullptr);
+			}
+			/* the list is newest first, resume in completion order */
+			IoState *prev = nullptr;
+			while (s)
+				prev = std::exchange(s, std::exchange(s->next, prev));
+			for (; prev; prev = prev->next)
+				runq_.push_back(prev->h);
+		}
+		for (std::coroutine_handle<> h : tasks_)
+			h.destroy();
+		tasks_.clear();
+	}
+
+	/* called from a libfs worker */
+	void post(IoState *s)
+	{
+		std::lock_guard<std::mutex> lk(m_);
+		s->next = done_;
+		done_ = s;
+		cv_.notify_one();
+	}
+
+private:
+	bool all_done() const
+	{
+		for (std::coroutine_handle<> h : tasks_)
+			if (!h.done())
+				return false;
+		return true;
+	}
+
+	std::mutex m_;
+	std::condition_variable cv_;
+	IoState *done_ = nullptr;
+	std::deque<std::coroutine_handle<>> runq_;
+	std::vector<std::coroutine_handle<>> tasks_;
+};
+
+/**
+ * Task - Coroutine returning a T, started when awaited or spawned
+ */
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+	std::coroutine_handle<> cont;
+	std::exception_ptr err;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct Final {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			std::coroutine_handle<> c = h.promise().cont;
+			return c ? c : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	Final final_suspend() noexcept { return {}; }
+	void unhandled_exception() { err = std::current_exception(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+	T value{};
+
+	Task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+	T result()
+	{
+		if (err)
+			std::rethrow_exception(err);
+		return std::move(value);
+	}
+};
+
+template <> struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+	void result()
+	{
+		if (err)
+			std::rethrow_exception(err);
+	}
+};
+
+} // namespace detail
+
+template <typename T> class Task {
+public:
+	using promise_type = detail::Promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit Task(handle_type h) : h_(h) {}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	Task(Task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	handle_type handle() const { return h_; }
+	handle_type release() { return std::exchange(h_, nullptr); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().cont = c;
+		return h_;
+	}
+	T await_resume() { return h_.promise().result(); }
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/*
+ * Awaiter of one read or write. If it cannot be queued the coroutine does not
+ * suspend and gets -1; once resumed it gets what fs_pread() or fs_pwrite()
+ * would have returned.
+ */
+class IoOp {
+public:
+	IoOp(Executor &ex, int fd, bool write, void *buf, size_t count,
+	     size_t offset, size_t *pos)
+		: s_{&ex}, fd_(fd), write_(write), buf_(buf), count_(count),
+		  offset_(offset), pos_(pos) {}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		s_.h = h;
+		int ret = write_ ?
+			fs_write_async(fd_, buf_, count_, offset_, done, &s_) :
+			fs_read_async(fd_, buf_, count_, offset_, done, &s_);
+		return ret == 0;
+	}
+	int await_resume() noexcept
+	{
+		if (pos_ && s_.result > 0)
+			*pos_ = offset_ + s_.result;
+		return s_.result;
+	}
+
+private:
+	static void done(int, int result, void *data)
+	{
+		IoState *s = static_cast<IoState *>(data);
+		s->result = result;
+		s->ex->post(s);
+	}
+
+	IoState s_;
+	int fd_;
+	bool write_;
+	void *buf_;
+	size_t count_;
+	size_t offset_;
+	size_t *pos_;
+};
+
+/**
+ * Fs - Awaitable reads and writes of the mounted file system
+ *
+ * The operations complete on the executor given at construction. The ones
+ * taking a File without offset use and move the offset of the handle, and
+ * should not overlap on the same handle.
+ */
+class Fs {
+public:
+	explicit Fs(Executor &ex) : ex_(ex) {}
+
+	IoOp read(int fd, std::span<std::byte> buf, size_t offset)
+	{
+		return IoOp(ex_, fd, false, buf.data(), buf.size(), offset, nullptr);
+	}
+	IoOp write(int fd, std::span<const std::byte> buf, size_t offset)
+	{
+		return IoOp(ex_, fd, true, const_cast<std::byte *>(buf.data()),
+			    buf.size(), offset, nullptr);
+	}
+
+	template <typename U, size_t N>
+	IoOp read(const File &f, std::span<U, N> buf, size_t offset)
+	{
+		return read(f.fd_, std::as_writable_bytes(buf), offset);
+	}
+	template <typename U, size_t N>
+	IoOp write(const File &f, std::span<U, N> buf, size_t offset)
+	{
+		return write(f.fd_, std::as_bytes(buf), offset);
+	}
+
+	template <typename U, size_t N>
+	IoOp read(File &f, std::span<U, N> buf)
+	{
+		auto b = std::as_writable_bytes(buf);
+		return IoOp(ex_, f.fd_, false, b.data(), b.size(), f.pos_, &f.pos_);
+	}
+	template <typename U, size_t N>
+	IoOp write(File &f, std::span<U, N> buf)
+	{
+		auto b = std::as_bytes(buf);
+		return IoOp(ex_, f.fd_, true, const_cast<std::byte *>(b.data()),
+			    b.size(), f.pos_, &f.pos_);
+	}
+
+private:
+	Executor &ex_;
+};
+
+} // namespace libfs
+
+#endif /* _FS_HPP */
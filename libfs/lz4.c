@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+/* Shortest match */
+#define MIN_MATCH 4
+/* The last match starts this far from the end at least */
+#define MF_LIMIT 12
+/* The last bytes are always literals */
+#define LAST_LITERALS 5
+/* Farthest match */
+#define MAX_DISTANCE 65535
+
+/* Hash table of the compressor, positions of the last 4-byte sequences seen */
+#define HASH_LOG 12
+/* Every 2^SKIP_TRIGGER misses in a row, the search steps one byte further */
+#define SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Number of equal bytes at @a and @b, stopping at @limit for @a */
+static size_t common(const uint8_t *a, const uint8_t *b, const uint8_t *limit)
+{
+	const uint8_t *start = a;
+
+	while (a + 8 <= limit) {
+		uint64_t x = read64(a) ^ read64(b);
+
+		if (x)
+			return a - start + (__builtin_ctzll(x) >> 3);
+		a += 8;
+		b += 8;
+	}
+	while (a < limit && *a == *b) {
+		a++;
+		b++;
+	}
+	return a - start;
+}
+
+/* Extra bytes of a length of 15 or more, after its token */
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* Token, literals, and the match if @ml is not 0; NULL if out of room */
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			size_t ll, size_t off, size_t ml)
+{
+	size_t need = 1 + ll + ll / 255 + 1 + (ml ? 2 + ml / 255 + 1 : 0);
+	uint8_t *token = op++;
+
+	if (need > (size_t)(oend - token))
+		return NULL;
+
+	*token = (ll < 15 ? ll : 15) << 4;
+	if (ll >= 15)
+		op = put_len(op, ll - 15);
+	memcpy(op, lit, ll);
+	op += ll;
+	if (!ml)
+		return op;
+
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	ml -= MIN_MATCH;
+	*token |= ml < 15 ? ml : 15;
+	if (ml >= 15)
+		op = put_len(op, ml - 15);
+	return op;
+}
+
+int lz4_bound(int n)
+{
+	return n + n / 255 + 16;
+}
+
+int lz4_compress(const void *src, int n, void *dst, int cap)
+{
+	const uint8_t *base = src;
+	const uint8_t *ip = base, *anchor = base, *end = base + n;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t table[1 << HASH_LOG];
+
+	if (n < 0 || cap < 0)
+		return 0;
+
+	if (n > MF_LIMIT) {
+		const uint8_t *mflimit = end - MF_LIMIT;
+		const uint8_t *matchlimit = end - LAST_LITERALS;
+		unsigned misses = 0;
+
+		memset(table, 0, sizeof(table));
+		for (ip++; ip < mflimit;) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash32(seq);
+			const uint8_t *ref = base + table[h];
+
+			table[h] = ip - base;
+			if (ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+				ip += 1 + (misses++ >> SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+
+			/* grow the match backwards over the pending literals */
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			size_t ml = MIN_MATCH + common(ip + MIN_MATCH, ref + MIN_MATCH, matchlimit);
+
+			op = put_seq(op, oend, anchor, ip - anchor, ip - ref, ml);
+			if (!op)
+				return 0;
+			ip += ml;
+			anchor = ip;
+			if (ip < mflimit)
+				table[hash32(read32(ip - 2))] = ip - 2 - base;
+		}
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/* Length of 15 or more, NULL if @src ends first */
+static const uint8_t *get_len(const uint8_t *ip, const uint8_t *iend,
+			      size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+int lz4_decompress(const void *src, int n, void *dst, int cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *op = dst, *oend = op + cap;
+
+	if (n <= 0 || cap < 0)
+		return -1;
+
+	for (;;) {
+		unsigned token = *ip++;
+		size_t ll = token >> 4, ml = token & 15;
+
+		if (ll == 15 && !(ip = get_len(ip, iend, &ll)))
+			return -1;
+		if (ll > (size_t)(iend - ip))
+			return -1;
+		if (ll >= (size_t)(oend - op)) { /* as much as asked for */
+			memcpy(op, ip, oend - op);
+			return cap;
+		}
+		if (ll <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16); /* one fixed copy for the short ones */
+		else
+			memcpy(op, ip, ll);
+		op += ll;
+		ip += ll;
+		if (ip == iend) /* the last sequence has no match */
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - (uint8_t *)dst))
+			return -1;
+		if (ml == 15 && !(ip = get_len(ip, iend, &ml)))
+			return -1;
+		ml += MIN_MATCH;
+		if (ml > (size_t)(oend - op))
+			ml = oend - op;
+
+		const uint8_t *ref = op - off;
+		if (off >= 16 && ml <= 16 && oend - op >= 16) {
+			memcpy(op, ref, 16);
+		} else if (off >= ml) {
+			memcpy(op, ref, ml);
+		} else { /* overlapping, a run repeating the last @off bytes */
+			for (size_t i = 0; i < ml; i++)
+				op[i] = ref[i];
+		}
+		op += ml;
+		if (op == oend)
+			break;
+		if (ip >= iend)
+			return -1;
+	}
+	return op - (uint8_t *)dst;
+}
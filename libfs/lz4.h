@@ -0,0 +1,47 @@
+#ifndef _LZ4_H
+#define _LZ4_H
+
+/*
+ * LZ4 block format, compatible with the blocks of liblz4: a sequence of
+ * tokens, each with literals and a match of 4 bytes or more up to 64 KiB back.
+ * No frame, no checksum, the caller stores the sizes.
+ */
+
+/**
+ * lz4_bound - Largest compressed size of a buffer
+ * @n: Size of the buffer, in bytes
+ *
+ * Return: The size lz4_compress() can reach for @n bytes of incompressible data.
+ */
+int lz4_bound(int n);
+
+/**
+ * lz4_compress - Compress a buffer
+ * @src: Data to compress
+ * @n: Size of @src, in bytes
+ * @dst: Buffer to be filled with the compressed data
+ * @cap: Size of @dst, in bytes
+ *
+ * Return: 0 if @n is negative or if the compressed data does not fit in @cap
+ * bytes. Otherwise return the size of the compressed data.
+ */
+int lz4_compress(const void *src, int n, void *dst, int cap);
+
+/**
+ * lz4_decompress - Decompress a buffer
+ * @src: Compressed data
+ * @n: Size of @src, in bytes
+ * @dst: Buffer to be filled with the data
+ * @cap: Size of @dst, in bytes
+ *
+ * Decompression stops once @cap bytes are there, so the start of the data
+ * costs less than the whole of it. Nothing is read past @src + @n nor written
+ * past @dst + @cap, whatever @src holds. The bytes of @dst past the data may
+ * be overwritten.
+ *
+ * Return: -1 if @src is malformed. Otherwise return the size of the data, at
+ * most @cap.
+ */
+int lz4_decompress(const void *src, int n, void *dst, int cap);
+
+#endif /* _LZ4_H */
@@ -0,0 +1,785 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define BENCH_FILE "bench-file"
+#define BENCH_FILE_SZ (1024 * 1024)
+#define BENCH_IO_SZ 512
+
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* create BENCH_FILE filled with @model */
+void bench_setup(char *diskname, char *model)
+{
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(BENCH_FILE);
+	if (fs_create(BENCH_FILE))
+		die("Cannot create file");
+	fd = fs_open(BENCH_FILE);
+	if (fd < 0 || fs_write(fd, model, BENCH_FILE_SZ) != BENCH_FILE_SZ)
+		die("Cannot fill file");
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* read BENCH_FILE back and compare it with @model, then remove it */
+void bench_check(char *diskname, char *model)
+{
+	char *buf = malloc(BENCH_FILE_SZ);
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fd = fs_open(BENCH_FILE);
+	if (fd < 0 || fs_read(fd, buf, BENCH_FILE_SZ) != BENCH_FILE_SZ
+		|| memcmp(buf, model, BENCH_FILE_SZ))
+		die("File content differs");
+	fs_close(fd);
+	fs_delete(BENCH_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+/* @count random writes of BENCH_IO_SZ bytes, through @mount */
+void bench_randwrite_mode(char *diskname, int count, const char *mode,
+			  int (*mount)(const char *))
+{
+	char *model = malloc(BENCH_FILE_SZ);
+	char io[BENCH_IO_SZ];
+	double start, wrote, end;
+	int fd;
+
+	for (int i = 0; i < BENCH_FILE_SZ; i++)
+		model[i] = 'a' + i % 26;
+	bench_setup(diskname, model);
+
+	srand(1);
+	if (mount(diskname))
+		die("Cannot mount diskname");
+	fd = fs_open(BENCH_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now_ms();
+	for (int i = 0; i < count; i++) {
+		size_t offset = (size_t)(rand() % (BENCH_FILE_SZ / BENCH_IO_SZ)) * BENCH_IO_SZ;
+
+		memset(io, 'A' + i % 26, BENCH_IO_SZ);
+		memcpy(model + offset, io, BENCH_IO_SZ);
+		if (fs_lseek(fd, offset) || fs_write(fd, io, BENCH_IO_SZ) != BENCH_IO_SZ)
+			die("Cannot write file");
+	}
+	wrote = now_ms();
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	end = now_ms();
+
+	printf("randwrite %-5s %d x %d bytes: %.1f ms, %.0f writes/s (%.1f ms with umount)\n",
+	       mode, count, BENCH_IO_SZ, wrote - start,
+	       count / ((wrote - start) / 1000.0), end - start);
+
+	bench_check(diskname, model);
+	free(model);
+}
+
+void bench_randwrite(int argc, char **argv)
+{
+	int count;
+
+	if (argc < 1)
+		die("need <diskname> [count]");
+	count = argc > 1 ? atoi(argv[1]) : 10000;
+
+	bench_randwrite_mode(argv[0], count, "rmw", fs_mount);
+	bench_randwrite_mode(argv[0], count, "log", fs_log_mount);
+}
+
+/* @count appends of @size bytes records to an empty file */
+void bench_append(int argc, char **argv)
+{
+	char *diskname;
+	int count, size, fd;
+	char *rec;
+	double start, end;
+
+	if (argc < 1)
+		die("need <diskname> [count] [size]");
+	diskname = argv[0];
+	count = argc > 1 ? atoi(argv[1]) : 20000;
+	size = argc > 2 ? atoi(argv[2]) : 100;
+
+	rec = malloc(size);
+	memset(rec, 'r', size);
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(BENCH_FILE);
+	if (fs_create(BENCH_FILE))
+		die("Cannot create file");
+	fd = fs_open(BENCH_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now_ms();
+	for (int i = 0; i < count; i++)
+		if (fs_write(fd, rec, size) != size)
+			die("Cannot write file");
+	if (fs_close(fd))
+		die("Cannot close file");
+	end = now_ms();
+
+	printf("append %d x %d bytes: %.1f ms, %.0f records/s\n",
+	       count, size, end - start, count / ((end - start) / 1000.0));
+
+	fs_delete(BENCH_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(rec);
+}
+
+#define STRESS_MAX_THREADS 32
+#define STRESS_WRITE_SZ (64 * 1024)
+
+struct stress_arg {
+	int fd;
+	size_t size;
+	unsigned int seed;
+	long ops;
+};
+
+static volatile int stress_stop;
+
+/* random block reads of a file shared by all readers, through one descriptor */
+void *stress_reader(void *arg)
+{
+	struct stress_arg *a = arg;
+	char buf[4096];
+
+	while (!stress_stop) {
+		size_t offset = rand_r(&a->seed) % (a->size / sizeof(buf)) * sizeof(buf);
+
+		if (fs_pread(a->fd, buf, sizeof(buf), offset) != sizeof(buf))
+			die("Cannot read file");
+		a->ops++;
+	}
+	return NULL;
+}
+
+/* random block overwrites of a file of its own */
+void *stress_writer(void *arg)
+{
+	struct stress_arg *a = arg;
+	char buf[4096];
+
+	memset(buf, 'w', sizeof(buf));
+	while (!stress_stop) {
+		size_t offset = rand_r(&a->seed) % (a->size / sizeof(buf)) * sizeof(buf);
+
+		if (fs_pwrite(a->fd, buf, sizeof(buf), offset) != sizeof(buf))
+			die("Cannot write file");
+		a->ops++;
+	}
+	return NULL;
+}
+
+/* @readers threads on BENCH_FILE and @writers threads on files of their own for @ms */
+void bench_stress_run(int readers, int writers, int ms, int fd, int *wfd)
+{
+	pthread_t tid[2 * STRESS_MAX_THREADS];
+	struct stress_arg arg[2 * STRESS_MAX_THREADS];
+	struct timespec wait = { ms / 1000, ms % 1000 * 1000000L };
+	long reads = 0, writes = 0;
+	double start, end;
+	int n = readers + writers;
+
+	stress_stop = 0;
+	start = now_ms();
+	for (int i = 0; i < n; i++) {
+		arg[i].fd = i < readers ? fd : wfd[i - readers];
+		arg[i].size = i < readers ? BENCH_FILE_SZ : STRESS_WRITE_SZ;
+		arg[i].seed = i + 1;
+		arg[i].ops = 0;
+		if (pthread_create(tid + i, NULL, i < readers ? stress_reader : stress_writer, arg + i))
+			die("Cannot create thread");
+	}
+	nanosleep(&wait, NULL);
+	stress_stop = 1;
+	for (int i = 0; i < n; i++) {
+		pthread_join(tid[i], NULL);
+		if (i < readers)
+			reads += arg[i].ops;
+		else
+			writes += arg[i].ops;
+	}
+	end = now_ms();
+
+	printf("stress %2d readers %2d writers: %9.0f reads/s %9.0f writes/s\n",
+	       readers, writers, reads / ((end - start) / 1000.0),
+	       writes / ((end - start) / 1000.0));
+}
+
+void bench_stress(int argc, char **argv)
+{
+	char *model = malloc(BENCH_FILE_SZ);
+	char *wbuf = calloc(1, STRESS_WRITE_SZ);
+	int writers, ms, fd, wfd[STRESS_MAX_THREADS];
+
+	if (argc < 1)
+		die("need <diskname> [writers] [ms]");
+	writers = argc > 1 ? atoi(argv[1]) : 2;
+	ms = argc > 2 ? atoi(argv[2]) : 500;
+	if (writers < 0 || writers > STRESS_MAX_THREADS - 1)
+		die("at most %d writers", STRESS_MAX_THREADS - 1);
+
+	for (int i = 0; i < BENCH_FILE_SZ; i++)
+		model[i] = 'a' + i % 26;
+	bench_setup(argv[0], model);
+
+	if (fs_mount(argv[0]))
+		die("Cannot mount diskname");
+	fd = fs_open(BENCH_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+	for (int i = 0; i < writers; i++) {
+		char name[FS_FILENAME_LEN];
+
+		snprintf(name, sizeof(name), "stress-%d", i);
+		fs_delete(name);
+		if (fs_create(name) || (wfd[i] = fs_open(name)) < 0
+		    || fs_write(wfd[i], wbuf, STRESS_WRITE_SZ) != STRESS_WRITE_SZ)
+			die("Cannot create file");
+	}
+
+	for (int readers = 1; readers <= STRESS_MAX_THREADS; readers *= 2)
+		bench_stress_run(readers, writers, ms, fd, wfd);
+
+	for (int i = 0; i < writers; i++) {
+		char name[FS_FILENAME_LEN];
+
+		snprintf(name, sizeof(name), "stress-%d", i);
+		fs_close(wfd[i]);
+		fs_delete(name);
+	}
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	bench_check(argv[0], model);
+	free(wbuf);
+	free(model);
+}
+
+#define UPLOAD_FILE "upload-file"
+#define UPLOAD_SZ (8 * 1024 * 1024)
+#define UPLOAD_MAX_THREADS 16
+
+struct upload_arg {
+	int fd;
+	int id;
+	int threads;
+	size_t chunk;
+	char *model;
+};
+
+/* chunks id, id + threads, ... of the upload, each one at its own offset */
+void *upload_worker(void *arg)
+{
+	struct upload_arg *a = arg;
+
+	for (size_t i = a->id; i * a->chunk < UPLOAD_SZ; i += a->threads)
+		if (fs_pwrite(a->fd, a->model + i * a->chunk, a->chunk, i * a->chunk) != (int)a->chunk)
+			die("Cannot write chunk %zu", i);
+	return NULL;
+}
+
+/* @threads threads writing the chunks of an empty file at once, then read it back */
+void bench_upload_run(char *diskname, int threads, size_t chunk, char *model)
+{
+	pthread_t tid[UPLOAD_MAX_THREADS];
+	struct upload_arg arg[UPLOAD_MAX_THREADS];
+	char *buf = malloc(UPLOAD_SZ);
+	double start, end;
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(UPLOAD_FILE);
+	if (fs_create(UPLOAD_FILE) || (fd = fs_open(UPLOAD_FILE)) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	for (int i = 0; i < threads; i++) {
+		arg[i] = (struct upload_arg){ fd, i, threads, chunk, model };
+		if (pthread_create(tid + i, NULL, upload_worker, arg + i))
+			die("Cannot create thread");
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	end = now_ms();
+
+	if (fs_stat(fd) != UPLOAD_SZ || fs_pread(fd, buf, UPLOAD_SZ, 0) != UPLOAD_SZ
+	    || memcmp(buf, model, UPLOAD_SZ))
+		die("File content differs");
+	fs_close(fd);
+	fs_delete(UPLOAD_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("upload %2d threads %zu KB chunks: %.1f ms, %.1f MB/s\n",
+	       threads, chunk / 1024, end - start,
+	       UPLOAD_SZ / 1048576.0 / ((end - start) / 1000.0));
+	free(buf);
+}
+
+void bench_upload(int argc, char **argv)
+{
+	char *model = malloc(UPLOAD_SZ);
+	size_t chunk;
+
+	if (argc < 1)
+		die("need <diskname> [chunk KB]");
+	chunk = (argc > 1 ? atoi(argv[1]) : 64) * 1024;
+	if (chunk == 0 || UPLOAD_SZ % chunk)
+		die("chunk size must divide %d KB", UPLOAD_SZ / 1024);
+
+	for (int i = 0; i < UPLOAD_SZ; i++)
+		model[i] = 'a' + (i / 4096 + i) % 26;
+	for (int threads = 1; threads <= UPLOAD_MAX_THREADS; threads *= 2)
+		bench_upload_run(argv[0], threads, chunk, model);
+	free(model);
+}
+
+#define BIGREAD_FILE "bigread-file"
+#define BIGREAD_SZ (24 * 1024 * 1024)
+#define BIGREAD_ROUNDS 4
+
+/* read a 24 MB file in one fs_read() with 1 to 16 threads */
+void bench_bigread(int argc, char **argv)
+{
+	char *model = malloc(BIGREAD_SZ), *buf = malloc(BIGREAD_SZ);
+	double start, end;
+	int fd;
+
+	if (argc < 1)
+		die("need <diskname>");
+	for (int i = 0; i < BIGREAD_SZ; i++)
+		model[i] = 'a' + (i / 4096 + i) % 26;
+
+	if (fs_mount(argv[0]))
+		die("Cannot mount diskname");
+	fs_delete(BIGREAD_FILE);
+	if (fs_create(BIGREAD_FILE) || (fd = fs_open(BIGREAD_FILE)) < 0)
+		die("Cannot create file");
+	if (fs_write(fd, model, BIGREAD_SZ) != BIGREAD_SZ)
+		die("Cannot fill file");
+
+	for (int workers = 1; workers <= 16; workers *= 2) {
+		fs_read_workers(workers);
+		start = now_ms();
+		for (int i = 0; i < BIGREAD_ROUNDS; i++)
+			if (fs_pread(fd, buf, BIGREAD_SZ, 0) != BIGREAD_SZ)
+				die("Cannot read file");
+		end = now_ms();
+		if (memcmp(buf, model, BIGREAD_SZ))
+			die("File content differs");
+		printf("bigread %2d workers: %.1f ms, %.1f MB/s\n", workers,
+		       (end - start) / BIGREAD_ROUNDS,
+		       BIGREAD_ROUNDS * (BIGREAD_SZ / 1048576.0) / ((end - start) / 1000.0));
+	}
+
+	fs_close(fd);
+	fs_delete(BIGREAD_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+	free(model);
+}
+
+#define POPULATE_FILES 128
+
+/* create POPULATE_FILES files of @size bytes, then remove them */
+double bench_populate_run(char *diskname, int size, int batch)
+{
+	char name[FS_FILENAME_LEN], *data = malloc(size + 1);
+	double start, end;
+	int fd;
+
+	memset(data, 'p', size + 1);
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	start = now_ms();
+	if (batch && fs_batch_begin())
+		die("Cannot start batch");
+	for (int i = 0; i < POPULATE_FILES; i++) {
+		snprintf(name, sizeof(name), "populate-%d", i);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		if (size > 0 && fs_write(fd, data, size) != size)
+			die("Cannot write file");
+		fs_close(fd);
+	}
+	if (batch && fs_batch_commit())
+		die("Cannot commit batch");
+	end = now_ms();
+
+	for (int i = 0; i < POPULATE_FILES; i++) {
+		snprintf(name, sizeof(name), "populate-%d", i);
+		fs_delete(name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(data);
+	return end - start;
+}
+
+/* fill the root directory, one metadata commit per call or one in all */
+void bench_populate(int argc, char **argv)
+{
+	int size;
+	double plain, batch;
+
+	if (argc < 1)
+		die("need <diskname> [size]");
+	size = argc > 1 ? atoi(argv[1]) : 0;
+
+	plain = bench_populate_run(argv[0], size, 0);
+	batch = bench_populate_run(argv[0], size, 1);
+	printf("populate %d files of %d bytes: %.1f ms, %.1f ms batched\n",
+	       POPULATE_FILES, size, plain, batch);
+}
+
+#define COMPRESS_FILE "compress-file"
+#define COMPRESS_SZ (8 * 1024 * 1024)
+#define COMPRESS_IO_SZ (64 * 1024)
+#define COMPRESS_RANDOM_READS 2000
+
+/* write @model in COMPRESS_IO_SZ pieces, read it back the same way, then 4 KB
+ * at random offsets, with or without compression
+*/
+void bench_compress_run(char *diskname, const char *kind, char *model, int zip)
+{
+	char *buf = malloc(COMPRESS_SZ);
+	double start, mid, end, rnd;
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(COMPRESS_FILE);
+	if (fs_create(COMPRESS_FILE)
+	    || (zip && fs_set_compression(COMPRESS_FILE, FS_COMPRESS_LZ4))
+	    || (fd = fs_open(COMPRESS_FILE)) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	for (int off = 0; off < COMPRESS_SZ; off += COMPRESS_IO_SZ)
+		if (fs_write(fd, model + off, COMPRESS_IO_SZ) != COMPRESS_IO_SZ)
+			die("Cannot fill file");
+	mid = now_ms();
+	for (int off = 0; off < COMPRESS_SZ; off += COMPRESS_IO_SZ)
+		if (fs_pread(fd, buf + off, COMPRESS_IO_SZ, off) != COMPRESS_IO_SZ)
+			die("Cannot read file");
+	end = now_ms();
+	if (memcmp(buf, model, COMPRESS_SZ))
+		die("File content differs");
+
+	srand(1);
+	rnd = now_ms();
+	for (int i = 0; i < COMPRESS_RANDOM_READS; i++) {
+		int off = rand() % (COMPRESS_SZ - 4096);
+		if (fs_pread(fd, buf, 4096, off) != 4096 || memcmp(buf, model + off, 4096))
+			die("Cannot read file");
+	}
+	rnd = now_ms() - rnd;
+
+	fs_close(fd);
+	fs_delete(COMPRESS_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("compress %-6s %-4s: write %.1f MB/s, read %.1f MB/s, 4 KB random read %.1f us\n",
+	       kind, zip ? "lz4" : "off",
+	       COMPRESS_SZ / 1048576.0 / ((mid - start) / 1000.0),
+	       COMPRESS_SZ / 1048576.0 / ((end - mid) / 1000.0),
+	       rnd * 1000.0 / COMPRESS_RANDOM_READS);
+	free(buf);
+}
+
+/* throughput of compressed files, on log lines and on random bytes */
+void bench_compress(int argc, char **argv)
+{
+	char *model = malloc(COMPRESS_SZ + 64);
+	int len = 0;
+
+	if (argc < 1)
+		die("need <diskname>");
+
+	for (int i = 0; len < COMPRESS_SZ; i++)
+		len += sprintf(model + len, "12:00:%02d INFO request %d served in %d ms\n",
+			       i % 60, i, i % 7);
+	bench_compress_run(argv[0], "text", model, 0);
+	bench_compress_run(argv[0], "text", model, 1);
+
+	srand(2);
+	for (int i = 0; i < COMPRESS_SZ; i++)
+		model[i] = rand();
+	bench_compress_run(argv[0], "random", model, 0);
+	bench_compress_run(argv[0], "random", model, 1);
+	free(model);
+}
+
+#define DEDUP_FILES 4
+#define DEDUP_SZ (2 * 1024 * 1024)
+#define DEDUP_IO_SZ (64 * 1024)
+
+/* write DEDUP_FILES copies of @model, each with its own first DEDUP_IO_SZ
+ * bytes, in dedup mode or not; return the time spent writing
+ */
+double bench_dedup_run(char *diskname, char *model, int on)
+{
+	char name[FS_FILENAME_LEN];
+	double start, end = 0;
+	int fd;
+
+	if (fs_mount(diskname) || fs_set_dedup(on))
+		die("Cannot mount diskname");
+	for (int i = 0; i < DEDUP_FILES; i++) {
+		snprintf(name, sizeof(name), "dedup-%d", i);
+		fs_delete(name);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		memset(model, 'a' + i, DEDUP_IO_SZ);
+		start = now_ms();
+		for (int off = 0; off < DEDUP_SZ; off += DEDUP_IO_SZ)
+			if (fs_write(fd, model + off, DEDUP_IO_SZ) != DEDUP_IO_SZ)
+				die("Cannot fill file");
+		fs_close(fd);
+		end += now_ms() - start;
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return end;
+}
+
+/* remove the files of bench_dedup_run() and turn dedup mode off */
+void bench_dedup_clean(char *diskname)
+{
+	char name[FS_FILENAME_LEN];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	for (int i = 0; i < DEDUP_FILES; i++) {
+		snprintf(name, sizeof(name), "dedup-%d", i);
+		fs_delete(name);
+	}
+	if (fs_set_dedup(0) || fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* cost of hashing every block written, and what an offline pass gets back */
+void bench_dedup(int argc, char **argv)
+{
+	char *model = malloc(DEDUP_SZ);
+	struct fs_dedup_stats st;
+	double plain, hashed, pass;
+	int blocks = DEDUP_FILES * DEDUP_SZ / 4096;
+
+	if (argc < 1)
+		die("need <diskname>");
+
+	srand(3);
+	for (int i = 0; i < DEDUP_SZ; i++)
+		model[i] = rand();
+
+	plain = bench_dedup_run(argv[0], model, 0);
+	if (fs_mount(argv[0]))
+		die("Cannot mount diskname");
+	pass = now_ms();
+	if (fs_dedup(&st))
+		die("Cannot deduplicate");
+	pass = now_ms() - pass;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	bench_dedup_clean(argv[0]);
+
+	hashed = bench_dedup_run(argv[0], model, 1);
+	bench_dedup_clean(argv[0]);
+
+	printf("dedup off: write %.1f MB/s\n",
+	       DEDUP_FILES * DEDUP_SZ / 1048576.0 / (plain / 1000.0));
+	printf("dedup on : write %.1f MB/s, %.2f us more per 4 KB block\n",
+	       DEDUP_FILES * DEDUP_SZ / 1048576.0 / (hashed / 1000.0),
+	       (hashed - plain) * 1000.0 / blocks);
+	printf("dedup pass: %u blocks in files, %u on disk (ratio %.2f), %.1f ms\n",
+	       st.logical, st.physical, (double)st.logical / st.physical, pass);
+	free(model);
+}
+
+#define FANOUT_FILE "fanout-file"
+#define FANOUT_SZ (8 * 1024 * 1024)
+#define FANOUT_IO_SZ (64 * 1024)
+#define FANOUT_MOUNTS 200
+
+/* mount @diskname read-only and read FANOUT_FILE in FANOUT_IO_SZ preads */
+int fanout_read(char *diskname, char *model)
+{
+	char *buf = malloc(FANOUT_IO_SZ);
+	int fd, ret = 0;
+
+	if (fs_readonly_mount(diskname))
+		return -1;
+	fd = fs_open(FANOUT_FILE);
+	if (fd < 0)
+		ret = -1;
+	for (int off = 0; !ret && off < FANOUT_SZ; off += FANOUT_IO_SZ)
+		if (fs_pread(fd, buf, FANOUT_IO_SZ, off) != FANOUT_IO_SZ
+		    || memcmp(buf, model + off, FANOUT_IO_SZ))
+			ret = -1;
+	if (fd >= 0)
+		fs_close(fd);
+	if (fs_umount())
+		ret = -1;
+	free(buf);
+	return ret;
+}
+
+/* @procs processes reading FANOUT_FILE at once, each with its own mount */
+void bench_fanout_run(char *diskname, int procs, char *model)
+{
+	double start, end;
+	int status, failed = 0;
+
+	start = now_ms();
+	for (int i = 0; i < procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			die("Cannot fork");
+		if (pid == 0)
+			_exit(fanout_read(diskname, model) ? 1 : 0);
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	end = now_ms();
+	if (failed)
+		die("%d readers failed", failed);
+
+	printf("fanout %2d procs: %.1f ms, %.1f MB/s\n", procs, end - start,
+	       procs * (FANOUT_SZ / 1048576.0) / ((end - start) / 1000.0));
+}
+
+/* what a mount and an unmount cost, the disk left as it is */
+double bench_fanout_mount(char *diskname, int (*mount)(const char *))
+{
+	double start = now_ms();
+
+	for (int i = 0; i < FANOUT_MOUNTS; i++)
+		if (mount(diskname) || fs_umount())
+			die("Cannot mount diskname");
+	return (now_ms() - start) / FANOUT_MOUNTS;
+}
+
+/* many processes starting against one disk, as fan-out jobs do */
+void bench_fanout(int argc, char **argv)
+{
+	char *model = malloc(FANOUT_SZ);
+	int procs, fd;
+
+	if (argc < 1)
+		die("need <diskname> [procs]");
+	procs = argc > 1 ? atoi(argv[1]) : 64;
+	for (int i = 0; i < FANOUT_SZ; i++)
+		model[i] = 'a' + (i / 4096 + i) % 26;
+
+	if (fs_mount(argv[0]))
+		die("Cannot mount diskname");
+	fs_delete(FANOUT_FILE);
+	if (fs_create(FANOUT_FILE) || (fd = fs_open(FANOUT_FILE)) < 0)
+		die("Cannot create file");
+	if (fs_write(fd, model, FANOUT_SZ) != FANOUT_SZ)
+		die("Cannot fill file");
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("fanout mount: %.3f ms read-write, %.3f ms read-only\n",
+	       bench_fanout_mount(argv[0], fs_mount),
+	       bench_fanout_mount(argv[0], fs_readonly_mount));
+	for (int i = 1; i < procs; i *= 4)
+		bench_fanout_run(argv[0], i, model);
+	bench_fanout_run(argv[0], procs, model);
+
+	if (fs_mount(argv[0]))
+		die("Cannot mount diskname");
+	fs_delete(FANOUT_FILE);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(model);
+}
+
+static struct {
+	const char *name;
+	void(*func)(int, char **);
+} commands[] = {
+	{ "randwrite",	bench_randwrite },
+	{ "append",	bench_append },
+	{ "stress",	bench_stress },
+	{ "upload",	bench_upload },
+	{ "bigread",	bench_bigread },
+	{ "populate",	bench_populate },
+	{ "compress",	bench_compress },
+	{ "dedup",	bench_dedup },
+	{ "fanout",	bench_fanout },
+};
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(commands[i].name, argv[1])) {
+			commands[i].func(argc - 2, argv + 2);
+			return 0;
+		}
+	}
+	usage(argv[0]);
+	return 1;
+}
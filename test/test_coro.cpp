@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <span>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <fs.hpp>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define test_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_fs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+using libfs::File;
+using libfs::Task;
+
+/* one coroutine per stripe of chunks id, id + tasks, ... */
+static Task<> upload(libfs::Fs &fs, const File &f, std::span<const char> src,
+		    int id, int tasks, size_t chunk, int &written)
+{
+	for (size_t off = id * chunk; off < src.size(); off += tasks * chunk) {
+		auto piece = src.subspan(off, std::min(chunk, src.size() - off));
+		int w = co_await fs.write(f, piece, off);
+		if (w < 0)
+			break;
+		written += w;
+	}
+}
+
+/* read back in odd-sized steps through the offset of the handle */
+static Task<int> download(libfs::Fs &fs, File &f, std::span<char> dst)
+{
+	while (f.tell() < dst.size()) {
+		auto piece = dst.subspan(f.tell(), std::min<size_t>(5000, dst.size() - f.tell()));
+		if (co_await fs.read(f, piece) <= 0)
+			break;
+	}
+	co_return f.tell();
+}
+
+static void coro_copy(int argc, char **argv)
+{
+	char *diskname, *filename, *buf;
+	int fd, tasks, written = 0, read = 0;
+	size_t chunk;
+	struct stat st;
+
+	if (argc < 4)
+		die("Usage: <diskname> <host filename> <tasks> <chunk>");
+
+	diskname = argv[0];
+	filename = argv[1];
+	tasks = atoi(argv[2]);
+	chunk = atoi(argv[3]);
+	if (tasks <= 0 || chunk == 0)
+		die("Need at least one task and one byte per chunk");
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	buf = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+	std::vector<char> back(st.st_size);
+	std::span<const char> src(buf, st.st_size);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	{
+		libfs::Executor ex;
+		libfs::Fs fs(ex);
+		File f = File::open(filename);
+		File g = File::open(filename);
+
+		if (!f || !g) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		/* the uploads run side by side, then one reads it all back */
+		for (int i = 0; i < tasks; i++)
+			ex.spawn(upload(fs, f, src, i, tasks, chunk, written));
+		ex.run();
+		/* named, the frame refers to the captures of the lambda */
+		auto check = [&]() -> Task<> {
+			read = co_await download(fs, g, back);
+		};
+		ex.spawn(check());
+		ex.run();
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%d/%zu bytes) with %d tasks\n", filename,
+	       written, (size_t)st.st_size, tasks);
+	printf("Read file '%s' (%d/%zu bytes)\n", filename, read,
+	       (size_t)st.st_size);
+	printf("Content of the file:\n");
+	printf("%.*s", read, back.data());
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+static struct {
+	const char *name;
+	void (*func)(int, char **);
+} commands[] = {
+	{ "copy",	coro_copy },
+};
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage(argv[0]);
+
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(argv[1], commands[i].name)) {
+			commands[i].func(argc - 2, argv + 2);
+			return 0;
+		}
+	}
+
+	test_fs_error("invalid command '%s'", argv[1]);
+	usage(argv[0]);
+	return 0;
+}
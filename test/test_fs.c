@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,7 +48,7 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_readonly_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -99,7 +101,7 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fs_readonly_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -240,7 +242,7 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_readonly_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -259,7 +261,7 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fs_readonly_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -294,7 +296,7 @@ void thread_fs_read(void *arg)
 	if(t_arg->argc >=4)
 		count = atoi(t_arg->argv[3]);
 
-	if (fs_mount(diskname))
+	if (fs_readonly_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -317,7 +319,7 @@ void thread_fs_read(void *arg)
 	}
 
 	// printf("offset = %d, stat = %d\n", offset, stat);
-	if(fs_lseek(fs_fd, offset) < 0){
+	if(offset > stat || fs_lseek(fs_fd, offset) < 0){
 		fs_close(fs_fd);
 		fs_umount();
 		die("Offset out of boundary");
@@ -451,7 +453,12 @@ void thread_fs_write(void *arg)
 		opt = t_arg->argv[5];
 
 
-	if (fs_mount(diskname))
+	if (opt != NULL && strcmp(opt, "log") == 0) {
+		// small writes go through the write log
+		if (fs_log_mount(diskname))
+			die("Cannot mount diskname");
+	}
+	else if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -533,6 +540,1256 @@ void thread_fs_write(void *arg)
 }
 
 
+void thread_fs_truncate(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fs_fd;
+	size_t size;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <size>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	size = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_truncate(fs_fd, size)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot truncate file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Truncated file '%s' to %zu bytes\n", filename, size);
+}
+
+void thread_fs_punch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fs_fd;
+	size_t offset, len;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <filename> <offset> <len>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	offset = get_argv(t_arg->argv[2]);
+	len = get_argv(t_arg->argv[3]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_punch_hole(fs_fd, offset, len)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot punch hole");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Punched hole in file '%s' (%zu bytes at offset %zu)\n", filename, len, offset);
+}
+
+void thread_fs_concat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dst, *src;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <dst> <src>");
+
+	diskname = t_arg->argv[0];
+	dst = t_arg->argv[1];
+	src = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_concat(dst, src)) {
+		fs_umount();
+		die("Cannot concatenate files");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Appended file '%s' to file '%s'\n", src, dst);
+}
+
+void thread_fs_split(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *newname;
+	size_t offset;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <src> <offset> <newname>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	offset = get_argv(t_arg->argv[2]);
+	newname = t_arg->argv[3];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_split(src, offset, newname)) {
+		fs_umount();
+		die("Cannot split file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Split file '%s' at offset %zu into '%s'\n", src, offset, newname);
+}
+
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <src> <dst>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
+void thread_fs_snap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_create(name)) {
+		fs_umount();
+		die("Cannot create snapshot");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Created snapshot '%s'\n", name);
+}
+
+void thread_fs_snaprm(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_delete(name)) {
+		fs_umount();
+		die("Cannot delete snapshot");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Removed snapshot '%s'\n", name);
+}
+
+void thread_fs_snapcat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name, *filename, *buf;
+	int fs_fd;
+	int stat, read;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <snapshot> <filename>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+	filename = t_arg->argv[2];
+
+	if (fs_snapshot_mount(diskname, name))
+		die("Cannot mount snapshot");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	if (!stat) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+	buf = malloc(stat);
+	if (!buf) {
+		perror("malloc");
+		fs_umount();
+		die("Cannot malloc");
+	}
+
+	read = fs_read(fs_fd, buf, stat);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' of snapshot '%s' (%d/%d bytes)\n", filename, name, read, stat);
+	printf("Content of the file:\n");
+	printf("%.*s", (int)stat, buf);
+
+	free(buf);
+}
+
+void thread_fs_journal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t nblocks;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <nblocks>");
+
+	diskname = t_arg->argv[0];
+	nblocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_journal_create(nblocks)) {
+		fs_umount();
+		die("Cannot create journal");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Created journal of %zu blocks\n", nblocks);
+}
+
+
+void thread_fs_append(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *record;
+	size_t times, len;
+	int fd, stat;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <filename> <record> <times>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	record = t_arg->argv[2];
+	times = get_argv(t_arg->argv[3]);
+	len = strlen(record);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fd);
+	if (fs_lseek(fd, stat)) {
+		fs_umount();
+		die("Cannot seek file");
+	}
+
+	/* small records, gathered by the write buffer of the descriptor */
+	for (size_t i = 0; i < times; i++) {
+		if (fs_write(fd, record, len) != (int)len) {
+			fs_umount();
+			die("Cannot append to file");
+		}
+	}
+
+	if (fs_close(fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Appended %zu records of %zu bytes to file '%s'\n", times, len, filename);
+}
+
+
+void thread_fs_writev(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	struct iovec *iov;
+	int fs_fd, iovcnt, written;
+	size_t offset;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <filename> <offset> <string> [<string>...]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	offset = get_argv(t_arg->argv[2]);
+	iovcnt = t_arg->argc - 3;
+
+	iov = malloc(iovcnt * sizeof(struct iovec));
+	if (!iov)
+		die_perror("malloc");
+	for (int i = 0; i < iovcnt; i++) {
+		iov[i].iov_base = t_arg->argv[3 + i];
+		iov[i].iov_len = strlen(t_arg->argv[3 + i]);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	if (fs_lseek(fs_fd, offset)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot seek file");
+	}
+
+	written = fs_writev(fs_fd, iov, iovcnt);
+	if (written < 0) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot write file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Wrote %d bytes from %d buffers to file '%s' with offset '%zu'\n",
+	       written, iovcnt, filename, offset);
+
+	free(iov);
+}
+
+void thread_fs_readv(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf, *flat;
+	struct iovec *iov;
+	int fs_fd, iovcnt, read, pread;
+	size_t offset, total = 0;
+
+	if (t_arg->argc < 4)
+		die("need <diskname> <filename> <offset> <len> [<len>...]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	offset = get_argv(t_arg->argv[2]);
+	iovcnt = t_arg->argc - 3;
+
+	iov = malloc(iovcnt * sizeof(struct iovec));
+	if (!iov)
+		die_perror("malloc");
+	for (int i = 0; i < iovcnt; i++) {
+		iov[i].iov_len = get_argv(t_arg->argv[3 + i]);
+		total += iov[i].iov_len;
+	}
+	buf = calloc(1, total + 1);
+	flat = calloc(1, total + 1);
+	if (!buf || !flat)
+		die_perror("calloc");
+	for (int i = 0, done = 0; i < iovcnt; done += iov[i++].iov_len)
+		iov[i].iov_base = buf + done;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* the same bytes in one buffer, the file offset does not move */
+	pread = fs_pread(fs_fd, flat, total, offset);
+
+	if (fs_lseek(fs_fd, offset)) {
+		fs_close(fs_fd);
+		fs_umount();
+		die("Cannot seek file");
+	}
+	read = fs_readv(fs_fd, iov, iovcnt);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (read < 0 || read != pread || memcmp(buf, flat, read))
+		die("Vectored and positional reads differ");
+
+	printf("Read %d bytes into %d buffers from file '%s' with offset '%zu'\n",
+	       read, iovcnt, filename, offset);
+	for (int i = 0; i < iovcnt; i++)
+		printf("%.*s\n", (int)iov[i].iov_len, (char *)iov[i].iov_base);
+
+	free(flat);
+	free(buf);
+	free(iov);
+}
+
+struct upload_arg {
+	int fs_fd;
+	int id;
+	int threads;
+	size_t chunk;
+	size_t size;
+	char *buf;
+	int written;
+};
+
+/* chunks id, id + threads, ... of the file, each under a lock of its range */
+void *upload_worker(void *arg)
+{
+	struct upload_arg *u = arg;
+
+	for (size_t off = u->id * u->chunk; off < u->size; off += u->threads * u->chunk) {
+		size_t n = u->size - off < u->chunk ? u->size - off : u->chunk;
+		int w;
+
+		if (fs_lock_range(u->fs_fd, off, n, 1))
+			return NULL;
+		w = fs_pwrite(u->fs_fd, u->buf + off, n, off);
+		fs_unlock_range(u->fs_fd, off, n);
+		if (w < 0)
+			return NULL;
+		u->written += w;
+		if ((size_t)w < n)
+			return NULL;
+	}
+	return NULL;
+}
+
+void thread_fs_upload(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct upload_arg *u;
+	pthread_t *tid;
+	char *diskname, *filename, *buf;
+	int fd, fs_fd, threads, written = 0;
+	size_t chunk;
+	struct stat st;
+
+	if (t_arg->argc < 4)
+		die("Usage: <diskname> <host filename> <threads> <chunk>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	threads = get_argv(t_arg->argv[2]);
+	chunk = get_argv(t_arg->argv[3]);
+	if (threads <= 0 || chunk == 0)
+		die("Need at least one thread and one byte per chunk");
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!buf)
+		die_perror("mmap");
+	u = calloc(threads, sizeof(struct upload_arg));
+	tid = malloc(threads * sizeof(pthread_t));
+	if (!u || !tid)
+		die_perror("malloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* the chunks go in parallel through one descriptor, in no particular order */
+	for (int i = 0; i < threads; i++) {
+		u[i] = (struct upload_arg){ fs_fd, i, threads, chunk, st.st_size, buf, 0 };
+		if (pthread_create(tid + i, NULL, upload_worker, u + i))
+			die_perror("pthread_create");
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(tid[i], NULL);
+		written += u[i].written;
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' (%d/%zu bytes) with %d threads\n", filename,
+	       written, st.st_size, threads);
+
+	free(tid);
+	free(u);
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+static int catasync_cbs;
+
+void catasync_cb(int fd, int result, void *data)
+{
+	(void)fd;
+	*(int *)data = result;
+	__atomic_add_fetch(&catasync_cbs, 1, __ATOMIC_RELEASE);
+}
+
+void thread_fs_catasync(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_completion c[8];
+	struct pollfd pfd;
+	char *diskname, *filename, *buf;
+	int fs_fd, stat, pieces, len, read = 0, done = 0, *res;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <pieces>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	pieces = get_argv(t_arg->argv[2]);
+	if (pieces <= 0)
+		die("Need at least one piece");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+	len = (stat + pieces - 1) / pieces;
+	buf = malloc(stat + 1);
+	res = calloc(pieces, sizeof(int));
+	pfd.fd = fs_async_fd();
+	pfd.events = POLLIN;
+	if (!buf || !res || pfd.fd < 0) {
+		fs_umount();
+		die("Cannot set up");
+	}
+
+	/* odd pieces complete through a callback, even ones through the queue */
+	for (int i = 0; i < pieces; i++) {
+		int off = i * len, n = off < stat ? stat - off : 0;
+
+		if (n > len)
+			n = len;
+		if (fs_read_async(fs_fd, buf + off, n, off,
+				  i % 2 ? catasync_cb : NULL, res + i)) {
+			fs_umount();
+			die("Cannot queue read");
+		}
+	}
+	while (done + __atomic_load_n(&catasync_cbs, __ATOMIC_ACQUIRE) < pieces) {
+		int n;
+
+		poll(&pfd, 1, 10);
+		while ((n = fs_async_reap(c, 8)) > 0) {
+			for (int k = 0; k < n; k++)
+				*(int *)c[k].data = c[k].result;
+			done += n;
+		}
+	}
+	for (int i = 0; i < pieces; i++)
+		read += res[i] > 0 ? res[i] : 0;
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Read file '%s' (%d/%d bytes) in %d pieces\n", filename, read,
+	       stat, pieces);
+	printf("Content of the file:\n");
+	printf("%.*s", stat, buf);
+
+	free(res);
+	free(buf);
+}
+
+void thread_fs_catmap(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *view, first;
+	int fs_fd, stat, private;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename> [private]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	private = t_arg->argc > 2 && !strcmp(t_arg->argv[2], "private");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat <= 0) {
+		fs_umount();
+		die("Cannot stat file, or empty file");
+	}
+	view = fs_mmap(fs_fd, 0, stat, private ? FS_MAP_PRIVATE : 0);
+	if (!view) {
+		fs_umount();
+		die("Cannot map file");
+	}
+	/* a private view takes writes, the file does not see them */
+	if (private)
+		view[0] = '#';
+	if (fs_pread(fs_fd, &first, 1, 0) != 1) {
+		fs_umount();
+		die("Cannot read file");
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	printf("Mapped file '%s' (%d bytes), first byte '%c'\n", filename, stat,
+	       first);
+	printf("Content of the file:\n");
+	printf("%.*s", stat, view);
+
+	if (fs_munmap(view, stat))
+		die("Cannot unmap file");
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fd, imported;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	imported = fs_import(fd, filename);
+	if (imported < 0) {
+		fs_umount();
+		die("Cannot import file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported file '%s' (%d bytes)\n", filename, imported);
+
+	close(fd);
+}
+
+void thread_fs_bulk_add(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+	int workers = 4, imported;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [workers]");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		workers = atoi(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	imported = fs_import_dir(dirname, workers);
+	if (imported < 0) {
+		fs_umount();
+		die("Cannot import directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d files from '%s'\n", imported, dirname);
+}
+
+void thread_fs_batch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, name[FS_FILENAME_LEN], line[32];
+	int count, fd, len;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <count>");
+
+	diskname = t_arg->argv[0];
+	count = atoi(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* file-<i> holds "line <i>", the last one is removed again */
+	if (fs_batch_begin())
+		die("Cannot start batch");
+	for (int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "file-%d", i);
+		len = snprintf(line, sizeof(line), "line %d\n", i);
+		if (fs_create(name) || (fd = fs_open(name)) < 0) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		if (fs_write(fd, line, len) != len || fs_close(fd)) {
+			fs_umount();
+			die("Cannot write file");
+		}
+	}
+	if (count > 0 && fs_delete(name)) {
+		fs_umount();
+		die("Cannot delete file");
+	}
+	if (fs_batch_commit()) {
+		fs_umount();
+		die("Cannot commit batch");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created %d files in one batch\n", count > 0 ? count - 1 : 0);
+}
+
+void thread_fs_mv(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *oldname, *newname;
+	int flags = 0;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <new filename> [replace|<flags>]");
+
+	diskname = t_arg->argv[0];
+	oldname = t_arg->argv[1];
+	newname = t_arg->argv[2];
+	if (t_arg->argc > 3 && !strcmp(t_arg->argv[3], "replace"))
+		flags = FS_RENAME_REPLACE;
+	else if (t_arg->argc > 3)
+		flags = get_argv(t_arg->argv[3]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rename(oldname, newname, flags)) {
+		fs_umount();
+		die("Cannot rename file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Renamed file '%s' to '%s'\n", oldname, newname);
+}
+
+static void print_dirent(const struct fs_dirent *ent)
+{
+	printf("file: %s, size: %zu, data_blk: %u, extents: %u\n", ent->name,
+	       ent->size, ent->first_blk, ent->extents);
+}
+
+static int readdir_print(const struct fs_dirent *ent, void *data)
+{
+	print_dirent(ent);
+	(*(int *)data)++;
+	return 0;
+}
+
+void thread_fs_readdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int seen = 0, count;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	count = fs_readdir(readdir_print, &seen);
+	if (count != seen) {
+		fs_umount();
+		die("Cannot read directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Listed %d files\n", count);
+}
+
+void thread_fs_statname(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	struct fs_dirent ent;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_stat_name(filename, &ent) < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	print_dirent(&ent);
+}
+
+void thread_fs_openmany(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, c;
+	int count, *fds;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <count>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	count = atoi(t_arg->argv[2]);
+	fds = malloc(count * sizeof(int));
+	if (fds == NULL)
+		die_perror("malloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* all open at once, descriptor i writes byte i */
+	for (int i = 0; i < count; i++) {
+		fds[i] = fs_open(filename);
+		if (fds[i] < 0) {
+			fs_umount();
+			die("Cannot open file %d", i);
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		c = 'a' + i % 26;
+		if (fs_lseek(fds[i], i) || fs_write(fds[i], &c, 1) != 1) {
+			fs_umount();
+			die("Cannot write file");
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (fs_close(fds[i])) {
+			fs_umount();
+			die("Cannot close file");
+		}
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote file '%s' through %d descriptors\n", filename, count);
+	free(fds);
+}
+
+struct readers_arg {
+	const char *filename;
+	const char *orig;
+	int size;
+	int reads;
+	int bad;
+};
+
+static volatile int readers_stop;
+
+/* open, read and close the file until the writer is done, each read must see
+ * the first bytes of the file as it was, never those of another one */
+void *readers_worker(void *arg)
+{
+	struct readers_arg *r = arg;
+	char *buf = malloc(r->size + 1);
+
+	if (!buf)
+		return NULL;
+	do {
+		int fd = fs_open(r->filename), n = -1;
+
+		if (fd >= 0)
+			n = fs_read(fd, buf, r->size + 1);
+		if (n < 0 || n > r->size || memcmp(buf, r->orig, n))
+			r->bad++;
+		if (fd >= 0)
+			fs_close(fd);
+		r->reads++;
+	} while (!readers_stop);
+	free(buf);
+	return NULL;
+}
+
+void thread_fs_readers(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct readers_arg *r;
+	pthread_t *tid;
+	char *diskname, *filename, *orig, *junk;
+	int fd, size, readers, rounds, reads = 0, bad = 0;
+
+	if (t_arg->argc < 4)
+		die("Usage: <diskname> <filename> <readers> <rounds>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	readers = get_argv(t_arg->argv[2]);
+	rounds = get_argv(t_arg->argv[3]);
+	if (readers <= 0)
+		die("Need at least one reader");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	size = fs_stat(fd);
+	orig = malloc(size + 1);
+	junk = malloc(size + 1);
+	r = calloc(readers, sizeof(struct readers_arg));
+	tid = malloc(readers * sizeof(pthread_t));
+	if (!orig || !junk || !r || !tid)
+		die_perror("malloc");
+	if (fs_read(fd, orig, size) != size) {
+		fs_umount();
+		die("Cannot read file");
+	}
+	memset(junk, 'x', size);
+
+	for (int i = 0; i < readers; i++) {
+		r[i] = (struct readers_arg){ filename, orig, size, 0, 0 };
+		if (pthread_create(tid + i, NULL, readers_worker, r + i))
+			die_perror("pthread_create");
+	}
+
+	/*
+	 * meanwhile the read file gives its blocks to another one, made, renamed
+	 * and deleted, then gets them back with the same bytes: new directory
+	 * copies and block maps all along
+	 */
+	for (int i = 0; i < rounds; i++) {
+		int jfd;
+
+		if (fs_truncate(fd, 0)) {
+			fs_umount();
+			die("Cannot truncate file");
+		}
+		if (fs_create("junk") || (jfd = fs_open("junk")) < 0) {
+			fs_umount();
+			die("Cannot create file");
+		}
+		if (fs_write(jfd, junk, size) != size || fs_close(jfd)
+		    || fs_rename("junk", "junk-2", 0) || fs_delete("junk-2")) {
+			fs_umount();
+			die("Cannot write file");
+		}
+		if (fs_pwrite(fd, orig, size, 0) != size) {
+			fs_umount();
+			die("Cannot rewrite file");
+		}
+	}
+	readers_stop = 1;
+	for (int i = 0; i < readers; i++) {
+		pthread_join(tid[i], NULL);
+		reads += r[i].reads;
+		bad += r[i].bad;
+	}
+
+	if (fs_close(fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Read file '%s' %d times with %d readers during %d rounds\n",
+	       filename, reads, readers, rounds);
+	printf("Bad reads: %d\n", bad);
+
+	free(tid);
+	free(r);
+	free(junk);
+	free(orig);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int fd = STDOUT_FILENO, exported;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename> [host filename, standard output without]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (t_arg->argc > 2) {
+		fd = open(t_arg->argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror("open");
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fflush(stdout);
+	exported = fs_export(filename, fd);
+	if (exported < 0) {
+		fs_umount();
+		die("Cannot export file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (t_arg->argc > 2) {
+		printf("Exported file '%s' (%d bytes)\n", filename, exported);
+		close(fd);
+	}
+}
+
+void thread_fs_zip(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	int fd, fs_fd, piece, written = 0;
+	struct stat st;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [piece]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	piece = t_arg->argc > 2 ? atoi(t_arg->argv[2]) : 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+	if (piece <= 0)
+		piece = st.st_size;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create(filename) || fs_set_compression(filename, FS_COMPRESS_LZ4)) {
+		fs_umount();
+		die("Cannot create compressed file");
+	}
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	/* pieces which do not match the chunks get some of them rewritten */
+	while (written < st.st_size) {
+		int left = st.st_size - written;
+		int n = fs_write(fs_fd, buf + written, left < piece ? left : piece);
+		if (n <= 0)
+			break;
+		written += n;
+	}
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote compressed file '%s' (%d/%zu bytes)\n", filename, written,
+	       st.st_size);
+
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dedup_stats st;
+	char *diskname;
+	int on = -1;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [on|off]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		on = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* the mode is kept on the disk, or one pass over the disk */
+	if (on >= 0 ? fs_set_dedup(on) : fs_dedup(&st)) {
+		fs_umount();
+		die("Cannot deduplicate");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (on >= 0)
+		printf("Dedup mode %s\n", on ? "on" : "off");
+	else
+		printf("Deduplicated: %u blocks in files, %u on disk (ratio %.2f), %u freed\n",
+		       st.logical, st.physical,
+		       st.physical ? (double)st.logical / st.physical : 1.0,
+		       st.freed);
+}
 
 static struct {
 	const char *name;
@@ -547,6 +1804,32 @@ static struct {
 	{ "read",	thread_fs_read },
 	{ "readm",	thread_fs_read_multiple }, // open multiple files and read
 	{ "write",	thread_fs_write },
+	{ "truncate",	thread_fs_truncate },
+	{ "punch",	thread_fs_punch },
+	{ "concat",	thread_fs_concat },
+	{ "split",	thread_fs_split },
+	{ "clone",	thread_fs_clone },
+	{ "snap",	thread_fs_snap },
+	{ "snaprm",	thread_fs_snaprm },
+	{ "snapcat",	thread_fs_snapcat },
+	{ "journal",	thread_fs_journal },
+	{ "append",	thread_fs_append },
+	{ "writev",	thread_fs_writev },
+	{ "readv",	thread_fs_readv },
+	{ "upload",	thread_fs_upload },
+	{ "catasync",	thread_fs_catasync },
+	{ "catmap",	thread_fs_catmap },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
+	{ "bulk-add",	thread_fs_bulk_add },
+	{ "batch",	thread_fs_batch },
+	{ "mv",		thread_fs_mv },
+	{ "readdir",	thread_fs_readdir },
+	{ "statname",	thread_fs_statname },
+	{ "openmany",	thread_fs_openmany },
+	{ "readers",	thread_fs_readers },
+	{ "zip",	thread_fs_zip },
+	{ "dedup",	thread_fs_dedup },
 };
 
 void usage(char *program)
@@ -364,6 +364,1029 @@ run_fs_create_multiple() {
 	add_answer "${sub}"
 }
 
+# Phase 5
+# shrink a file with test_fs.x truncate, check size and freed blocks with fs_ref.x
+run_fs_truncate() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 20480 > test-file-t # 5 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-t
+	run_tool timeout 2 ./test_fs.x truncate test.fs test-file-t 5000 # 2 blocks left
+
+	local line_array=()
+	local corr_array=()
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-t, size: 5000, data_blk: 1")
+
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=97/100")
+
+	# content before the cut is kept
+	run_test ./test_fs.x read test.fs test-file-t 0 5000
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(head -c 5000 test-file-t)")
+
+	rm -f test.fs test-file-t
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.33"
+	inc_total
+	add_answer "${sub}"
+}
+
+# punch the middle blocks of a file, they read back as zeros and are freed
+run_fs_punch_hole() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 20480 > test-file-p # 5 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-p
+	run_tool timeout 2 ./test_fs.x punch test.fs test-file-p 4096 12288 # blocks 1, 2, 3
+
+	local line_array=()
+	local corr_array=()
+	run_test ./test_fs.x stat test.fs test-file-p
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Size of file 'test-file-p' is 20480 bytes")
+
+	# 2 data blocks and 1 block for the hole list
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=96/100")
+
+	# the hole reads back as zeros, printing stops right at the hole
+	run_test ./test_fs.x read test.fs test-file-p 4000 1000
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(head -c 4096 test-file-p | tail -c 96)")
+
+	# the last block is kept
+	run_test ./test_fs.x read test.fs test-file-p 16384 4096
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(tail -c 4096 test-file-p)")
+
+	rm -f test.fs test-file-p
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+# a file grows up to INT_MAX bytes, what fs_stat() can report, and no further
+run_fs_max_size() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	echo -n "" > test-file-m
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-m
+
+	local line_array=()
+	local corr_array=()
+	run_test ./test_fs.x truncate test.fs test-file-m 2147483648
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_truncate: Cannot truncate file")
+
+	# of 2 bytes at the last offset, only the first one is written
+	run_tool timeout 2 ./test_fs.x truncate test.fs test-file-m 2147483646
+	run_test ./test_fs.x write test.fs test-file-m AB 2147483646 2
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Write file 'test-file-m' (1/2147483646 bytes) with offset '2147483646'")
+
+	run_test ./test_fs.x stat test.fs test-file-m
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Size of file 'test-file-m' is 2147483647 bytes")
+
+	rm -f test.fs test-file-m
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.33"
+	inc_total
+	add_answer "${sub}"
+}
+
+# append a block aligned file to another one, then split it back at a block boundary
+run_fs_concat_split() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-a # 2 blocks, printable
+	base64 -w 0 /dev/urandom | head -c 3000 > test-file-b
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-a
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-b
+	run_tool timeout 2 ./test_fs.x concat test.fs test-file-a test-file-b
+
+	local line_array=()
+	local corr_array=()
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-a, size: 11192, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("")
+
+	# the blocks of test-file-b are reused, no block is copied
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=96/100")
+
+	run_test ./test_fs.x read test.fs test-file-a 8192 3000
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-b)")
+
+	run_tool timeout 2 ./test_fs.x split test.fs test-file-a 4096 test-file-c
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-a, size: 4096, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("file: test-file-c, size: 7096, data_blk: 2")
+
+	run_test ./test_fs.x read test.fs test-file-c 0 7096
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a test-file-b | tail -c 7096)")
+
+	rm -f test.fs test-file-a test-file-b
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.14"
+	inc_total
+	add_answer "${sub}"
+}
+
+# cuts inside a block copy the bytes, on a full disk the files keep their sizes
+run_fs_concat_split_copy() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 5000 > test-file-a # 2 blocks, printable
+	base64 -w 0 /dev/urandom | head -c 7000 > test-file-b # 2 blocks
+	run_tool ./fs_ref.x add test.fs test-file-a
+	run_tool ./fs_ref.x add test.fs test-file-b
+	run_tool timeout 2 ./test_fs.x concat test.fs test-file-a test-file-b
+
+	local line_array=()
+	local corr_array=()
+	# 12000 bytes in 3 blocks, those of test-file-b freed
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-a, size: 12000, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("")
+	run_test ./fs_ref.x cat test.fs test-file-a
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a test-file-b)")
+
+	run_tool timeout 2 ./test_fs.x split test.fs test-file-a 3001 test-file-c
+	run_test ./test_fs.x read test.fs test-file-c 0 8999
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a test-file-b | tail -c 8999)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=95/100")
+
+	# 9 blocks in use out of 9, the copy runs out of space
+	rm -f test.fs
+	run_tool ./fs_make.x test.fs 10
+	base64 -w 0 /dev/urandom | head -c 28000 > test-file-b # 7 blocks
+	run_tool ./fs_ref.x add test.fs test-file-a
+	run_tool ./fs_ref.x add test.fs test-file-b
+	run_test ./test_fs.x concat test.fs test-file-a test-file-b
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_concat: Cannot concatenate files")
+	run_test ./test_fs.x split test.fs test-file-b 1000 test-file-c
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_split: Cannot split file")
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-a, size: 5000, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("file: test-file-b, size: 28000, data_blk: 3")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	corr_array+=("")
+	run_test ./fs_ref.x cat test.fs test-file-a
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=0/10")
+
+	rm -f test.fs test-file-a test-file-b
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.09"
+	inc_total
+	add_answer "${sub}"
+}
+
+# clone a file, write to the clone, the original keeps its content
+run_fs_clone() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 20480 > test-file-o # 5 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-o
+	run_tool timeout 2 ./test_fs.x clone test.fs test-file-o test-file-k
+
+	local line_array=()
+	local corr_array=()
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("file: test-file-k, size: 20480, data_blk: 1")
+
+	# the data blocks are shared, 1 block for the reference counts
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=93/100")
+
+	# writing the middle block copies the first 3 blocks only
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-k AAAA 8192 4
+	run_test ./test_fs.x read test.fs test-file-k 8190 8
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(head -c 8192 test-file-o | tail -c 2)AAAA$(head -c 8198 test-file-o | tail -c 2)")
+
+	run_test ./test_fs.x read test.fs test-file-o 0 20480
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-o)")
+
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=90/100")
+
+	# deleting the clone drops the shared blocks back to one owner
+	run_tool timeout 2 ./test_fs.x rm test.fs test-file-k
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=94/100")
+
+	rm -f test.fs test-file-o
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.16"
+	inc_total
+	add_answer "${sub}"
+}
+
+# take a snapshot, change the file, the snapshot keeps the old content
+run_fs_snapshot() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-s # 2 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-s
+	run_tool timeout 2 ./test_fs.x snap test.fs backup
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-s AAAA 0 4
+	run_tool timeout 2 ./test_fs.x truncate test.fs test-file-s 4
+
+	local line_array=()
+	local corr_array=()
+	run_test ./test_fs.x snapcat test.fs backup test-file-s
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read file 'test-file-s' of snapshot 'backup' (8192/8192 bytes)")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-s)")
+
+	run_test ./test_fs.x cat test.fs test-file-s
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("AAAA")
+
+	# 2 blocks of the snapshot, 1 copied block, the table and the frozen directory
+	# nothing is shared anymore, the reference counts are gone
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=94/100")
+
+	run_tool timeout 2 ./test_fs.x snaprm test.fs backup
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=98/100")
+
+	rm -f test.fs test-file-s
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_snapshot_full() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# 2 free blocks, the table, the frozen directory and the reference counts need 3
+	run_tool ./fs_make.x test.fs 10
+	run_tool dd if=/dev/urandom of=test-file-s bs=4096 count=7
+	run_tool ./fs_ref.x add test.fs test-file-s
+	local line_array=()
+	local corr_array=()
+	run_test ./test_fs.x snap test.fs backup
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_snap: Cannot create snapshot")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=2/10")
+
+	# one block less in the file, it just fits
+	run_tool ./fs_ref.x rm test.fs test-file-s
+	run_tool dd if=/dev/urandom of=test-file-s bs=4096 count=6
+	run_tool ./fs_ref.x add test.fs test-file-s
+	run_test ./test_fs.x snap test.fs backup
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Created snapshot 'backup'")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=0/10")
+	run_test ./test_fs.x snapcat test.fs backup test-file-s
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read file 'test-file-s' of snapshot 'backup' (24576/24576 bytes)")
+
+	rm -f test.fs test-file-s
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_journal() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool timeout 2 ./test_fs.x journal test.fs 8
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-j # 2 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-j
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-j AAAA 0 4
+	run_tool timeout 2 ./test_fs.x truncate test.fs test-file-j 4
+
+	local line_array=()
+	local corr_array=()
+	# checkpointed by fs_umount, readable without the journal
+	run_test ./fs_ref.x cat test.fs test-file-j
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("AAAA")
+
+	# 8 blocks of journal, 1 block of file
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=90/100")
+
+	run_tool timeout 2 ./test_fs.x rm test.fs test-file-j
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=91/100")
+
+	rm -f test.fs test-file-j
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_log_write() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-l # 2 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-l
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-l AAAA 5000 4 log
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-l BBBB 100 4 log
+	printf "AAAA" | dd of=test-file-l bs=1 seek=5000 conv=notrunc status=none
+	printf "BBBB" | dd of=test-file-l bs=1 seek=100 conv=notrunc status=none
+
+	local line_array=()
+	local corr_array=()
+	# merged into the blocks by fs_umount
+	run_test ./fs_ref.x cat test.fs test-file-l
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-l)")
+
+	# 17 blocks of write log on a small disk, 2 blocks of file
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=80/100")
+
+	rm -f test.fs test-file-l
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_append() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 100 > test-file-a
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-a
+	local record="$(base64 -w 0 /dev/urandom | head -c 64)"
+	run_tool timeout 2 ./test_fs.x append test.fs test-file-a "${record}" 100
+	for i in $(seq 100); do printf "%s" "${record}" >> test-file-a; done
+
+	local line_array=()
+	local corr_array=()
+	# buffered records reach the blocks by fs_close
+	run_test ./fs_ref.x cat test.fs test-file-a
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a)")
+
+	# 6500 bytes, 2 blocks
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=97/100")
+
+	rm -f test.fs test-file-a
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_append_full() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 10
+	run_tool dd if=/dev/urandom of=test-file-a bs=4096 count=9 # every data block
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-a
+
+	local line_array=()
+	local corr_array=()
+	# no block for the record, fs_write() says so rather than fs_close()
+	run_test ./test_fs.x append test.fs test-file-a "record" 1
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_append: Cannot append to file")
+
+	run_test ./fs_ref.x stat test.fs test-file-a
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Size of file 'test-file-a' is 36864 bytes")
+
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=0/10")
+
+	rm -f test.fs test-file-a
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_vectored() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-v # 2 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-v
+	# three buffers across the first block boundary
+	run_tool timeout 2 ./test_fs.x writev test.fs test-file-v 4090 AAAAAAAA BBBB CCCCCC
+	printf "AAAAAAAABBBBCCCCCC" | dd of=test-file-v bs=1 seek=4090 conv=notrunc status=none
+
+	local line_array=()
+	local corr_array=()
+	run_test ./fs_ref.x cat test.fs test-file-v
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-v)")
+
+	run_test ./test_fs.x readv test.fs test-file-v 4088 2 12 6
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read 20 bytes into 3 buffers from file 'test-file-v' with offset '4088'")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("$(head -c 4090 test-file-v | tail -c 2)")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("AAAAAAAABBBB")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	corr_array+=("CCCCCC")
+
+	rm -f test.fs test-file-v
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_upload() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 100000 > test-file-u # 25 blocks, printable
+	# 4 threads, chunks of 3 blocks and of 5000 bytes, which share blocks
+	run_test timeout 5 ./test_fs.x upload test.fs test-file-u 4 12288
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Wrote file 'test-file-u' (100000/100000 bytes) with 4 threads")
+	run_test ./fs_ref.x cat test.fs test-file-u
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-u)")
+
+	run_tool ./fs_ref.x rm test.fs test-file-u
+	run_tool timeout 5 ./test_fs.x upload test.fs test-file-u 4 5000
+	run_test ./fs_ref.x cat test.fs test-file-u
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-u)")
+
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=74/100")
+
+	rm -f test.fs test-file-u
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_async() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 300000 > test-file-a # 74 blocks, printable
+	run_tool ./fs_ref.x add test.fs test-file-a
+	# a piece spans several 64KB parts, a callback and a queue read per pair
+	run_test timeout 5 ./test_fs.x catasync test.fs test-file-a 3
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read file 'test-file-a' (300000/300000 bytes) in 3 pieces")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a)")
+	run_test timeout 5 ./test_fs.x catasync test.fs test-file-a 37
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-a)")
+
+	rm -f test.fs test-file-a
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_bigread() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	base64 -w 0 /dev/urandom | head -c 3000000 > test-file-b # 733 blocks, printable
+	# uploaded in 5000-byte chunks by 4 threads, the chain is scattered
+	run_tool timeout 10 ./test_fs.x upload test.fs test-file-b 4 5000
+	# read in one call, fanned out over several threads
+	run_test timeout 10 ./test_fs.x cat test.fs test-file-b
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read file 'test-file-b' (3000000/3000000 bytes)")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-b)")
+	run_test ./fs_ref.x cat test.fs test-file-b
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-b)")
+
+	rm -f test.fs test-file-b
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_mmap() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 100000 > test-file-m # 25 blocks, printable
+	# one view stitched from the runs of a scattered chain, one over one run
+	run_tool timeout 5 ./test_fs.x upload test.fs test-file-m 4 5000
+	cp test-file-m test-file-n
+	run_tool ./fs_ref.x add test.fs test-file-n
+	run_test ./test_fs.x catmap test.fs test-file-m
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-m)")
+	run_test ./test_fs.x catmap test.fs test-file-n private
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Mapped file 'test-file-n' (100000 bytes), first byte '$(head -c 1 test-file-n)'")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("#$(tail -c +2 test-file-n)")
+
+	rm -f test.fs test-file-m test-file-n
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_import() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 100000 > test-file-i # 25 blocks, printable
+	run_test ./test_fs.x import test.fs test-file-i
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Imported file 'test-file-i' (100000 bytes)")
+	run_test ./fs_ref.x cat test.fs test-file-i
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-i)")
+	# to a host file, then to a pipe
+	run_test ./test_fs.x export test.fs test-file-i test-file-o
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Exported file 'test-file-i' (100000 bytes)")
+	line_array+=("$(cat test-file-o)")
+	corr_array+=("$(cat test-file-i)")
+	run_test ./test_fs.x export test.fs test-file-i
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("$(cat test-file-i)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=74/100")
+
+	rm -f test.fs test-file-i test-file-o
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_bulk() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	rm -rf test-dir-b
+	mkdir -p test-dir-b/sub
+	base64 -w 0 /dev/urandom | head -c 100000 > test-dir-b/b-big # 25 blocks
+	echo "small one" > test-dir-b/a-small
+	: > test-dir-b/c-empty
+	echo "skipped" > test-dir-b/sub/d-deep
+	run_test ./test_fs.x bulk-add test.fs test-dir-b 3
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Imported 3 files from 'test-dir-b'")
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: a-small, size: 10, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	corr_array+=("file: c-empty, size: 0, data_blk: 65535")
+	run_test ./fs_ref.x cat test.fs b-big
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-dir-b/b-big)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=73/100")
+	# all or nothing: the names are taken now
+	run_test ./test_fs.x bulk-add test.fs test-dir-b
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=73/100")
+
+	rm -rf test.fs test-dir-b
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_batch() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	# 20 files made and one removed again in one batch
+	run_test ./test_fs.x batch test.fs 20
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Created 19 files in one batch")
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: file-0, size: 7, data_blk: 1")
+	line_array+=("$(select_line "${STDOUT}" "20")")
+	corr_array+=("file: file-18, size: 8, data_blk: 19")
+	line_array+=("$(select_line "${STDOUT}" "21")")
+	corr_array+=("")
+	run_test ./fs_ref.x cat test.fs file-12
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("line 12")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=80/100")
+
+	rm -f test.fs
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_rename() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 10000 > test-file-r # 3 blocks
+	echo "new config" > test-file-n
+	run_tool ./fs_ref.x add test.fs test-file-r
+	run_tool ./fs_ref.x add test.fs test-file-n
+	# taken name, then replaced
+	run_test ./test_fs.x mv test.fs test-file-n test-file-r
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("")
+	# unknown flags
+	run_test ./test_fs.x mv test.fs test-file-n test-file-x 7
+	line_array+=("$(select_line "${STDERR}" "1")")
+	corr_array+=("thread_fs_mv: Cannot rename file")
+	run_test ./test_fs.x mv test.fs test-file-n test-file-r replace
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Renamed file 'test-file-n' to 'test-file-r'")
+	run_test ./fs_ref.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-r, size: 11, data_blk: 4")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("")
+	run_test ./fs_ref.x cat test.fs test-file-r
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("new config")
+	run_test ./test_fs.x mv test.fs test-file-r config
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Renamed file 'test-file-r' to 'config'")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=98/100")
+
+	rm -f test.fs test-file-r test-file-n
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_readdir() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 8192 > test-file-1 # 2 blocks
+	echo "one block" > test-file-2
+	base64 -w 0 /dev/urandom | head -c 10000 > test-file-3 # 3 blocks
+	run_tool ./fs_ref.x add test.fs test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-2
+	run_tool ./fs_ref.x rm test.fs test-file-1
+	# in blocks 1, 2 then 4, around test-file-2
+	run_tool ./fs_ref.x add test.fs test-file-3
+	run_test ./test_fs.x readdir test.fs
+	local line_array=()
+	local corr_array=()
+	# directory order, test-file-3 took the entry of test-file-1
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("file: test-file-3, size: 10000, data_blk: 1, extents: 2")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("file: test-file-2, size: 10, data_blk: 3, extents: 1")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("Listed 2 files")
+	run_test ./test_fs.x statname test.fs test-file-3
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("file: test-file-3, size: 10000, data_blk: 1, extents: 2")
+	run_test ./test_fs.x statname test.fs test-file-1
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("")
+
+	rm -f test.fs test-file-1 test-file-2 test-file-3
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_openmany() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	: > test-file-m
+	run_tool ./fs_ref.x add test.fs test-file-m
+	# far more than 32 descriptors on one file, each writes one byte
+	run_test ./test_fs.x openmany test.fs test-file-m 2000
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Wrote file 'test-file-m' through 2000 descriptors")
+	run_test ./fs_ref.x cat test.fs test-file-m
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(for i in $(seq 0 1999); do printf "\\$(printf %o $((97 + i % 26)))"; done)")
+
+	rm -f test.fs test-file-m
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_lockfree_read() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 200
+	base64 -w 0 /dev/urandom | head -c 204800 > test-file-l # 50 blocks
+	run_tool ./fs_ref.x add test.fs test-file-l
+	# 8 threads open and read it through the views while it is truncated, its
+	# blocks rewritten by another file, and written back
+	run_test ./test_fs.x readers test.fs test-file-l 8 500
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("Bad reads: 0")
+	run_test ./fs_ref.x cat test.fs test-file-l
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-l)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	corr_array+=("fat_free_ratio=149/200")
+	corr_array+=("rdir_free_ratio=127/128")
+
+	rm -f test.fs test-file-l
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_compress() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	for i in $(seq 1 5000); do echo "12:00:$((i % 60)) INFO request $i served in $((i % 7)) ms"; done > test-file-z # 51 blocks
+	# pieces of 50000 bytes, the chunks they end in get rewritten by the next one
+	run_test ./test_fs.x zip test.fs test-file-z 50000
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Wrote compressed file 'test-file-z' (208054/208054 bytes)")
+	run_test ./test_fs.x stat test.fs test-file-z
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Size of file 'test-file-z' is 208054 bytes")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=84/100")
+	# one chunk in the middle
+	run_test ./test_fs.x read test.fs test-file-z 100000 40
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(dd if=test-file-z bs=1 skip=100000 count=40 2>/dev/null)")
+	# the last chunk left is recompressed
+	run_test ./test_fs.x truncate test.fs test-file-z 70000
+	run_test ./test_fs.x cat test.fs test-file-z
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Read file 'test-file-z' (70000/70000 bytes)")
+	line_array+=("$(echo "${STDOUT}" | tail -n +3)")
+	corr_array+=("$(head -c 70000 test-file-z)")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=92/100")
+
+	rm -f test.fs test-file-z
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_dedup() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 20480 > test-file-d # 5 blocks, printable
+	cp test-file-d test-file-e
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-d
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-e
+
+	# the copies end up on the same 5 blocks, 1 block for the reference counts
+	local line_array=()
+	local corr_array=()
+	run_test ./test_fs.x dedup test.fs
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Deduplicated: 10 blocks in files, 5 on disk (ratio 2.00), 5 freed")
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=93/100")
+
+	# writing one copy leaves the other as it was
+	run_tool timeout 2 ./test_fs.x write test.fs test-file-e AAAA 8192 4
+	run_test ./test_fs.x read test.fs test-file-d 0 20480
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-d)")
+
+	# in dedup mode a copy is shared as soon as it is closed, 1 block for the fingerprints
+	run_tool timeout 2 ./test_fs.x dedup test.fs on
+	cp test-file-d test-file-f
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-f
+	run_test ./fs_ref.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=89/100")
+	run_tool timeout 2 ./test_fs.x rm test.fs test-file-d
+	run_test ./test_fs.x read test.fs test-file-f 0 20480
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-d)")
+
+	rm -f test.fs test-file-d test-file-e test-file-f
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_readonly() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 20480 > test-file-r # 5 blocks, printable
+	run_tool timeout 2 ./test_fs.x add test.fs test-file-r
+	local sum=$(md5sum < test.fs)
+
+	# 64 processes reading the disk at once all see the file
+	local dir=$(mktemp -d)
+	for i in $(seq 64); do
+		timeout 5 ./test_fs.x cat test.fs test-file-r > "${dir}/${i}" 2>&1 &
+	done
+	wait
+	local same=0
+	for i in $(seq 64); do
+		[[ "$(tail -n +3 "${dir}/${i}")" == "$(cat test-file-r)" ]] && let "same++"
+	done
+	rm -rf "${dir}"
+
+	local line_array=()
+	local corr_array=()
+	line_array+=("readers=${same}/64")
+	corr_array+=("readers=64/64")
+
+	# not a byte of the disk was written
+	line_array+=("$(md5sum < test.fs)")
+	corr_array+=("${sum}")
+
+	# which can then be read without write permission
+	chmod 444 test.fs
+	run_test ./test_fs.x read test.fs test-file-r 0 20480
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-r)")
+
+	# a FAT of 2 whole blocks, the root directory right after it in the mapping
+	rm -f test.fs
+	run_tool ./fs_make.x test.fs 4096
+	run_tool ./fs_ref.x add test.fs test-file-r
+	run_test ./test_fs.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	corr_array+=("fat_free_ratio=4090/4096")
+
+	rm -f test.fs test-file-r
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.25"
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_coro() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	base64 -w 0 /dev/urandom | head -c 100000 > test-file-c # 25 blocks, printable
+	# 4 coroutines write stripes of 5000 bytes, one reads back by 5000 too
+	run_test timeout 5 ./test_coro.x copy test.fs test-file-c 4 5000
+	local line_array=()
+	local corr_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	corr_array+=("Wrote file 'test-file-c' (100000/100000 bytes) with 4 tasks")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	corr_array+=("Read file 'test-file-c' (100000/100000 bytes)")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	corr_array+=("$(cat test-file-c)")
+	run_test ./fs_ref.x cat test.fs test-file-c
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	corr_array+=("$(cat test-file-c)")
+
+	rm -f test.fs test-file-c
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "0.2"
+	inc_total
+	add_answer "${sub}"
+}
+
 #
 # Run tests
 #
@@ -375,6 +1398,35 @@ run_tests() {
 	run_fs_simple_create
     run_fs_xM_create # yuan: add large file
 	run_fs_create_multiple # yuan: add two with test_fs.x, ls with fs_ref.x, within boundary
+	# Phase 5
+	run_fs_truncate
+	run_fs_punch_hole
+	run_fs_max_size
+	run_fs_concat_split
+	run_fs_concat_split_copy
+	run_fs_clone
+	run_fs_snapshot
+	run_fs_snapshot_full
+	run_fs_journal
+	run_fs_log_write
+	run_fs_append
+	run_fs_append_full
+	run_fs_vectored
+	run_fs_upload
+	run_fs_async
+	run_fs_coro
+	run_fs_bigread
+	run_fs_mmap
+	run_fs_import
+	run_fs_bulk
+	run_fs_batch
+	run_fs_rename
+	run_fs_readdir
+	run_fs_openmany
+	run_fs_lockfree_read
+	run_fs_compress
+	run_fs_dedup
+	run_fs_readonly
 }
 
 make_fs() {
@@ -382,7 +1434,7 @@ make_fs() {
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "test_coro.x" "fs_make.x" "fs_ref.x")
 
     # Make sure executables were properly created
     local x